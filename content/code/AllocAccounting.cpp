@@ -0,0 +1,165 @@
+#include "AllocAccounting.h"
+#include <atomic>
+#include <cstddef> // For std::max_align_t
+#include <cstdlib> // For std::malloc, std::aligned_alloc, std::free
+#include <new>
+
+namespace
+{
+    const size_t NUM_STAGES = static_cast<size_t>(AllocStage::Count);
+
+    // Plain arrays of atomics: constant-initialized, so they are ready
+    // before any static constructor allocates
+    std::atomic<uint64_t> g_allocations[NUM_STAGES];
+    std::atomic<uint64_t> g_bytes[NUM_STAGES];
+
+    thread_local AllocStage t_stage = AllocStage::Other;
+
+    const char *const STAGE_NAMES[NUM_STAGES] = {"other", "parse", "compile", "render", "master bus", "encode"};
+}
+
+// --- AllocAccounting::available Implementation ---
+bool AllocAccounting::available()
+{
+#ifdef MML_ALLOC_ACCOUNTING
+    return true;
+#else
+    return false;
+#endif
+}
+
+// --- AllocAccounting::counts Implementation ---
+AllocCounts AllocAccounting::counts(AllocStage stage)
+{
+    size_t index = static_cast<size_t>(stage);
+    AllocCounts result;
+    result.allocations = g_allocations[index].load(std::memory_order_relaxed);
+    result.bytes = g_bytes[index].load(std::memory_order_relaxed);
+    return result;
+}
+
+// --- AllocAccounting::total Implementation ---
+AllocCounts AllocAccounting::total()
+{
+    AllocCounts result;
+    for (size_t i = 0; i < NUM_STAGES; ++i)
+    {
+        AllocCounts stageCounts = counts(static_cast<AllocStage>(i));
+        result.allocations += stageCounts.allocations;
+        result.bytes += stageCounts.bytes;
+    }
+    return result;
+}
+
+// --- AllocAccounting::reset Implementation ---
+void AllocAccounting::reset()
+{
+    for (size_t i = 0; i < NUM_STAGES; ++i)
+    {
+        g_allocations[i].store(0, std::memory_order_relaxed);
+        g_bytes[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+// --- AllocAccounting::stageName Implementation ---
+const char *AllocAccounting::stageName(AllocStage stage)
+{
+    size_t index = static_cast<size_t>(stage);
+    return index < NUM_STAGES ? STAGE_NAMES[index] : "unknown";
+}
+
+// --- AllocAccounting::report Implementation ---
+void AllocAccounting::report(std::ostream &out)
+{
+    for (size_t i = 0; i < NUM_STAGES; ++i)
+    {
+        AllocCounts stageCounts = counts(static_cast<AllocStage>(i));
+        if (stageCounts.allocations > 0)
+        {
+            out << "  " << stageName(static_cast<AllocStage>(i)) << ": " << stageCounts.allocations
+                << " allocations, " << stageCounts.bytes << " bytes" << std::endl;
+        }
+    }
+    AllocCounts all = total();
+    out << "  total: " << all.allocations << " allocations, " << all.bytes << " bytes" << std::endl;
+}
+
+// --- AllocAccounting::enterStage Implementation ---
+AllocStage AllocAccounting::enterStage(AllocStage stage)
+{
+    AllocStage previous = t_stage;
+    t_stage = stage;
+    return previous;
+}
+
+#ifdef MML_ALLOC_ACCOUNTING
+
+////
+// Global allocator replacement. Every form of operator new funnels into
+// countedAllocate; every form of delete into std::free. Counting is two
+// relaxed atomic adds, so the instrumented build stays usable for timing.
+////
+
+static void *countedAllocate(size_t bytes, size_t alignment)
+{
+    size_t index = static_cast<size_t>(t_stage);
+    g_allocations[index].fetch_add(1, std::memory_order_relaxed);
+    g_bytes[index].fetch_add(bytes, std::memory_order_relaxed);
+
+    if (bytes == 0)
+    {
+        bytes = 1; // Every new must return a distinct pointer
+    }
+    if (alignment <= alignof(std::max_align_t))
+    {
+        return std::malloc(bytes);
+    }
+    // aligned_alloc wants the size to be a multiple of the alignment
+    return std::aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
+}
+
+static void *countedAllocateOrThrow(size_t bytes, size_t alignment)
+{
+    void *p = countedAllocate(bytes, alignment);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new(size_t bytes) { return countedAllocateOrThrow(bytes, 0); }
+void *operator new[](size_t bytes) { return countedAllocateOrThrow(bytes, 0); }
+void *operator new(size_t bytes, const std::nothrow_t &) noexcept { return countedAllocate(bytes, 0); }
+void *operator new[](size_t bytes, const std::nothrow_t &) noexcept { return countedAllocate(bytes, 0); }
+void *operator new(size_t bytes, std::align_val_t alignment)
+{
+    return countedAllocateOrThrow(bytes, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t bytes, std::align_val_t alignment)
+{
+    return countedAllocateOrThrow(bytes, static_cast<size_t>(alignment));
+}
+void *operator new(size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return countedAllocate(bytes, static_cast<size_t>(alignment));
+}
+void *operator new[](size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return countedAllocate(bytes, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+
+#endif // MML_ALLOC_ACCOUNTING
@@ -0,0 +1,83 @@
+// AllocAccounting.h
+
+#ifndef ALLOC_ACCOUNTING_H
+#define ALLOC_ACCOUNTING_H
+
+#include <cstdint>
+#include <ostream>
+
+// Heap allocation accounting, for checking that the render loop stays off
+// the allocator.
+//
+// Built with -DMML_ALLOC_ACCOUNTING (every file, so the stage markers are
+// compiled in), AllocAccounting.cpp replaces the global operator new and
+// delete with versions that count allocations and bytes against the stage
+// the calling thread is in. ALLOC_STAGE marks a stretch of code as one
+// stage; code outside any marker counts as Other. Without the flag the
+// markers compile to nothing, the allocator is untouched and every count
+// reads zero.
+
+enum class AllocStage
+{
+    Other,     // Setup, caches, anything unmarked
+    Parse,     // Comment stripping, tokenizing, compiling commands
+    Compile,   // Building the timeline and loading samples
+    Render,    // Mixing events into the output
+    MasterBus, // Limiter and loudness analysis
+    Encode,    // Handing blocks to the encoder and writing them
+    Count
+};
+
+struct AllocCounts
+{
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+};
+
+class AllocAccounting
+{
+public:
+    // True if this build counts allocations (MML_ALLOC_ACCOUNTING)
+    static bool available();
+
+    // Allocations made in 'stage' (on any thread) since the last reset()
+    static AllocCounts counts(AllocStage stage);
+
+    // All stages together
+    static AllocCounts total();
+
+    static void reset();
+
+    static const char *stageName(AllocStage stage);
+
+    // One line per stage that allocated, then the total
+    static void report(std::ostream &out);
+
+    // Makes 'stage' the calling thread's stage; returns the previous one
+    static AllocStage enterStage(AllocStage stage);
+};
+
+// Counts the allocations of the enclosing scope against 'stage'
+class AllocStageScope
+{
+public:
+    explicit AllocStageScope(AllocStage stage) : m_previous(AllocAccounting::enterStage(stage)) {}
+    ~AllocStageScope() { AllocAccounting::enterStage(m_previous); }
+
+    AllocStageScope(const AllocStageScope &) = delete;
+    AllocStageScope &operator=(const AllocStageScope &) = delete;
+
+private:
+    AllocStage m_previous;
+};
+
+#define ALLOC_CONCAT_INNER(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_INNER(a, b)
+
+#ifdef MML_ALLOC_ACCOUNTING
+#define ALLOC_STAGE(stage) AllocStageScope ALLOC_CONCAT(allocStage_, __LINE__)(AllocStage::stage)
+#else
+#define ALLOC_STAGE(stage) ((void)0)
+#endif
+
+#endif // ALLOC_ACCOUNTING_H
@@ -0,0 +1,473 @@
+#include "AudioEncoder.h"
+#include "AllocAccounting.h"
+#include "Trace.h"
+#include <algorithm> // For std::transform, std::min
+#include <cctype>    // For std::tolower
+#include <cstdint>
+#include <iostream>
+
+// --- outputFormatForPath Implementation ---
+OutputFormat outputFormatForPath(const std::string &path)
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return OutputFormat::Unknown;
+    }
+    std::string extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c)
+                   { return static_cast<char>(std::tolower(c)); });
+
+    if (extension == "pcm" || extension == "raw")
+        return OutputFormat::RawFloat;
+    if (extension == "wav")
+        return OutputFormat::Wav;
+    if (extension == "flac")
+        return OutputFormat::Flac;
+    if (extension == "ogg")
+        return OutputFormat::Vorbis;
+    if (extension == "opus")
+        return OutputFormat::Opus;
+    if (extension == "mp3")
+        return OutputFormat::Mp3;
+    return OutputFormat::Unknown;
+}
+
+// --- outputFormatName Implementation ---
+const char *outputFormatName(OutputFormat format)
+{
+    switch (format)
+    {
+    case OutputFormat::RawFloat:
+        return "raw 32-bit float PCM";
+    case OutputFormat::Wav:
+        return "WAV (32-bit float)";
+    case OutputFormat::Flac:
+        return "FLAC (24-bit)";
+    case OutputFormat::Vorbis:
+        return "Ogg Vorbis";
+    case OutputFormat::Opus:
+        return "Ogg Opus";
+    case OutputFormat::Mp3:
+        return "MP3";
+    default:
+        return "unknown";
+    }
+}
+
+// --- AudioEncoder Constructor ---
+AudioEncoder::AudioEncoder()
+    : m_format(OutputFormat::Unknown),
+      m_sampleType(SampleType::Float32),
+      m_sampleRate(0),
+#ifndef MML_NO_SNDFILE
+      m_file(nullptr),
+#endif
+      m_queuedSamples(0),
+      m_closing(false),
+      m_failed(false),
+      m_samplesWritten(0)
+{
+}
+
+// --- AudioEncoder Destructor ---
+AudioEncoder::~AudioEncoder()
+{
+    close();
+}
+
+// --- open Implementation ---
+bool AudioEncoder::open(const std::string &path, int sampleRate, SampleType sampleType)
+{
+    m_format = outputFormatForPath(path);
+    m_sampleType = sampleType;
+    m_path = path;
+    m_sampleRate = sampleRate;
+
+#ifdef MML_NO_SNDFILE
+    if (m_format == OutputFormat::RawFloat || m_format == OutputFormat::Wav)
+#else
+    if (m_format == OutputFormat::RawFloat)
+#endif
+    {
+        m_rawFile.open(path, std::ios::out | std::ios::binary);
+        if (!m_rawFile.is_open())
+        {
+            std::cerr << "Error: Could not open file " << path << " for writing." << std::endl;
+            return false;
+        }
+        if (m_format == OutputFormat::Wav)
+        {
+            writeWavHeader(m_rawFile, sampleRate, 0, m_sampleType); // Sizes are filled in by close()
+        }
+    }
+#ifdef MML_NO_SNDFILE
+    else
+    {
+        std::cerr << "Error: " << outputFormatName(m_format) << " output needs libsndfile; this build has "
+                  << "none (write .pcm or .wav)." << std::endl;
+        return false;
+    }
+#else
+    else
+    {
+        SF_INFO info{};
+        info.samplerate = sampleRate;
+        info.channels = 1;
+        switch (m_format)
+        {
+        case OutputFormat::Wav:
+            info.format = SF_FORMAT_WAV | (m_sampleType == SampleType::Int16 ? SF_FORMAT_PCM_16 : SF_FORMAT_FLOAT);
+            break;
+        case OutputFormat::Flac:
+            info.format = SF_FORMAT_FLAC | (m_sampleType == SampleType::Int16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24);
+            break;
+        case OutputFormat::Vorbis:
+            info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+            break;
+        case OutputFormat::Opus:
+            // Opus only runs at these rates; libsndfile does not resample
+            if (sampleRate != 8000 && sampleRate != 12000 && sampleRate != 16000 &&
+                sampleRate != 24000 && sampleRate != 48000)
+            {
+                std::cerr << "Error: Opus cannot encode " << sampleRate
+                          << " Hz audio; render with --rate 48000 (or 8000, 12000, 16000, 24000)." << std::endl;
+                return false;
+            }
+            info.format = SF_FORMAT_OGG | SF_FORMAT_OPUS;
+            break;
+        case OutputFormat::Mp3:
+            info.format = SF_FORMAT_MPEG | SF_FORMAT_MPEG_LAYER_III;
+            break;
+        default:
+            std::cerr << "Error: Unknown output format for " << path
+                      << " (use .pcm, .wav, .flac, .ogg, .opus or .mp3)." << std::endl;
+            return false;
+        }
+
+        if (!sf_format_check(&info))
+        {
+            std::cerr << "Error: This libsndfile cannot write " << outputFormatName(m_format)
+                      << " at " << sampleRate << " Hz." << std::endl;
+            return false;
+        }
+        m_file = sf_open(path.c_str(), SFM_WRITE, &info);
+        if (!m_file)
+        {
+            std::cerr << "Error: Could not open " << path << " for writing: " << sf_strerror(nullptr) << std::endl;
+            return false;
+        }
+        if (m_format == OutputFormat::Flac)
+        {
+            // FLAC is integer PCM: clip float peaks past full scale instead
+            // of letting them wrap around
+            sf_command(m_file, SFC_SET_CLIPPING, nullptr, SF_TRUE);
+        }
+    }
+#endif
+
+    m_writer = std::thread(&AudioEncoder::writerLoop, this);
+    return true;
+}
+
+// --- write Implementation ---
+bool AudioEncoder::write(const float *samples, size_t numSamples)
+{
+    if (numSamples == 0)
+    {
+        return !m_failed;
+    }
+
+    ALLOC_STAGE(Encode);
+    QueuedBlock block;
+    block.samples.assign(samples, samples + numSamples); // Copied outside the lock
+    block.silentSamples = 0;
+    return queueBlock(std::move(block));
+}
+
+// --- write (int16) Implementation ---
+bool AudioEncoder::write(const int16_t *samples, size_t numSamples)
+{
+    if (numSamples == 0)
+    {
+        return !m_failed;
+    }
+
+    ALLOC_STAGE(Encode);
+    QueuedBlock block;
+    block.samples16.assign(samples, samples + numSamples);
+    block.silentSamples = 0;
+    return queueBlock(std::move(block));
+}
+
+// --- queueBlock Implementation ---
+bool AudioEncoder::queueBlock(QueuedBlock &&block)
+{
+    const size_t numSamples = block.size();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    {
+        // Back-pressure: wait until the writer has caught up (a block larger
+        // than the bound still goes through once the queue is empty)
+        TRACE_SCOPE("encoder queue full", "io");
+        m_spaceFreed.wait(lock, [this, numSamples]
+                          { return m_failed || m_queuedSamples == 0 ||
+                                   m_queuedSamples + numSamples <= MAX_QUEUED_SAMPLES; });
+    }
+    if (m_failed)
+    {
+        return false;
+    }
+    m_queue.push_back(std::move(block));
+    m_queuedSamples += numSamples;
+    lock.unlock();
+    m_blockQueued.notify_one();
+    return true;
+}
+
+// --- writeSilence Implementation ---
+bool AudioEncoder::writeSilence(size_t numSamples)
+{
+    if (numSamples == 0)
+    {
+        return !m_failed;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_failed)
+    {
+        return false;
+    }
+    if (!m_queue.empty() && m_queue.back().size() == 0)
+    {
+        m_queue.back().silentSamples += numSamples; // Extend the silence already queued
+    }
+    else
+    {
+        m_queue.push_back({{}, {}, numSamples});
+    }
+    lock.unlock();
+    m_blockQueued.notify_one();
+    return true;
+}
+
+// --- close Implementation ---
+bool AudioEncoder::close()
+{
+    if (!m_writer.joinable())
+    {
+        return !m_failed;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+    }
+    m_blockQueued.notify_one();
+    m_writer.join();
+
+    // Finishing the file flushes the codec's last frames and the header
+#ifndef MML_NO_SNDFILE
+    if (m_file)
+    {
+        TRACE_SCOPE("close output", "io");
+        sf_close(m_file);
+        m_file = nullptr;
+    }
+#endif
+    if (m_rawFile.is_open())
+    {
+        if (m_format == OutputFormat::Wav)
+        {
+            m_rawFile.seekp(0);
+            writeWavHeader(m_rawFile, m_sampleRate, m_samplesWritten, m_sampleType);
+        }
+        m_rawFile.close();
+        if (m_rawFile.fail())
+        {
+            m_failed = true;
+        }
+    }
+
+    if (m_failed)
+    {
+        std::cerr << "Error: Failed to write audio data to " << m_path << "." << std::endl;
+        return false;
+    }
+    std::cout << "Successfully wrote " << m_samplesWritten << " samples to " << m_path
+              << " (" << describe() << ")" << std::endl;
+    return true;
+}
+
+// --- writerLoop Implementation ---
+void AudioEncoder::writerLoop()
+{
+    Trace::setThreadName("encoder");
+    while (true)
+    {
+        QueuedBlock block;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_blockQueued.wait(lock, [this]
+                               { return m_closing || !m_queue.empty(); });
+            if (m_queue.empty())
+            {
+                return; // Closing and drained
+            }
+            block = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        // Encode without holding the lock, so write() can queue the next block
+        bool ok = !block.samples.empty()     ? encodeBlock(block.samples.data(), block.samples.size())
+                  : !block.samples16.empty() ? encodeBlock(block.samples16.data(), block.samples16.size())
+                                             : encodeSilence(block.silentSamples);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queuedSamples -= block.size();
+            if (ok)
+            {
+                m_samplesWritten += block.size() + block.silentSamples;
+            }
+            else
+            {
+                m_failed = true;
+                m_queue.clear();
+                m_queuedSamples = 0;
+            }
+        }
+        m_spaceFreed.notify_all();
+        if (!ok)
+        {
+            return;
+        }
+    }
+}
+
+// --- encodeBlock Implementation ---
+bool AudioEncoder::encodeBlock(const float *samples, size_t numSamples)
+{
+    TRACE_SCOPE("encode block", "io");
+    ALLOC_STAGE(Encode);
+#ifndef MML_NO_SNDFILE
+    if (m_file)
+    {
+        sf_count_t frames = static_cast<sf_count_t>(numSamples);
+        return sf_writef_float(m_file, samples, frames) == frames;
+    }
+#endif
+    if (m_sampleType == SampleType::Int16)
+    {
+        // Convert through a small buffer on the stack
+        int16_t converted[4096];
+        for (size_t done = 0; done < numSamples;)
+        {
+            size_t count = std::min(numSamples - done, sizeof(converted) / sizeof(converted[0]));
+            convertToInt16(samples + done, count, converted);
+            m_rawFile.write(reinterpret_cast<const char *>(converted), count * sizeof(int16_t));
+            done += count;
+        }
+        return !m_rawFile.fail();
+    }
+    m_rawFile.write(reinterpret_cast<const char *>(samples), numSamples * sizeof(float));
+    return !m_rawFile.fail();
+}
+
+// --- encodeBlock (int16) Implementation ---
+bool AudioEncoder::encodeBlock(const int16_t *samples, size_t numSamples)
+{
+    TRACE_SCOPE("encode block", "io");
+    ALLOC_STAGE(Encode);
+#ifndef MML_NO_SNDFILE
+    if (m_file)
+    {
+        sf_count_t frames = static_cast<sf_count_t>(numSamples);
+        return sf_writef_short(m_file, samples, frames) == frames;
+    }
+#endif
+    if (m_sampleType == SampleType::Float32)
+    {
+        float converted[4096];
+        for (size_t done = 0; done < numSamples;)
+        {
+            size_t count = std::min(numSamples - done, sizeof(converted) / sizeof(converted[0]));
+            convertToFloat(samples + done, count, converted);
+            m_rawFile.write(reinterpret_cast<const char *>(converted), count * sizeof(float));
+            done += count;
+        }
+        return !m_rawFile.fail();
+    }
+    m_rawFile.write(reinterpret_cast<const char *>(samples), numSamples * sizeof(int16_t));
+    return !m_rawFile.fail();
+}
+
+// --- encodeSilence Implementation ---
+bool AudioEncoder::encodeSilence(size_t numSamples)
+{
+    static const float zeros[4096] = {};
+    while (numSamples > 0)
+    {
+        size_t count = std::min(numSamples, sizeof(zeros) / sizeof(zeros[0]));
+        if (!encodeBlock(zeros, count))
+        {
+            return false;
+        }
+        numSamples -= count;
+    }
+    return true;
+}
+
+// --- describe Implementation ---
+std::string AudioEncoder::describe() const
+{
+    if (m_sampleType == SampleType::Int16)
+    {
+        switch (m_format)
+        {
+        case OutputFormat::RawFloat:
+            return "raw 16-bit PCM";
+        case OutputFormat::Wav:
+            return "WAV (16-bit)";
+        case OutputFormat::Flac:
+            return "FLAC (16-bit)";
+        default:
+            break;
+        }
+    }
+    return outputFormatName(m_format);
+}
+
+// --- writeWavHeader Implementation ---
+void AudioEncoder::writeWavHeader(std::ostream &out, int sampleRate, size_t numSamples, SampleType sampleType)
+{
+    auto put16 = [&out](uint16_t value)
+    {
+        const char bytes[2] = {static_cast<char>(value & 0xFF), static_cast<char>(value >> 8)};
+        out.write(bytes, 2);
+    };
+    auto put32 = [&out](uint32_t value)
+    {
+        const char bytes[4] = {static_cast<char>(value & 0xFF), static_cast<char>((value >> 8) & 0xFF),
+                               static_cast<char>((value >> 16) & 0xFF), static_cast<char>(value >> 24)};
+        out.write(bytes, 4);
+    };
+
+    // RIFF sizes are 32-bit; a longer track keeps the largest size they can hold
+    const uint16_t bytesPerSample = sampleType == SampleType::Int16 ? sizeof(int16_t) : sizeof(float);
+    uint32_t dataBytes = static_cast<uint32_t>(std::min<size_t>(numSamples * bytesPerSample, 0xFFFFFFFFu - 36));
+    out.write("RIFF", 4);
+    put32(36 + dataBytes);
+    out.write("WAVE", 4);
+    out.write("fmt ", 4);
+    put32(16);
+    put16(sampleType == SampleType::Int16 ? 1 : 3); // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+    put16(1);                                       // Mono
+    put32(static_cast<uint32_t>(sampleRate));
+    put32(static_cast<uint32_t>(sampleRate) * bytesPerSample); // Bytes per second
+    put16(bytesPerSample);                                     // Block align
+    put16(bytesPerSample * 8);                                 // Bits per sample
+    out.write("data", 4);
+    put32(dataBytes);
+}
@@ -0,0 +1,134 @@
+// AudioEncoder.h
+
+#ifndef AUDIO_ENCODER_H
+#define AUDIO_ENCODER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SampleType.h"
+
+#ifndef MML_NO_SNDFILE
+#include <sndfile.h>
+#endif
+
+// Container and codec of an output file, chosen by its extension
+enum class OutputFormat
+{
+    RawFloat, // .pcm / .raw: headerless 32-bit float, little-endian (as before)
+    Wav,      // .wav: 32-bit float WAV
+    Flac,     // .flac: 24-bit FLAC
+    Vorbis,   // .ogg: Ogg Vorbis
+    Opus,     // .opus: Ogg Opus (8, 12, 16, 24 or 48 kHz only)
+    Mp3,      // .mp3: MPEG layer III (libsndfile 1.1 or later)
+    Unknown
+};
+
+// Output format for 'path' (case-insensitive extension)
+OutputFormat outputFormatForPath(const std::string &path);
+
+// Human-readable name of a format, for messages
+const char *outputFormatName(OutputFormat format);
+
+// Writes mono audio to a file while the caller keeps rendering.
+//
+// write() only copies the block into a bounded queue; a writer thread takes
+// blocks off the queue and encodes them (through libsndfile, or straight to
+// disk for raw output), so encoding overlaps with whatever produces the next
+// block. When the encoder falls behind, write() waits for queue space
+// instead of buffering the whole track.
+//
+// Built with MML_NO_SNDFILE (no libsndfile to link), raw and WAV output are
+// written directly and the compressed formats are unavailable.
+class AudioEncoder
+{
+public:
+    AudioEncoder();
+    ~AudioEncoder(); // Closes the file if close() was not called
+
+    AudioEncoder(const AudioEncoder &) = delete;
+    AudioEncoder &operator=(const AudioEncoder &) = delete;
+
+    // Opens 'path' for mono audio at 'sampleRate' in the format its
+    // extension names and starts the writer thread. Returns false (with an
+    // error printed) for an unknown extension or a rate the codec rejects.
+    // With SampleType::Int16 the uncompressed formats are written as 16-bit
+    // PCM (raw output as signed 16-bit little-endian) instead of 32-bit
+    // float, and FLAC as 16-bit instead of 24.
+    bool open(const std::string &path, int sampleRate, SampleType sampleType = SampleType::Float32);
+
+    // Queues 'numSamples' samples for encoding. Returns false once the
+    // writer has failed; the rest of the track is then dropped. Samples of
+    // either type can be written to either kind of file; they are converted
+    // (saturating to int16) as they are encoded.
+    bool write(const float *samples, size_t numSamples);
+    bool write(const int16_t *samples, size_t numSamples);
+
+    // Queues 'numSamples' samples of silence. Only the count is queued; the
+    // writer thread encodes the zeros from a small reused block.
+    bool writeSilence(size_t numSamples);
+
+    // Waits for every queued block to be encoded, then closes the file.
+    // Returns false if any write failed.
+    bool close();
+
+    OutputFormat format() const { return m_format; }
+
+    // Samples in the finished file (valid after close())
+    size_t samplesWritten() const { return m_samplesWritten; }
+
+    // Header of a mono 32-bit float or 16-bit PCM WAV file holding
+    // 'numSamples' samples (written directly when there is no libsndfile,
+    // and by mml_libtool)
+    static void writeWavHeader(std::ostream &out, int sampleRate, size_t numSamples, SampleType sampleType);
+
+private:
+    // Queue bound: about six seconds of 44.1 kHz audio
+    static const size_t MAX_QUEUED_SAMPLES = 1 << 18;
+
+    OutputFormat m_format;
+    SampleType m_sampleType; // Of the samples in the file
+    std::string m_path;
+    int m_sampleRate;
+#ifndef MML_NO_SNDFILE
+    SNDFILE *m_file;          // libsndfile output (every format but RawFloat)
+#endif
+    std::ofstream m_rawFile;  // RawFloat output (and WAV without libsndfile)
+
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_blockQueued;  // Signals the writer thread
+    std::condition_variable m_spaceFreed;   // Signals a waiting write()
+    // A block waiting to be encoded: float or int16 samples, or a stretch
+    // of silence
+    struct QueuedBlock
+    {
+        std::vector<float> samples;
+        std::vector<int16_t> samples16;
+        size_t silentSamples;
+
+        size_t size() const { return samples.size() + samples16.size(); }
+    };
+
+    std::deque<QueuedBlock> m_queue;
+    size_t m_queuedSamples; // Samples held by the queue (silence holds none)
+    bool m_closing;
+    bool m_failed;
+    size_t m_samplesWritten;
+
+    void writerLoop();
+    bool queueBlock(QueuedBlock &&block);
+    bool encodeBlock(const float *samples, size_t numSamples);
+    bool encodeBlock(const int16_t *samples, size_t numSamples);
+    bool encodeSilence(size_t numSamples);
+
+    // Name of the file's format and sample type, for messages
+    std::string describe() const;
+};
+
+#endif // AUDIO_ENCODER_H
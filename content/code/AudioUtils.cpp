@@ -7,6 +7,9 @@
 #include <sstream>  // Required for std::stringstream
 #include <string>   // Required for std::string
 #include <iostream> // For std::cerr, std::cout
+#include <cmath>    // For std::sin, std::cos, std::floor
+#include <algorithm> // For std::min, std::max
+#include <type_traits> // For std::is_same
 
 // Function to read the entire content of a file into a single string
 std::string readFileIntoString(const std::string &filePath)
@@ -27,8 +30,9 @@ std::string readFileIntoString(const std::string &filePath)
 }
 
 
-// Function to save a vector of float audio samples to a raw PCM file
-bool saveToPcmFile(const std::vector<float> &audioData, const std::string &filename)
+// Function to save a vector of float (or int16) audio samples to a raw PCM file
+template <typename Sample>
+bool saveToPcmFile(const std::vector<Sample> &audioData, const std::string &filename)
 {
     std::ofstream outFile(filename, std::ios::out | std::ios::binary);
 
@@ -38,10 +42,10 @@ bool saveToPcmFile(const std::vector<float> &audioData, const std::string &filen
         return false;
     }
 
-    // Write the raw float data directly to the file
-    // std::vector<float>::data() gives a pointer to the underlying array
-    // sizeof(float) * audioData.size() gives the total number of bytes
-    outFile.write(reinterpret_cast<const char *>(audioData.data()), audioData.size() * sizeof(float));
+    // Write the raw sample data directly to the file
+    // std::vector<Sample>::data() gives a pointer to the underlying array
+    // sizeof(Sample) * audioData.size() gives the total number of bytes
+    outFile.write(reinterpret_cast<const char *>(audioData.data()), audioData.size() * sizeof(Sample));
 
     if (outFile.fail())
     {
@@ -51,6 +55,69 @@ bool saveToPcmFile(const std::vector<float> &audioData, const std::string &filen
     }
 
     outFile.close();
-    std::cout << "Successfully wrote " << audioData.size() << " float samples to " << filename << std::endl;
+    std::cout << "Successfully wrote " << audioData.size() << (std::is_same<Sample, float>::value ? " float" : " int16")
+              << " samples to " << filename << std::endl;
     return true;
 }
+
+template bool saveToPcmFile<float>(const std::vector<float> &, const std::string &);
+template bool saveToPcmFile<int16_t>(const std::vector<int16_t> &, const std::string &);
+
+// Function to resample mono audio between two sample rates
+std::vector<float> resampleAudio(const std::vector<float> &audioData, int fromRate, int toRate)
+{
+    if (fromRate <= 0 || toRate <= 0 || fromRate == toRate || audioData.empty())
+    {
+        return audioData;
+    }
+
+    // Kernel half-width in zero crossings of the sinc; wider is sharper
+    const int ZERO_CROSSINGS = 16;
+
+    const double step = static_cast<double>(fromRate) / toRate; // Input samples per output sample
+    const double cutoff = std::min(1.0, 1.0 / step) * 0.95;     // Fraction of the input Nyquist kept
+    const double halfWidth = ZERO_CROSSINGS / cutoff;           // Kernel half-width in input samples
+    const long inputSize = static_cast<long>(audioData.size());
+    const size_t outputSize = static_cast<size_t>(audioData.size() / step);
+
+    std::vector<float> resampled(outputSize);
+    for (size_t n = 0; n < outputSize; ++n)
+    {
+        double center = n * step; // Position of this output sample in the input
+        long first = static_cast<long>(std::floor(center - halfWidth)) + 1;
+        long last = static_cast<long>(std::floor(center + halfWidth));
+
+        double sum = 0.0;
+        for (long k = std::max(0L, first); k <= std::min(inputSize - 1, last); ++k)
+        {
+            double x = (k - center) * cutoff; // Distance in kernel zero crossings
+            double sinc = (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+            // Blackman window over the kernel's full width
+            double w = 0.42 + 0.5 * std::cos(M_PI * x / ZERO_CROSSINGS) + 0.08 * std::cos(2.0 * M_PI * x / ZERO_CROSSINGS);
+            sum += audioData[k] * sinc * w;
+        }
+        resampled[n] = static_cast<float>(sum * cutoff);
+    }
+    return resampled;
+}
+
+// Function to average interleaved channels into mono
+std::vector<float> downmixToMono(const std::vector<float> &interleaved, int channels)
+{
+    if (channels <= 1)
+    {
+        return interleaved;
+    }
+
+    std::vector<float> mono(interleaved.size() / channels);
+    for (size_t frame = 0; frame < mono.size(); ++frame)
+    {
+        float sum = 0.0f;
+        for (int c = 0; c < channels; ++c)
+        {
+            sum += interleaved[frame * channels + c];
+        }
+        mono[frame] = sum / channels;
+    }
+    return mono;
+}
@@ -1,6 +1,18 @@
+#include <cstdint>
 #include <string>
 #include <vector> // Required for std::vector
 
 std::string readFileIntoString(const std::string &filePath);
 
-bool saveToPcmFile(const std::vector<float> &audioData, const std::string &filename);
+// Writes raw samples (float, or int16_t for 16-bit PCM) with no header
+template <typename Sample>
+bool saveToPcmFile(const std::vector<Sample> &audioData, const std::string &filename);
+
+// Resamples mono audio from 'fromRate' to 'toRate' with a windowed-sinc
+// interpolator. When decimating, the kernel's cutoff follows the new Nyquist
+// frequency, so content the lower rate cannot hold is filtered out instead
+// of aliasing. Returns the input unchanged if the rates are equal.
+std::vector<float> resampleAudio(const std::vector<float> &audioData, int fromRate, int toRate);
+
+// Averages interleaved multi-channel audio down to one channel
+std::vector<float> downmixToMono(const std::vector<float> &interleaved, int channels);
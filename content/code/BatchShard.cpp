@@ -0,0 +1,289 @@
+#include "BatchShard.h"
+#include <algorithm> // For std::sort
+#include <cerrno>
+#include <chrono>
+#include <cstdio>    // For std::rename, std::remove
+#include <cstring>   // For std::strerror
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // This machine's name, as written in claims
+    std::string hostName()
+    {
+        char name[256] = {};
+        if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == '\0')
+        {
+            return "localhost";
+        }
+        return name;
+    }
+
+    // Temporary output of the claimant 'host'/'pid'
+    std::string tempPathFor(const std::string &outputPath, const std::string &host, long pid)
+    {
+        fs::path path(outputPath);
+        fs::path temp = path.parent_path() /
+                        (path.stem().string() + ".tmp-" + host + "-" + std::to_string(pid) + path.extension().string());
+        return temp.string();
+    }
+
+    // The whole contents of the claim at 'claimPath' (empty if it is gone)
+    std::string readClaim(const std::string &claimPath)
+    {
+        std::ifstream claim(claimPath, std::ios::binary);
+        std::ostringstream contents;
+        contents << claim.rdbuf();
+        return contents.str();
+    }
+
+    // True if the claim at 'claimPath' was left behind: its owner ran on this
+    // host and is gone, or it was last touched more than 'staleSeconds' ago.
+    // Sets the owner ('host' empty if the claim cannot be read) and the
+    // contents it was judged by.
+    bool claimIsStale(const std::string &claimPath, double staleSeconds, std::string &host, long &pid,
+                      std::string &contents)
+    {
+        host.clear();
+        pid = 0;
+        contents = readClaim(claimPath);
+        std::istringstream claim(contents);
+        if (!(claim >> host >> pid))
+        {
+            host.clear(); // Written only partly, or already gone
+        }
+
+        if (!host.empty() && host == hostName() && pid > 0 && kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH)
+        {
+            return true;
+        }
+        std::error_code ec;
+        fs::file_time_type written = fs::last_write_time(claimPath, ec);
+        if (ec)
+        {
+            return false; // Released meanwhile: let the next attempt create it
+        }
+        double age = std::chrono::duration<double>(fs::file_time_type::clock::now() - written).count();
+        return age > staleSeconds;
+    }
+}
+
+// --- ShardSpec::owns Implementation ---
+bool ShardSpec::owns(std::string_view relativePath) const
+{
+    return shardHash(relativePath) % count == index;
+}
+
+// --- parseShardSpec Implementation ---
+bool parseShardSpec(const std::string &text, ShardSpec &spec)
+{
+    size_t slash = text.find('/');
+    if (slash == std::string::npos || slash == 0 || slash + 1 == text.length() ||
+        text.find_first_not_of("0123456789/") != std::string::npos || text.find('/', slash + 1) != std::string::npos)
+    {
+        std::cerr << "Error: --shard expects i/n (e.g., 0/4), got '" << text << "'." << std::endl;
+        return false;
+    }
+    spec.index = static_cast<size_t>(std::stoull(text.substr(0, slash)));
+    spec.count = static_cast<size_t>(std::stoull(text.substr(slash + 1)));
+    if (spec.count == 0)
+    {
+        std::cerr << "Error: --shard " << text << ": there must be at least one shard." << std::endl;
+        return false;
+    }
+    if (spec.index >= spec.count)
+    {
+        std::cerr << "Error: --shard " << text << ": the shard must be 0 to " << spec.count - 1 << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// --- shardHash Implementation ---
+uint64_t shardHash(std::string_view relativePath)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    for (char c : relativePath)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL; // FNV prime
+    }
+    // FNV's low bits mix poorly (bit 0 is the parity of the bytes), and the
+    // shard is taken modulo a small count: finish with MurmurHash3's fmix64
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// --- listBatchSongs Implementation ---
+std::vector<std::string> listBatchSongs(const std::string &directory)
+{
+    std::vector<std::string> songs;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (it->is_regular_file(ec) && it->path().extension() == ".mml")
+        {
+            songs.push_back(it->path().lexically_relative(directory).generic_string());
+        }
+    }
+    if (ec)
+    {
+        std::cerr << "Error: Cannot list " << directory << ": " << ec.message() << std::endl;
+    }
+    std::sort(songs.begin(), songs.end());
+    return songs;
+}
+
+// --- outputComplete Implementation ---
+bool outputComplete(const std::string &songPath, const std::string &outputPath)
+{
+    std::error_code ec;
+    fs::file_time_type output = fs::last_write_time(outputPath, ec);
+    if (ec)
+    {
+        return false; // Not written yet
+    }
+    fs::file_time_type song = fs::last_write_time(songPath, ec);
+    return !ec && output >= song;
+}
+
+// --- SongClaim Destructor ---
+SongClaim::~SongClaim()
+{
+    release();
+}
+
+// --- SongClaim::acquire Implementation ---
+ClaimStatus SongClaim::acquire(const std::string &outputPath, double staleSeconds)
+{
+    release();
+    const std::string claimPath = outputPath + ".claim";
+    const auto tag = std::chrono::steady_clock::now().time_since_epoch().count();
+    const std::string owner =
+        hostName() + " " + std::to_string(static_cast<long>(getpid())) + " " + std::to_string(tag) + "\n";
+
+    // Two tries: the second after moving a stale claim aside
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        int fd = ::open(claimPath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0)
+        {
+            bool written = ::write(fd, owner.data(), owner.size()) == static_cast<ssize_t>(owner.size());
+            ::close(fd);
+            if (!written)
+            {
+                std::remove(claimPath.c_str());
+                std::cerr << "Error: Cannot write claim " << claimPath << "." << std::endl;
+                return ClaimStatus::Failed;
+            }
+            m_outputPath = outputPath;
+            m_claimPath = claimPath;
+            m_owner = owner;
+            m_stopping = false;
+            m_heartbeat = std::thread(&SongClaim::heartbeatLoop, this, std::max(1.0, staleSeconds / 4));
+            return ClaimStatus::Claimed;
+        }
+        if (errno != EEXIST)
+        {
+            std::cerr << "Error: Cannot create claim " << claimPath << ": " << std::strerror(errno) << std::endl;
+            return ClaimStatus::Failed;
+        }
+
+        std::string host, staleContents;
+        long pid;
+        if (attempt > 0 || !claimIsStale(claimPath, staleSeconds, host, pid, staleContents))
+        {
+            return ClaimStatus::Busy;
+        }
+        // Several processes may judge the same claim stale. Rename moves
+        // whatever file has the name by then, which may already be the
+        // fresh claim of one that took over first: check that what was
+        // moved aside is still the stale claim, and put it back if not
+        std::string aside = claimPath + ".stale-" + hostName() + "-" + std::to_string(static_cast<long>(getpid()));
+        if (std::rename(claimPath.c_str(), aside.c_str()) != 0)
+        {
+            return ClaimStatus::Busy;
+        }
+        if (readClaim(aside) != staleContents)
+        {
+            // link() fails rather than replace a claim made in the
+            // meantime; its owner and the one moved aside then both render
+            // the song, which only costs time (renders are deterministic)
+            if (::link(aside.c_str(), claimPath.c_str()) != 0)
+            {
+                std::cerr << "Warning: Could not restore the claim on " << outputPath << "." << std::endl;
+            }
+            std::remove(aside.c_str());
+            return ClaimStatus::Busy;
+        }
+        std::remove(aside.c_str());
+        if (!host.empty())
+        {
+            std::remove(tempPathFor(outputPath, host, pid).c_str());
+        }
+        std::cout << "Taking over the stale claim on " << outputPath
+                  << (host.empty() ? std::string() : " (left by " + host + " pid " + std::to_string(pid) + ")")
+                  << std::endl;
+    }
+    return ClaimStatus::Busy;
+}
+
+// --- SongClaim::release Implementation ---
+void SongClaim::release()
+{
+    if (m_heartbeat.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_stopHeartbeat.notify_one();
+        m_heartbeat.join();
+    }
+    if (!m_claimPath.empty())
+    {
+        // A claim that went stale (this process stalled past the stale age)
+        // may have been taken over: leave the new owner's file alone
+        if (readClaim(m_claimPath) == m_owner)
+        {
+            std::remove(m_claimPath.c_str());
+        }
+        m_claimPath.clear();
+    }
+}
+
+// --- SongClaim::heartbeatLoop Implementation ---
+void SongClaim::heartbeatLoop(double intervalSeconds)
+{
+    const auto interval = std::chrono::duration<double>(intervalSeconds);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopHeartbeat.wait_for(lock, interval, [this] { return m_stopping; }))
+    {
+        if (readClaim(m_claimPath) != m_owner)
+        {
+            std::cerr << "Warning: The claim on " << m_outputPath << " was taken over." << std::endl;
+            return;
+        }
+        std::error_code ec;
+        fs::last_write_time(m_claimPath, fs::file_time_type::clock::now(), ec);
+    }
+}
+
+// --- SongClaim::tempPath Implementation ---
+std::string SongClaim::tempPath() const
+{
+    return tempPathFor(m_outputPath, hostName(), static_cast<long>(getpid()));
+}
@@ -0,0 +1,101 @@
+// BatchShard.h
+
+#ifndef BATCH_SHARD_H
+#define BATCH_SHARD_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Splitting a directory of songs between machines that share a filesystem
+// but nothing else (no scheduler, no coordinating service).
+//
+// Every machine lists the same songs and keeps those whose path (relative
+// to the batch directory, so mount points do not matter) hashes to its
+// shard. Outputs only appear by an atomic rename of a finished file, so an
+// output that exists is complete. A song being rendered has a claim file
+// next to its output, created exclusively and touched while its owner
+// works; a claim left behind by a crash (its process gone, or not touched
+// for the stale age) is taken over, so re-running a shard picks up where
+// it stopped. Renders are deterministic:
+// if two machines ever do render the same song, they write the same file.
+
+// --shard i/n: this machine renders the songs of shard 'index' (0 to count - 1)
+struct ShardSpec
+{
+    size_t index = 0;
+    size_t count = 1;
+
+    // True if the song at 'relativePath' belongs to this shard
+    bool owns(std::string_view relativePath) const;
+};
+
+// Parses "i/n". Returns false (after saying why) for anything else.
+bool parseShardSpec(const std::string &text, ShardSpec &spec);
+
+// Stable hash of a song path (64-bit FNV-1a, then avalanched), the same on
+// every machine
+uint64_t shardHash(std::string_view relativePath);
+
+// Every .mml file below 'directory', as paths relative to it ('/'
+// separated), sorted
+std::vector<std::string> listBatchSongs(const std::string &directory);
+
+// True if 'outputPath' exists and is not older than the song it was
+// rendered from
+bool outputComplete(const std::string &songPath, const std::string &outputPath);
+
+enum class ClaimStatus
+{
+    Claimed, // This process renders the song
+    Busy,    // Another live claimant has it
+    Failed   // The claim file could not be created (the error has been printed)
+};
+
+// The claim on one output, "<output>.claim", holding "<host> <pid> <tag>"
+// of its owner (the tag tells this claim from an earlier one of the same
+// process). While held, a background thread touches the file every quarter
+// of the stale age, so a long render keeps it. Released (the file removed)
+// when the object goes away.
+class SongClaim
+{
+public:
+    SongClaim() = default;
+    ~SongClaim();
+
+    SongClaim(const SongClaim &) = delete;
+    SongClaim &operator=(const SongClaim &) = delete;
+
+    // Claims 'outputPath'. A claim whose owner ran on this host and is
+    // gone, or that was last touched more than 'staleSeconds' ago, is taken
+    // over (and the owner's half-written output removed).
+    ClaimStatus acquire(const std::string &outputPath, double staleSeconds);
+
+    // Stops touching the claim and removes its file, unless another
+    // process has taken it over meanwhile (if this object holds one)
+    void release();
+
+    // Where this claimant writes the output before renaming it into place:
+    // next to it (same filesystem, so the rename is atomic), extension last
+    std::string tempPath() const;
+
+private:
+    std::string m_outputPath;
+    std::string m_claimPath;
+    std::string m_owner; // The claim file's contents, as written
+
+    // Heartbeat: touches the claim until release() stops it
+    std::thread m_heartbeat;
+    std::mutex m_mutex;
+    std::condition_variable m_stopHeartbeat;
+    bool m_stopping = false;
+
+    void heartbeatLoop(double intervalSeconds);
+};
+
+#endif // BATCH_SHARD_H
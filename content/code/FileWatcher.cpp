@@ -0,0 +1,176 @@
+#include "FileWatcher.h"
+#include <cerrno>
+#include <cstring>    // For std::strerror
+#include <filesystem> // For walking a watched tree
+#include <iostream>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Events that mean a file's content may be different now
+static const uint32_t CHANGE_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM;
+
+// --- FileWatcher Constructor ---
+FileWatcher::FileWatcher()
+    : m_fd(inotify_init1(IN_CLOEXEC))
+{
+    if (m_fd < 0)
+    {
+        std::cerr << "Error: inotify is unavailable: " << std::strerror(errno) << std::endl;
+    }
+}
+
+// --- FileWatcher Destructor ---
+FileWatcher::~FileWatcher()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd); // Removes every watch
+    }
+}
+
+// --- addDirectory Implementation ---
+int FileWatcher::addDirectory(const std::string &directory)
+{
+    int wd = inotify_add_watch(m_fd, directory.c_str(), CHANGE_EVENTS);
+    if (wd < 0)
+    {
+        std::cerr << "Warning: Cannot watch " << directory << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    m_directories[wd] = directory;
+    return wd;
+}
+
+// --- watchFile Implementation ---
+bool FileWatcher::watchFile(const std::string &filePath)
+{
+    if (m_fd < 0)
+    {
+        return false;
+    }
+    fs::path path(filePath);
+    std::string directory = path.has_parent_path() ? path.parent_path().string() : ".";
+    if (m_files.find(directory) == m_files.end() && addDirectory(directory) < 0)
+    {
+        return false;
+    }
+    m_files[directory][path.filename().string()] = filePath;
+    return true;
+}
+
+// --- addTree Implementation ---
+void FileWatcher::addTree(const std::string &root)
+{
+    int wd = addDirectory(root);
+    if (wd < 0)
+    {
+        return;
+    }
+    m_trees.insert(wd);
+
+    std::error_code ec;
+    for (fs::directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (it->is_directory(ec))
+        {
+            addTree(it->path().string());
+        }
+    }
+}
+
+// --- watchTree Implementation ---
+bool FileWatcher::watchTree(const std::string &root)
+{
+    if (m_fd < 0 || !fs::is_directory(root))
+    {
+        return false;
+    }
+    addTree(root);
+    return true;
+}
+
+// --- readEvents Implementation ---
+bool FileWatcher::readEvents(std::set<std::string> &changed)
+{
+    alignas(inotify_event) char buffer[16384];
+    ssize_t length = ::read(m_fd, buffer, sizeof(buffer));
+    if (length < 0)
+    {
+        return errno == EINTR || errno == EAGAIN;
+    }
+
+    for (ssize_t offset = 0; offset < length;)
+    {
+        const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+        offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+        auto dir_it = m_directories.find(event->wd);
+        if (dir_it == m_directories.end() || event->len == 0)
+        {
+            continue;
+        }
+        const std::string &directory = dir_it->second;
+        std::string name(event->name);
+
+        // A watched file is reported as it was given, even inside a tree
+        auto files_it = m_files.find(directory);
+        if (files_it != m_files.end())
+        {
+            auto file_it = files_it->second.find(name);
+            if (file_it != files_it->second.end())
+            {
+                changed.insert(file_it->second);
+                continue;
+            }
+        }
+
+        if (m_trees.count(event->wd))
+        {
+            // New directories inside a tree are watched too
+            std::string fullPath = directory + "/" + name;
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            {
+                addTree(fullPath);
+            }
+            changed.insert(fullPath);
+        }
+    }
+    return true;
+}
+
+// --- waitForChanges Implementation ---
+std::vector<std::string> FileWatcher::waitForChanges(int settleMs)
+{
+    std::set<std::string> changed;
+    if (m_fd < 0)
+    {
+        return {};
+    }
+
+    pollfd descriptor{m_fd, POLLIN, 0};
+    while (true)
+    {
+        // Block for the first change, then only until the burst is over
+        int timeout = changed.empty() ? -1 : settleMs;
+        int ready = ::poll(&descriptor, 1, timeout);
+        if (ready < 0 && errno == EINTR)
+        {
+            if (changed.empty())
+                return {}; // Interrupted by a signal before anything changed
+            continue;
+        }
+        if (ready <= 0)
+        {
+            break; // Settled (or poll failed)
+        }
+        if (!readEvents(changed))
+        {
+            break;
+        }
+    }
+    return std::vector<std::string>(changed.begin(), changed.end());
+}
@@ -0,0 +1,54 @@
+// FileWatcher.h
+
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Waits for files to change on disk (Linux inotify).
+//
+// A watched file is watched through its directory, so editors that save by
+// writing a new file and renaming it over the old one are still seen. A
+// watched tree covers every directory below its root, including ones
+// created later.
+class FileWatcher
+{
+public:
+    FileWatcher();
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    // False if inotify is unavailable (the error has been printed)
+    bool isValid() const { return m_fd >= 0; }
+
+    // Reports changes to one file
+    bool watchFile(const std::string &filePath);
+
+    // Reports changes to every file below 'root'
+    bool watchTree(const std::string &root);
+
+    // Blocks until something watched changes, then keeps collecting events
+    // until none arrive for 'settleMs' (an editor's save is several events).
+    // Returns the changed paths: a watched file as it was passed to
+    // watchFile(), anything in a tree as "<directory>/<name>".
+    std::vector<std::string> waitForChanges(int settleMs = 50);
+
+private:
+    int m_fd;
+    std::map<int, std::string> m_directories;         // Watch descriptor -> directory
+    std::map<std::string, std::map<std::string, std::string>> m_files; // Directory -> file name -> path as given
+    std::set<int> m_trees;                            // Watches of directories inside a watched tree
+
+    int addDirectory(const std::string &directory);
+    void addTree(const std::string &root);
+
+    // Reads the pending events; returns false on error
+    bool readEvents(std::set<std::string> &changed);
+};
+
+#endif // FILE_WATCHER_H
@@ -0,0 +1,143 @@
+// InstrumentRegistry.h
+
+#ifndef INSTRUMENT_REGISTRY_H
+#define INSTRUMENT_REGISTRY_H
+
+#include <cstddef>
+#include <string_view>
+
+// Amplitude envelope applied to every voice of an instrument. The release
+// fades the note out before its hard end, so cut-off loops do not click.
+struct VoiceEnvelope
+{
+    double attackSeconds;  // Linear fade-in from silence to full level
+    double decaySeconds;   // Linear fall from full level to sustainLevel
+    float sustainLevel;    // Level held after the decay (1.0 = no decay)
+    double releaseSeconds; // Linear fade-out ending at the note's last sample
+};
+
+// How the samples of an instrument are turned into a note
+enum class RenderPolicy
+{
+    LoopedPitched, // Single-cycle waveforms looped for the note's duration
+    OneShot,       // Recorded hits played once, padded with silence
+    Noise          // Generated noise beds, sounding for the whole note (see NoiseGenerator.h)
+};
+
+// How a note name maps to a file name inside the instrument's folder
+enum class NamingScheme
+{
+    PitchedNote,   // <note><octave>-<abbr>.wav (e.g., A4-sqr.wav, Db5-tri.wav)
+    DrumKit,       // DRUMS-<style><variant>.wav (e.g., DRUMS-bass01.wav)
+    Generated,     // No file: the note name picks a built-in generator (e.g., white)
+    Direct         // <name>.wav (e.g., bassline1.wav)
+};
+
+// One instrument of the waveform library
+struct InstrumentInfo
+{
+    std::string_view abbr;   // MML folder abbreviation (lowercase), e.g. "sqr"
+    std::string_view folder; // Directory under the library base path
+    NamingScheme naming;
+    RenderPolicy policy;
+};
+
+// --- The registry ---
+// Adding an instrument to the library means adding its line here.
+inline constexpr InstrumentInfo INSTRUMENTS[] = {
+    {"imp", "impulsewave", NamingScheme::PitchedNote, RenderPolicy::LoopedPitched},
+    {"i05", "impulse-05-wave", NamingScheme::PitchedNote, RenderPolicy::LoopedPitched},
+    {"i25", "impulse-25-wave", NamingScheme::PitchedNote, RenderPolicy::LoopedPitched},
+    {"sqr", "squarewave", NamingScheme::PitchedNote, RenderPolicy::LoopedPitched},
+    {"tri", "trianglewave", NamingScheme::PitchedNote, RenderPolicy::LoopedPitched},
+    {"x", "casio-drums", NamingScheme::DrumKit, RenderPolicy::OneShot},
+    {"noise", "noise", NamingScheme::Generated, RenderPolicy::Noise},
+    {"miscellaneous", "miscellaneous", NamingScheme::Direct, RenderPolicy::OneShot},
+    {"sk-5", "sk-5", NamingScheme::Direct, RenderPolicy::OneShot},
+};
+
+// Instrument used when a note has no "folder:" prefix
+inline constexpr std::string_view DEFAULT_INSTRUMENT = "sqr";
+
+// Looks up an instrument by its abbreviation (case-insensitive).
+// Returns nullptr for an unknown abbreviation.
+constexpr const InstrumentInfo *findInstrument(std::string_view abbr)
+{
+    for (const InstrumentInfo &instrument : INSTRUMENTS)
+    {
+        if (instrument.abbr.length() != abbr.length())
+            continue;
+        bool match = true;
+        for (size_t i = 0; i < abbr.length() && match; ++i)
+        {
+            char c = abbr[i];
+            if (c >= 'A' && c <= 'Z')
+                c = static_cast<char>(c - 'A' + 'a');
+            match = (c == instrument.abbr[i]);
+        }
+        if (match)
+            return &instrument;
+    }
+    return nullptr;
+}
+
+// --- Render policies ---
+// Everything that depends on the render policy lives in one specialization,
+// so prepareVoice() never inspects instrument names.
+template <RenderPolicy Policy>
+struct RenderPolicyTraits;
+
+template <>
+struct RenderPolicyTraits<RenderPolicy::LoopedPitched>
+{
+    static constexpr bool loops = true;        // Loop the waveform for the whole note
+    static constexpr bool parsesPitch = true;  // Note names are A-G, accidental, octave
+    // Fade in/out over a few milliseconds to remove the clicks of starting
+    // and cutting a looped waveform at an arbitrary sample
+    static constexpr VoiceEnvelope envelope{0.002, 0.0, 1.0f, 0.005};
+};
+
+template <>
+struct RenderPolicyTraits<RenderPolicy::OneShot>
+{
+    static constexpr bool loops = false;
+    static constexpr bool parsesPitch = false; // The note name is the sound's ID
+    // Drums and effects keep their recorded attack; they only get a short
+    // release when a note cuts them off early (see renderVoice)
+    static constexpr VoiceEnvelope envelope{0.0, 0.0, 1.0f, 0.003};
+};
+
+template <>
+struct RenderPolicyTraits<RenderPolicy::Noise>
+{
+    static constexpr bool loops = true; // Generated for the whole note, like a loop
+    static constexpr bool parsesPitch = false;
+    // Noise starts mid-waveform, so it needs the same declick as a loop
+    static constexpr VoiceEnvelope envelope{0.002, 0.0, 1.0f, 0.005};
+};
+
+// Calls 'f' with the traits type of 'policy', turning the runtime enum into
+// a compile-time specialization: f(RenderPolicyTraits<P>{}).
+template <typename F>
+constexpr decltype(auto) dispatchRenderPolicy(RenderPolicy policy, F &&f)
+{
+    switch (policy)
+    {
+    case RenderPolicy::OneShot:
+        return f(RenderPolicyTraits<RenderPolicy::OneShot>{});
+    case RenderPolicy::Noise:
+        return f(RenderPolicyTraits<RenderPolicy::Noise>{});
+    case RenderPolicy::LoopedPitched:
+    default:
+        return f(RenderPolicyTraits<RenderPolicy::LoopedPitched>{});
+    }
+}
+
+// True if notes of this instrument are written as pitches (A-G ...)
+constexpr bool parsesPitch(const InstrumentInfo &instrument)
+{
+    return dispatchRenderPolicy(instrument.policy, [](auto traits)
+                                { return decltype(traits)::parsesPitch; });
+}
+
+#endif // INSTRUMENT_REGISTRY_H
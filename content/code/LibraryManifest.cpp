@@ -0,0 +1,140 @@
+#include "LibraryManifest.h"
+#include <algorithm> // For std::sort, std::lower_bound
+#include <cerrno>    // For errno, ERANGE
+#include <cstdio>    // For std::rename
+#include <cstdlib>   // For std::strtoull
+#include <fstream>
+#include <iomanip>   // For std::hex, std::setw
+#include <iostream>
+#include <sstream>
+
+// --- load Implementation ---
+bool LibraryManifest::load(const std::string &libraryRoot)
+{
+    m_entries.clear();
+
+    std::string manifestPath = libraryRoot + "/" + MANIFEST_FILENAME;
+    std::ifstream in(manifestPath);
+    if (!in)
+    {
+        return false;
+    }
+
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(in, line))
+    {
+        lineNumber++;
+        if (line.empty() || line[0] == '#')
+        {
+            continue; // Header or comment
+        }
+
+        // path, rate, channels, frames, peak [, rms, hash]
+        // (manifests from before RMS and hashes were added have 5 columns)
+        std::istringstream fields(line);
+        ManifestEntry entry{};
+        std::string hashText;
+        if (!std::getline(fields, entry.path, '\t') ||
+            !(fields >> entry.sampleRate >> entry.channels >> entry.frames >> entry.peak))
+        {
+            std::cerr << "Warning: Malformed line " << lineNumber << " in " << manifestPath << ". Skipping." << std::endl;
+            continue;
+        }
+        if (fields >> entry.rms >> hashText)
+        {
+            char *end = nullptr;
+            errno = 0;
+            entry.contentHash = std::strtoull(hashText.c_str(), &end, 16);
+            if (hashText[0] == '-' || end == hashText.c_str() || *end != '\0' || errno == ERANGE)
+            {
+                std::cerr << "Warning: Malformed hash on line " << lineNumber << " in " << manifestPath << ". Skipping."
+                          << std::endl;
+                continue;
+            }
+        }
+        m_entries.push_back(std::move(entry));
+    }
+
+    resolveIds();
+    return true;
+}
+
+// --- save Implementation ---
+bool LibraryManifest::save(const std::string &libraryRoot) const
+{
+    std::string manifestPath = libraryRoot + "/" + MANIFEST_FILENAME;
+    std::string tempPath = manifestPath + ".tmp";
+    {
+        std::ofstream out(tempPath);
+        if (!out)
+        {
+            std::cerr << "Error: Cannot write manifest " << manifestPath << std::endl;
+            return false;
+        }
+        out << "# path\tsample_rate\tchannels\tframes\tpeak\trms\thash\n";
+        for (const ManifestEntry &entry : m_entries)
+        {
+            out << entry.path << '\t' << entry.sampleRate << '\t' << entry.channels << '\t'
+                << entry.frames << '\t' << entry.peak << '\t' << entry.rms << '\t'
+                << std::hex << std::setw(16) << std::setfill('0') << entry.contentHash
+                << std::dec << std::setfill(' ') << '\n';
+        }
+        if (!out)
+        {
+            std::cerr << "Error: Failed writing manifest " << tempPath << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(tempPath.c_str(), manifestPath.c_str()) != 0)
+    {
+        std::cerr << "Error: Cannot replace manifest " << manifestPath << std::endl;
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --- assign Implementation ---
+void LibraryManifest::assign(std::vector<ManifestEntry> entries)
+{
+    m_entries = std::move(entries);
+    resolveIds();
+}
+
+// --- find Implementation ---
+const ManifestEntry *LibraryManifest::find(std::string_view relativePath) const
+{
+    auto it = std::lower_bound(m_entries.begin(), m_entries.end(), relativePath,
+                               [](const ManifestEntry &entry, std::string_view path)
+                               { return entry.path < path; });
+    if (it != m_entries.end() && it->path == relativePath)
+    {
+        return &*it;
+    }
+    return nullptr;
+}
+
+// --- hashSamples Implementation ---
+uint64_t LibraryManifest::hashSamples(const float *samples, size_t count)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(samples);
+    for (size_t i = 0; i < count * sizeof(float); ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL; // FNV prime
+    }
+    return hash;
+}
+
+// --- resolveIds Implementation ---
+void LibraryManifest::resolveIds()
+{
+    std::sort(m_entries.begin(), m_entries.end(), [](const ManifestEntry &a, const ManifestEntry &b)
+              { return a.path < b.path; });
+    for (size_t i = 0; i < m_entries.size(); ++i)
+    {
+        m_entries[i].id = static_cast<uint32_t>(i);
+    }
+}
@@ -0,0 +1,63 @@
+// LibraryManifest.h
+
+#ifndef LIBRARY_MANIFEST_H
+#define LIBRARY_MANIFEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Name of the manifest file at the root of a waveform library
+const char *const MANIFEST_FILENAME = "library_manifest.tsv";
+
+// Precomputed description of one sample in the library
+struct ManifestEntry
+{
+    std::string path;     // Relative to the library root, '/' separated (e.g. "squarewave/A4-sqr.wav")
+    int sampleRate;
+    int channels;
+    size_t frames;
+    float peak;           // Linear sample peak
+    float rms;            // Linear RMS level
+    uint64_t contentHash; // FNV-1a of the decoded float samples
+    uint32_t id;          // Resolved sample ID: the entry's index in path order
+
+    double durationSeconds() const { return sampleRate > 0 ? static_cast<double>(frames) / sampleRate : 0.0; }
+};
+
+// The manifest of a waveform library: one line per sample, tab-separated,
+// written by "mml_libtool conform" or "mml_libtool manifest". With it the
+// engine knows what the library holds, and how long every sample is,
+// without opening any WAV file.
+class LibraryManifest
+{
+public:
+    // Reads <libraryRoot>/library_manifest.tsv. Returns false if there is
+    // none (or it cannot be read); the manifest is then empty.
+    bool load(const std::string &libraryRoot);
+
+    // Writes the manifest to <libraryRoot>/library_manifest.tsv through a
+    // temporary file, so a reader never sees a partial manifest
+    bool save(const std::string &libraryRoot) const;
+
+    // Replaces the entries (e.g. after scanning a library) and resolves IDs
+    void assign(std::vector<ManifestEntry> entries);
+
+    // Entry for a relative sample path, or nullptr (binary search)
+    const ManifestEntry *find(std::string_view relativePath) const;
+
+    const std::vector<ManifestEntry> &entries() const { return m_entries; }
+    bool empty() const { return m_entries.empty(); }
+
+    // FNV-1a (64-bit) over the bytes of decoded float samples
+    static uint64_t hashSamples(const float *samples, size_t count);
+
+private:
+    std::vector<ManifestEntry> m_entries; // Sorted by path
+
+    void resolveIds();
+};
+
+#endif // LIBRARY_MANIFEST_H
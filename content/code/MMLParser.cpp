@@ -1,88 +1,131 @@
 #include "AudioUtils.h"
 #include "MMLParser.h"
+#include "AllocAccounting.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 #include <sstream>   // For std::istringstream
 #include <algorithm> // For std::remove_if, std::transform
 #include <cctype>    // For std::isspace, std::isdigit etc.
 #include <iostream>  // For error reporting
 #include <string>    // For std::string::npos, substr etc
+#include <charconv>  // For std::from_chars
+#include <cmath>     // For std::isfinite
+#include <type_traits> // For std::is_same_v
 
 // MMLParser constructor implementation
 MMLParser::MMLParser(const std::string &waveformLibraryPath,
                      double defaultTempoBPM,
                      int defaultOctave,
                      int defaultLength,
-                     int defaultVolume)
+                     int defaultVolume,
+                     int sampleRate)
     // Initialize member variables in the initializer list
-    : m_noteDecoder(waveformLibraryPath), // Initialize the NoteDecoder here
+    : m_sampleRate(sampleRate),
+      m_noteDecoder(waveformLibraryPath, sampleRate), // Initialize the NoteDecoder here
       m_currentTempoBPM(defaultTempoBPM),
       m_currentOctave(defaultOctave),
       m_currentLength(defaultLength),
       m_currentVolume(static_cast<float>(defaultVolume) / 100.0f)
 {
     std::cout << "MMLParser initialized with waveform library: " << waveformLibraryPath << std::endl;
+    std::cout << "Sample Rate: " << m_sampleRate << " Hz" << std::endl;
     std::cout << "Default Tempo: " << m_currentTempoBPM << ", Octave: " << m_currentOctave << ", Length: " << m_currentLength << ", Volume: " << defaultVolume << "%" << std::endl;
 }
 
+// Helper: trims whitespace from both ends of a view
+static std::string_view trimView(std::string_view s)
+{
+    size_t first = s.find_first_not_of(" \t\n\r\f\v");
+    if (first == std::string_view::npos)
+    {
+        return {};
+    }
+    size_t last = s.find_last_not_of(" \t\n\r\f\v");
+    return s.substr(first, last - first + 1);
+}
+
+// Helper: compares a token against a lowercase keyword, ignoring case
+static bool equalsIgnoreCase(std::string_view token, std::string_view lowerKeyword)
+{
+    if (token.length() != lowerKeyword.length())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < token.length(); ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(token[i])) != lowerKeyword[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Helper: splitString (Basic implementation)
-std::vector<std::string> MMLParser::splitString(const std::string &s, char delimiter) const
+// The pieces are views into 's' and the vector lives in the render arena,
+// so splitting allocates nothing on the heap.
+std::pmr::vector<std::string_view> MMLParser::splitString(std::string_view s, char delimiter)
 {
-    std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream tokenStream(s);
-    while (std::getline(tokenStream, token, delimiter))
+    std::pmr::vector<std::string_view> tokens(m_arena.resource());
+    size_t start = 0;
+    while (start <= s.length())
     {
+        size_t end = s.find(delimiter, start);
+        if (end == std::string_view::npos)
+        {
+            end = s.length();
+        }
         // Trim leading/trailing whitespace from each token
-        token.erase(token.find_last_not_of(" \t\n\r\f\v") + 1);
-        token.erase(0, token.find_first_not_of(" \t\n\r\f\v"));
+        std::string_view token = trimView(s.substr(start, end - start));
         if (!token.empty())
         {
             tokens.push_back(token);
         }
+        start = end + 1;
     }
     return tokens;
 }
 
 // Helper: parseInt
-int MMLParser::parseInt(const std::string &s, int defaultValue) const
+int MMLParser::parseInt(std::string_view s, int defaultValue) const
 {
-    try
+    // Accept what std::stoi did: leading whitespace and an explicit '+'
+    s = s.substr(std::min(s.find_first_not_of(" \t\n\r\f\v"), s.length()));
+    if (s.length() > 1 && s[0] == '+')
     {
-        size_t pos;
-        int value = std::stoi(s, &pos);
-        if (pos == s.length())
-        { // Ensure entire string was consumed
-            return value;
-        }
+        s.remove_prefix(1);
     }
-    catch (const std::exception &)
-    {
-        // Conversion failed or not a full number
+    int value = 0;
+    auto result = std::from_chars(s.data(), s.data() + s.length(), value);
+    if (!s.empty() && result.ec == std::errc() && result.ptr == s.data() + s.length())
+    { // Ensure entire string was consumed
+        return value;
     }
+    // Conversion failed or not a full number
     return defaultValue;
 }
 
 // Helper: parseDouble
-double MMLParser::parseDouble(const std::string &s, double defaultValue) const
+double MMLParser::parseDouble(std::string_view s, double defaultValue) const
 {
-    try
+    s = s.substr(std::min(s.find_first_not_of(" \t\n\r\f\v"), s.length()));
+    if (s.length() > 1 && s[0] == '+')
     {
-        size_t pos;
-        double value = std::stod(s, &pos);
-        if (pos == s.length())
-        { // Ensure entire string was consumed
-            return value;
-        }
+        s.remove_prefix(1);
     }
-    catch (const std::exception &)
-    {
-        // Conversion failed or not a full number
+    double value = 0.0;
+    auto result = std::from_chars(s.data(), s.data() + s.length(), value);
+    if (!s.empty() && result.ec == std::errc() && result.ptr == s.data() + s.length() && std::isfinite(value))
+    { // Ensure entire string was consumed
+        return value;
     }
+    // Conversion failed, not a full number, or "inf"/"nan"
     return defaultValue;
 }
 
 // parseNoteCommand (MODIFIED to use defaults)
 bool MMLParser::parseNoteCommand(
-    const std::string &command_args_str,
+    std::string_view command_args_str,
     std::string &folderAbbr,
     std::string &noteName,
     char &accidental,
@@ -91,7 +134,7 @@ bool MMLParser::parseNoteCommand(
     double &explicitDurationSeconds,
     int defaultLength,
     int defaultOctave
-) const
+)
 {
     // Initialize output parameters with passed-in defaults
     noteName = "";
@@ -101,7 +144,7 @@ bool MMLParser::parseNoteCommand(
     octave = defaultOctave;
     explicitDurationSeconds = 0.0;
 
-    std::vector<std::string> parts = splitString(command_args_str, ' ');
+    std::pmr::vector<std::string_view> parts = splitString(command_args_str, ' ');
 
     // --- DEBUG PRINT ---
     std::cout << "  DEBUG: parseNoteCommand received '" << command_args_str << "'. Split into parts:";
@@ -112,7 +155,7 @@ bool MMLParser::parseNoteCommand(
     std::cout << std::endl;
     // --- END DEBUG PRINT ---
 
-    std::string note_spec_part;
+    std::string_view note_spec_part;
     if (!parts.empty())
     {
         note_spec_part = parts[0];
@@ -126,7 +169,7 @@ bool MMLParser::parseNoteCommand(
     // Explicit duration parsing
     if (parts.size() > 1)
     {
-        std::string duration_str = parts[1];
+        std::string_view duration_str = parts[1];
         if (duration_str.length() > 1 && duration_str.back() == 's')
         {
             explicitDurationSeconds = parseDouble(duration_str.substr(0, duration_str.length() - 1));
@@ -139,22 +182,23 @@ bool MMLParser::parseNoteCommand(
     }
 
     // Special handling for non-pitched instruments
-    if (folderAbbr == "X" || folderAbbr == "noise" || folderAbbr == "miscellaneous" || folderAbbr == "sk-5")
+    const InstrumentInfo *instrument = findInstrument(folderAbbr);
+    if (instrument != nullptr && !parsesPitch(*instrument))
     {
-        noteName = note_spec_part;
+        noteName = std::string(note_spec_part);
         // length and octave will remain defaultLength/defaultOctave but are unused by NoteDecoder for these types.
         return true;
     }
 
     // Complex parsing for pitched instruments
     // (MODIFIED to potentially override defaults)
-    std::string current_note_spec_remaining = note_spec_part;
+    std::string_view current_note_spec_remaining = note_spec_part;
     size_t current_pos = 0;
 
     // 1. Extract baseNote (A-G)
     if (current_pos < current_note_spec_remaining.length() && std::isalpha(current_note_spec_remaining[current_pos]))
     {
-        noteName = current_note_spec_remaining.substr(current_pos, 1);
+        noteName = std::string(current_note_spec_remaining.substr(current_pos, 1));
         char upper_note = std::toupper(noteName[0]);
         if (upper_note < 'A' || upper_note > 'G')
         {
@@ -189,7 +233,7 @@ bool MMLParser::parseNoteCommand(
     }
     if (current_pos > start_of_length)
     { // If digits were found
-        std::string length_str = current_note_spec_remaining.substr(start_of_length, current_pos - start_of_length);
+        std::string_view length_str = current_note_spec_remaining.substr(start_of_length, current_pos - start_of_length);
         int parsedLength = parseInt(length_str, 0);
         if (parsedLength > 0)
         {                          // Only override if parsed length is valid
@@ -208,7 +252,7 @@ bool MMLParser::parseNoteCommand(
         current_pos++; // Move past 'o'
         if (current_pos < current_note_spec_remaining.length() && std::isdigit(current_note_spec_remaining[current_pos]))
         {
-            std::string octave_str = current_note_spec_remaining.substr(current_pos, 1); // Only expecting single digit octave
+            std::string_view octave_str = current_note_spec_remaining.substr(current_pos, 1); // Only expecting single digit octave
             // Use -1 as sentinel for invalid
             int parsedOctave = parseInt(octave_str, -1);
             if (parsedOctave >= 0)
@@ -242,12 +286,14 @@ bool MMLParser::parseNoteCommand(
 }
 
 // parseNoteString Implementation (MODIFIED)
-bool MMLParser::parseNoteString(const std::string &fullNoteString,
+bool MMLParser::parseNoteString(std::string_view fullNoteString,
                                 std::string &folderAbbr,
+                                const InstrumentInfo *&instrument, // Output: registry entry for folderAbbr
                                 std::string &noteName, // This will be the full drum name if X folder
                                 char &accidental,
                                 int &length_for_note,
                                 int &octave_for_note,
+                                double &cents,
                                 double &explicitDurationSeconds,
                                 int defaultLength,
                                 int defaultOctave)
@@ -257,22 +303,24 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
     accidental = ' '; // Initialize to a default non-accidental char
     length_for_note = defaultLength;
     octave_for_note = defaultOctave;
+    cents = 0.0;
     explicitDurationSeconds = 0.0;
     folderAbbr = ""; // Initialize folderAbbr
+    instrument = nullptr;
 
-    std::string temp_note_str = fullNoteString; // e.g., "X:bass03" or "sqr:C4 0.5s"
+    std::string_view temp_note_str = fullNoteString; // e.g., "X:bass03" or "sqr:C4 0.5s"
 
     // 1. Extract folder abbreviation (e.g., "X", "sqr", "tri")
     size_t colon_pos = temp_note_str.find(':');
     if (colon_pos != std::string::npos)
     {
-        folderAbbr = temp_note_str.substr(0, colon_pos);
+        folderAbbr = std::string(temp_note_str.substr(0, colon_pos));
         temp_note_str = temp_note_str.substr(colon_pos + 1); // Remaining part: "bass03" or "C4 0.5s"
     }
     else
     {
         // If no folder prefix, use a default (as per your parseMML logic)
-        folderAbbr = "sqr";
+        folderAbbr = std::string(DEFAULT_INSTRUMENT);
     }
 
     // Convert folderAbbr to lowercase for case-insensitive comparison
@@ -280,11 +328,20 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
                    [](unsigned char c)
                    { return std::tolower(c); });
 
+    // Resolve the instrument once, here, so rendering never compares names
+    instrument = findInstrument(folderAbbr);
+    if (instrument == nullptr)
+    {
+        std::cerr << "Error: Unknown instrument folder '" << folderAbbr
+                  << "' in '" << fullNoteString << "'" << std::endl;
+        return false;
+    }
+
     // 2. Extract explicit duration if present (e.g., "C4 0.5s" -> "0.5s")
     size_t space_pos = temp_note_str.find(' ');
     if (space_pos != std::string::npos)
     {
-        std::string duration_part = temp_note_str.substr(space_pos + 1);
+        std::string_view duration_part = temp_note_str.substr(space_pos + 1);
         temp_note_str = temp_note_str.substr(0, space_pos); // Note part before space: "C4" or "bass03"
 
         if (duration_part.length() > 1 && duration_part.back() == 's')
@@ -305,8 +362,7 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
     }
 
     // Trim any remaining whitespace from the main note/sound string
-    temp_note_str.erase(0, temp_note_str.find_first_not_of(" \t\n\r\f\v"));
-    temp_note_str.erase(temp_note_str.find_last_not_of(" \t\n\r\f\v") + 1);
+    temp_note_str = trimView(temp_note_str);
 
     if (temp_note_str.empty())
     {
@@ -315,11 +371,11 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
     }
 
     // --- Special handling for non-pitched instruments (like 'X') ---
-    // If the folder abbreviation is one of the non-pitched types,
-    // the entire 'temp_note_str' is the sound's name (e.g., "bass03", "snare01").
-    if (folderAbbr == "x" || folderAbbr == "noise" || folderAbbr == "miscellaneous" || folderAbbr == "sk-5")
+    // If the instrument's render policy is not pitched, the entire
+    // 'temp_note_str' is the sound's name (e.g., "bass03", "snare01").
+    if (!parsesPitch(*instrument))
     {
-        noteName = temp_note_str; // The entire remaining string is the drum/sound ID
+        noteName = std::string(temp_note_str); // The entire remaining string is the drum/sound ID
         // For non-pitched instruments, 'accidental', 'length', 'octave' are not relevant
         // and will retain their default values/initializations.
         return true; // Successfully parsed a non-pitched sound
@@ -356,12 +412,12 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
     // Extract octave (does not require 'o' anymore)
     if (i < temp_note_str.length() && std::isdigit(temp_note_str[i]))
     {
-        std::string octave_str = "";
+        size_t octave_start = i;
         while (i < temp_note_str.length() && std::isdigit(temp_note_str[i]))
         {
-            octave_str += temp_note_str[i];
             i++;
         }
+        std::string_view octave_str = temp_note_str.substr(octave_start, i - octave_start);
         // Use parseInt helper for robust conversion
         int parsed_octave = parseInt(octave_str, -1); // Use -1 as sentinel for invalid
         if (parsed_octave >= 0)                       // Assuming valid octaves are non-negative
@@ -380,6 +436,18 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
         octave_for_note = defaultOctave;
     }
 
+    // Optional detune in cents after the octave: "A4+25c", "C#3-12.5c"
+    if (i + 1 < temp_note_str.length() && (temp_note_str[i] == '+' || temp_note_str[i] == '-') &&
+        temp_note_str.back() == 'c')
+    {
+        double parsed_cents = parseDouble(temp_note_str.substr(i, temp_note_str.length() - 1 - i), std::nan(""));
+        if (std::isfinite(parsed_cents))
+        {
+            cents = parsed_cents;
+            i = temp_note_str.length();
+        }
+    }
+
     // Check for any remaining unrecognized characters
     if (i < temp_note_str.length())
     {
@@ -396,14 +464,14 @@ bool MMLParser::parseNoteString(const std::string &fullNoteString,
 
 
 // Helper to check if a string looks like an explicit duration (e.g., "1s", "0.5s")
-bool isExplicitDurationToken(const std::string &token)
+static bool isExplicitDurationToken(std::string_view token)
 {
     if (token.empty() || token.back() != 's' || token.length() < 2)
     {
         return false;
     }
     // Check if the part before 's' is a valid number
-    std::string num_part = token.substr(0, token.length() - 1);
+    std::string_view num_part = token.substr(0, token.length() - 1);
     bool has_digit = false;
     bool has_decimal = false;
     for (char c : num_part)
@@ -426,620 +494,1549 @@ bool isExplicitDurationToken(const std::string &token)
     return has_digit; // Must have at least one digit
 }
 
-// parseMML - Main entry point (REVISED for explicit durations)
-std::vector<float> MMLParser::parseMML(const std::string &mmlString)
-{
-    std::vector<float> fullAudioOutput;
+// Maximum nesting depth for repeat blocks and pattern bodies, to keep
+// runaway input bounded
+static const int MAX_BLOCK_DEPTH = 16;
 
-    // Initialize current state (these will be updated by TEMPO, OCTAVE, LENGTH commands)
-    double currentTempo = m_currentTempoBPM; // Start with default BPM
-    int currentOctave = m_currentOctave;     // Start with default octave
-    int currentLength = m_currentLength;     // Start with default length
-    float currentVolume = m_currentVolume;
+// Helper to check if a token opens a repeat block ("[")
+static bool isRepeatOpenToken(std::string_view token)
+{
+    return token == "[";
+}
 
-    std::cout << "Tempo set to: " << currentTempo << " BPM" << std::endl;
-    std::cout << "Default octave set to: " << currentOctave << std::endl;
-    std::cout << "Default length set to: " << currentLength << std::endl;
-    std::cout << "Default volume set to: " << static_cast<int>(currentVolume * 100) << "%" << std::endl;
+// Helper to check if a token closes a repeat block ("]" or "]N")
+static bool isRepeatCloseToken(std::string_view token)
+{
+    return !token.empty() && token[0] == ']';
+}
 
-    // --- Apply comment stripping here ---
-    std::string cleanedMMLString = stripComments(mmlString);
+// Helper to check if a token is block punctuation rather than a command
+static bool isBlockToken(std::string_view token)
+{
+    return isRepeatOpenToken(token) || isRepeatCloseToken(token) || token == "{" || token == "}";
+}
 
-    // --- Use std::stringstream for robust tokenization ---
-    std::stringstream ss(cleanedMMLString);
-    std::string current_token;
+// --- tokenizeMML Implementation ---
+// Splits comment-free MML into command tokens. Block punctuation is split off
+// into its own tokens ("[X:bass01" -> "[", "X:bass01"; "R:8]4" -> "R:8",
+// "]4"; "PATTERN:fill{" -> "PATTERN:fill", "{"), and an explicit duration
+// token ("0.5s") is joined onto the command before it, exactly as the old
+// look-ahead in parseMML did. Tokens are allocated from the render arena.
+std::pmr::vector<std::pmr::string> MMLParser::tokenizeMML(std::string_view cleanedMMLString)
+{
+    TRACE_SCOPE("tokenize", "parse");
+    std::pmr::memory_resource *arena = m_arena.resource();
+    std::pmr::vector<std::string_view> pieces(arena);
 
-    // The loop now correctly extracts tokens separated by any whitespace
-    // (including newlines)
-    while (ss >> current_token)
-    { // Loop advances token automatically
+    size_t word_start = 0;
+    while (true)
+    {
+        word_start = cleanedMMLString.find_first_not_of(" \t\n\r\f\v", word_start);
+        if (word_start == std::string_view::npos)
+        {
+            break;
+        }
+        size_t word_end = std::min(cleanedMMLString.find_first_of(" \t\n\r\f\v", word_start), cleanedMMLString.length());
+        std::string_view word = cleanedMMLString.substr(word_start, word_end - word_start);
+        word_start = word_end;
 
-        std::string command_type_str;
-        std::string command_args_str;
+        size_t piece_start = 0;
+        for (size_t i = 0; i < word.length(); ++i)
+        {
+            char c = word[i];
+            if (c != '[' && c != ']' && c != '{' && c != '}')
+            {
+                continue;
+            }
+            if (i > piece_start)
+            {
+                pieces.push_back(word.substr(piece_start, i - piece_start));
+            }
+            // A ']' takes the repeat count that follows it ("]4")
+            size_t end = i + 1;
+            if (c == ']')
+            {
+                while (end < word.length() && std::isdigit(static_cast<unsigned char>(word[end])))
+                {
+                    end++;
+                }
+            }
+            pieces.push_back(word.substr(i, end - i));
+            piece_start = end;
+            i = end - 1;
+        }
+        if (piece_start < word.length())
+        {
+            pieces.push_back(word.substr(piece_start));
+        }
+    }
 
-        size_t colon_pos = current_token.find(':');
-        if (colon_pos != std::string::npos)
+    // Join explicit durations onto the preceding command token
+    std::pmr::vector<std::pmr::string> tokens(arena);
+    tokens.reserve(pieces.size());
+    for (std::string_view piece : pieces)
+    {
+        if (isExplicitDurationToken(piece) && !tokens.empty() && !isBlockToken(tokens.back()))
         {
-            command_type_str = current_token.substr(0, colon_pos);
-            command_args_str = current_token.substr(colon_pos + 1);
+            tokens.back() += ' ';
+            tokens.back() += piece;
         }
         else
         {
-            // Default to squarewave folder if no colon
-            command_type_str = "sqr";
-            // This is the problem spot for notes without explicit folders.
-            // The current MML format always uses folder:note, so this path may not be hit.
-            command_args_str = current_token;
+            tokens.emplace_back(piece);
         }
+    }
+    return tokens;
+}
+
+// --- compileCommand Implementation ---
+// Compiles one command token into a ParsedCommand. Values that depend on the
+// running state (tempo-relative rests, default octave/length for notes) are
+// left for the renderer, so a compiled block can be replayed from any state.
+ParsedCommand MMLParser::compileCommand(std::string_view token)
+{
+    ParsedCommand pCmd;
+    pCmd.type = CommandType::UNKNOWN;
+    pCmd.originalCommandString = std::string(token);
 
-        // Convert command_type_str to lowercase for case-insensitive comparison
-        std::transform(command_type_str.begin(), command_type_str.end(), command_type_str.begin(),
-                       [](unsigned char c)
-                       { return std::tolower(c); });
+    // Views into the token; keywords are matched case-insensitively in place
+    std::string_view command_type_str;
+    std::string_view command_args_str;
 
-        // --- LOOK-AHEAD LOGIC FOR OPTIONAL EXPLICIT DURATION ---
-        // Moved here to allow both CHORD and note explicit duration
-        std::string next_token_candidate;
-        std::streampos current_iss_pos = ss.tellg(); // Save current stream position
+    size_t colon_pos = token.find(':');
+    if (colon_pos != std::string_view::npos)
+    {
+        command_type_str = token.substr(0, colon_pos);
+        command_args_str = token.substr(colon_pos + 1);
+    }
+    else
+    {
+        // Default to squarewave folder if no colon
+        command_type_str = "sqr";
+        // The current MML format always uses folder:note, so this path may not be hit.
+        command_args_str = token;
+    }
 
-        // Try to read the next token from the stream
-        if (ss >> next_token_candidate)
+    if (equalsIgnoreCase(command_type_str, "tempo"))
+    {
+        double tempo = parseDouble(command_args_str);
+        if (tempo > 0)
         {
-            // *** USE THE HELPER METHOD HERE ***
-            if (isExplicitDurationToken(next_token_candidate)) // Check if it's a valid explicit duration token
-            {
-                // If it's a valid duration, append it to the full note specification.
-                // The 'ss >> next_token_candidate' already consumed it, so no rewind needed.
-                command_args_str += " " + next_token_candidate;
-            }
-            else
-            {
-                // Not an explicit duration, put the token back into the stream
-                ss.seekg(current_iss_pos); // Rewind the stream
-            }
+            pCmd.type = CommandType::TEMPO;
+            pCmd.data = ParsedTempo{tempo};
         }
-        // If ss >> next_token_candidate failed (e.g., end of stream),
-        // full_note_spec remains just the first token, which is correct.
-
-        // --- END OF LOOK-AHEAD LOGIC ---
-
-        if (command_type_str == "tempo")
+        else
         {
-            double tempo = parseDouble(command_args_str);
-            if (tempo > 0)
-            {
-                currentTempo = tempo;
-                std::cout << "Tempo changed to: " << currentTempo << " BPM" << std::endl;
-            }
-            else
-            {
-                std::cerr << "Warning: Invalid tempo value '" << command_args_str << "'. Using current tempo." << std::endl;
-            }
+            std::cerr << "Warning: Invalid tempo value '" << command_args_str << "'. Using current tempo." << std::endl;
         }
-        else if (command_type_str == "octave")
+    }
+    else if (equalsIgnoreCase(command_type_str, "octave"))
+    {
+        int octave = parseInt(command_args_str, -1);
+        if (octave >= 0 && octave <= 8)
         {
-            int octave = parseInt(command_args_str);
-            if (octave >= 0 && octave <= 8)
-            {
-                currentOctave = octave;
-                std::cout << "Octave changed to: " << currentOctave << std::endl;
-            }
-            else
-            {
-                std::cerr << "Warning: Invalid octave value '" << command_args_str << "'. Using current octave." << std::endl;
-            }
+            pCmd.type = CommandType::OCTAVE;
+            pCmd.data = ParsedOctave{octave};
+        }
+        else
+        {
+            std::cerr << "Warning: Invalid octave value '" << command_args_str << "'. Using current octave." << std::endl;
         }
-        else if (command_type_str == "length")
+    }
+    else if (equalsIgnoreCase(command_type_str, "length"))
+    {
+        int length = parseInt(command_args_str);
+        if (length > 0 && (length == 1 || length == 2 || length == 4 || length == 8 || length == 16 || length == 32 || length == 64))
+        {
+            pCmd.type = CommandType::LENGTH;
+            pCmd.data = ParsedLength{length};
+        }
+        else
+        {
+            std::cerr << "Warning: Invalid or unsupported length value '" << command_args_str << "' in LENGTH command. Keeping current default length." << std::endl;
+        }
+    }
+    else if (equalsIgnoreCase(command_type_str, "volume"))
+    {
+        int volume = parseInt(command_args_str, -1);
+        if (volume >= 0 && volume <= 100)
+        {
+            pCmd.type = CommandType::VOLUME;
+            pCmd.data = ParsedVolume{volume};
+        }
+        else
+        {
+            std::cerr << "Warning: Invalid volume value '" << command_args_str << "'. Volume must be between 0 and 100. Using current volume." << std::endl;
+        }
+    }
+    else if (equalsIgnoreCase(command_type_str, "r"))
+    { // REST command
+        ParsedRest parsedRestData;
+        parsedRestData.isExplicitDuration = false;
+        parsedRestData.length = 0;
+        parsedRestData.explicitDurationSeconds = 0.0;
+
+        if (command_args_str.length() > 1 && command_args_str.back() == 's')
         {
-            int length = parseInt(command_args_str);
-            if (length > 0 && (length == 1 || length == 2 || length == 4 || length == 8 || length == 16 || length == 32 || length == 64))
+            double explicitRestDur = parseDouble(command_args_str.substr(0, command_args_str.length() - 1));
+            if (explicitRestDur > 0)
             {
-                currentLength = length;
-                std::cout << "Length changed to: " << currentLength << std::endl;
+                parsedRestData.explicitDurationSeconds = explicitRestDur;
+                parsedRestData.isExplicitDuration = true;
+                pCmd.type = CommandType::REST;
             }
             else
             {
-                std::cerr << "Warning: Invalid or unsupported length value '" << command_args_str << "' in LENGTH command. Keeping current default length." << std::endl;
+                std::cerr << "Warning: Rest duration calculated to be 0 or less for '" << token << "'. Skipping." << std::endl;
             }
         }
-        else if (command_type_str == "volume")
-        { // <--- NEW: VOLUME Command handling
-            int volume = parseInt(command_args_str);
-            if (volume >= 0 && volume <= 100)
+        else
+        {
+            int restLength = parseInt(command_args_str, 0);
+            if (restLength > 0 && (restLength == 1 || restLength == 2 || restLength == 4 || restLength == 8 || restLength == 16 || restLength == 32 || restLength == 64))
             {
-                // Scale to 0.0-1.0
-                currentVolume = static_cast<float>(volume) / 100.0f;
-                std::cout << "Volume changed to: " << volume << "%" << std::endl;
+                parsedRestData.length = restLength;
+                pCmd.type = CommandType::REST;
             }
             else
             {
-                std::cerr << "Warning: Invalid volume value '" << command_args_str << "'. Volume must be between 0 and 100. Using current volume." << std::endl;
+                std::cerr << "Warning: Invalid or unsupported rest length '" << command_args_str << "' in 'r:' command. Skipping rest." << std::endl;
             }
         }
-        else if (command_type_str == "r")
-        { // REST command
-            double restDurationSeconds = 0.0;
+        pCmd.data = parsedRestData;
+    }
+    else if (equalsIgnoreCase(command_type_str, "chord"))
+    { // <--- CHORD Command handling
+        ParsedChord parsedChordData;
+        parsedChordData.explicitDurationSeconds = 0.0; // Default to 0.0, indicating no explicit duration
+        std::string_view notes_only_str = command_args_str; // Will hold just the comma-separated notes
+
+        // --- Step 1: Attempt to extract explicit duration from the end of the chord argument string ---
+        size_t s_pos = notes_only_str.find_last_of('s');
+        // Check if 's' is found and there's a number before it
+        if (s_pos != std::string_view::npos && s_pos > 0 && notes_only_str[s_pos - 1] != ' ')
+        {
+            // Find the last space before 's', which should separate the notes from the duration
+            size_t space_before_s_or_start = notes_only_str.rfind(' ', s_pos);
 
-            if (command_args_str.length() > 1 && command_args_str.back() == 's')
-            {
-                restDurationSeconds = parseDouble(command_args_str.substr(0, command_args_str.length() - 1));
-            }
-            else
+            // If a space is found, the duration string starts after it. Otherwise, duration starts at the beginning.
+            size_t duration_start_pos = (space_before_s_or_start == std::string_view::npos) ? 0 : space_before_s_or_start + 1;
+
+            if (duration_start_pos < s_pos) // Ensure there's content for a number
             {
-                int restLength = parseInt(command_args_str, 0);
-                if (restLength > 0 && (restLength == 1 || restLength == 2 || restLength == 4 || restLength == 8 || restLength == 16 || restLength == 32 || restLength == 64))
+                std::string_view duration_str = notes_only_str.substr(duration_start_pos, s_pos - duration_start_pos);
+                double duration = parseDouble(duration_str, -1.0);
+                if (duration >= 0.0)
                 {
-                    restDurationSeconds = (60.0 / currentTempo) * (4.0 / restLength);
+                    parsedChordData.explicitDurationSeconds = duration;
+                    // Successfully parsed duration, now remove it from the string
+                    // (and any whitespace left in front of it)
+                    notes_only_str = trimView(notes_only_str.substr(0, duration_start_pos));
+                    std::cout << "DEBUG: Chord explicit duration found: " << parsedChordData.explicitDurationSeconds << "s" << std::endl;
                 }
                 else
                 {
-                    std::cerr << "Warning: Invalid or unsupported rest length '" << command_args_str << "' in 'r:' command. Skipping rest." << std::endl;
-                    // No audio added, loop proceeds to next token
+                    std::cerr << "Warning: Invalid explicit duration format for chord '" << duration_str << "'. Ignoring." << std::endl;
                 }
             }
-
-            if (restDurationSeconds > 0)
-            {
-                size_t numSamples = static_cast<size_t>(restDurationSeconds * SAMPLE_RATE);
-                std::vector<float> silentAudio(numSamples, 0.0f);
-                fullAudioOutput.insert(fullAudioOutput.end(), silentAudio.begin(), silentAudio.end());
-            }
-            else
-            {
-                std::cerr << "Warning: Rest duration calculated to be 0 or less for '" << current_token << "'. Skipping." << std::endl;
-            }
         }
-        else if (command_type_str == "chord")
-        { // <--- CHORD Command handling
-            std::cout << "DEBUG: Parsing CHORD: " << command_args_str << std::endl;
-
-            double chord_explicitDurationSeconds = 0.0;    // Default to 0.0, indicating no explicit duration
-            std::string notes_only_str = command_args_str; // Will hold just the comma-separated notes
 
-            // --- Step 1: Attempt to extract explicit duration from the end of the chord argument string ---
-            size_t s_pos = notes_only_str.find_last_of('s');
-            // Check if 's' is found and there's a number before it
-            if (s_pos != std::string::npos && s_pos > 0 && notes_only_str[s_pos - 1] != ' ')
-            {
-                // Find the last space before 's', which should separate the notes from the duration
-                size_t space_before_s_or_start = notes_only_str.rfind(' ', s_pos);
-
-                // If a space is found, the duration string starts after it. Otherwise, duration starts at the beginning.
-                size_t duration_start_pos = (space_before_s_or_start == std::string::npos) ? 0 : space_before_s_or_start + 1;
-
-                if (duration_start_pos < s_pos) // Ensure there's content for a number
-                {
-                    std::string duration_str = notes_only_str.substr(duration_start_pos, s_pos - duration_start_pos);
-                    try
-                    {
-                        chord_explicitDurationSeconds = std::stod(duration_str);
-                        // Successfully parsed duration, now remove it from the string
-                        notes_only_str = notes_only_str.substr(0, duration_start_pos);
-                        // Trim any trailing whitespace left by removing the duration
-                        notes_only_str.erase(notes_only_str.find_last_not_of(" \t\n\r\f\v") + 1);
-                        std::cout << "DEBUG: Chord explicit duration found: " << chord_explicitDurationSeconds << "s" << std::endl;
-                    }
-                    catch (const std::invalid_argument &e)
-                    {
-                        std::cerr << "Warning: Invalid explicit duration format for chord '" << duration_str << "'. Ignoring." << std::endl;
-                        chord_explicitDurationSeconds = 0.0; // Reset to default if parsing failed
-                    }
-                    catch (const std::out_of_range &e)
-                    {
-                        std::cerr << "Warning: Explicit duration for chord '" << duration_str << "' out of range. Ignoring." << std::endl;
-                        chord_explicitDurationSeconds = 0.0; // Reset to default if parsing failed
-                    }
-                }
-            }
-
-            // --- Step 2: Split the remaining string (which now only contains notes) by commas ---
-            std::vector<std::string> note_strings = splitString(notes_only_str, ',');
-
-            std::vector<std::vector<float>> individualNoteAudios;
-            size_t chordDurationSamples = 0; // Will now be determined consistently
-
-            if (note_strings.empty())
-            {
-                std::cerr << "Warning: CHORD command has no notes specified after parsing duration: '" << current_token << "'. Skipping." << std::endl;
-                continue;
-            }
-
-            // --- Step 3: Parse each note and generate audio, applying the chord-level duration ---
-            for (const std::string &note_str_raw : note_strings)
-            {
-                // Trim whitespace from individual note string parts
-                std::string note_str = note_str_raw;
-                note_str.erase(0, note_str.find_first_not_of(" \t\n\r\f\v"));
-                note_str.erase(note_str.find_last_not_of(" \t\n\r\f\v") + 1);
-
-                if (note_str.empty())
-                    continue; // Skip empty strings resulting from multiple commas or leading/trailing commas
-
-                std::string chord_note_folderAbbr;
-                std::string chord_note_name;
-                char chord_note_accidental;
-                int chord_note_length;
-                int chord_note_octave;
-                double dummy_explicitDurationSeconds; // This will capture any explicit duration within an individual note,
-                                                      // but it will be *ignored* in favor of chord_explicitDurationSeconds.
-
-                std::cout << " DEBUG: parseNoteString chord received '" << note_str << "'" << std::endl;
-
-                if (this->parseNoteString(note_str, chord_note_folderAbbr, chord_note_name, chord_note_accidental,
-                                          chord_note_length, chord_note_octave, dummy_explicitDurationSeconds,
-                                          currentLength, currentOctave))
-                {
-                    std::vector<float> noteAudio = m_noteDecoder.getNoteAudio(
-                        chord_note_folderAbbr,
-                        chord_note_name,
-                        chord_note_accidental,
-                        chord_note_length,
-                        chord_note_octave,
-                        chord_explicitDurationSeconds, // <--- CRITICAL CHANGE: Use the CHORD-level explicit duration here!
-                        currentTempo);
-
-                    // Apply current global volume to individual note
-                    for (float &sample : noteAudio)
-                    {
-                        sample *= currentVolume;
-                    }
-
-                    // All notes in the chord will now have the same duration (either explicit or derived from length)
-                    // We only need to set the chordDurationSamples once from the first note's size.
-                    if (chordDurationSamples == 0)
-                    {
-                        chordDurationSamples = noteAudio.size();
-                    }
-
-                    individualNoteAudios.push_back(noteAudio);
-                }
-                else
-                {
-                    std::cerr << "Warning: Could not parse note '" << note_str << "' within CHORD. Skipping this note." << std::endl;
-                }
-            } // End of loop through note_strings
+        // --- Step 2: Split the remaining string (which now only contains notes) by commas ---
+        std::pmr::vector<std::string_view> note_strings = splitString(notes_only_str, ',');
 
-            std::cout << "DEBUG: After parsing all chord notes - individualNoteAudios count: " << individualNoteAudios.size()
-                      << ", calculated chordDurationSamples: " << chordDurationSamples << std::endl;
+        // --- Step 3: Parse each note; the chord-level duration applies to all of them ---
+        for (std::string_view note_str : note_strings)
+        {
+            ParsedNote chordNote;
+            double dummy_explicitDurationSeconds; // Any per-note duration is *ignored* in favor of the chord's
 
-            // --- Mixing Audio Samples ---
-            if (chordDurationSamples > 0 && !individualNoteAudios.empty())
+            if (this->parseNoteString(note_str, chordNote.folderAbbr, chordNote.instrument, chordNote.noteName, chordNote.accidental,
+                                      chordNote.length, chordNote.octave, chordNote.cents, dummy_explicitDurationSeconds,
+                                      0, -1))
             {
-                std::vector<float> mixedChordAudio(chordDurationSamples, 0.0f);
-                float maxAmplitude = 0.0f; // To track for clipping
-
-                for (const auto &noteAudio : individualNoteAudios)
-                {
-                    // Ensure noteAudio has enough samples for chordDurationSamples (should be consistent now)
-                    size_t currentNoteAudioSize = noteAudio.size();
-                    for (size_t i = 0; i < std::min(chordDurationSamples, currentNoteAudioSize); ++i)
-                    {
-                        mixedChordAudio[i] += noteAudio[i];
-                        // Update max amplitude for clipping detection
-                        if (std::abs(mixedChordAudio[i]) > maxAmplitude)
-                        {
-                            maxAmplitude = std::abs(mixedChordAudio[i]);
-                        }
-                    }
-                }
-
-                // --- Simple Clipping (or add dynamic normalization here if preferred) ---
-                if (maxAmplitude > 1.0f)
-                {
-                    // Option 1: Hard clipping (simpler)
-                    for (float &sample : mixedChordAudio)
-                    {
-                        sample = std::max(-1.0f, std::min(1.0f, sample));
-                    }
-                    // Option 2: Dynamic normalization (better quality) - uncomment if preferred
-                    // float scaleFactor = 1.0f / maxAmplitude;
-                    // for (float& sample : mixedChordAudio) {
-                    //     sample *= scaleFactor;
-                    // }
-                    std::cout << "DEBUG: Chord audio clipped/normalized due to high amplitude." << std::endl;
-                }
-
-                fullAudioOutput.insert(fullAudioOutput.end(), mixedChordAudio.begin(), mixedChordAudio.end());
+                chordNote.explicitDurationSeconds = parsedChordData.explicitDurationSeconds;
+                parsedChordData.notes.push_back(chordNote);
             }
             else
             {
-                std::cerr << "Warning: No valid notes in CHORD or duration 0. Skipping chord." << std::endl;
+                std::cerr << "Warning: Could not parse note '" << note_str << "' within CHORD. Skipping this note." << std::endl;
             }
-        } // End of CHORD block
+        }
+
+        if (!parsedChordData.notes.empty())
+        {
+            pCmd.type = CommandType::CHORD;
+        }
         else
-        { // This is a potential Note/Sound Command (e.g., "X:bass03", "tri:C4")
-            // Now, parseNoteString receives the complete note specification,
-            // including the explicit duration if one was found and appended.
-            std::string full_note_str = command_type_str + ":" + command_args_str;
-
-            std::string parsed_folderAbbr;
-            std::string parsed_noteName;
-            char parsed_accidental;
-            int parsed_length_for_note;
-            int parsed_octave_for_note;
-            double parsed_explicitDurationSeconds;
-
-            std::cout << " DEBUG: parseNoteString note received '" << full_note_str << "'" << std::endl;
-
-            if (this->parseNoteString(full_note_str, parsed_folderAbbr, parsed_noteName, parsed_accidental,
-                                      parsed_length_for_note, parsed_octave_for_note, parsed_explicitDurationSeconds,
-                                      currentLength, currentOctave)) // HOTFIX
-            {
-                std::vector<float> noteAudio = m_noteDecoder.getNoteAudio(
-                    parsed_folderAbbr,
-                    parsed_noteName,
-                    parsed_accidental,
-                    parsed_length_for_note,
-                    parsed_octave_for_note,
-                    parsed_explicitDurationSeconds,
-                    currentTempo); // HOTFIX
-
-                // Apply volume
-                for (float &sample : noteAudio)
-                {
-                    sample *= m_currentVolume;
-                }
-                fullAudioOutput.insert(fullAudioOutput.end(), noteAudio.begin(), noteAudio.end());
-            }
-            else
-            {
-                std::cerr << "Error: Could not parse note command '" << command_args_str << "'. Skipping." << std::endl;
-            }
+        {
+            std::cerr << "Warning: CHORD command has no notes specified after parsing duration: '" << token << "'. Skipping." << std::endl;
         }
+        pCmd.data = parsedChordData;
+    }
+    else if (equalsIgnoreCase(command_type_str, "play"))
+    { // PLAY:name invokes a previously defined PATTERN
+        auto it = m_patterns.find(std::string(command_args_str));
+        if (it != m_patterns.end())
+        {
+            pCmd.type = CommandType::PLAY;
+            pCmd.data = ParsedPlay{it->second};
+        }
+        else
+        {
+            std::cerr << "Warning: PLAY of undefined pattern '" << command_args_str << "'. Patterns must be defined before they are played. Skipping." << std::endl;
+        }
+    }
+    else
+    { // This is a potential Note/Sound Command (e.g., "X:bass03", "tri:C4")
+        // The token already is "folder:note"; only a bare note needs its folder
+        std::pmr::string full_note_str(m_arena.resource());
+        if (colon_pos == std::string_view::npos)
+        {
+            full_note_str = DEFAULT_INSTRUMENT;
+            full_note_str += ':';
+        }
+        full_note_str += token;
+
+        ParsedNote parsedNoteData;
+        if (this->parseNoteString(full_note_str, parsedNoteData.folderAbbr, parsedNoteData.instrument, parsedNoteData.noteName, parsedNoteData.accidental,
+                                  parsedNoteData.length, parsedNoteData.octave, parsedNoteData.cents, parsedNoteData.explicitDurationSeconds,
+                                  0, -1))
+        {
+            pCmd.type = CommandType::NOTE;
+        }
+        else
+        {
+            std::cerr << "Error: Could not parse note command '" << command_args_str << "'. Skipping." << std::endl;
+        }
+        pCmd.data = parsedNoteData;
     }
-    return fullAudioOutput;
-}
 
+    return pCmd;
+}
 
-// --- stripComments function implementation ---
-std::string MMLParser::stripComments(const std::string &mmlStringWithComments)
+// Appends a description of what 'commands' play to 'key': each command's
+// text, with repeats spelled out and every PLAY replaced by the ID of the
+// pattern it resolved to (so a pattern playing a redefined pattern does not
+// share an ID with one playing the old definition)
+static void appendContentKey(const std::vector<ParsedCommand> &commands, std::string &key)
 {
-    std::string cleanedMML;
-    std::stringstream ss_input(mmlStringWithComments);
-    std::string line;
-
-    while (std::getline(ss_input, line))
+    for (const ParsedCommand &cmd : commands)
     {
-        size_t comment_pos = line.find(';'); // Find the first semicolon on the line
-        if (comment_pos != std::string::npos)
+        key += ' ';
+        if (cmd.type == CommandType::REPEAT)
+        {
+            const auto &repeat = std::get<ParsedRepeat>(cmd.data);
+            key += repeat.id + std::to_string(repeat.count);
+        }
+        else if (cmd.type == CommandType::PLAY)
         {
-            // If a semicolon is found, take only the part before it
-            cleanedMML += line.substr(0, comment_pos);
+            key += std::get<ParsedPlay>(cmd.data).pattern->id;
         }
         else
         {
-            // No semicolon, take the whole line
-            cleanedMML += line;
+            key += cmd.originalCommandString;
         }
-        cleanedMML += " "; // Add a space to separate tokens from different lines
     }
-    return cleanedMML;
 }
 
-
-// --- debugParseMML Implementation ---
-std::vector<ParsedCommand> MMLParser::debugParseMML(const std::string &mmlFilePath)
+// Gives each generated note of a NOTE or CHORD its noise key: a hash of the
+// command's text, how many times the same text already appeared in this
+// block, and the note's place in its chord. Identical passes of a block get
+// identical noise, and inserting or removing other notes does not reseed it.
+static void assignNoiseKeys(ParsedCommand &cmd, std::string_view token,
+                            std::map<std::string, uint64_t, std::less<>> &occurrences)
 {
-    std::vector<ParsedCommand> parsedCommands;
-    std::string mmlString = readFileIntoString(mmlFilePath);
-
-    if (mmlString.empty())
+    ParsedNote *notes = nullptr;
+    size_t numNotes = 0;
+    if (cmd.type == CommandType::NOTE)
     {
-        std::cerr << "Error: debugParseMML could not read MML file: " << mmlFilePath << std::endl;
-        return parsedCommands;
+        notes = &std::get<ParsedNote>(cmd.data);
+        numNotes = 1;
+    }
+    else if (cmd.type == CommandType::CHORD)
+    {
+        auto &chord = std::get<ParsedChord>(cmd.data);
+        notes = chord.notes.data();
+        numNotes = chord.notes.size();
+    }
+    if (std::none_of(notes, notes + numNotes, [](const ParsedNote &note)
+                     { return note.instrument->naming == NamingScheme::Generated; }))
+    {
+        return;
     }
 
-    // --- Apply comment stripping here as well ---
-    std::string cleanedMMLString = stripComments(mmlString);
+    auto it = occurrences.find(token);
+    if (it == occurrences.end())
+    {
+        it = occurrences.emplace(std::string(token), 0).first;
+    }
+    uint64_t occurrence = it->second++;
 
-    double currentTempo = 120.0;
-    int currentOctave = 4;
-    int currentLength = 4;
-    int currentDebugVolume = 100; // Track volume for debug output
+    uint64_t key = 14695981039346656037ULL; // FNV-1a
+    for (char c : token)
+    {
+        key = (key ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    key = (key ^ occurrence) * 1099511628211ULL;
+    for (size_t n = 0; n < numNotes; ++n)
+    {
+        notes[n].noiseKey = (key ^ n) * 1099511628211ULL;
+    }
+}
 
-    std::stringstream ss(cleanedMMLString);
-    std::string current_token;
+// --- compileTokens Implementation ---
+// Compiles tokens starting at 'pos' until the end of input or the token that
+// closes the current block ("]N" for repeats, "}" for pattern bodies), which
+// is left at 'pos' for the caller. 'closer' is '\0' at the top level.
+std::vector<ParsedCommand> MMLParser::compileTokens(const std::pmr::vector<std::pmr::string> &tokens, size_t &pos, int depth, char closer)
+{
+    std::vector<ParsedCommand> commands;
+    std::map<std::string, uint64_t, std::less<>> noiseOccurrences; // Per noise note text, in this block
 
-    while (ss >> current_token)
+    while (pos < tokens.size())
     {
-        ParsedCommand pCmd;
-        pCmd.originalCommandString = current_token;
-
-        std::string command_type_str;
-        std::string command_args_str;
+        const std::pmr::string &token = tokens[pos];
 
-        size_t colon_pos = current_token.find(':');
-        if (colon_pos != std::string::npos)
+        if (isRepeatCloseToken(token) || token == "}")
         {
-            command_type_str = current_token.substr(0, colon_pos);
-            command_args_str = current_token.substr(colon_pos + 1);
+            if (token[0] == closer)
+            {
+                return commands; // Closes the block our caller opened
+            }
+            std::cerr << "Warning: Unmatched '" << token << "'";
+            if (closer != '\0')
+            {
+                std::cerr << " (expected '" << closer << "')";
+            }
+            std::cerr << ". Ignoring." << std::endl;
+            pos++;
+            continue;
         }
-        else
+
+        if (token == "{")
         {
-            command_type_str = "sqr";
-            command_args_str = current_token;
+            std::cerr << "Warning: '{' must follow a PATTERN:name definition. Ignoring." << std::endl;
+            pos++;
+            continue;
         }
 
-        // --- LOOK-AHEAD LOGIC FOR OPTIONAL EXPLICIT DURATION ---
-        std::string next_token_candidate;
-        std::streampos current_iss_pos = ss.tellg(); // Save current stream position
-
-        // Try to read the next token from the stream
-        if (ss >> next_token_candidate)
+        if (isRepeatOpenToken(token))
         {
-            // *** USE THE HELPER METHOD HERE ***
-            if (isExplicitDurationToken(next_token_candidate)) // Check if it's a valid explicit duration token
-            {
-                // If it's a valid duration, append it to the full note specification.
-                // The 'ss >> next_token_candidate' already consumed it, so no rewind needed.
-                command_args_str += " " + next_token_candidate;
-            }
-            else
+            pos++; // Move past '['
+            if (depth + 1 > MAX_BLOCK_DEPTH)
             {
-                // Not an explicit duration, put the token back into the stream
-                ss.seekg(current_iss_pos); // Rewind the stream
+                std::cerr << "Warning: Blocks nested deeper than " << MAX_BLOCK_DEPTH << " levels. Ignoring '['." << std::endl;
+                continue;
             }
-        }
-        // If ss >> next_token_candidate failed (e.g., end of stream),
-        // full_note_spec remains just the first token, which is correct.
 
-        // --- END OF LOOK-AHEAD LOGIC ---
+            ParsedCommand pCmd;
+            pCmd.type = CommandType::REPEAT;
+            pCmd.originalCommandString = "[";
 
-        std::transform(command_type_str.begin(), command_type_str.end(), command_type_str.begin(),
-                       [](unsigned char c)
-                       { return std::tolower(c); });
+            ParsedRepeat parsedRepeatData;
+            parsedRepeatData.commands = compileTokens(tokens, pos, depth + 1, ']');
+            parsedRepeatData.count = 2; // A bare "]" plays the block twice
+            parsedRepeatData.id = "[";
+            appendContentKey(parsedRepeatData.commands, parsedRepeatData.id);
+            parsedRepeatData.id += " ]";
 
-        if (command_type_str == "tempo")
-        {
-            double tempo = parseDouble(command_args_str);
-            if (tempo > 0)
+            if (pos < tokens.size())
             {
-                currentTempo = tempo;
-                pCmd.data = ParsedTempo{tempo};
+                const std::pmr::string &close = tokens[pos];
+                pCmd.originalCommandString += " ... ";
+                pCmd.originalCommandString += close;
+                if (close.length() > 1)
+                {
+                    int count = parseInt(std::string_view(close).substr(1), -1);
+                    if (count >= 0)
+                    {
+                        parsedRepeatData.count = count;
+                    }
+                    else
+                    {
+                        std::cerr << "Warning: Invalid repeat count in '" << close << "'. Repeating twice." << std::endl;
+                    }
+                }
+                pos++; // Move past "]N"
             }
             else
             {
-                std::cerr << "Warning: Debug: Invalid tempo value '" << command_args_str << "'. Using current tempo." << std::endl;
-                pCmd.type = CommandType::UNKNOWN;
+                std::cerr << "Warning: Repeat block opened with '[' was never closed. Playing it once." << std::endl;
+                parsedRepeatData.count = 1;
             }
-            pCmd.type = CommandType::TEMPO;
+
+            pCmd.data = std::move(parsedRepeatData);
+            commands.push_back(std::move(pCmd));
+            continue;
         }
-        else if (command_type_str == "octave")
+
+        // PATTERN:name { ... } defines a pattern; it renders nothing by itself
+        if (equalsIgnoreCase(std::string_view(token).substr(0, 8), "pattern:"))
         {
-            int octave = parseInt(command_args_str);
-            if (octave >= 0 && octave <= 8)
+            std::string name(token.substr(8));
+            pos++; // Move past "PATTERN:name"
+            if (name.empty() || pos >= tokens.size() || tokens[pos] != "{")
             {
-                currentOctave = octave;
-                pCmd.data = ParsedOctave{octave};
+                std::cerr << "Warning: PATTERN definition '" << token << "' must be a name followed by '{ ... }'. Ignoring." << std::endl;
+                continue;
             }
-            else
+            if (depth + 1 > MAX_BLOCK_DEPTH)
             {
-                std::cerr << "Warning: Debug: Invalid octave value '" << command_args_str << "'. Using current octave." << std::endl;
-                pCmd.type = CommandType::UNKNOWN;
+                std::cerr << "Warning: Blocks nested deeper than " << MAX_BLOCK_DEPTH << " levels. Ignoring pattern '" << name << "'." << std::endl;
+                continue;
             }
-            pCmd.type = CommandType::OCTAVE;
-        }
-        else if (command_type_str == "length")
-        {
-            int length = parseInt(command_args_str);
-            if (length > 0 && (length == 1 || length == 2 || length == 4 || length == 8 || length == 16 || length == 32 || length == 64))
+            pos++; // Move past '{'
+
+            auto pattern = std::make_shared<ParsedPattern>();
+            pattern->name = name;
+            pattern->commands = compileTokens(tokens, pos, depth + 1, '}');
+            pattern->id = "{";
+            appendContentKey(pattern->commands, pattern->id);
+            pattern->id += " }";
+
+            if (pos < tokens.size())
             {
-                currentLength = length;
-                pCmd.data = ParsedLength{length};
+                pos++; // Move past '}'
             }
             else
             {
-                std::cerr << "Warning: Debug: Invalid or unsupported length value '" << command_args_str << "' in LENGTH command. Keeping current default length." << std::endl;
-                pCmd.type = CommandType::UNKNOWN;
+                std::cerr << "Warning: PATTERN '" << name << "' was never closed with '}'." << std::endl;
             }
-            pCmd.type = CommandType::LENGTH;
+
+            if (m_patterns.count(name) > 0)
+            {
+                std::cerr << "Warning: PATTERN '" << name << "' redefined; later PLAYs use the new definition." << std::endl;
+            }
+            m_patterns[name] = pattern;
+            continue;
         }
-        else if (command_type_str == "volume")
-        { // <--- VOLUME Debug Handling
-            int volume = parseInt(command_args_str);
-            if (volume >= 0 && volume <= 100)
+
+        commands.push_back(compileCommand(token));
+        assignNoiseKeys(commands.back(), token, noiseOccurrences);
+        pos++;
+    }
+
+    return commands;
+}
+
+// --- compileMML Implementation ---
+std::vector<ParsedCommand> MMLParser::compileMML(const std::string &mmlString)
+{
+    TRACE_SCOPE("compileMML", "parse");
+    ALLOC_STAGE(Parse);
+
+    // Compiling starts a new render job: everything the previous job put in
+    // the arena is released in one step
+    m_arena.reset();
+
+    std::pmr::vector<std::pmr::string> tokens = tokenizeMML(stripComments(mmlString));
+    size_t pos = 0;
+
+    // Pattern names are scoped to one MML string; compiled PLAY commands
+    // keep their patterns alive after the table is cleared.
+    m_patterns.clear();
+    std::vector<ParsedCommand> commands;
+    {
+        TRACE_SCOPE("compileTokens", "parse");
+        commands = compileTokens(tokens, pos, 0, '\0');
+    }
+    m_patterns.clear();
+
+    // With a manifest, missing samples show up now rather than mid-render
+    if (m_noteDecoder.hasManifest())
+    {
+        int octave = m_currentOctave;
+        std::set<std::string> reported;
+        TRACE_SCOPE("reportMissingSamples", "parse");
+        reportMissingSamples(commands, octave, reported);
+    }
+
+    return commands;
+}
+
+// --- reportMissingSamples Implementation ---
+// Walks the commands in play order, tracking only the octave (the one piece
+// of state a sample's file name depends on)
+void MMLParser::reportMissingSamples(const std::vector<ParsedCommand> &commands,
+                                     int &octave,
+                                     std::set<std::string> &reported)
+{
+    for (const ParsedCommand &cmd : commands)
+    {
+        switch (cmd.type)
+        {
+        case CommandType::OCTAVE:
+            octave = std::get<ParsedOctave>(cmd.data).value;
+            break;
+        case CommandType::NOTE:
+            reportMissingSample(std::get<ParsedNote>(cmd.data), octave, reported);
+            break;
+        case CommandType::CHORD:
+            for (const ParsedNote &note : std::get<ParsedChord>(cmd.data).notes)
             {
-                currentDebugVolume = volume; // Update debug tracker
-                pCmd.data = ParsedVolume{volume};
+                reportMissingSample(note, octave, reported);
             }
-            else
+            break;
+        case CommandType::REPEAT:
+        {
+            const auto &repeat = std::get<ParsedRepeat>(cmd.data);
+            for (int pass = 0; pass < repeat.count; ++pass)
             {
-                std::cerr << "Warning: Debug: Invalid volume value '" << command_args_str << "'. Volume must be between 0 and 100. Marking as UNKNOWN." << std::endl;
-                pCmd.type = CommandType::UNKNOWN;
+                reportMissingSamples(repeat.commands, octave, reported);
             }
-            pCmd.type = CommandType::VOLUME;
+            break;
         }
-        else if (command_type_str == "r")
-        {
-            ParsedRest parsedRestData;
-            parsedRestData.isExplicitDuration = false;
-            parsedRestData.length = 0;
-            parsedRestData.explicitDurationSeconds = 0.0;
+        case CommandType::PLAY:
+            reportMissingSamples(std::get<ParsedPlay>(cmd.data).pattern->commands, octave, reported);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void MMLParser::reportMissingSample(const ParsedNote &note, int octave, std::set<std::string> &reported)
+{
+    int noteOctave = note.octave >= 0 ? note.octave : octave;
+    if (m_noteDecoder.playsFromRoots(*note.instrument))
+    {
+        return; // Any pitch is played from the instrument's roots
+    }
+    if (note.instrument->naming == NamingScheme::Generated)
+    {
+        return; // Nothing in the library to find
+    }
+    if (m_noteDecoder.lookupSample(*note.instrument, note.noteName, note.accidental, noteOctave) != nullptr)
+    {
+        return;
+    }
+    std::string path = m_noteDecoder.getSampleRelativePath(*note.instrument, note.noteName, note.accidental, noteOctave);
+    if (reported.insert(path).second)
+    {
+        std::cerr << "Warning: Sample '" << path << "' (for '" << note.folderAbbr << ":" << note.noteName
+                  << "') is not in the library manifest." << std::endl;
+    }
+}
 
-            if (command_args_str.length() > 1 && command_args_str.back() == 's')
+// --- clearPatternCache Implementation ---
+void MMLParser::clearPatternCache()
+{
+    m_blockCache.clear();
+    m_blockCacheOrder.clear();
+    m_blockCacheBytes = 0;
+}
+
+// --- reloadLibrary Implementation ---
+void MMLParser::reloadLibrary()
+{
+    clearPatternCache(); // Compiled with the old samples
+    m_noteDecoder.reloadLibrary();
+}
+
+// Applies a TEMPO, OCTAVE, LENGTH or VOLUME command to the running state
+static void applyStateCommand(const ParsedCommand &cmd, RenderState &state)
+{
+    switch (cmd.type)
+    {
+    case CommandType::TEMPO:
+        state.tempoBPM = std::get<ParsedTempo>(cmd.data).value;
+        std::cout << "Tempo changed to: " << state.tempoBPM << " BPM" << std::endl;
+        break;
+
+    case CommandType::OCTAVE:
+        state.octave = std::get<ParsedOctave>(cmd.data).value;
+        std::cout << "Octave changed to: " << state.octave << std::endl;
+        break;
+
+    case CommandType::LENGTH:
+        state.length = std::get<ParsedLength>(cmd.data).value;
+        std::cout << "Length changed to: " << state.length << std::endl;
+        break;
+
+    case CommandType::VOLUME:
+    {
+        int volume = std::get<ParsedVolume>(cmd.data).value;
+        // Scale to 0.0-1.0
+        state.volume = static_cast<float>(volume) / 100.0f;
+        std::cout << "Volume changed to: " << volume << "%" << std::endl;
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+// Mixes an event's voices, at the given volume, into 'out' (zeroed, and as
+// long as the event). Every voice already fits the event's length.
+static void mixVoice(const Voice &voice, float volume, float *out)
+{
+    NoteDecoder::renderVoice(voice, volume, out, true);
+}
+
+static void mixVoice(const Voice &voice, float volume, int16_t *out)
+{
+    NoteDecoder::renderVoice(voice, volume, out); // Saturating
+}
+
+// Mixes samples [from, to) of an event's voices into 'out', which holds
+// just that window
+template <typename Sample>
+static void renderEventVoicesRange(const Voice *voices, size_t voiceCount, float volume,
+                                   size_t from, size_t to, Sample *out)
+{
+    TRACE_SCOPE("mix event", "render");
+    for (size_t v = 0; v < voiceCount; ++v)
+    {
+        NoteDecoder::renderVoiceRange(voices[v], volume, from, to, out);
+    }
+}
+
+template <typename Sample>
+static void renderEventVoices(const Voice *voices, size_t voiceCount, float volume, Sample *out)
+{
+    TRACE_SCOPE("mix event", "render");
+    for (size_t v = 0; v < voiceCount; ++v)
+    {
+        mixVoice(voices[v], volume, out);
+    }
+}
+
+// --- prepareEvent Implementation ---
+size_t MMLParser::prepareEvent(const ParsedCommand &cmd,
+                               const RenderState &state,
+                               std::vector<Voice> &voices)
+{
+    switch (cmd.type)
+    {
+    case CommandType::REST:
+    {
+        const auto &rest = std::get<ParsedRest>(cmd.data);
+        double restDurationSeconds = rest.isExplicitDuration
+                                         ? rest.explicitDurationSeconds
+                                         : (60.0 / state.tempoBPM) * (4.0 / rest.length);
+        return durationToSamples(restDurationSeconds, m_sampleRate);
+    }
+
+    case CommandType::CHORD:
+    {
+        const auto &chord = std::get<ParsedChord>(cmd.data);
+
+        // All notes in the chord have the same duration (either explicit
+        // or derived from length); the first playable note sets it.
+        size_t firstVoice = voices.size();
+        for (const ParsedNote &note : chord.notes)
+        {
+            Voice voice;
+            if (m_noteDecoder.prepareVoice(
+                    *note.instrument,
+                    note.noteName,
+                    note.accidental,
+                    note.length > 0 ? note.length : state.length,
+                    note.octave >= 0 ? note.octave : state.octave,
+                    note.cents,
+                    note.explicitDurationSeconds, // The CHORD-level explicit duration
+                    state.tempoBPM,
+                    voice))
             {
-                double explicitRestDur = parseDouble(command_args_str.substr(0, command_args_str.length() - 1));
-                if (explicitRestDur > 0)
+                if (voice.noise.type != NoiseType::None)
                 {
-                    parsedRestData.explicitDurationSeconds = explicitRestDur;
-                    parsedRestData.isExplicitDuration = true;
-                }
-                else
-                {
-                    std::cerr << "Warning: Debug: Invalid or non-positive explicit rest duration '" << command_args_str << "' in 'r:' command. Marking as UNKNOWN." << std::endl;
-                    pCmd.type = CommandType::UNKNOWN;
+                    voice.noise.seed = noiseSeedFor(voice.noise.seed, note.noiseKey);
                 }
+                voices.push_back(voice);
             }
-            else
+        }
+
+        if (voices.size() == firstVoice)
+        {
+            std::cerr << "Warning: No valid notes in CHORD or duration 0. Skipping chord." << std::endl;
+            return 0;
+        }
+
+        // --- Mixing Audio Samples ---
+        // Each voice is later rendered with the current volume and mixed
+        // straight into the output in the same pass. Peaks above full
+        // scale are left for the master bus limiter (see MasterBus.h).
+        size_t chordDurationSamples = voices[firstVoice].numSamples;
+        for (size_t v = firstVoice; v < voices.size(); ++v)
+        {
+            voices[v].numSamples = std::min(voices[v].numSamples, chordDurationSamples);
+        }
+        return chordDurationSamples;
+    }
+
+    case CommandType::NOTE:
+    {
+        const auto &note = std::get<ParsedNote>(cmd.data);
+        Voice voice;
+        if (m_noteDecoder.prepareVoice(
+                *note.instrument,
+                note.noteName,
+                note.accidental,
+                note.length > 0 ? note.length : state.length,
+                note.octave >= 0 ? note.octave : state.octave,
+                note.cents,
+                note.explicitDurationSeconds,
+                state.tempoBPM,
+                voice))
+        {
+            if (voice.noise.type != NoiseType::None)
             {
-                int restLength = parseInt(command_args_str, 0);
-                if (restLength > 0 && (restLength == 1 || restLength == 2 || restLength == 4 || restLength == 8 || restLength == 16 || restLength == 32 || restLength == 64))
-                {
-                    parsedRestData.length = restLength;
-                }
-                else
-                {
-                    std::cerr << "Warning: Debug: Invalid or unsupported rest length '" << command_args_str << "' in 'r:' command. Marking as UNKNOWN." << std::endl;
-                    pCmd.type = CommandType::UNKNOWN;
-                }
+                voice.noise.seed = noiseSeedFor(voice.noise.seed, note.noiseKey);
             }
-            pCmd.data = parsedRestData;
-            pCmd.type = CommandType::REST;
+            voices.push_back(voice);
+            return voice.numSamples;
+        }
+        return 0;
+    }
+
+    default:
+        return 0;
+    }
+}
+
+// parseMML - Main entry point: compile once, then render
+std::vector<float> MMLParser::parseMML(const std::string &mmlString)
+{
+    std::cout << "Tempo set to: " << m_currentTempoBPM << " BPM" << std::endl;
+    std::cout << "Default octave set to: " << m_currentOctave << std::endl;
+    std::cout << "Default length set to: " << m_currentLength << std::endl;
+    std::cout << "Default volume set to: " << static_cast<int>(m_currentVolume * 100) << "%" << std::endl;
+
+    // The song holds its samples until it has been rendered; the store may
+    // drop them afterwards
+    CompiledSong song = compileSong(mmlString);
+    TRACE_SCOPE("renderRange", "render");
+    return song.renderRange(0, song.totalSamples);
+}
+
+// --- buildTimeline Implementation ---
+// Walks the command list in render order and appends each note, chord and
+// rest to the song's time index together with the state it starts in. Each
+// repeat pass and pattern invocation becomes one event playing its block.
+void MMLParser::buildTimeline(const std::vector<ParsedCommand> &commands,
+                              RenderState &state,
+                              CompiledSong &song)
+{
+    for (const ParsedCommand &cmd : commands)
+    {
+        if (timelinePastLimits())
+        {
+            return; // admit() rejects or cuts the song
         }
-        else if (command_type_str == "chord")
+        switch (cmd.type)
+        {
+        case CommandType::TEMPO:
+        case CommandType::OCTAVE:
+        case CommandType::LENGTH:
+        case CommandType::VOLUME:
+            applyStateCommand(cmd, state);
+            break;
+
+        case CommandType::REST:
+        case CommandType::CHORD:
+        case CommandType::NOTE:
         {
-            ParsedChord parsedChordData;
-            std::vector<std::string> note_strings = splitString(command_args_str, ',');
+            TimelineEvent event;
+            event.firstVoice = song.voices.size();
+            event.numSamples = prepareEvent(cmd, state, song.voices);
+            event.voiceCount = song.voices.size() - event.firstVoice;
+            event.startSample = song.totalSamples;
+            event.state = state;
+            if (event.numSamples > 0)
+            {
+                song.events.push_back(event);
+                song.totalSamples += event.numSamples;
+                m_compiledEvents++;
+                m_compiledVoices += event.voiceCount;
+                m_compiledSamples += event.numSamples;
+            }
+            break;
+        }
 
-            for (const std::string &note_str : note_strings)
+        case CommandType::REPEAT:
+        {
+            const auto &repeat = std::get<ParsedRepeat>(cmd.data);
+            for (int pass = 0; pass < repeat.count && !timelinePastLimits(); ++pass)
             {
-                std::string chord_note_folderAbbr;
-                std::string chord_note_name;
-                char chord_note_accidental;
-                int chord_note_length;
-                int chord_note_octave;
-                double chord_note_explicitDurationSeconds;
-
-                if (this->parseNoteString(note_str, chord_note_folderAbbr, chord_note_name, chord_note_accidental,
-                                          chord_note_length, chord_note_octave, chord_note_explicitDurationSeconds,
-                                          currentLength, currentOctave))
-                {
-                    parsedChordData.notes.push_back(ParsedNote{chord_note_folderAbbr, chord_note_name, chord_note_accidental,
-                                                               chord_note_length, chord_note_octave, chord_note_explicitDurationSeconds});
-                }
-                else
-                {
-                    std::cerr << "Warning: Debug: Could not parse note '" << note_str << "' within CHORD for debug output. Skipping." << std::endl;
-                }
+                appendBlock(repeat.id, repeat.commands, state, song);
             }
-            pCmd.data = parsedChordData;
-            pCmd.type = CommandType::CHORD;
+            break;
+        }
+
+        case CommandType::PLAY:
+        {
+            const ParsedPattern &pattern = *std::get<ParsedPlay>(cmd.data).pattern;
+            appendBlock(pattern.id, pattern.commands, state, song);
+            break;
+        }
+
+        case CommandType::UNKNOWN:
+        default:
+            break;
+        }
+    }
+}
+
+// Memory a block holds once its audio has been rendered
+static size_t blockBytes(const TimelineBlock &block)
+{
+    const CompiledSong &song = block.song;
+    return song.events.size() * sizeof(TimelineEvent) + song.voices.size() * sizeof(Voice) +
+           song.totalSamples * sizeof(float);
+}
+
+// --- appendBlock Implementation ---
+// Blocks are looked up by content and entry state, so every pass of a
+// repeat that leaves the state as it found it, and every PLAY of a pattern
+// in the same state, shares one block: compiled once, rendered once.
+void MMLParser::appendBlock(const std::string &id,
+                            const std::vector<ParsedCommand> &commands,
+                            RenderState &state,
+                            CompiledSong &song)
+{
+    TimelineEvent event;
+    event.state = state;
+
+    auto key = std::make_pair(id, state);
+    auto cache_it = m_blockCache.find(key);
+    if (cache_it != m_blockCache.end())
+    {
+        event.block = cache_it->second;
+        m_compiledSamples += event.block->song.totalSamples;
+    }
+    else
+    {
+        // The samples pinned so far belong to the song around the block;
+        // the block keeps its own
+        std::vector<std::shared_ptr<const SampleInfo>> pins = m_noteDecoder.takePins();
+        song.samples.insert(song.samples.end(), pins.begin(), pins.end());
+
+        auto block = std::make_shared<TimelineBlock>();
+        block->song.sampleRate = m_sampleRate;
+        RenderState blockState = state;
+        buildTimeline(commands, blockState, block->song);
+        block->song.exitState = blockState;
+        block->song.samples = m_noteDecoder.takePins();
+        event.block = block;
+
+        // A block cut short by the limits is only good for this song. Of
+        // the rest, the oldest entries make room; a block larger than the
+        // whole budget is not kept.
+        size_t bytes = blockBytes(*block);
+        if (!timelinePastLimits() && bytes <= BLOCK_CACHE_BYTES)
+        {
+            while (m_blockCacheBytes + bytes > BLOCK_CACHE_BYTES && !m_blockCacheOrder.empty())
+            {
+                auto oldest = m_blockCache.find(m_blockCacheOrder.front());
+                m_blockCacheBytes -= blockBytes(*oldest->second);
+                m_blockCache.erase(oldest);
+                m_blockCacheOrder.pop_front();
+            }
+            m_blockCache[key] = block;
+            m_blockCacheOrder.push_back(key);
+            m_blockCacheBytes += bytes;
+        }
+    }
+
+    state = event.block->song.exitState;
+    event.numSamples = event.block->song.totalSamples;
+    if (event.numSamples > 0)
+    {
+        event.startSample = song.totalSamples;
+        event.firstVoice = song.voices.size();
+        event.voiceCount = 0;
+        song.totalSamples += event.numSamples;
+        song.events.push_back(std::move(event));
+        m_compiledEvents++;
+    }
+}
+
+// --- timelinePastLimits Implementation ---
+bool MMLParser::timelinePastLimits() const
+{
+    const RenderLimits &limits = m_compileLimits;
+    if (limits.maxEvents > 0 && m_compiledEvents > limits.maxEvents)
+    {
+        return true;
+    }
+    if (limits.maxDurationSeconds > 0.0 &&
+        static_cast<double>(m_compiledSamples) > limits.maxDurationSeconds * m_sampleRate)
+    {
+        return true;
+    }
+    // The timeline alone is past the memory limit (a long repeat of big chords)
+    size_t timelineBytes = m_compiledEvents * sizeof(TimelineEvent) + m_compiledVoices * sizeof(Voice);
+    return limits.maxBytes > 0 && timelineBytes > limits.maxBytes;
+}
+
+// --- compileSong Implementation ---
+CompiledSong MMLParser::compileSong(const std::string &mmlString, const RenderLimits &limits)
+{
+    CompiledSong song;
+    song.sampleRate = m_sampleRate;
+    m_compileLimits = limits;
+    m_compiledEvents = 0;
+    m_compiledVoices = 0;
+    m_compiledSamples = 0;
+
+    RenderState state{m_currentTempoBPM, m_currentOctave, m_currentLength, m_currentVolume};
+    std::vector<ParsedCommand> commands = compileMML(mmlString);
+    {
+        TRACE_SCOPE("buildTimeline", "parse");
+        ALLOC_STAGE(Compile);
+        buildTimeline(commands, state, song);
+    }
+    song.exitState = state;
+    std::vector<std::shared_ptr<const SampleInfo>> pins = m_noteDecoder.takePins();
+    song.samples.insert(song.samples.end(), pins.begin(), pins.end());
+    m_compileLimits = RenderLimits();
+
+    std::cout << "Compiled song: " << song.events.size() << " events, " << song.voices.size() << " voices, "
+              << song.totalSamples << " samples (" << static_cast<double>(song.totalSamples) / m_sampleRate << "s)" << std::endl;
+    return song;
+}
+
+// --- CompiledSong::findEvent Implementation ---
+size_t CompiledSong::findEvent(size_t sample) const
+{
+    if (sample >= totalSamples)
+    {
+        return events.size();
+    }
+    // First event starting after 'sample'; the one before it contains it
+    auto it = std::upper_bound(events.begin(), events.end(), sample,
+                               [](size_t s, const TimelineEvent &event)
+                               { return s < event.startSample; });
+    return static_cast<size_t>(it - events.begin()) - 1;
+}
+
+// --- CompiledSong::renderRange Implementation ---
+template <typename Sample>
+std::vector<Sample> CompiledSong::renderRange(size_t startSample, size_t endSample) const
+{
+    endSample = std::min(endSample, totalSamples);
+    if (startSample >= endSample)
+    {
+        return {};
+    }
+
+    std::vector<Sample> output(endSample - startSample, Sample(0));
+    renderRangeInto(startSample, endSample, output.data());
+    return output;
+}
+
+// --- secondsToSample Implementation ---
+size_t secondsToSample(double seconds, int sampleRate, size_t totalSamples)
+{
+    double sample = seconds * sampleRate;
+    if (!(sample > 0.0))
+    {
+        return 0; // Negative or NaN
+    }
+    return sample < static_cast<double>(totalSamples) ? static_cast<size_t>(sample) : totalSamples;
+}
+
+// --- TimelineBlock::audio Implementation ---
+template <typename Sample>
+const std::vector<Sample> &TimelineBlock::audio() const
+{
+    std::once_flag *once = &m_floatOnce;
+    std::vector<Sample> *rendered = nullptr;
+    if constexpr (std::is_same_v<Sample, int16_t>)
+    {
+        once = &m_int16Once;
+        rendered = &m_int16Audio;
+    }
+    else
+    {
+        rendered = &m_floatAudio;
+    }
+    std::call_once(*once, [&]
+                   { *rendered = song.renderRange<Sample>(0, song.totalSamples); });
+    return *rendered;
+}
+
+// Renders the audio of every block played in [startSample, endSample) on
+// 'pool', one block per task, before the segments that copy it run. (A
+// block nested in another is rendered by the task of the outer one.)
+template <typename Sample>
+static void renderBlocks(const CompiledSong &song, ThreadPool &pool, size_t startSample, size_t endSample,
+                         const CancellationToken *cancel)
+{
+    std::vector<const TimelineBlock *> blocks;
+    std::set<const TimelineBlock *> seen;
+    for (size_t i = song.findEvent(startSample); i < song.events.size() && song.events[i].startSample < endSample; ++i)
+    {
+        const TimelineBlock *block = song.events[i].block.get();
+        if (block && seen.insert(block).second)
+        {
+            blocks.push_back(block);
+        }
+    }
+    pool.parallelFor(blocks.size(), [&](size_t b)
+                     {
+                         if (!(cancel && cancel->cancelled()))
+                         {
+                             blocks[b]->audio<Sample>();
+                         } });
+}
+
+// --- CompiledSong::renderRangeParallel Implementation ---
+template <typename Sample>
+std::vector<Sample> CompiledSong::renderRangeParallel(ThreadPool &pool, size_t startSample, size_t endSample,
+                                                      const CancellationToken *cancel) const
+{
+    endSample = std::min(endSample, totalSamples);
+    if (startSample >= endSample)
+    {
+        return {};
+    }
+    renderBlocks<Sample>(*this, pool, startSample, endSample, cancel);
+
+    // The output is allocated once; every segment writes a disjoint slice.
+    // Several segments per thread let work stealing balance dense passages
+    // against sparse ones, while the minimum keeps per-task overhead small.
+    const size_t MIN_SEGMENT_SAMPLES = 1 << 16;
+    const size_t rangeSamples = endSample - startSample;
+    size_t numSegments = std::min(pool.size() * 4, std::max<size_t>(1, rangeSamples / MIN_SEGMENT_SAMPLES));
+    size_t segmentSamples = (rangeSamples + numSegments - 1) / numSegments;
+
+    ALLOC_STAGE(Render);
+    std::vector<Sample> output(rangeSamples, Sample(0));
+    pool.parallelFor(numSegments, [&](size_t segment)
+                     {
+                         size_t from = startSample + segment * segmentSamples;
+                         size_t to = std::min(endSample, from + segmentSamples);
+                         if (from < to && !(cancel && cancel->cancelled()))
+                         {
+                             renderRangeInto(from, to, output.data() + (from - startSample));
+                         } });
+    return output;
+}
+
+// --- CompiledSong::renderRangeInto Implementation ---
+template <typename Sample>
+void CompiledSong::renderRangeInto(size_t startSample, size_t endSample, Sample *output) const
+{
+    TRACE_SCOPE("mix segment", "render");
+    ALLOC_STAGE(Render);
+
+    for (size_t i = findEvent(startSample); i < events.size() && events[i].startSample < endSample; ++i)
+    {
+        const TimelineEvent &event = events[i];
+        size_t eventEnd = event.startSample + event.numSamples;
+        if (event.block)
+        {
+            // Copy the part of the block's audio inside the range
+            const std::vector<Sample> &audio = event.block->audio<Sample>();
+            size_t from = std::max(event.startSample, startSample);
+            size_t to = std::min(eventEnd, endSample);
+            std::copy(audio.begin() + (from - event.startSample), audio.begin() + (to - event.startSample),
+                      output + (from - startSample));
+            continue;
+        }
+        if (event.voiceCount == 0)
+        {
+            continue; // Rests are already silent
+        }
+
+        if (event.startSample >= startSample && eventEnd <= endSample)
+        {
+            // Wholly inside the range: render in place
+            renderEventVoices(&voices[event.firstVoice], event.voiceCount, event.state.volume,
+                              output + (event.startSample - startSample));
         }
         else
-        { // Note/Sound Command
-            std::string full_note_str = command_type_str + ":" + command_args_str;
+        {
+            // Cut by either end of the range: render only the part inside it
+            size_t from = std::max(event.startSample, startSample);
+            size_t to = std::min(eventEnd, endSample);
+            renderEventVoicesRange(&voices[event.firstVoice], event.voiceCount, event.state.volume,
+                                   from - event.startSample, to - event.startSample, output + (from - startSample));
+        }
+    }
+}
 
-            pCmd.type = CommandType::NOTE;
-            std::string parsed_folderAbbr;
-            std::string parsed_noteName;
-            char parsed_accidental;
-            int parsed_length_for_note;
-            int parsed_octave_for_note;
-            double parsed_explicitDurationSeconds;
-
-            if (!this->parseNoteString(full_note_str, parsed_folderAbbr, parsed_noteName, parsed_accidental,
-                                       parsed_length_for_note, parsed_octave_for_note, parsed_explicitDurationSeconds,
-                                       currentLength, currentOctave))
+// The float and int16 engine paths
+template std::vector<float> CompiledSong::renderRange<float>(size_t, size_t) const;
+template std::vector<int16_t> CompiledSong::renderRange<int16_t>(size_t, size_t) const;
+template std::vector<float> CompiledSong::renderRangeParallel<float>(ThreadPool &, size_t, size_t,
+                                                                     const CancellationToken *) const;
+template std::vector<int16_t> CompiledSong::renderRangeParallel<int16_t>(ThreadPool &, size_t, size_t,
+                                                                         const CancellationToken *) const;
+template void CompiledSong::renderRangeInto<float>(size_t, size_t, float *) const;
+template void CompiledSong::renderRangeInto<int16_t>(size_t, size_t, int16_t *) const;
+template const std::vector<float> &TimelineBlock::audio<float>() const;
+template const std::vector<int16_t> &TimelineBlock::audio<int16_t>() const;
+
+// --- CompiledSong::renderSparse Implementation ---
+SparseTrack CompiledSong::renderSparse(ThreadPool &pool, size_t startSample, size_t endSample,
+                                       const CancellationToken *cancel) const
+{
+    TRACE_SCOPE("renderSparse", "render");
+    ALLOC_STAGE(Render);
+    endSample = std::min(endSample, totalSamples);
+    SparseTrack track(endSample > startSample ? endSample - startSample : 0);
+    if (startSample >= endSample)
+    {
+        return track;
+    }
+
+    // Find the runs: stretches of audible events, broken by long rests
+    struct Extent
+    {
+        size_t start;
+        size_t end;
+    };
+    std::vector<Extent> extents;
+    for (size_t i = findEvent(startSample); i < events.size() && events[i].startSample < endSample; ++i)
+    {
+        const TimelineEvent &event = events[i];
+        if ((event.voiceCount == 0 && !event.block) || event.numSamples == 0)
+        {
+            continue; // A gap, unless the next audible event closes it up
+        }
+        size_t from = std::max(event.startSample, startSample);
+        size_t to = std::min(event.startSample + event.numSamples, endSample);
+        if (!extents.empty() && from - extents.back().end < MIN_SPARSE_GAP_SAMPLES)
+        {
+            extents.back().end = to;
+        }
+        else
+        {
+            extents.push_back({from, to});
+        }
+    }
+
+    // Allocate every run, render the blocks they play, then render the runs
+    // in segments across the pool (one long run, like a dense melody, still
+    // splits across threads)
+    const size_t SEGMENT_SAMPLES = 1 << 16;
+    struct Segment
+    {
+        size_t from;
+        size_t to;
+        float *out;
+    };
+    std::vector<Segment> segments;
+    for (const Extent &extent : extents)
+    {
+        float *out = track.appendRun(extent.start - startSample, extent.end - extent.start);
+        for (size_t from = extent.start; from < extent.end; from += SEGMENT_SAMPLES)
+        {
+            segments.push_back({from, std::min(extent.end, from + SEGMENT_SAMPLES), out + (from - extent.start)});
+        }
+    }
+    renderBlocks<float>(*this, pool, startSample, endSample, cancel);
+    pool.parallelFor(segments.size(), [&](size_t s)
+                     {
+                         if (!(cancel && cancel->cancelled()))
+                         {
+                             renderRangeInto(segments[s].from, segments[s].to, segments[s].out);
+                         } });
+    return track;
+}
+
+// Adds a timeline's events, voices and memory to 'cost', and those of each
+// block it plays that is not in 'seen' yet (a block's own audio included)
+static void addTimelineCost(const CompiledSong &song, RenderCost &cost, std::set<const TimelineBlock *> &seen)
+{
+    cost.events += song.events.size();
+    cost.bytes += song.events.size() * sizeof(TimelineEvent) + song.voices.size() * sizeof(Voice);
+    for (const TimelineEvent &event : song.events)
+    {
+        cost.voices += event.voiceCount;
+        cost.maxPolyphony = std::max(cost.maxPolyphony, event.voiceCount);
+        // Segments render only their own window of a cut event, so each
+        // voice sample is mixed exactly once
+        for (size_t v = 0; v < event.voiceCount; ++v)
+        {
+            cost.voiceSamples += song.voices[event.firstVoice + v].numSamples;
+        }
+        if (event.block && seen.insert(event.block.get()).second)
+        {
+            cost.bytes += event.block->song.totalSamples * sizeof(float);
+            addTimelineCost(event.block->song, cost, seen);
+        }
+    }
+}
+
+// --- CompiledSong::estimateCost Implementation ---
+RenderCost CompiledSong::estimateCost() const
+{
+    RenderCost cost;
+    cost.samples = totalSamples;
+    std::set<const TimelineBlock *> seen;
+    addTimelineCost(*this, cost, seen);
+    cost.bytes += cost.samples * sizeof(float);
+    return cost;
+}
+
+// Thins every chord of the timeline to 'maxVoices', blocks included. Each
+// block is replaced by a thinned copy, made once ('thinned' maps the
+// originals to their copies, and keeps the originals alive meanwhile).
+static void thinChords(CompiledSong &song, size_t maxVoices,
+                       std::map<std::shared_ptr<const TimelineBlock>, std::shared_ptr<const TimelineBlock>> &thinned)
+{
+    for (TimelineEvent &event : song.events)
+    {
+        event.voiceCount = std::min(event.voiceCount, maxVoices);
+        if (event.block)
+        {
+            auto it = thinned.find(event.block);
+            if (it == thinned.end())
+            {
+                auto copy = std::make_shared<TimelineBlock>();
+                copy->song = event.block->song;
+                thinChords(copy->song, maxVoices, thinned);
+                it = thinned.emplace(event.block, copy).first;
+            }
+            event.block = it->second;
+        }
+    }
+}
+
+// Cuts the timeline short at 'cutSample' (within the song). A block the
+// cut falls inside is replaced by a copy cut the same way.
+static void cutTimeline(CompiledSong &song, size_t cutSample)
+{
+    size_t last = song.findEvent(cutSample - 1);
+    song.events.resize(last + 1);
+    TimelineEvent &event = song.events.back();
+    event.numSamples = cutSample - event.startSample;
+    song.voices.resize(event.firstVoice + event.voiceCount);
+    for (size_t v = 0; v < event.voiceCount; ++v)
+    {
+        Voice &voice = song.voices[event.firstVoice + v];
+        voice.numSamples = std::min(voice.numSamples, event.numSamples);
+    }
+    if (event.block && event.numSamples < event.block->song.totalSamples)
+    {
+        auto copy = std::make_shared<TimelineBlock>();
+        copy->song = event.block->song;
+        cutTimeline(copy->song, event.numSamples);
+        event.block = copy;
+    }
+    song.totalSamples = cutSample;
+}
+
+// --- CompiledSong::admit Implementation ---
+bool CompiledSong::admit(const RenderLimits &limits, std::string &reason)
+{
+    RenderCost cost = estimateCost();
+    // Compared in double first: a huge or infinite limit is just no limit
+    const double limitSamples = limits.maxDurationSeconds * sampleRate;
+    const size_t maxSamples = limits.maxDurationSeconds > 0.0 && limitSamples < static_cast<double>(totalSamples)
+                                  ? static_cast<size_t>(limitSamples)
+                                  : totalSamples;
+
+    // The limits the song breaks, as "longer than 60s, 80 voices at once ..."
+    std::ostringstream broken;
+    const char *separator = "";
+    if (cost.samples > maxSamples)
+    {
+        broken << separator << "longer than " << limits.maxDurationSeconds << "s";
+        separator = ", ";
+    }
+    if (limits.maxEvents > 0 && cost.events > limits.maxEvents)
+    {
+        broken << separator << "more than " << limits.maxEvents << " events";
+        separator = ", ";
+    }
+    if (limits.maxPolyphony > 0 && cost.maxPolyphony > limits.maxPolyphony)
+    {
+        broken << separator << cost.maxPolyphony << " voices at once (limit " << limits.maxPolyphony << ")";
+        separator = ", ";
+    }
+    if (limits.maxBytes > 0 && cost.bytes > limits.maxBytes)
+    {
+        broken << separator << "needs about " << (cost.bytes >> 20) << " MiB (limit " << (limits.maxBytes >> 20) << " MiB)";
+    }
+    reason = broken.str();
+    if (reason.empty())
+    {
+        return true;
+    }
+    if (!limits.truncate)
+    {
+        return false;
+    }
+
+    // Thin chords to the polyphony limit (their first voices are kept)
+    std::ostringstream cut;
+    if (limits.maxPolyphony > 0 && cost.maxPolyphony > limits.maxPolyphony)
+    {
+        cut << "chords thinned to " << limits.maxPolyphony << " voices";
+        std::map<std::shared_ptr<const TimelineBlock>, std::shared_ptr<const TimelineBlock>> thinned;
+        thinChords(*this, limits.maxPolyphony, thinned);
+    }
+
+    // Find where to cut the timeline: the duration and event limits, then
+    // as much output as fits the memory limit next to the timeline itself
+    size_t cutSample = std::min(totalSamples, maxSamples);
+    if (limits.maxEvents > 0 && cost.events > limits.maxEvents)
+    {
+        // Keep the events that fit within the limit, a block's own events
+        // counted at its first play
+        size_t kept = 0;
+        std::set<const TimelineBlock *> seen;
+        for (const TimelineEvent &event : events)
+        {
+            if (event.block && seen.insert(event.block.get()).second)
+            {
+                RenderCost blockCost;
+                addTimelineCost(event.block->song, blockCost, seen);
+                kept += blockCost.events;
+            }
+            if (++kept > limits.maxEvents)
+            {
+                cutSample = std::min(cutSample, event.startSample);
+                break;
+            }
+        }
+    }
+    if (limits.maxBytes > 0)
+    {
+        // Next to the timeline, each event needs its output and, at a
+        // block's first play, the block's audio (and what it plays itself)
+        size_t used = events.size() * sizeof(TimelineEvent) + voices.size() * sizeof(Voice);
+        std::set<const TimelineBlock *> seen;
+        for (const TimelineEvent &event : events)
+        {
+            if (event.startSample >= cutSample)
+            {
+                break;
+            }
+            size_t bytesPerSample = sizeof(float);
+            if (event.block && seen.insert(event.block.get()).second)
+            {
+                RenderCost blockCost;
+                addTimelineCost(event.block->song, blockCost, seen);
+                used += blockCost.bytes;
+                bytesPerSample += sizeof(float);
+            }
+            if (used + event.numSamples * bytesPerSample > limits.maxBytes)
             {
-                std::cerr << "Warning: Debug: Could not parse note command '" << current_token << "'. Marking as UNKNOWN." << std::endl;
-                pCmd.type = CommandType::UNKNOWN;
+                size_t room = limits.maxBytes > used ? (limits.maxBytes - used) / bytesPerSample : 0;
+                cutSample = std::min(cutSample, event.startSample + room);
+                break;
             }
-            pCmd.data = ParsedNote{parsed_folderAbbr, parsed_noteName, parsed_accidental,
-                                   parsed_length_for_note, parsed_octave_for_note, parsed_explicitDurationSeconds};
+            used += event.numSamples * bytesPerSample;
         }
+    }
+    if (cutSample == 0)
+    {
+        reason += "; nothing is left after cutting it to fit";
+        return false;
+    }
 
-        parsedCommands.push_back(pCmd);
+    if (cutSample < totalSamples)
+    {
+        cutTimeline(*this, cutSample);
+        cut << (cut.tellp() > 0 ? ", " : "") << "cut to " << static_cast<double>(totalSamples) / sampleRate
+            << "s, " << events.size() << " events";
+    }
+    truncated = true;
+    cut << " (" << reason << ")";
+    reason = cut.str();
+    return true;
+}
+
+// Two events render the same audio
+static bool sameEventAudio(const CompiledSong &a, const TimelineEvent &eventA,
+                           const CompiledSong &b, const TimelineEvent &eventB)
+{
+    if (eventA.numSamples != eventB.numSamples || eventA.voiceCount != eventB.voiceCount ||
+        eventA.block != eventB.block || (eventA.voiceCount > 0 && eventA.state.volume != eventB.state.volume))
+    {
+        return false;
+    }
+    for (size_t v = 0; v < eventA.voiceCount; ++v)
+    {
+        const Voice &voiceA = a.voices[eventA.firstVoice + v];
+        const Voice &voiceB = b.voices[eventB.firstVoice + v];
+        if (voiceA.sample != voiceB.sample || voiceA.loop != voiceB.loop || voiceA.numSamples != voiceB.numSamples ||
+            voiceA.pitchRatio != voiceB.pitchRatio ||
+            voiceA.noise.type != voiceB.noise.type || voiceA.noise.seed != voiceB.noise.seed ||
+            voiceA.noise.lfsrStep != voiceB.noise.lfsrStep ||
+            voiceA.envelope.attackSeconds != voiceB.envelope.attackSeconds ||
+            voiceA.envelope.decaySeconds != voiceB.envelope.decaySeconds ||
+            voiceA.envelope.sustainLevel != voiceB.envelope.sustainLevel ||
+            voiceA.envelope.releaseSeconds != voiceB.envelope.releaseSeconds)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --- CompiledSong::diff Implementation ---
+TimelineDiff CompiledSong::diff(const CompiledSong &previous) const
+{
+    // Leading events that are unchanged (events, rests included, are back
+    // to back, so equal lengths up to here mean equal positions)
+    size_t common = std::min(events.size(), previous.events.size());
+    size_t prefix = 0;
+    while (prefix < common && sameEventAudio(*this, events[prefix], previous, previous.events[prefix]))
+    {
+        prefix++;
+    }
+
+    // Trailing events that are unchanged, counted from each version's end;
+    // they never overlap the prefix
+    size_t suffix = 0;
+    while (suffix < common - prefix &&
+           sameEventAudio(*this, events[events.size() - 1 - suffix],
+                          previous, previous.events[previous.events.size() - 1 - suffix]))
+    {
+        suffix++;
+    }
+
+    // Matched events have equal lengths, so the unchanged tail is equally
+    // long in both versions; only its position moves with the edit
+    TimelineDiff result;
+    result.start = prefix < events.size() ? events[prefix].startSample : totalSamples;
+    result.newEnd = suffix > 0 ? events[events.size() - suffix].startSample : totalSamples;
+    result.oldEnd = suffix > 0 ? previous.events[previous.events.size() - suffix].startSample
+                               : previous.totalSamples;
+    return result;
+}
+
+// --- stripComments function implementation ---
+std::pmr::string MMLParser::stripComments(std::string_view mmlStringWithComments)
+{
+    TRACE_SCOPE("stripComments", "parse");
+    std::pmr::string cleanedMML(m_arena.resource());
+    cleanedMML.reserve(mmlStringWithComments.length() + 1);
+
+    size_t line_start = 0;
+    while (line_start < mmlStringWithComments.length())
+    {
+        size_t line_end = std::min(mmlStringWithComments.find('\n', line_start), mmlStringWithComments.length());
+        std::string_view line = mmlStringWithComments.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+
+        // If a semicolon is found, take only the part before it
+        cleanedMML += line.substr(0, line.find(';'));
+        cleanedMML += ' '; // Add a space to separate tokens from different lines
+    }
+    return cleanedMML;
+}
+
+
+// --- debugParseMML Implementation ---
+// Returns the compiled command list for an MML file (the same front end
+// parseMML renders from).
+std::vector<ParsedCommand> MMLParser::debugParseMML(const std::string &mmlFilePath)
+{
+    std::string mmlString = readFileIntoString(mmlFilePath);
+
+    if (mmlString.empty())
+    {
+        std::cerr << "Error: debugParseMML could not read MML file: " << mmlFilePath << std::endl;
+        return {};
     }
 
-    return parsedCommands;
+    return compileMML(mmlString);
 }
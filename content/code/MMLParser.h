@@ -6,12 +6,32 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>   // For std::once_flag
 #include <variant> // For std::variant (C++17)
+#include <deque>
+#include <map>
+#include <set>
+#include <tuple>
+#include <string_view>
+#include <memory_resource> // For std::pmr containers (C++17)
 #include "AudioUtils.h"
 #include "NoteDecoder.h"
+#include "RenderArena.h"
+#include "RenderLimits.h"
+#include "SparseTrack.h"
 
-// Define the global audio sample rate
-const int SAMPLE_RATE = 44100; // <--- ADD THIS LINE (Adjust value if needed)
+class ThreadPool;
+
+// Default audio sample rate of the engine; a parser can render at another
+// rate (see the sampleRate constructor argument)
+const int SAMPLE_RATE = 44100;
+
+// Rate used by draft (preview) renders
+const int DRAFT_SAMPLE_RATE = 22050;
+
+// Shortest rest that splits a sparse render into separate runs (about 23 ms
+// at 44.1 kHz); shorter rests are cheaper kept as zeros inside their run
+const size_t MIN_SPARSE_GAP_SAMPLES = 1024;
 
 // --- New structs for parsed command information ---
 
@@ -25,6 +45,8 @@ enum class CommandType
     REST,
     VOLUME,
     CHORD,
+    REPEAT, // [ ... ]N block
+    PLAY,   // PLAY:name invocation of a PATTERN:name { ... } definition
     // Add other types if your MML expands
     UNKNOWN
 };
@@ -33,11 +55,17 @@ enum class CommandType
 struct ParsedNote
 {
     std::string folderAbbr;
+    const InstrumentInfo *instrument; // Registry entry for folderAbbr, resolved when compiled
     std::string noteName;
     char accidental;
-    int length;
-    int octave;
+    int length; // 0 means "use the current LENGTH when rendered"
+    int octave; // -1 means "use the current OCTAVE when rendered"
+    double cents; // Microtonal detune ("A4+25c"), 0 = in tune
     double explicitDurationSeconds;
+    // Generated (noise) notes: picks the note's noise stream. Derived from
+    // the note's text and how often the same text came before it in its
+    // block (see compileTokens), never from its position in time.
+    uint64_t noiseKey = 0;
     // Add any other note-specific properties parsed from MML
 };
 
@@ -72,7 +100,26 @@ struct ParsedVolume
 
 struct ParsedChord
 {
-    std::vector<ParsedNote> notes; // A vector of individual notes in the chord
+    std::vector<ParsedNote> notes;  // A vector of individual notes in the chord
+    double explicitDurationSeconds; // Chord-level 'Xs' duration, 0 if not given
+};
+
+struct ParsedCommand;
+struct ParsedPattern;
+
+// A repeat block, e.g. "[ X:bass01 R:8 X:snare01 R:8 ]4"
+// The body is compiled once; each pass plays it as one timeline block.
+struct ParsedRepeat
+{
+    int count;                           // Number of times the body plays
+    std::vector<ParsedCommand> commands; // The compiled body of the block
+    std::string id;                      // Identifies one pass's content, like ParsedPattern::id
+};
+
+// An invocation of a named pattern, e.g. "PLAY:fill"
+struct ParsedPlay
+{
+    std::shared_ptr<const ParsedPattern> pattern; // Shared with the definition
 };
 
 // Update ParsedCommand's variant to include new types
@@ -82,9 +129,179 @@ struct ParsedCommand
     std::string originalCommandString;
 
     // Add ParsedOctave and ParsedLength to the variant
-    std::variant<ParsedNote, ParsedTempo, ParsedOctave, ParsedLength, ParsedRest, ParsedVolume, ParsedChord> data;
+    std::variant<ParsedNote, ParsedTempo, ParsedOctave, ParsedLength, ParsedRest, ParsedVolume, ParsedChord, ParsedRepeat, ParsedPlay> data;
 };
 
+// A named pattern, e.g. "PATTERN:fill { X:snare01 X:snare01 }"
+struct ParsedPattern
+{
+    std::string name;
+    // Identifies the pattern's content: its body's commands, with nested
+    // PLAYs replaced by the IDs of the patterns they resolved to, so the
+    // same motif written into several tracks (under any name) shares one
+    // block cache entry.
+    std::string id;
+    std::vector<ParsedCommand> commands;
+};
+
+// The running state the renderer carries from one command to the next.
+// A block renders identically whenever it is entered with the same state.
+struct RenderState
+{
+    double tempoBPM;
+    int octave;
+    int length;
+    float volume; // 0.0-1.0
+
+    bool operator==(const RenderState &other) const
+    {
+        return tempoBPM == other.tempoBPM && octave == other.octave &&
+               length == other.length && volume == other.volume;
+    }
+    bool operator!=(const RenderState &other) const { return !(*this == other); }
+    bool operator<(const RenderState &other) const
+    {
+        return std::tie(tempoBPM, octave, length, volume) <
+               std::tie(other.tempoBPM, other.octave, other.length, other.volume);
+    }
+};
+
+struct TimelineBlock;
+
+// One sound-producing event (note, chord or rest) of a compiled song, or
+// one play of a block (a repeat pass or a pattern invocation)
+struct TimelineEvent
+{
+    size_t startSample; // Offset of the event in the song
+    size_t numSamples;  // Events are back to back: the next starts where this ends
+    size_t firstVoice;  // Voices are CompiledSong::voices[firstVoice, firstVoice + voiceCount)
+    size_t voiceCount;  // 0 for rests and blocks
+    RenderState state;  // State checkpoint: tempo, octave, length and volume at this event
+    std::shared_ptr<const TimelineBlock> block; // The block this event plays, or nullptr
+};
+
+// Where two compiled versions of a song differ. Samples before 'start' are
+// the same in both; so are the last (totalSamples - newEnd) samples of the
+// new version and the last (totalSamples - oldEnd) of the old one, which may
+// have moved if the edit changed the song's length. Only the new version's
+// [start, newEnd) needs rendering.
+struct TimelineDiff
+{
+    size_t start;
+    size_t newEnd;
+    size_t oldEnd;
+
+    bool unchanged() const { return start == newEnd && start == oldEnd; }
+};
+
+// A song flattened into a time index. Every note is resolved to its
+// voices, each repeat pass and pattern invocation is one event playing a
+// shared block, and each event knows where it starts, so any time range
+// renders without rendering what precedes it. The voices point into the
+// sample cache of the parser that compiled the song, so the song is only
+// valid while that parser is.
+struct CompiledSong
+{
+    std::vector<TimelineEvent> events;
+    std::vector<Voice> voices;
+    std::vector<std::shared_ptr<const SampleInfo>> samples; // Keeps the samples the voices point at
+    RenderState exitState{};
+    size_t totalSamples = 0;
+    int sampleRate = 0;
+    bool truncated = false; // Cut short to fit RenderLimits (see admit)
+
+    // Index of the event sounding at 'sample' (binary search over the start
+    // offsets), or events.size() if the song has ended by then
+    size_t findEvent(size_t sample) const;
+
+    // Renders samples [startSample, endSample) of the song (clamped to its
+    // length). Only the events that overlap the range are rendered, and of
+    // an event cut by either end only the part inside the range; a block's
+    // audio is rendered the first time one of its plays is needed, then
+    // copied. The result matches the same slice of a full render (before
+    // the master bus). Sample is float, or int16_t for the int16 engine
+    // (mixed with saturating adds; load the samples with
+    // MMLParser::setSampleType(SampleType::Int16) to keep the whole path
+    // 16-bit). The same goes for the two functions below.
+    template <typename Sample = float>
+    std::vector<Sample> renderRange(size_t startSample, size_t endSample) const;
+
+    // Same as renderRange, but the range is split into segments rendered
+    // at the same time on 'pool', each into its own slice of one output
+    // buffer. The blocks played in the range are rendered first, also on
+    // 'pool'. An event crossing a segment boundary is rendered by both
+    // segments, each rendering just its own part, so the result is identical.
+    // A segment that starts after 'cancel' fires is skipped (left silent).
+    template <typename Sample = float>
+    std::vector<Sample> renderRangeParallel(ThreadPool &pool, size_t startSample, size_t endSample,
+                                            const CancellationToken *cancel = nullptr) const;
+
+    // Mixes [startSample, endSample) into 'out' (zeroed, as long as the
+    // range; the range must lie within the song). For block-by-block
+    // rendering into a reused buffer: once warmed up (every sample loaded,
+    // every block in the range rendered) it does not allocate.
+    template <typename Sample>
+    void renderRangeInto(size_t startSample, size_t endSample, Sample *out) const;
+
+    // Renders [startSample, endSample) as a run list: runs of notes and
+    // chords become audio runs, rests of at least MIN_SPARSE_GAP_SAMPLES
+    // become gaps that are neither stored nor rendered (shorter ones stay
+    // inside their run, as zeros). Runs are rendered in segments on 'pool'.
+    // Mixed down, the result equals renderRange over the same range.
+    // Segments are skipped once 'cancel' fires, as in renderRangeParallel.
+    SparseTrack renderSparse(ThreadPool &pool, size_t startSample, size_t endSample,
+                             const CancellationToken *cancel = nullptr) const;
+
+    // Predicts what rendering the whole song in one piece costs. Each voice
+    // sample is mixed once, however the song is split into segments, and
+    // each distinct block once however often it plays (its audio is kept,
+    // and copied for every play). No scratch memory grows with the thread
+    // count, so the cost is the same on any number of threads.
+    RenderCost estimateCost() const;
+
+    // Admission control: checks the song's estimated cost against 'limits'.
+    // Returns true if it fits, or if limits.truncate is set and the song
+    // could be cut down to fit (chords thinned to maxPolyphony, the timeline
+    // cut to the duration, event and memory limits; blocks that change get
+    // private copies, so other songs sharing them are left as they were);
+    // 'truncated' is then set and 'reason' says what was cut. Otherwise
+    // returns false with the limits it breaks in 'reason'.
+    bool admit(const RenderLimits &limits, std::string &reason);
+
+    // Compares this song's timeline with an earlier compile of the same
+    // track, matching events from the front by position and from the back
+    // by distance to the end. Events match if they render the same audio:
+    // same length, volume and voices, or the same block (a voice's sample
+    // and a block are compared by address, so both versions must come from
+    // the same parser and its caches).
+    TimelineDiff diff(const CompiledSong &previous) const;
+};
+
+// A repeat pass or pattern body, compiled for the state it is entered with
+// and shared by every event that plays it with that state (in this song,
+// and in later ones while the parser's block cache keeps it)
+struct TimelineBlock
+{
+    CompiledSong song; // The body's own timeline; song.exitState is the state it leaves
+
+    // The block's audio (song.totalSamples long), rendered by the first
+    // call; calls from other threads meanwhile wait for it
+    template <typename Sample>
+    const std::vector<Sample> &audio() const;
+
+private:
+    mutable std::once_flag m_floatOnce;
+    mutable std::once_flag m_int16Once;
+    mutable std::vector<float> m_floatAudio;
+    mutable std::vector<int16_t> m_int16Audio;
+};
+
+// Converts a time in seconds (the start or end of a render range) to a
+// sample offset at 'sampleRate', clamped to [0, totalSamples]. The clamp
+// is done in double before the cast, so a negative, huge, infinite or NaN
+// time gives 0 or totalSamples instead of overflowing.
+size_t secondsToSample(double seconds, int sampleRate, size_t totalSamples);
+
 // --- End new structs ---
 
 class MMLParser
@@ -95,14 +312,84 @@ public:
               double defaultTempoBPM = 120.0,
               int defaultOctave = 4, // default for initial octave
               int defaultLength = 4, // default length (e.g., quarter note)
-              int defaultVolume = 100
+              int defaultVolume = 100,
+              int sampleRate = SAMPLE_RATE // Output rate; samples are converted to it on load
     );
 
+    // Rate of the audio parseMML returns
+    int getSampleRate() const { return m_sampleRate; }
+
+    // The render settings below change how every note sounds, so each one
+    // also drops the compiled blocks (see clearPatternCache)
+
+    // Enables the per-voice attack/release declick ramps (on by default)
+    void setDeclickEnabled(bool enabled)
+    {
+        m_noteDecoder.setDeclickEnabled(enabled);
+        clearPatternCache();
+    }
+
+    // Plays pitched instruments from a few root samples each (see
+    // NoteDecoder::setSamplerMode); call it before compiling
+    void setSamplerMode(bool enabled, int rootSpacing = 0)
+    {
+        m_noteDecoder.setSamplerMode(enabled, rootSpacing);
+        clearPatternCache();
+    }
+
+    // Seed of the generated noise instrument; each noise note is seeded
+    // from it and its own key (see noiseSeedFor)
+    void setNoiseSeed(uint64_t seed)
+    {
+        m_noteDecoder.setNoiseSeed(seed);
+        clearPatternCache();
+    }
+
+    // Type samples are loaded in (see NoteDecoder::setSampleType); call it
+    // before compiling, since songs render the samples they were compiled with
+    void setSampleType(SampleType type)
+    {
+        m_noteDecoder.setSampleType(type);
+        clearPatternCache();
+    }
+
+    // Bytes of decoded samples the sample store keeps for later songs
+    // (see SampleStore); songs hold their own samples regardless
+    void setSampleCacheBudget(size_t bytes) { m_noteDecoder.setSampleCacheBudget(bytes); }
+
+    // Every sample loaded so far (see SampleStore::printStats)
+    const SampleStore &getSampleStore() const { return m_noteDecoder.getSampleStore(); }
+
+    // Compiles and renders a whole song (compileSong, then renderRange)
     std::vector<float> parseMML(const std::string &mmlString);
     // UPDATED: debugParseMML now takes a file path
     std::vector<ParsedCommand> debugParseMML(const std::string &mmlFilePath);
 
+    // Front end: strips comments, tokenizes and compiles an MML string into
+    // a command list without rendering any audio.
+    std::vector<ParsedCommand> compileMML(const std::string &mmlString);
+
+    // Compiles an MML string and builds its time index (loading every
+    // sample it needs), ready for CompiledSong::renderRange. With 'limits',
+    // the timeline stops growing once it is past their duration, event or
+    // memory limit, so a song that repeats without bound costs no more to
+    // compile than one just over the limit; admit() then rejects or cuts it.
+    CompiledSong compileSong(const std::string &mmlString, const RenderLimits &limits = RenderLimits());
+
+    // Drops every repeat pass and pattern kept by the block cache (songs
+    // already compiled keep theirs)
+    void clearPatternCache();
+
+    // Forgets every loaded sample (and compiled block) and re-reads the
+    // library manifest, after the library changed on disk. Songs compiled
+    // before the call keep rendering the samples they were compiled with.
+    void reloadLibrary();
+
+    // Directory samples are loaded from
+    const std::string &getLibraryPath() const { return m_noteDecoder.getLibraryPath(); }
+
 private:
+    int m_sampleRate;          // Output rate (declared first: the decoder is built with it)
     NoteDecoder m_noteDecoder; // <--- This is the change
 
     // Member variables for current global settings
@@ -111,15 +398,69 @@ private:
     int m_currentLength; // Tracks the current default length
     float m_currentVolume; // Store current volume as a float
 
+    // Patterns defined by the MML currently being compiled, by name
+    std::map<std::string, std::shared_ptr<const ParsedPattern>> m_patterns;
+
+    // Compiled blocks (repeat passes and pattern plays), keyed by content ID
+    // and the state they were entered with. Kept across songs so tracks
+    // sharing a motif reuse it, audio included, up to BLOCK_CACHE_BYTES of
+    // timeline and audio (the oldest entries go first).
+    using BlockCacheKey = std::pair<std::string, RenderState>;
+    static const size_t BLOCK_CACHE_BYTES = size_t(64) << 20;
+    std::map<BlockCacheKey, std::shared_ptr<const TimelineBlock>> m_blockCache;
+    std::deque<BlockCacheKey> m_blockCacheOrder; // Insertion order, for eviction
+    size_t m_blockCacheBytes = 0;
+
+    // Scratch memory for this parser's render job: tokens and split
+    // strings. Reset when a new job compiles.
+    RenderArena m_arena;
+
     // Helper functions (declarations)
-    std::string stripComments(const std::string &mmlStringWithComments);
-    std::vector<std::string> splitString(const std::string &s, char delimiter) const;
-    int parseInt(const std::string &s, int defaultValue = 0) const;
-    double parseDouble(const std::string &s, double defaultValue = 0.0) const;
+    std::pmr::string stripComments(std::string_view mmlStringWithComments);
+    std::pmr::vector<std::pmr::string> tokenizeMML(std::string_view cleanedMMLString);
+    std::vector<ParsedCommand> compileTokens(const std::pmr::vector<std::pmr::string> &tokens, size_t &pos, int depth, char closer);
+    ParsedCommand compileCommand(std::string_view token);
+
+    // Resolves a NOTE, CHORD or REST to the voices it plays (appended to
+    // 'voices') and returns its length in samples. Other commands are 0.
+    size_t prepareEvent(const ParsedCommand &cmd,
+                        const RenderState &state,
+                        std::vector<Voice> &voices);
+
+    // Compile-time library check: reports (once each) the samples the
+    // commands play that the library manifest does not list
+    void reportMissingSamples(const std::vector<ParsedCommand> &commands,
+                              int &octave,
+                              std::set<std::string> &reported);
+    void reportMissingSample(const ParsedNote &note, int octave, std::set<std::string> &reported);
+
+    // Time index builder: appends the command list to song.events
+    void buildTimeline(const std::vector<ParsedCommand> &commands,
+                       RenderState &state,
+                       CompiledSong &song);
+
+    // Appends one play of a repeat pass or pattern body to song.events,
+    // compiling its block unless the block cache has it for 'state'
+    void appendBlock(const std::string &id,
+                     const std::vector<ParsedCommand> &commands,
+                     RenderState &state,
+                     CompiledSong &song);
+
+    // Limits of the compileSong call in progress, what it has compiled so
+    // far (blocks included) and whether that has already outgrown them
+    // (buildTimeline then stops expanding)
+    RenderLimits m_compileLimits;
+    size_t m_compiledEvents = 0;
+    size_t m_compiledVoices = 0;
+    size_t m_compiledSamples = 0;
+    bool timelinePastLimits() const;
+    std::pmr::vector<std::string_view> splitString(std::string_view s, char delimiter);
+    int parseInt(std::string_view s, int defaultValue = 0) const;
+    double parseDouble(std::string_view s, double defaultValue = 0.0) const;
 
     // Modified parseNoteCommand to accept current default length and octave
     bool parseNoteCommand(
-        const std::string &command_args_str,
+        std::string_view command_args_str,
         std::string &folderAbbr,
         std::string &noteName,
         char &accidental,
@@ -128,14 +469,16 @@ private:
         double &explicitDurationSeconds,
         int defaultLength, // Input: current default length
         int defaultOctave  // Input: current default octave
-    ) const;
+    );
 
-    bool parseNoteString(const std::string &fullNoteString,
+    bool parseNoteString(std::string_view fullNoteString,
                          std::string &folderAbbr,
+                         const InstrumentInfo *&instrument,
                          std::string &noteName,
                          char &accidental,
                          int &length_for_note,
                          int &octave_for_note,
+                         double &cents,
                          double &explicitDurationSeconds,
                          int defaultLength,
                          int defaultOctave);
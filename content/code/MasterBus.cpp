@@ -0,0 +1,450 @@
+#include "MasterBus.h"
+#include "AllocAccounting.h"
+#include "Trace.h"
+#include <algorithm> // For std::min, std::max
+#include <cmath>     // For std::tan, std::pow, std::log10, std::exp
+#include <iostream>  // For reporting the normalization gain
+
+//////////////////////////////////////////////////////////////////////////////
+// LOUDNESS ANALYSIS                                                        //
+//////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // Direct form I biquad
+    struct Biquad
+    {
+        double b0, b1, b2, a1, a2;
+        double x1 = 0.0, x2 = 0.0, y1 = 0.0, y2 = 0.0;
+
+        double process(double x)
+        {
+            double y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+            return y;
+        }
+    };
+
+    // Converts a mean-square value to loudness units (BS.1770)
+    double meanSquareToLUFS(double meanSquare)
+    {
+        return -0.691 + 10.0 * std::log10(std::max(meanSquare, 1e-12));
+    }
+}
+
+LoudnessAnalysis analyzeLoudness(const float *audio, size_t numSamples, int sampleRate)
+{
+    LoudnessAnalysis result{-70.0, 0.0f};
+    if (audio == nullptr || numSamples == 0 || sampleRate <= 0)
+    {
+        return result;
+    }
+
+    // K-weighting: high-shelf "head" filter followed by the RLB high-pass,
+    // with coefficients derived for the actual sample rate (as in BS.1770)
+    double K = std::tan(M_PI * 1681.974450955533 / sampleRate);
+    double Q = 0.7071752369554196;
+    double Vh = std::pow(10.0, 3.999843853973347 / 20.0);
+    double Vb = std::pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+    Biquad shelf{(Vh + Vb * K / Q + K * K) / a0, 2.0 * (K * K - Vh) / a0, (Vh - Vb * K / Q + K * K) / a0,
+                 2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0};
+
+    K = std::tan(M_PI * 38.13547087602444 / sampleRate);
+    Q = 0.5003270373238773;
+    a0 = 1.0 + K / Q + K * K;
+    Biquad highpass{1.0, -2.0, 1.0, 2.0 * (K * K - 1.0) / a0, (1.0 - K / Q + K * K) / a0};
+
+    // Mean square of each 100 ms step; a 400 ms gating block is four steps
+    size_t stepSamples = static_cast<size_t>(sampleRate / 10);
+    std::vector<double> stepMeanSquares;
+    stepMeanSquares.reserve(numSamples / stepSamples + 1);
+    double stepSum = 0.0;
+    size_t stepFill = 0;
+    float peak = 0.0f;
+
+    for (size_t i = 0; i < numSamples; ++i)
+    {
+        peak = std::max(peak, std::abs(audio[i]));
+        double weighted = highpass.process(shelf.process(audio[i]));
+        stepSum += weighted * weighted;
+        if (++stepFill == stepSamples)
+        {
+            stepMeanSquares.push_back(stepSum / stepSamples);
+            stepSum = 0.0;
+            stepFill = 0;
+        }
+    }
+    result.peak = peak;
+
+    if (stepMeanSquares.size() < 4)
+    {
+        return result; // Shorter than one gating block
+    }
+
+    // Absolute gate at -70 LUFS
+    std::vector<double> blocks;
+    blocks.reserve(stepMeanSquares.size() - 3);
+    for (size_t i = 0; i + 4 <= stepMeanSquares.size(); ++i)
+    {
+        double blockMeanSquare = (stepMeanSquares[i] + stepMeanSquares[i + 1] +
+                                  stepMeanSquares[i + 2] + stepMeanSquares[i + 3]) / 4.0;
+        if (meanSquareToLUFS(blockMeanSquare) > -70.0)
+        {
+            blocks.push_back(blockMeanSquare);
+        }
+    }
+    if (blocks.empty())
+    {
+        return result;
+    }
+
+    // Relative gate 10 LU below the absolute-gated loudness
+    double sum = 0.0;
+    for (double block : blocks)
+    {
+        sum += block;
+    }
+    double relativeGate = meanSquareToLUFS(sum / blocks.size()) - 10.0;
+
+    double gatedSum = 0.0;
+    size_t gatedCount = 0;
+    for (double block : blocks)
+    {
+        if (meanSquareToLUFS(block) > relativeGate)
+        {
+            gatedSum += block;
+            gatedCount++;
+        }
+    }
+    if (gatedCount > 0)
+    {
+        result.integratedLUFS = meanSquareToLUFS(gatedSum / gatedCount);
+    }
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// LOOK-AHEAD LIMITER                                                       //
+//////////////////////////////////////////////////////////////////////////////
+
+LookAheadLimiter::LookAheadLimiter(int sampleRate, float ceiling, double lookaheadSeconds, double releaseSeconds)
+    : m_ceiling(ceiling),
+      m_window(std::max<size_t>(1, static_cast<size_t>(lookaheadSeconds * sampleRate))),
+      m_releaseCoef(releaseSeconds > 0 ? static_cast<float>(1.0 - std::exp(-1.0 / (releaseSeconds * sampleRate))) : 1.0f),
+      m_heldGain(1.0f),
+      m_minQueue(m_window),
+      m_queueHead(0),
+      m_queueSize(0),
+      m_gainHistory(m_window, 1.0f),
+      m_gainSum(static_cast<double>(m_window)),
+      m_delayLine(m_window, 0.0f),
+      m_position(0)
+{
+}
+
+float LookAheadLimiter::processSample(float input)
+{
+    // Gain this sample needs to stay under the ceiling
+    float magnitude = std::abs(input);
+    float required = magnitude > m_ceiling ? m_ceiling / magnitude : 1.0f;
+
+    // Sliding minimum of the required gain over the last m_window samples
+    while (m_queueSize > 0 && m_minQueue[(m_queueHead + m_queueSize - 1) % m_window].second >= required)
+    {
+        m_queueSize--;
+    }
+    m_minQueue[(m_queueHead + m_queueSize) % m_window] = {m_position, required};
+    m_queueSize++;
+    while (m_minQueue[m_queueHead].first + m_window <= m_position)
+    {
+        m_queueHead = (m_queueHead + 1) % m_window;
+        m_queueSize--;
+    }
+    float windowMin = m_minQueue[m_queueHead].second;
+
+    // Release: recover toward unity, but never above the window minimum
+    m_heldGain = std::min(windowMin, m_heldGain + (1.0f - m_heldGain) * m_releaseCoef);
+
+    // Moving average of the held gain. Every held gain in the average covers
+    // the delayed sample below, so the smoothed gain never lets it overshoot.
+    size_t slot = m_position % m_window;
+    m_gainSum += m_heldGain - m_gainHistory[slot];
+    m_gainHistory[slot] = m_heldGain;
+    float gain = static_cast<float>(m_gainSum / m_window);
+
+    // Delay the signal by m_window - 1 samples to line it up with its gain
+    m_delayLine[slot] = input;
+    float delayed = m_delayLine[(m_position + 1) % m_window];
+    m_position++;
+
+    float output = delayed * gain;
+    return std::max(-m_ceiling, std::min(m_ceiling, output)); // Guard against rounding
+}
+
+void LookAheadLimiter::process(const float *in, float *out, size_t numSamples)
+{
+    for (size_t i = 0; i < numSamples; ++i)
+    {
+        out[i] = processSample(in[i]);
+    }
+}
+
+void LookAheadLimiter::flush(float *out)
+{
+    for (size_t i = 0; i < latency(); ++i)
+    {
+        out[i] = processSample(0.0f);
+    }
+}
+
+bool LookAheadLimiter::sameState(const LookAheadLimiter &other) const
+{
+    if (m_window != other.m_window || m_ceiling != other.m_ceiling || m_releaseCoef != other.m_releaseCoef ||
+        m_heldGain != other.m_heldGain || m_gainSum != other.m_gainSum || m_queueSize != other.m_queueSize)
+    {
+        return false;
+    }
+    // Ring buffers are indexed by absolute position; compare them in order
+    for (size_t i = 0; i < m_window; ++i)
+    {
+        size_t slot = (m_position + i) % m_window;
+        size_t otherSlot = (other.m_position + i) % m_window;
+        if (m_gainHistory[slot] != other.m_gainHistory[otherSlot] || m_delayLine[slot] != other.m_delayLine[otherSlot])
+        {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < m_queueSize; ++i)
+    {
+        const auto &entry = m_minQueue[(m_queueHead + i) % m_window];
+        const auto &otherEntry = other.m_minQueue[(other.m_queueHead + i) % m_window];
+        if (m_position - entry.first != other.m_position - otherEntry.first || entry.second != otherEntry.second)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MASTER BUS                                                               //
+//////////////////////////////////////////////////////////////////////////////
+
+float normalizationGain(const float *audio, size_t numSamples, int sampleRate, const MasterBusSettings &settings)
+{
+    if (!settings.normalize)
+    {
+        return 1.0f;
+    }
+
+    // Analysis only, over audio that is already rendered
+    TRACE_SCOPE("loudness analysis", "bus");
+    ALLOC_STAGE(MasterBus);
+    float inputGain = 1.0f;
+    LoudnessAnalysis analysis = analyzeLoudness(audio, numSamples, sampleRate);
+    if (analysis.integratedLUFS > -70.0)
+    {
+        inputGain = static_cast<float>(std::pow(10.0, (settings.targetLoudnessLUFS - analysis.integratedLUFS) / 20.0));
+    }
+    std::cout << "Master bus: measured " << analysis.integratedLUFS << " LUFS (peak " << analysis.peak
+              << "), normalizing to " << settings.targetLoudnessLUFS << " LUFS with gain " << inputGain << std::endl;
+    return inputGain;
+}
+
+MasterBusStream::MasterBusStream(int sampleRate, const MasterBusSettings &settings, float inputGain)
+    : m_limiterEnabled(settings.limiterEnabled),
+      m_ceiling(settings.ceiling),
+      m_inputGain(inputGain),
+      m_limiter(sampleRate, settings.ceiling, settings.lookaheadSeconds, settings.releaseSeconds),
+      m_block(std::max(MASTER_BLOCK_SIZE, m_limiter.latency())),
+      m_toSkip(m_limiterEnabled ? m_limiter.latency() : 0),
+      m_samplesIn(0),
+      m_samplesOut(0)
+{
+}
+
+size_t MasterBusStream::process(const float *in, size_t numSamples, float *out)
+{
+    TRACE_SCOPE("master bus", "bus");
+    ALLOC_STAGE(MasterBus);
+    if (!m_limiterEnabled)
+    {
+        // Gain and safety clip in one pass
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            out[i] = std::max(-m_ceiling, std::min(m_ceiling, in[i] * m_inputGain));
+        }
+        m_samplesIn += numSamples;
+        m_samplesOut += numSamples;
+        return numSamples;
+    }
+
+    // Output lags input by the limiter's latency, so the write position
+    // trails the read position and never overwrites unread input
+    size_t written = 0;
+    for (size_t readPos = 0; readPos < numSamples; readPos += MASTER_BLOCK_SIZE)
+    {
+        size_t count = std::min(MASTER_BLOCK_SIZE, numSamples - readPos);
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_block[i] = in[readPos + i] * m_inputGain;
+        }
+        m_limiter.process(m_block.data(), m_block.data(), count);
+
+        size_t skipped = std::min(m_toSkip, count);
+        m_toSkip -= skipped;
+        std::copy(m_block.begin() + skipped, m_block.begin() + count, out + written);
+        written += count - skipped;
+    }
+    m_samplesIn += numSamples;
+    m_samplesOut += written;
+    return written;
+}
+
+size_t MasterBusStream::finish(float *out)
+{
+    if (!m_limiterEnabled)
+    {
+        return 0;
+    }
+
+    // Drain the samples still held in the look-ahead window, but no more
+    // than the input had (a track shorter than the latency)
+    m_limiter.flush(m_block.data());
+    size_t tail = std::min(m_limiter.latency() - m_toSkip, m_samplesIn - m_samplesOut);
+    std::copy(m_block.begin() + m_toSkip, m_block.begin() + m_toSkip + tail, out);
+    m_samplesOut += tail;
+    return tail;
+}
+
+bool MasterBusStream::sameState(const MasterBusStream &other) const
+{
+    if (m_limiterEnabled != other.m_limiterEnabled || m_ceiling != other.m_ceiling ||
+        m_inputGain != other.m_inputGain || m_toSkip != other.m_toSkip ||
+        m_samplesIn - m_samplesOut != other.m_samplesIn - other.m_samplesOut)
+    {
+        return false;
+    }
+    return !m_limiterEnabled || m_limiter.sameState(other.m_limiter);
+}
+
+IncrementalMasterBus::IncrementalMasterBus(int sampleRate, const MasterBusSettings &settings)
+    : m_sampleRate(sampleRate),
+      m_settings(settings),
+      m_processedSamples(0)
+{
+}
+
+const std::vector<float> &IncrementalMasterBus::process(const std::vector<float> &audio)
+{
+    // A full pass is an update that nothing from the last pass can shortcut
+    m_output.clear();
+    m_checkpoints.clear();
+    return update(audio, 0, audio.size(), 0);
+}
+
+const std::vector<float> &IncrementalMasterBus::update(const std::vector<float> &audio, size_t start, size_t newEnd, size_t oldEnd)
+{
+    std::vector<Checkpoint> previous;
+    previous.swap(m_checkpoints);
+    if (m_settings.normalize)
+    {
+        previous.clear(); // The gain may have changed: nothing can be reused
+    }
+    if (previous.empty())
+    {
+        float inputGain = normalizationGain(audio.data(), audio.size(), m_sampleRate, m_settings);
+        previous.push_back({0, 0, MasterBusStream(m_sampleRate, m_settings, inputGain)});
+        start = 0;
+    }
+
+    // Resume from the last checkpoint at or before the edit; the input up
+    // to it is unchanged, so are the stream's state and output
+    size_t resume = 0;
+    while (resume + 1 < previous.size() && previous[resume + 1].inputPos <= start)
+    {
+        resume++;
+    }
+    m_checkpoints.assign(previous.begin(), previous.begin() + resume + 1);
+    MasterBusStream stream = previous[resume].stream;
+    size_t inputPos = previous[resume].inputPos;
+    size_t outputPos = previous[resume].outputPos;
+
+    std::vector<float> output(audio.size());
+    std::copy(m_output.begin(), m_output.begin() + outputPos, output.begin());
+    m_processedSamples = 0;
+
+    // Checkpoints of the last pass after the edit, where the two passes may
+    // meet again; 'rejoinAt' maps one to its position in the new input
+    size_t next = resume + 1;
+    auto rejoinAt = [&](size_t i)
+    { return newEnd + (previous[i].inputPos - oldEnd); };
+    while (next < previous.size() && previous[next].inputPos < oldEnd)
+    {
+        next++;
+    }
+
+    while (true)
+    {
+        while (next < previous.size() && rejoinAt(next) < inputPos)
+        {
+            next++;
+        }
+        if (next < previous.size() && rejoinAt(next) == inputPos)
+        {
+            if (stream.sameState(previous[next].stream))
+            {
+                // Same state, same input from here on: the rest of the last
+                // pass's output (and its checkpoints) carries over
+                const Checkpoint &rejoin = previous[next];
+                std::copy(m_output.begin() + rejoin.outputPos, m_output.end(), output.begin() + outputPos);
+                for (size_t i = next; i < previous.size(); ++i)
+                {
+                    m_checkpoints.push_back({rejoinAt(i), outputPos + (previous[i].outputPos - rejoin.outputPos),
+                                             previous[i].stream});
+                }
+                m_output.swap(output);
+                return m_output;
+            }
+            next++;
+        }
+        if (inputPos >= audio.size())
+        {
+            break;
+        }
+
+        size_t target = std::min(audio.size(), inputPos + MASTER_CHECKPOINT_INTERVAL);
+        if (next < previous.size())
+        {
+            target = std::min(target, rejoinAt(next));
+        }
+        outputPos += stream.process(audio.data() + inputPos, target - inputPos, output.data() + outputPos);
+        m_processedSamples += target - inputPos;
+        inputPos = target;
+        m_checkpoints.push_back({inputPos, outputPos, stream});
+    }
+
+    stream.finish(output.data() + outputPos);
+    m_output.swap(output);
+    return m_output;
+}
+
+void applyMasterBus(std::vector<float> &audio, int sampleRate, const MasterBusSettings &settings)
+{
+    if (audio.empty())
+    {
+        return;
+    }
+
+    // Pass 1 (optional): loudness analysis of the rendered track
+    float inputGain = normalizationGain(audio.data(), audio.size(), sampleRate, settings);
+
+    // Pass 2: gain and limiter, in place
+    MasterBusStream stream(sampleRate, settings, inputGain);
+    size_t written = stream.process(audio.data(), audio.size(), audio.data());
+    stream.finish(audio.data() + written);
+}
@@ -0,0 +1,170 @@
+// MasterBus.h
+
+#ifndef MASTER_BUS_H
+#define MASTER_BUS_H
+
+#include <cstddef>
+#include <vector>
+
+// Number of samples the master bus processes at a time
+const size_t MASTER_BLOCK_SIZE = 1024;
+
+// Settings for the final stage every rendered track goes through
+struct MasterBusSettings
+{
+    bool limiterEnabled = true;
+    float ceiling = 0.98f;          // Peak level the limiter never exceeds (linear, ~ -0.2 dBFS)
+    double lookaheadSeconds = 0.005; // How far ahead the limiter sees peaks coming
+    double releaseSeconds = 0.080;   // Time for the gain to recover after a peak
+
+    bool normalize = false;          // Apply a loudness-normalizing gain first
+    double targetLoudnessLUFS = -18.0; // Same default as wav_lib.py's library target
+};
+
+// Result of the loudness analysis pass
+struct LoudnessAnalysis
+{
+    double integratedLUFS; // Gated integrated loudness (ITU-R BS.1770, mono)
+    float peak;            // Sample peak (linear)
+};
+
+// Measures integrated loudness and peak of mono audio in one cheap pass
+// (K-weighting, 400 ms blocks with 75% overlap, absolute and relative gates).
+// Silent or too-short input reports -70 LUFS.
+LoudnessAnalysis analyzeLoudness(const float *audio, size_t numSamples, int sampleRate);
+
+// Streaming look-ahead peak limiter.
+//
+// The gain for each sample is the minimum gain needed over the next
+// 'lookahead' samples, smoothed by a moving average of the same length, so
+// it ramps down before a peak instead of clipping it. Output is delayed by
+// latency() samples; call process() block by block and flush() at the end.
+class LookAheadLimiter
+{
+public:
+    LookAheadLimiter(int sampleRate, float ceiling, double lookaheadSeconds, double releaseSeconds);
+
+    // Fixed delay between input and output, in samples
+    size_t latency() const { return m_window - 1; }
+
+    // Limits 'numSamples' of input into 'out' (which may alias 'in')
+    void process(const float *in, float *out, size_t numSamples);
+
+    // Pushes latency() samples of silence through, emitting the held tail
+    void flush(float *out);
+
+    // True if this limiter will turn the same future input into the same
+    // output as 'other' (same gains, window and delayed samples, relative
+    // to each one's own position)
+    bool sameState(const LookAheadLimiter &other) const;
+
+private:
+    float m_ceiling;
+    size_t m_window;     // Look-ahead window length (samples)
+    float m_releaseCoef; // Per-sample recovery toward unity gain
+    float m_heldGain;    // Window minimum after release smoothing
+
+    // Monotonic queue of (sample index, required gain) for the window minimum
+    std::vector<std::pair<size_t, float>> m_minQueue;
+    size_t m_queueHead;
+    size_t m_queueSize;
+
+    std::vector<float> m_gainHistory; // Last m_window held gains for the moving average
+    double m_gainSum;
+    std::vector<float> m_delayLine;   // Last m_window input samples
+    size_t m_position;                // Total samples pushed so far
+
+    float processSample(float input);
+};
+
+// Loudness-normalizing gain for 'audio' under 'settings' (1.0 when
+// normalization is off or the audio is silent). Prints the measurement.
+float normalizationGain(const float *audio, size_t numSamples, int sampleRate, const MasterBusSettings &settings);
+
+// The master bus as a stream: gain, then the limiter (or the safety clip).
+// Input goes in block by block, in order; finished output comes back with
+// the limiter's latency already removed, so it can be written out while the
+// rest of the track is still being rendered. Normalization needs the whole
+// track, so its gain is measured beforehand and passed in.
+class MasterBusStream
+{
+public:
+    MasterBusStream(int sampleRate, const MasterBusSettings &settings, float inputGain = 1.0f);
+
+    // Processes 'numSamples' of input and writes the finished samples to
+    // 'out', which may alias 'in' or trail it in the same buffer. Returns the
+    // number written (fewer than numSamples while the limiter fills up).
+    size_t process(const float *in, size_t numSamples, float *out);
+
+    // Writes the samples the limiter still holds (at most latency()) to
+    // 'out' and returns their number. Call once, after the last process().
+    size_t finish(float *out);
+
+    // Most samples process() holds back (and finish() returns)
+    size_t latency() const { return m_limiterEnabled ? m_limiter.latency() : 0; }
+
+    // True if both streams will turn the same future input into the same
+    // output, wherever each one is in its track
+    bool sameState(const MasterBusStream &other) const;
+
+private:
+    bool m_limiterEnabled;
+    float m_ceiling;
+    float m_inputGain;
+    LookAheadLimiter m_limiter;
+    std::vector<float> m_block; // Scratch block (output may alias the input)
+    size_t m_toSkip;            // Outputs that precede the first input sample
+    size_t m_samplesIn;         // Total input so far
+    size_t m_samplesOut;        // Total output so far
+};
+
+// Master bus for a track that is edited and re-rendered in pieces (watch
+// mode). The output and a checkpoint of the stream every
+// MASTER_CHECKPOINT_INTERVAL samples are kept from the last pass. After an
+// edit, processing resumes at the checkpoint before the change, and stops as
+// soon as the stream is back in the state the last pass had at the same
+// point after the change; from there the previous output is reused, moved
+// if the edit changed the track's length. The cost follows the size of the
+// edit, and the output is the same as a full pass. With normalization the
+// gain depends on the whole track, so every update is a full pass.
+const size_t MASTER_CHECKPOINT_INTERVAL = 1 << 16;
+
+class IncrementalMasterBus
+{
+public:
+    IncrementalMasterBus(int sampleRate, const MasterBusSettings &settings);
+
+    // Processes a whole track and returns the finished audio
+    const std::vector<float> &process(const std::vector<float> &audio);
+
+    // Processes 'audio', an edit of the track last processed: its first
+    // 'start' samples are unchanged, and its samples from 'newEnd' on are
+    // the previous track's from 'oldEnd' on.
+    const std::vector<float> &update(const std::vector<float> &audio, size_t start, size_t newEnd, size_t oldEnd);
+
+    // Input samples the last process()/update() actually ran through the bus
+    size_t lastProcessedSamples() const { return m_processedSamples; }
+
+private:
+    struct Checkpoint
+    {
+        size_t inputPos;  // Input samples consumed when the copy was taken
+        size_t outputPos; // Output samples emitted by then
+        MasterBusStream stream;
+    };
+
+    int m_sampleRate;
+    MasterBusSettings m_settings;
+    std::vector<float> m_output;
+    std::vector<Checkpoint> m_checkpoints;
+    size_t m_processedSamples;
+};
+
+// Runs a rendered track through the master bus in MASTER_BLOCK_SIZE blocks:
+// optional loudness normalization (measured with analyzeLoudness on the
+// audio already rendered, not a second render) followed by the limiter, or a
+// safety clip at the ceiling when the limiter is off. The limiter's latency
+// is compensated, so the output lines up with the input.
+void applyMasterBus(std::vector<float> &audio, int sampleRate, const MasterBusSettings &settings);
+
+#endif // MASTER_BUS_H
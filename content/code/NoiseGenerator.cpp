@@ -0,0 +1,247 @@
+#include "NoiseGenerator.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Rows of the pink generator: the slowest changes every 2^16 samples,
+    // so the spectrum falls at 3 dB per octave down to about 0.7 Hz
+    const int PINK_ROWS = 16;
+    // Keeps the pink sum (17 rows) at about the loudness of white noise
+    const float PINK_SCALE = 2.0f / (PINK_ROWS + 1);
+
+    // Level of the NES generator's two output states
+    const float NES_LEVEL = 0.5f;
+    // NTSC 2A03 CPU clock, and the noise periods (in CPU cycles) the
+    // channel's 4-bit period index selects
+    const double NES_CPU_CLOCK = 1789773.0;
+    const int NES_PERIODS[16] = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+
+    const float INT32_TO_UNIT = 1.0f / 2147483648.0f;
+
+    // SplitMix64 finalizer: turns related seeds into unrelated ones
+    uint64_t mixSeed(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // 32-bit xorshift-multiply hash ("lowbias32") of a counter offset by
+    // the seed. Consecutive counters give uncorrelated values, which
+    // multiply-free hashes (Wang's) do not.
+    inline uint32_t hashIndex(uint32_t index, uint64_t seed)
+    {
+        uint32_t key = (index + static_cast<uint32_t>(seed)) ^ static_cast<uint32_t>(seed >> 32);
+        key ^= key >> 16;
+        key *= 0x7feb352dU;
+        key ^= key >> 15;
+        key *= 0x846ca68bU;
+        key ^= key >> 16;
+        return key;
+    }
+
+#ifdef __SSE2__
+    // Four 32-bit products (SSE2 has only the 32x32->64 multiply)
+    inline __m128i multiply32(__m128i a, __m128i b)
+    {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+#endif
+
+    // White noise, samples [pos, pos + count), within -1..1
+    void renderWhite(uint64_t seed, size_t pos, size_t count, float *out)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i multiplier1 = _mm_set1_epi32(0x7feb352d);
+        const __m128i multiplier2 = _mm_set1_epi32(static_cast<int>(0x846ca68bU));
+        const __m128i high = _mm_set1_epi32(static_cast<int>(seed >> 32));
+        const __m128 scale = _mm_set1_ps(INT32_TO_UNIT);
+        __m128i counter = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(static_cast<uint32_t>(pos) + static_cast<uint32_t>(seed))),
+                                        _mm_setr_epi32(0, 1, 2, 3));
+        const __m128i four = _mm_set1_epi32(4);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i key = _mm_xor_si128(counter, high);
+            key = multiply32(_mm_xor_si128(key, _mm_srli_epi32(key, 16)), multiplier1);
+            key = multiply32(_mm_xor_si128(key, _mm_srli_epi32(key, 15)), multiplier2);
+            key = _mm_xor_si128(key, _mm_srli_epi32(key, 16));
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(key), scale));
+            counter = _mm_add_epi32(counter, four);
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            uint32_t key = hashIndex(static_cast<uint32_t>(pos + i), seed);
+            out[i] = static_cast<float>(static_cast<int32_t>(key)) * INT32_TO_UNIT;
+        }
+    }
+
+    // Pink noise: a white row plus PINK_ROWS held rows. Row k takes a new
+    // value at every sample whose index has exactly k trailing zero bits,
+    // so at sample n it holds its value number (n + 2^k) >> (k + 1).
+    void renderPink(uint64_t seed, size_t pos, size_t count, float *out)
+    {
+        uint64_t rowSeeds[PINK_ROWS];
+        int64_t rows[PINK_ROWS];
+        int64_t sum = 0;
+        for (int k = 0; k < PINK_ROWS; ++k)
+        {
+            rowSeeds[k] = mixSeed(seed + k + 1);
+            uint32_t value = static_cast<uint32_t>((pos + (size_t(1) << k)) >> (k + 1));
+            rows[k] = static_cast<int32_t>(hashIndex(value, rowSeeds[k]));
+            sum += rows[k];
+        }
+
+        renderWhite(seed, pos, count, out);
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t n = pos + i;
+            if (i > 0)
+            {
+                int k = 0;
+                while (k < PINK_ROWS && ((n >> k) & 1) == 0)
+                {
+                    k++;
+                }
+                if (k < PINK_ROWS)
+                {
+                    sum -= rows[k];
+                    uint32_t value = static_cast<uint32_t>((n + (size_t(1) << k)) >> (k + 1));
+                    rows[k] = static_cast<int32_t>(hashIndex(value, rowSeeds[k]));
+                    sum += rows[k];
+                }
+            }
+            out[i] = (out[i] + static_cast<float>(sum) * INT32_TO_UNIT) * PINK_SCALE;
+        }
+    }
+
+    // One period of the NES noise register's output bit, from its power-on
+    // state (1). Long mode feeds back bit 0 xor bit 1, short mode bit 0 xor
+    // bit 6.
+    std::vector<uint8_t> buildLfsrSequence(int tap)
+    {
+        std::vector<uint8_t> bits;
+        uint32_t state = 1;
+        do
+        {
+            bits.push_back(static_cast<uint8_t>(state & 1));
+            uint32_t feedback = (state ^ (state >> tap)) & 1;
+            state = (state >> 1) | (feedback << 14);
+        } while (state != 1);
+        return bits;
+    }
+
+    const std::vector<uint8_t> &lfsrSequence(bool shortMode)
+    {
+        static const std::vector<uint8_t> longSequence = buildLfsrSequence(1);  // 32767 steps
+        static const std::vector<uint8_t> shortSequence = buildLfsrSequence(6); // 93 steps
+        return shortMode ? shortSequence : longSequence;
+    }
+
+    // NES noise: the register's output (low while bit 0 is set) sampled at
+    // the clock position of each output sample. The seed picks where in the
+    // sequence the voice starts.
+    void renderNes(const NoiseSource &source, size_t pos, size_t count, float *out)
+    {
+        const std::vector<uint8_t> &bits = lfsrSequence(source.type == NoiseType::NesMetal);
+        const size_t period = bits.size();
+        const uint64_t step = source.lfsrStep;
+
+        uint64_t clock = static_cast<uint64_t>(pos) * step; // 16.16 fixed point
+        size_t index = static_cast<size_t>((source.seed % period + (clock >> 16)) % period);
+        for (size_t i = 0; i < count; ++i)
+        {
+            out[i] = bits[index] ? -NES_LEVEL : NES_LEVEL;
+            uint64_t next = clock + step;
+            index += static_cast<size_t>((next >> 16) - (clock >> 16));
+            while (index >= period)
+            {
+                index -= period;
+            }
+            clock = next;
+        }
+    }
+}
+
+// --- parseNoiseName Implementation ---
+bool parseNoiseName(std::string_view name, int sampleRate, NoiseSource &source)
+{
+    source = NoiseSource();
+    source.sampleRate = sampleRate;
+
+    size_t digits = name.find_first_of("0123456789");
+    std::string_view kind = name.substr(0, digits);
+    std::string_view periodDigits = digits == std::string_view::npos ? std::string_view() : name.substr(digits);
+
+    if (kind == "white" || kind == "pink")
+    {
+        if (!periodDigits.empty())
+        {
+            return false;
+        }
+        source.type = kind == "white" ? NoiseType::White : NoiseType::Pink;
+        return true;
+    }
+    if (kind != "noise" && kind != "metal")
+    {
+        return false;
+    }
+
+    int period = NES_DEFAULT_PERIOD;
+    if (!periodDigits.empty())
+    {
+        if (periodDigits.length() > 2 || periodDigits.find_first_not_of("0123456789") != std::string_view::npos)
+        {
+            return false;
+        }
+        period = std::stoi(std::string(periodDigits));
+        if (period > 15)
+        {
+            return false;
+        }
+    }
+    source.type = kind == "noise" ? NoiseType::Nes : NoiseType::NesMetal;
+    double clocksPerSample = NES_CPU_CLOCK / NES_PERIODS[period] / sampleRate;
+    source.lfsrStep = static_cast<uint64_t>(std::llround(clocksPerSample * 65536.0));
+    return sampleRate > 0;
+}
+
+// --- noiseSeedFor Implementation ---
+uint64_t noiseSeedFor(uint64_t songSeed, uint64_t noteKey)
+{
+    return mixSeed(mixSeed(songSeed) ^ noteKey);
+}
+
+// --- renderNoise Implementation ---
+void renderNoise(const NoiseSource &source, size_t pos, size_t count, float *out)
+{
+    switch (source.type)
+    {
+    case NoiseType::White:
+        renderWhite(mixSeed(source.seed), pos, count, out);
+        break;
+    case NoiseType::Pink:
+        renderPink(mixSeed(source.seed), pos, count, out);
+        break;
+    case NoiseType::Nes:
+    case NoiseType::NesMetal:
+        renderNes(source, pos, count, out);
+        break;
+    case NoiseType::None:
+    default:
+        std::fill(out, out + count, 0.0f);
+        break;
+    }
+}
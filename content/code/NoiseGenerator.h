@@ -0,0 +1,64 @@
+// NoiseGenerator.h
+
+#ifndef NOISE_GENERATOR_H
+#define NOISE_GENERATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Built-in noise for the "noise" instrument: no sample files, any duration,
+// and the same audio for the same seed on every render.
+//
+// Every generator is a function of the sample index, so a voice can be
+// rendered from any position (in chunks, or one block of the song at a
+// time) and still produce exactly the samples of a single pass:
+//   - white: an xorshift-multiply hash of the index and seed, four
+//     samples at a time with SSE2
+//   - pink:  Voss-McCartney, 16 rows of held white values, row k updated
+//     every 2^(k+1) samples (staggered, so one row changes per sample),
+//     plus a white row. Rows are summed as integers, so the result does
+//     not depend on where rendering started.
+//   - NES:   the 2A03's 15-bit LFSR noise channel, clocked at one of its 16
+//     periods. The register's sequence is tabulated once (32767 steps, or
+//     93 in short "metal" mode) and indexed by the clock position.
+
+enum class NoiseType
+{
+    None,    // Not a generated voice
+    White,
+    Pink,
+    Nes,     // LFSR, long mode (hiss)
+    NesMetal // LFSR, short mode (a metallic, pitched buzz)
+};
+
+// NES noise period used when the name gives none (202 CPU cycles, ~8.9 kHz)
+const int NES_DEFAULT_PERIOD = 8;
+// Length of a noise note given neither a length nor a duration
+const double NOISE_NATURAL_SECONDS = 1.0;
+
+struct NoiseSource
+{
+    NoiseType type = NoiseType::None;
+    uint64_t seed = 0;     // Selects the stream (see noiseSeedFor)
+    int sampleRate = 0;    // Rate the noise is generated at
+    uint64_t lfsrStep = 0; // NES: LFSR clocks per output sample, 16.16 fixed point
+};
+
+// Parses a noise note name: "white", "pink", "noise" or "metal" (NES long
+// and short mode), the NES ones optionally followed by a period index 0-15
+// (0 = highest, as the NES register: "noise3", "metal12"). Returns false
+// for anything else.
+bool parseNoiseName(std::string_view name, int sampleRate, NoiseSource &source);
+
+// Derives the seed of a voice from the song's seed and the key of the note
+// that plays it (see ParsedNote::noiseKey). The key depends only on how the
+// note is written and where it sits in its own block, so every noise note
+// sounds different, but an edit elsewhere in the song (even one that moves
+// it in time) leaves its noise unchanged.
+uint64_t noiseSeedFor(uint64_t songSeed, uint64_t noteKey);
+
+// Writes samples [pos, pos + count) of the noise to 'out', within -1..1
+void renderNoise(const NoiseSource &source, size_t pos, size_t count, float *out);
+
+#endif // NOISE_GENERATOR_H
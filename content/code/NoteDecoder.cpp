@@ -1,10 +1,21 @@
 #include "NoteDecoder.h" // Assuming you create this header
+#include "AudioUtils.h"  // For resampleAudio, downmixToMono
+#include "Trace.h"
 #include <map>
 #include <iostream> // For warning/error output during development
 #include <string>
 #include <stdexcept> // For throwing errors on unsupported MML
-#include <sstream>   // For building strings with numbers
 #include <algorithm> // For std::tolower (optional, for case-insensitive names)
+#include <cmath>     // For the pan law
+#include <filesystem> // For finding pre-decimated sample banks
+
+#ifdef __SSE2__
+#include <emmintrin.h> // For the int16 voice stage
+#endif
+
+#ifndef MML_NO_SNDFILE
+#include <sndfile.h> // Fallback for files the built-in reader does not handle
+#endif
 
 //////////////////////////////////////////////////////////////////////////////
 // UTILITY FUNCTIONS                                                        //
@@ -65,8 +76,26 @@ std::vector<float> generate_audio(const std::vector<float> &sample_data, double
 //////////////////////////////////////////////////////////////////////////////
 
 // --- NoteDecoder Constructor (minimal for now) ---
-NoteDecoder::NoteDecoder(const std::string &libraryBasePath) : m_libraryBasePath(libraryBasePath)
+NoteDecoder::NoteDecoder(const std::string &libraryBasePath, int engineSampleRate)
+    : m_libraryBasePath(libraryBasePath),
+      m_engineSampleRate(engineSampleRate),
+      m_declickEnabled(true),
+      m_sampleType(SampleType::Float32),
+      m_samplerMode(false),
+      m_rootSpacing(0),
+      m_noiseSeed(0)
 {
+    // Prefer a bank already decimated to the engine rate, if there is one
+    std::string bankPath = libraryBasePath + "-" + std::to_string(engineSampleRate);
+    std::error_code ec;
+    if (std::filesystem::is_directory(bankPath, ec))
+    {
+        m_libraryBasePath = bankPath;
+        std::cout << "NoteDecoder: using " << engineSampleRate << " Hz sample bank " << bankPath << std::endl;
+    }
+
+    // Learn what the library holds up front, without opening any WAVs
+    loadManifest();
     // Optional: Add some initialization or validation here
     // std::cout << "NoteDecoder initialized with library base path: " << m_libraryBasePath << std::endl;
 }
@@ -76,25 +105,28 @@ NoteDecoder::NoteDecoder(const std::string &libraryBasePath) : m_libraryBasePath
 // Class Functions                                                          //
 //////////////////////////////////////////////////////////////////////////////
 
-std::string NoteDecoder::buildWaveformFilePath(
-    const std::string &folderAbbr,
+void NoteDecoder::buildWaveformFilePath(
+    const InstrumentInfo &instrument,
     const std::string &noteName,
     char accidental,
     int length, // MML note length (not directly used for filename here)
-    int octave  // MML octave
+    int octave, // MML octave
+    std::pmr::string &filePath // Output: the path is appended here
 ) const
 {
-    std::string fullFolderPath = m_libraryBasePath + "/" + getFullFolderPath(folderAbbr);
-    std::string filename;
-
-    // Use a stringstream for easy number to string conversion for variants
-    std::stringstream ss;
+    (void)length;
+    filePath += m_libraryBasePath;
+    filePath += '/';
+    filePath += instrument.folder;
+    filePath += '/';
 
-    if (folderAbbr == "x")   // HOTFIX: all folders are lowercase
+    switch (instrument.naming)
+    {
+    case NamingScheme::DrumKit:
     { // Casio Drums
         // Naming: DRUMS-<style><variant>.wav
-        std::string drumStyle = noteName;
-        std::string drumVariant = "01"; // Default variant
+        std::string_view drumStyle = noteName;
+        std::string_view drumVariant = "01"; // Default variant
 
         // Check if noteName contains a variant number (e.g., "base06")
         // Assuming variant is always 2 digits at the end of the style name
@@ -106,53 +138,32 @@ std::string NoteDecoder::buildWaveformFilePath(
         // Note: For drums, accidental, length, octave are usually ignored.
         // They might be used for other effects later, but not for path.
 
-        ss << "DRUMS-" << drumStyle << drumVariant << ".wav";
-        filename = ss.str();
-    }
-    else if (folderAbbr == "noise")
-    {
-        // Naming: <type>-<duration>s.wav (e.g., white-1s.wav, pink-7s.wav)
-        // noteName already includes type and duration, e.g., "white1s", "pink7s"
-        // We'll assume the MML input will match the filename exactly for noise.
-        // So, if MML is "noise:white1s", we look for "white-1s.wav"
-        // If MML is "noise:pink7s", we look for "pink-7s.wav"
-        // This means the 'name' part of MML for noise needs to be 'white1s' or 'pink7s' to match the actual file naming.
-        // We need to add the dash back in the filename.
-        std::string noise_type_and_duration = noteName; // e.g., "white1s"
-        size_t last_digit_pos = noise_type_and_duration.find_last_not_of("0123456789") + 1;
-        if (last_digit_pos < noise_type_and_duration.length())
-        {
-            // Insert dash before the duration part if it exists
-            noise_type_and_duration.insert(last_digit_pos, "-");
-        }
-        ss << noise_type_and_duration << ".wav";
-        filename = ss.str();
-    }
-    else if (folderAbbr == "miscellaneous")
-    {
-        // Naming: Directly uses noteName (e.g., triC4-A4.wav, bassline1.wav)
-        // Assume noteName from MML will directly map to filename (e.g., "triC4-A4", "bassline1")
-        ss << noteName << ".wav";
-        filename = ss.str();
-    }
-    else if (folderAbbr == "sk-5")
-    {
-        // Naming: <chorus_id>.wav (e.g., chorus1.wav, chorus2.wav)
-        // Assume noteName from MML is "chorus1", "chorus2", etc.
-        ss << noteName << ".wav";
-        filename = ss.str();
+        filePath += "DRUMS-";
+        filePath += drumStyle;
+        filePath += drumVariant;
+        break;
     }
-    else
-    { // Pitched instruments: imp, i05, i25, sqr, tri
-        // Naming: <canonicalNote><octave>.wav (e.g., A4.wav, Db5.wav)
+    case NamingScheme::Generated:
+        // No file to find: prepareVoice() generates these notes (see
+        // NoiseGenerator.h). The name still makes a key for messages.
+        filePath += noteName;
+        break;
+    case NamingScheme::Direct:
+        // Naming: Directly uses noteName (e.g., triC4-A4.wav, bassline1.wav
+        // for miscellaneous; chorus1.wav, chorus2.wav for sk-5)
+        filePath += noteName;
+        break;
+    case NamingScheme::PitchedNote:
+        // Pitched instruments: imp, i05, i25, sqr, tri
+        // Naming: <canonicalNote><octave>-<abbr>.wav (e.g., A4-sqr.wav, Db5-tri.wav)
         // For these, we call getCanonicalNoteFilename to build the note part.
-        std::string canonicalNoteAndOctave = getCanonicalNoteFilename(noteName, accidental, octave);
-        ss << canonicalNoteAndOctave << "-" << folderAbbr << ".wav"; // <--- MODIFIED LINE!
-        filename = ss.str();
+        filePath += getCanonicalNoteFilename(noteName, accidental, octave);
+        filePath += '-';
+        filePath += instrument.abbr;
+        break;
     }
 
-    // Combine full path and filename
-    return fullFolderPath + "/" + filename;
+    filePath += ".wav";
 }
 
 // --- calculateDurationFromLength Implementation ---
@@ -188,137 +199,645 @@ double NoteDecoder::calculateDurationFromLength(int length, double currentTempoB
 
 std::string NoteDecoder::getCanonicalNoteFilename(
     const std::string &baseNote, // e.g., "A", "C", "D"
-    char accidental,             // '+', '-', or ' ' (space/empty for natural)
+    char accidental,             // '#'/'+' (sharp), 'b'/'-' (flat), or ' ' for natural
     int octave                   // e.g., 4, 5
 ) const
 {
-    std::string canonicalNote = baseNote;
+    // The library names each pitch once, with flats: sharps become the
+    // flat above (C# -> Db), and B#/Cb cross into the next/previous octave
+    static const char *const NOTE_NAMES[] = {"C", "Db", "D", "Eb", "E", "F", "Gb", "G", "Ab", "A", "Bb", "B"};
+    if (baseNote.empty())
+    {
+        return std::to_string(octave);
+    }
+    int semitone = noteSemitone(baseNote[0], accidental, octave);
+    return std::string(NOTE_NAMES[semitone % 12]) + std::to_string(semitone / 12 - 1);
+}
+
+int NoteDecoder::getLoadedSampleRate() const
+{
+    // loadWavFile converts every sample to the engine rate
+    return m_engineSampleRate;
+}
+
+void NoteDecoder::setDeclickEnabled(bool enabled)
+{
+    m_declickEnabled = enabled;
+}
 
-    // 1. Handle accidentals
-    if (accidental == '+')
+void NoteDecoder::setSamplerMode(bool enabled, int rootSpacing)
+{
+    m_samplerMode = enabled;
+    m_rootSpacing = std::max(0, rootSpacing);
+    m_roots.clear();
+}
+
+bool NoteDecoder::playsFromRoots(const InstrumentInfo &instrument)
+{
+    return m_samplerMode && instrument.naming == NamingScheme::PitchedNote && !findRoots(instrument).empty();
+}
+
+// --- findRoots Implementation ---
+// Roots are the instrument's files named like its notes ("<note><octave>-
+// <abbr>.wav"), listed by the manifest if the library has one, otherwise
+// found in its folder
+const std::vector<NoteDecoder::RootSample> &NoteDecoder::findRoots(const InstrumentInfo &instrument)
+{
+    auto found = m_roots.find(instrument.abbr);
+    if (found != m_roots.end())
     {
-        // Map sharps to their enharmonic flat equivalents
-        // This map stores "sharp_note" -> "flat_equivalent"
-        static const std::map<std::string, std::string> sharpToFlatOrNaturalMap = {
-            {"C", "Db"}, {"D", "Eb"}, {"F", "Gb"}, {"G", "Ab"}, {"A", "Bb"},
-            {"E", "F"}, // E# is F natural
-            {"B", "C"}  // B# is C natural
-        };
+        return found->second;
+    }
 
-        auto it = sharpToFlatOrNaturalMap.find(baseNote);
-        if (it != sharpToFlatOrNaturalMap.end())
+    std::vector<std::string> fileNames;
+    if (!m_manifest.empty())
+    {
+        std::string prefix = std::string(instrument.folder) + "/";
+        for (const ManifestEntry &entry : m_manifest.entries())
         {
-            canonicalNote = it->second;
+            if (entry.path.compare(0, prefix.length(), prefix) == 0)
+            {
+                fileNames.push_back(entry.path.substr(prefix.length()));
+            }
         }
-        else
+    }
+    else
+    {
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(m_libraryBasePath + "/" + std::string(instrument.folder), ec))
         {
-            // Should not happen for valid musical notes if map is exhaustive
-            // Could throw an error here for invalid MML if desired
+            fileNames.push_back(entry.path().filename().string());
         }
     }
-    else if (accidental == '-')
+
+    // Parse "<A-G>[#b]<octave>-<abbr>.wav"
+    std::string suffix = "-" + std::string(instrument.abbr) + ".wav";
+    std::vector<RootSample> all;
+    for (const std::string &name : fileNames)
     {
-        // Map flats to their enharmonic natural equivalents
-        // if they are Cb or Fb.
-        static const std::map<std::string, std::string> flatToNaturalMap = {
-            {"C", "B"}, // Cb is B natural
-            {"F", "E"}  // Fb is E natural
-        };
+        if (name.length() <= suffix.length() || name.compare(name.length() - suffix.length(), suffix.length(), suffix) != 0 ||
+            name[0] < 'A' || name[0] > 'G')
+        {
+            continue;
+        }
+        size_t i = 1;
+        char accidental = ' ';
+        if (name[i] == 'b' || name[i] == '#')
+        {
+            accidental = name[i++];
+        }
+        size_t digits = name.find_first_not_of("0123456789", i);
+        if (digits == i || digits != name.length() - suffix.length())
+        {
+            continue;
+        }
+        all.push_back({noteSemitone(name[0], accidental, std::stoi(name.substr(i, digits - i))), name});
+    }
+    std::sort(all.begin(), all.end(), [](const RootSample &a, const RootSample &b)
+              { return a.semitone < b.semitone; });
 
-        auto it = flatToNaturalMap.find(baseNote);
-        if (it != flatToNaturalMap.end())
+    // Only every m_rootSpacing-th semitone from A, unless that leaves none
+    std::vector<RootSample> roots;
+    for (const RootSample &root : all)
+    {
+        if (m_rootSpacing <= 1 || ((root.semitone - 69) % m_rootSpacing + m_rootSpacing) % m_rootSpacing == 0)
         {
-            canonicalNote = it->second; // Use the natural equivalent
-            // No 'b' appended here because it becomes a natural note
+            roots.push_back(root);
         }
-        else
+    }
+    if (roots.empty())
+    {
+        roots = std::move(all);
+    }
+    std::cout << "NoteDecoder: " << instrument.abbr << " plays from " << roots.size() << " root sample"
+              << (roots.size() == 1 ? "" : "s") << std::endl;
+    return m_roots.emplace(instrument.abbr, std::move(roots)).first->second;
+}
+
+void NoteDecoder::loadManifest()
+{
+    if (m_manifest.load(m_libraryBasePath))
+    {
+        size_t toConvert = 0;
+        for (const ManifestEntry &entry : m_manifest.entries())
+        {
+            if (entry.sampleRate != m_engineSampleRate || entry.channels != 1)
+            {
+                toConvert++;
+            }
+        }
+        std::cout << "NoteDecoder: library manifest lists " << m_manifest.entries().size() << " samples";
+        if (toConvert > 0)
         {
-            // For other flats, simply append 'b'
-            canonicalNote += "b";
+            std::cout << " (" << toConvert << " not " << m_engineSampleRate << " Hz mono; converted when loaded)";
         }
+        std::cout << std::endl;
     }
-    // If accidental is ' ', it's a natural, so canonicalNote remains baseNote
+}
 
-    // 2. Append octave
-    // Check if the folder type uses octave (pitched instruments)
-    // For drums/noise, octave might be irrelevant but parsing expects it.
-    // We only append octave for pitched instrument folders.
-    // This logic would need to be in buildWaveformFilePath, or passed here.
-    // For simplicity, let's assume this function *always* appends the octave
-    // and the caller (buildWaveformFilePath) decides if it's used for the path.
-    return canonicalNote + std::to_string(octave);
+void NoteDecoder::setSampleType(SampleType type)
+{
+    if (type != m_sampleType)
+    {
+        m_sampleType = type;
+        m_samples.clear(); // Stored samples are in the old type
+    }
 }
 
+void NoteDecoder::reloadLibrary()
+{
+    m_samples.clear();
+    m_roots.clear();
+    m_manifest = LibraryManifest();
+    loadManifest();
+}
 
-std::string NoteDecoder::getFullFolderPath(const std::string &folderAbbr) const
+namespace
 {
-    if (folderAbbr == "imp")
-        return "impulsewave";
-    if (folderAbbr == "i05")
-        return "impulse-05-wave";
-    if (folderAbbr == "i25")
-        return "impulse-25-wave";
-    if (folderAbbr == "sqr")
-        return "squarewave";
-    if (folderAbbr == "tri")
-        return "trianglewave";
-    if (folderAbbr == "x")   // HOTFIX: all folder names are lowercase
-        return "casio-drums";
-    // For "noise", "miscellaneous", "sk-5", the abbreviation is the full name
-    return folderAbbr;
+    // Memory for one file path built per note. It lives on the stack of the
+    // call, so a song's paths do not pile up in its render arena note after
+    // note; a longer path than the buffer holds comes from the heap.
+    class PathScratch
+    {
+    public:
+        PathScratch() : m_resource(m_buffer, sizeof(m_buffer)) {}
+        std::pmr::memory_resource *resource() { return &m_resource; }
+
+    private:
+        std::byte m_buffer[512];
+        std::pmr::monotonic_buffer_resource m_resource;
+    };
 }
 
-int NoteDecoder::getLoadedSampleRate() const
+std::string NoteDecoder::getSampleRelativePath(
+    const InstrumentInfo &instrument,
+    const std::string &noteName,
+    char accidental,
+    int octave)
+{
+    PathScratch scratch;
+    std::pmr::string filePath(scratch.resource());
+    buildWaveformFilePath(instrument, noteName, accidental, 0, octave, filePath);
+    return std::string(std::string_view(filePath).substr(m_libraryBasePath.length() + 1));
+}
+
+const ManifestEntry *NoteDecoder::lookupSample(
+    const InstrumentInfo &instrument,
+    const std::string &noteName,
+    char accidental,
+    int octave)
 {
-    if (!m_sampleCache.empty())
+    if (m_manifest.empty())
     {
-        // Return the sample rate of the first item in the cache
-        // Assuming all your WAV files will have the same sample rate
-        return m_sampleCache.begin()->second.sampleRate;
+        return nullptr;
     }
-    // Return a common default sample rate if no samples have been loaded yet
-    return 44100; // Common sample rate for audio
+    PathScratch scratch;
+    std::pmr::string filePath(scratch.resource());
+    buildWaveformFilePath(instrument, noteName, accidental, 0, octave, filePath);
+    return m_manifest.find(std::string_view(filePath).substr(m_libraryBasePath.length() + 1));
 }
 
 
-// --- getNoteAudio Implementation ---
-std::vector<float> NoteDecoder::getNoteAudio(
-    const std::string &folderAbbr,
+namespace
+{
+    // Renders 'count' output samples from a contiguous run of source samples
+    // on which the envelope is a single linear piece, 'offset' samples into
+    // the piece:
+    //   out[i] (+)= src[i] * (level + k * slope) * (fade + k * fadeSlope) * channel gain
+    // with k = offset + i, so a piece rendered in parts gives the same
+    // samples as in one go. Kept branch-free so the compiler can vectorize
+    // it. An int16 source is converted on the fly; its 1 / 32768 scale is
+    // folded into the gains.
+    template <bool Accumulate, bool Stereo, typename Source>
+    void renderVoiceSpan(const Source *src, size_t count, size_t offset,
+                         float level, float slope, float fade, float fadeSlope,
+                         float gainLeft, float gainRight,
+                         float *outLeft, float *outRight)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            float k = static_cast<float>(offset + i);
+            float sample = static_cast<float>(src[i]) * (level + k * slope) * (fade + k * fadeSlope);
+            if (Accumulate)
+            {
+                outLeft[i] += sample * gainLeft;
+                if (Stereo)
+                    outRight[i] += sample * gainRight;
+            }
+            else
+            {
+                outLeft[i] = sample * gainLeft;
+                if (Stereo)
+                    outRight[i] = sample * gainRight;
+            }
+        }
+    }
+
+#ifdef __SSE2__
+    // Loads eight source samples as floats
+    inline void loadFloat8(const float *src, __m128 &low, __m128 &high)
+    {
+        low = _mm_loadu_ps(src);
+        high = _mm_loadu_ps(src + 4);
+    }
+
+    inline void loadFloat8(const int16_t *src, __m128 &low, __m128 &high)
+    {
+        __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16));
+        high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16));
+    }
+#endif
+
+    // The int16 engine's span: the same envelope, with 'gain' scaling the
+    // result to int16 range, mixed into 'out' with saturating adds. With
+    // SSE2 eight samples are done per step, packed (saturating) to int16
+    // and added with _mm_adds_epi16.
+    template <typename Source>
+    void renderVoiceSpanInt16(const Source *src, size_t count, size_t offset,
+                              float level, float slope, float fade, float fadeSlope,
+                              float gain, int16_t *out)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128 ramp = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        const __m128 four = _mm_set1_ps(4.0f);
+        const __m128 levelVector = _mm_set1_ps(level), slopeVector = _mm_set1_ps(slope);
+        const __m128 fadeVector = _mm_set1_ps(fade), fadeSlopeVector = _mm_set1_ps(fadeSlope);
+        const __m128 gainVector = _mm_set1_ps(gain);
+        const __m128 lowest = _mm_set1_ps(-32768.0f), highest = _mm_set1_ps(32767.0f);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128 k0 = _mm_add_ps(_mm_set1_ps(static_cast<float>(offset + i)), ramp);
+            __m128 k1 = _mm_add_ps(k0, four);
+            __m128 s0, s1;
+            loadFloat8(src + i, s0, s1);
+            s0 = _mm_mul_ps(_mm_mul_ps(s0, _mm_add_ps(levelVector, _mm_mul_ps(k0, slopeVector))),
+                            _mm_add_ps(fadeVector, _mm_mul_ps(k0, fadeSlopeVector)));
+            s1 = _mm_mul_ps(_mm_mul_ps(s1, _mm_add_ps(levelVector, _mm_mul_ps(k1, slopeVector))),
+                            _mm_add_ps(fadeVector, _mm_mul_ps(k1, fadeSlopeVector)));
+            // Clamp before converting: an out-of-range value converts to INT_MIN
+            s0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(s0, gainVector), lowest), highest);
+            s1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(s1, gainVector), lowest), highest);
+            __m128i voice = _mm_packs_epi32(_mm_cvtps_epi32(s0), _mm_cvtps_epi32(s1));
+            __m128i mixed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(out + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_adds_epi16(mixed, voice));
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            float k = static_cast<float>(offset + i);
+            float sample = static_cast<float>(src[i]) * (level + k * slope) * (fade + k * fadeSlope);
+            out[i] = addSaturating(out[i], saturateToInt16(sample * gain));
+        }
+    }
+
+    // Output samples a pitch-shifted or generated span is rendered in at a time
+    const size_t SPAN_CHUNK = 256;
+
+    // Walks a voice through its envelope: calls span(src, count, offset,
+    // level, slope, fade, fadeSlope, pos) for every run of source samples on
+    // which the envelope is one linear piece, 'pos' being the run's offset
+    // in the note. Only the part of each run inside the window [from, to)
+    // of the note is passed: 'src' starts 'offset' samples into the run. A
+    // pitch-shifted voice is resampled a chunk at a time, and 'src' is then
+    // the chunk (as floats, in the source's scale); a generated one is
+    // generated straight from the window's start ('data' is unused).
+    // Returns how many samples the voice sounds for.
+    template <typename Source, typename Span>
+    size_t forEachVoiceSpan(const Voice &voice, const Source *data, size_t from, size_t to, Span &&span)
+    {
+        const bool generated = voice.noise.type != NoiseType::None;
+        const size_t sampleSize = generated ? voice.numSamples : voice.sample->size();
+        const size_t numSamples = voice.numSamples;
+        const double rate = generated ? voice.noise.sampleRate : voice.sample->sampleRate;
+
+        // Looped voices play for the whole note; one-shots stop when their
+        // sample runs out and the rest of the note is silence
+        const size_t playedSamples = voice.kernel ? static_cast<size_t>(std::ceil(sampleSize / voice.pitchRatio))
+                                                  : sampleSize;
+        const size_t activeSamples = voice.loop ? numSamples : std::min(playedSamples, numSamples);
+        const bool truncated = voice.loop || playedSamples > numSamples;
+
+        const size_t attack = static_cast<size_t>(voice.envelope.attackSeconds * rate);
+        const size_t decay = static_cast<size_t>(voice.envelope.decaySeconds * rate);
+        const size_t release = truncated ? static_cast<size_t>(voice.envelope.releaseSeconds * rate) : 0;
+        const float sustain = voice.envelope.sustainLevel;
+        const size_t releaseStart = activeSamples > release ? activeSamples - release : 0;
+
+        // Envelope breakpoints; every span rendered lies between two of them
+        const size_t breakpoints[] = {attack, attack + decay, releaseStart, activeSamples};
+
+        // The runs are always cut at the same places, from the start of the
+        // note, and only the ones overlapping the window are rendered
+        const size_t end = std::min(to, activeSamples);
+        size_t pos = 0;
+        while (pos < end)
+        {
+            size_t nextBreak = activeSamples;
+            for (size_t bp : breakpoints)
+            {
+                if (bp > pos && bp < nextBreak)
+                    nextBreak = bp;
+            }
+
+            float level, slope;
+            if (pos < attack)
+            {
+                level = static_cast<float>(pos) / attack;
+                slope = 1.0f / attack;
+            }
+            else if (pos < attack + decay)
+            {
+                level = 1.0f - (1.0f - sustain) * static_cast<float>(pos - attack) / decay;
+                slope = -(1.0f - sustain) / decay;
+            }
+            else
+            {
+                level = sustain;
+                slope = 0.0f;
+            }
+
+            float fade = 1.0f, fadeSlope = 0.0f;
+            if (release > 0 && pos >= releaseStart)
+            {
+                fade = static_cast<float>(activeSamples - pos) / release;
+                fadeSlope = -1.0f / release;
+            }
+
+            size_t srcPos = voice.loop && !generated ? pos % sampleSize : pos;
+            size_t count = generated || voice.kernel ? std::min(nextBreak - pos, SPAN_CHUNK)
+                                                     : std::min(nextBreak - pos, sampleSize - srcPos);
+            if (pos + count > from)
+            {
+                size_t first = from > pos ? from - pos : 0;
+                size_t last = std::min(count, end - pos);
+                if (generated)
+                {
+                    float noise[SPAN_CHUNK];
+                    renderNoise(voice.noise, pos + first, last - first, noise);
+                    span(static_cast<const float *>(noise), last - first, first, level, slope, fade, fadeSlope,
+                         pos + first);
+                }
+                else if (voice.kernel)
+                {
+                    float pitched[SPAN_CHUNK];
+                    renderPitched(data, sampleSize, voice.loop, voice.pitchRatio, *voice.kernel, pos, count, pitched);
+                    span(static_cast<const float *>(pitched + first), last - first, first, level, slope, fade,
+                         fadeSlope, pos + first);
+                }
+                else
+                {
+                    span(data + srcPos + first, last - first, first, level, slope, fade, fadeSlope, pos + first);
+                }
+            }
+            pos += count;
+        }
+        return activeSamples;
+    }
+
+    // Renders samples [from, to) of the voice into 'outLeft' (and
+    // 'outRight'), which hold just that window
+    template <bool Accumulate, bool Stereo, typename Source>
+    void renderVoiceImpl(const Voice &voice, const Source *data, size_t from, size_t to,
+                         float gainLeft, float gainRight, float *outLeft, float *outRight)
+    {
+        size_t activeSamples = forEachVoiceSpan(voice, data, from, to,
+                                                [&](const auto *src, size_t count, size_t offset, float level,
+                                                    float slope, float fade, float fadeSlope, size_t pos)
+                                                { renderVoiceSpan<Accumulate, Stereo>(src, count, offset, level, slope,
+                                                                                      fade, fadeSlope, gainLeft, gainRight,
+                                                                                      outLeft + (pos - from),
+                                                                                      Stereo ? outRight + (pos - from) : nullptr); });
+
+        if (!Accumulate && activeSamples < to)
+        {
+            // Pad one-shots with silence to reach the note's duration
+            size_t silentFrom = std::max(activeSamples, from) - from;
+            std::fill(outLeft + silentFrom, outLeft + (to - from), 0.0f);
+            if (Stereo)
+                std::fill(outRight + silentFrom, outRight + (to - from), 0.0f);
+        }
+    }
+
+    // A voice with nothing to play: no sample (or an empty one) and no noise
+    bool isSilent(const Voice &voice)
+    {
+        bool hasSource = voice.noise.type != NoiseType::None || (voice.sample != nullptr && voice.sample->size() > 0);
+        return !hasSource || voice.numSamples == 0;
+    }
+
+    template <bool Accumulate, bool Stereo>
+    void renderVoiceFrom(const Voice &voice, size_t from, size_t to, float gainLeft, float gainRight,
+                         float *outLeft, float *outRight)
+    {
+        if (voice.sample == nullptr)
+        {
+            renderVoiceImpl<Accumulate, Stereo>(voice, static_cast<const float *>(nullptr), from, to,
+                                                gainLeft, gainRight, outLeft, outRight);
+        }
+        else if (voice.sample->type == SampleType::Int16)
+        {
+            const float scale = 1.0f / INT16_FULL_SCALE;
+            renderVoiceImpl<Accumulate, Stereo>(voice, voice.sample->samples16(), from, to,
+                                                gainLeft * scale, gainRight * scale, outLeft, outRight);
+        }
+        else
+        {
+            renderVoiceImpl<Accumulate, Stereo>(voice, voice.sample->samples(), from, to,
+                                                gainLeft, gainRight, outLeft, outRight);
+        }
+    }
+}
+
+// --- renderVoice Implementation ---
+void NoteDecoder::renderVoice(const Voice &voice, float gain, float *out, bool accumulate,
+                              float *outRight, float pan)
+{
+    if (isSilent(voice))
+    {
+        if (!accumulate)
+        {
+            std::fill(out, out + voice.numSamples, 0.0f);
+            if (outRight)
+                std::fill(outRight, outRight + voice.numSamples, 0.0f);
+        }
+        return;
+    }
+
+    const size_t to = voice.numSamples;
+    if (outRight)
+    {
+        // Equal-power pan law
+        const double angle = (std::max(-1.0f, std::min(1.0f, pan)) + 1.0) * M_PI / 4.0;
+        float gainLeft = gain * static_cast<float>(std::cos(angle));
+        float gainRight = gain * static_cast<float>(std::sin(angle));
+        if (accumulate)
+            renderVoiceFrom<true, true>(voice, 0, to, gainLeft, gainRight, out, outRight);
+        else
+            renderVoiceFrom<false, true>(voice, 0, to, gainLeft, gainRight, out, outRight);
+    }
+    else if (accumulate)
+    {
+        renderVoiceFrom<true, false>(voice, 0, to, gain, gain, out, nullptr);
+    }
+    else
+    {
+        renderVoiceFrom<false, false>(voice, 0, to, gain, gain, out, nullptr);
+    }
+}
+
+// --- renderVoiceRange Implementation ---
+void NoteDecoder::renderVoiceRange(const Voice &voice, float gain, size_t from, size_t to, float *out)
+{
+    to = std::min(to, voice.numSamples);
+    if (isSilent(voice) || from >= to)
+    {
+        return; // Nothing to add
+    }
+    renderVoiceFrom<true, false>(voice, from, to, gain, gain, out, nullptr);
+}
+
+// --- renderVoiceRange (int16) Implementation ---
+void NoteDecoder::renderVoiceRange(const Voice &voice, float gain, size_t from, size_t to, int16_t *out)
+{
+    to = std::min(to, voice.numSamples);
+    if (isSilent(voice) || from >= to)
+    {
+        return; // Nothing to add
+    }
+
+    // One-shots pad with silence, which mixes as nothing
+    if (voice.sample != nullptr && voice.sample->type == SampleType::Int16)
+    {
+        forEachVoiceSpan(voice, voice.sample->samples16(), from, to,
+                         [&](const auto *src, size_t count, size_t offset, float level, float slope,
+                             float fade, float fadeSlope, size_t pos)
+                         { renderVoiceSpanInt16(src, count, offset, level, slope, fade, fadeSlope, gain,
+                                                out + (pos - from)); });
+    }
+    else
+    {
+        const float scaledGain = gain * INT16_FULL_SCALE;
+        const float *samples = voice.sample != nullptr ? voice.sample->samples() : nullptr; // Generated if null
+        forEachVoiceSpan(voice, samples, from, to,
+                         [&](const float *src, size_t count, size_t offset, float level, float slope,
+                             float fade, float fadeSlope, size_t pos)
+                         { renderVoiceSpanInt16(src, count, offset, level, slope, fade, fadeSlope, scaledGain,
+                                                out + (pos - from)); });
+    }
+}
+
+// --- renderVoice (int16) Implementation ---
+void NoteDecoder::renderVoice(const Voice &voice, float gain, int16_t *out)
+{
+    renderVoiceRange(voice, gain, 0, voice.numSamples, out);
+}
+
+// --- prepareVoice Implementation ---
+bool NoteDecoder::prepareVoice(
+    const InstrumentInfo &instrument,
     const std::string &noteName,
     char accidental,
     int length,
     int octave,
+    double cents,
     double explicitDurationSeconds,
-    double currentTempoBPM)
+    double currentTempoBPM,
+    Voice &voice)
 {
-    // 1. Build the full WAV file path
-    std::string filePath = buildWaveformFilePath(
-        folderAbbr, noteName, accidental, length, octave);
+    TRACE_SCOPE("prepareVoice", "note");
+    // 1. Build the full WAV file path (in scratch memory; it is only a key)
+    PathScratch scratch;
+    std::pmr::string filePath(scratch.resource());
+    buildWaveformFilePath(instrument, noteName, accidental, length, octave, filePath);
+
+    // A pitched note plays its own sample detuned by 'cents', or in sampler
+    // mode the root nearest its pitch (the higher one on a tie)
+    const bool pitched = instrument.naming == NamingScheme::PitchedNote && !noteName.empty();
+    double notePitch = 0.0, samplePitch = 0.0;
+    if (pitched)
+    {
+        samplePitch = noteSemitone(noteName[0], accidental, octave);
+        notePitch = samplePitch + cents / 100.0;
+    }
+    if (pitched && m_samplerMode)
+    {
+        const std::vector<RootSample> &roots = findRoots(instrument);
+        const RootSample *nearest = nullptr;
+        for (const RootSample &root : roots)
+        {
+            if (nearest == nullptr || std::fabs(root.semitone - notePitch) <= std::fabs(nearest->semitone - notePitch))
+            {
+                nearest = &root;
+            }
+        }
+        if (nearest != nullptr)
+        {
+            filePath.clear();
+            filePath += m_libraryBasePath;
+            filePath += '/';
+            filePath += instrument.folder;
+            filePath += '/';
+            filePath += nearest->fileName;
+            samplePitch = nearest->semitone;
+        }
+    }
 
-    // 2. Check cache for the sample
-    SampleInfo loadedSample;
-    auto cache_it = m_sampleCache.find(filePath);
-    if (cache_it != m_sampleCache.end())
+    // 2. A generated instrument has no sample: the note name picks its
+    //    noise, seeded with the decoder's seed
+    const SampleInfo *loadedSample = nullptr;
+    if (instrument.naming == NamingScheme::Generated)
     {
-        loadedSample = cache_it->second;
-        std::cout << "Using cached WAV: " << filePath << std::endl; // For debugging
+        if (!parseNoiseName(noteName, m_engineSampleRate, voice.noise))
+        {
+            std::cerr << "Error: Unknown noise '" << noteName
+                      << "' (expected white, pink, noise[0-15] or metal[0-15])." << std::endl;
+            return false;
+        }
+        voice.noise.seed = m_noiseSeed;
     }
     else
     {
-        // Not in cache, load the file
-        try
+        // Otherwise check the store for the sample. The voice points into
+        // it, so the sample data is never copied per note.
+        std::shared_ptr<const SampleInfo> stored = m_samples.acquire(std::string_view(filePath));
+        if (stored)
         {
-            loadedSample = loadWavFile(filePath);
-            m_sampleCache[filePath] = loadedSample; // Store in cache for future use
+            std::cout << "Using cached WAV: " << filePath << std::endl; // For debugging
         }
-        catch (const std::runtime_error &e)
+        else
         {
-            std::cerr << "Error loading waveform for MML command ("
-                      << folderAbbr << ":" << noteName << accidental << length << "o" << octave << "): "
-                      << e.what() << std::endl;
-            // Return an empty vector to indicate failure, or throw the exception up.
-            // Returning empty allows the MML sequence to continue playing other notes.
-            return {};
+            // A library with a manifest lists every sample it has, so a missing
+            // one is reported without trying to open it
+            if (!m_manifest.empty() &&
+                m_manifest.find(std::string_view(filePath).substr(m_libraryBasePath.length() + 1)) == nullptr)
+            {
+                std::cerr << "Error loading waveform for MML command ("
+                          << instrument.abbr << ":" << noteName << accidental << length << "o" << octave << "): "
+                          << filePath << " is not in the library manifest" << std::endl;
+                return false;
+            }
+
+            // Not in cache, load the file
+            try
+            {
+                std::string cacheKey(filePath);
+                stored = m_samples.add(cacheKey, loadWavFile(cacheKey)); // Store for future use
+            }
+            catch (const std::runtime_error &e)
+            {
+                std::cerr << "Error loading waveform for MML command ("
+                          << instrument.abbr << ":" << noteName << accidental << length << "o" << octave << "): "
+                          << e.what() << std::endl;
+                // Returning no voice allows the MML sequence to continue playing other notes.
+                return false;
+            }
+        }
+        loadedSample = stored.get();
+        if (m_pinned.insert(loadedSample).second)
+        {
+            m_pins.push_back(std::move(stored));
         }
     }
 
@@ -339,9 +858,9 @@ std::vector<float> NoteDecoder::getNoteAudio(
         catch (const std::invalid_argument &e)
         {
             std::cerr << "Error calculating duration for MML command ("
-                      << folderAbbr << ":" << noteName << accidental << length << "o" << octave << "): "
+                      << instrument.abbr << ":" << noteName << accidental << length << "o" << octave << "): "
                       << e.what() << std::endl;
-            return {}; // Return empty on error
+            return false;
         }
     }
     else
@@ -349,7 +868,8 @@ std::vector<float> NoteDecoder::getNoteAudio(
         // Fallback: If neither explicit duration nor length is provided,
         // use the original sample's natural duration. This is especially
         // useful for percussive sounds like drums and one-shot noises.
-        targetDurationSeconds = loadedSample.durationSeconds;
+        targetDurationSeconds = loadedSample != nullptr ? loadedSample->durationSeconds / pitchRatio(samplePitch, notePitch)
+                                                        : NOISE_NATURAL_SECONDS;
         std::cout << "Using natural sample duration: " << targetDurationSeconds << "s" << std::endl; // For debugging
     }
 
@@ -357,83 +877,90 @@ std::vector<float> NoteDecoder::getNoteAudio(
     if (targetDurationSeconds <= 0)
     {
         std::cerr << "Warning: Calculated/explicit duration for MML command ("
-                  << folderAbbr << ":" << noteName << accidental << length << "o" << octave << ") was non-positive ("
+                  << instrument.abbr << ":" << noteName << accidental << length << "o" << octave << ") was non-positive ("
                   << targetDurationSeconds << "s). Returning empty audio." << std::endl;
-        return {}; // Return empty audio if duration is invalid
+        return false;
     }
 
-    // Handle looping vs. padding with silence based on instrument type
-    std::vector<float> finalAudioData;
-    size_t numSamplesToGenerate = static_cast<size_t>(targetDurationSeconds * loadedSample.sampleRate);
+    // Looping and envelope come from the instrument's render policy
+    dispatchRenderPolicy(instrument.policy, [&voice](auto traits)
+                         {
+                             using Traits = decltype(traits);
+                             voice.loop = Traits::loops; // Pitched instruments loop their waveform
+                             voice.envelope = Traits::envelope; });
+    if (!m_declickEnabled)
+    {
+        voice.envelope = VoiceEnvelope{0.0, 0.0, 1.0f, 0.0};
+    }
 
-    // Convert folderAbbr to lowercase for comparison, assuming it's already
-    // lowercased, but just for safety.
-    std::string lowerFolderAbbr = folderAbbr;
-    std::transform(lowerFolderAbbr.begin(), lowerFolderAbbr.end(), lowerFolderAbbr.begin(),
-                   [](unsigned char c)
-                   { return std::tolower(c); });
+    voice.sample = loadedSample;
+    voice.pitchRatio = pitchRatio(samplePitch, notePitch);
+    voice.kernel = voice.pitchRatio != 1.0 ? sincKernelFor(voice.pitchRatio) : nullptr;
+    const int rate = loadedSample != nullptr ? loadedSample->sampleRate : m_engineSampleRate;
+    voice.numSamples = durationToSamples(targetDurationSeconds, rate);
+    return voice.numSamples > 0;
+}
 
-    // Define which folders should NOT loop, but rather pad with silence
-    bool isOneShotInstrument = (lowerFolderAbbr == "x" || lowerFolderAbbr == "noise" ||
-                                lowerFolderAbbr == "miscellaneous" || lowerFolderAbbr == "sk-5");
+// --- takePins Implementation ---
+std::vector<std::shared_ptr<const SampleInfo>> NoteDecoder::takePins()
+{
+    std::vector<std::shared_ptr<const SampleInfo>> pins;
+    pins.swap(m_pins);
+    m_pinned.clear();
+    return pins;
+}
 
-    if (isOneShotInstrument)
+// --- getNoteAudio Implementation ---
+std::vector<float> NoteDecoder::getNoteAudio(
+    const std::string &folderAbbr,
+    const std::string &noteName,
+    char accidental,
+    int length,
+    int octave,
+    double explicitDurationSeconds,
+    double currentTempoBPM,
+    float gain)
+{
+    TRACE_SCOPE("getNoteAudio", "note");
+    const InstrumentInfo *instrument = findInstrument(folderAbbr);
+    if (instrument == nullptr)
     {
-        // For one-shot instruments (drums, effects):
-        // Play the sample once, then pad with silence if desired_duration > sample_length
-        finalAudioData.insert(finalAudioData.end(), loadedSample.data.begin(), loadedSample.data.end());
-
-        if (finalAudioData.size() < numSamplesToGenerate)
-        {
-            // Pad with silence to reach the desired duration
-            finalAudioData.resize(numSamplesToGenerate, 0.0f);
-        }
-        else if (finalAudioData.size() > numSamplesToGenerate)
-        {
-            // Truncate if the sample is longer than desired (less common for drums)
-            finalAudioData.resize(numSamplesToGenerate);
-        }
+        std::cerr << "Error: Unknown instrument folder '" << folderAbbr << "'." << std::endl;
+        return {};
     }
-    else // For pitched instruments (impulsewave, squarewave, trianglewave)
+
+    Voice voice;
+    if (!prepareVoice(*instrument, noteName, accidental, length, octave, 0.0,
+                      explicitDurationSeconds, currentTempoBPM, voice))
     {
-        // Here, it's generally okay to loop the sample if desired_duration is longer.
-        // So, you can use your existing generate_audio function for these.
-        finalAudioData = generate_audio(loadedSample.data, loadedSample.sampleRate, targetDurationSeconds);
+        return {};
     }
 
+    std::vector<float> finalAudioData(voice.numSamples);
+    renderVoice(voice, gain, finalAudioData.data(), false);
     return finalAudioData;
 }
 
-// --- loadWavFile Implementation ---
-SampleInfo NoteDecoder::loadWavFile(const std::string &filePath)
+#ifndef MML_NO_SNDFILE
+// Reads a sample through libsndfile, for files the built-in reader rejects
+// (compressed WAV encodings). Returns false if libsndfile cannot read it
+// either.
+static bool loadWithSndfile(const std::string &filePath, SampleInfo &info, size_t &frames)
 {
-    SampleInfo info;
     SF_INFO sfinfo;
-    SNDFILE *infile = nullptr;
-
-    // Set file path in info struct for caching key
-    info.filePath = filePath;
-
-    // Open the input WAV file
-    infile = sf_open(filePath.c_str(), SFM_READ, &sfinfo);
+    SNDFILE *infile = sf_open(filePath.c_str(), SFM_READ, &sfinfo);
     if (!infile)
     {
-        throw std::runtime_error("Error opening WAV file: " + filePath + " - " + sf_strerror(nullptr));
+        return false;
     }
-
-    // Check if the file is in a supported format (e.g., float, PCM)
-    // For now, we assume all your files are fine for sf_read_float.
-    // If sf_read_float fails, it usually means the file format isn't compatible.
     if (!sf_format_check(&sfinfo))
     {
         sf_close(infile);
-        throw std::runtime_error("WAV file format not supported by libsndfile: " + filePath);
+        return false;
     }
 
-    // Allocate buffer to hold audio data
+    // Allocate buffer to hold audio data and read all frames into it
     info.data.resize(sfinfo.frames * sfinfo.channels);
-
-    // Read all frames from the WAV file into the buffer
     sf_count_t frames_read = sf_read_float(infile, info.data.data(), info.data.size());
     if (frames_read != sfinfo.frames)
     {
@@ -441,26 +968,102 @@ SampleInfo NoteDecoder::loadWavFile(const std::string &filePath)
         std::cerr << "Warning: Could not read all frames from " << filePath << ". Expected "
                   << sfinfo.frames << ", read " << frames_read << std::endl;
     }
-
-    // Store sample rate and channels
     info.sampleRate = sfinfo.samplerate;
     info.channels = sfinfo.channels;
+    frames = static_cast<size_t>(sfinfo.frames);
+    sf_close(infile);
+    return true;
+}
+#endif
+
+// --- loadWavFile Implementation ---
+SampleInfo NoteDecoder::loadWavFile(const std::string &filePath)
+{
+    TRACE_SCOPE_DETAIL("loadWavFile", "io", filePath);
+    SampleInfo info;
+    size_t frames = 0;
+
+    // Set file path in info struct for caching key
+    info.filePath = filePath;
+
+    // Map the file and parse its headers; nothing is decoded yet
+    auto file = std::make_shared<WavFile>();
+    std::string error;
+    if (file->open(filePath, error))
+    {
+        info.sampleRate = file->sampleRate();
+        info.channels = file->channels();
+        frames = file->frames();
+        bool inPlace = m_sampleType == SampleType::Int16 ? file->int16Data() != nullptr : file->floatData() != nullptr;
+        if (inPlace && info.channels == 1 && info.sampleRate == m_engineSampleRate)
+        {
+            // Already in the engine's format: render straight from the mapping
+            info.type = m_sampleType;
+            info.mappedFile = file;
+        }
+        else
+        {
+            file->readFloat(info.data);
+        }
+    }
+#ifndef MML_NO_SNDFILE
+    else if (!loadWithSndfile(filePath, info, frames))
+#else
+    else
+#endif
+    {
+        throw std::runtime_error("Error opening WAV file: " + filePath + " - " + error);
+    }
 
     // Calculate the original duration of the sample
-    if (sfinfo.samplerate > 0 && sfinfo.channels > 0)
+    if (info.sampleRate > 0 && info.channels > 0)
     {
-        info.durationSeconds = static_cast<double>(info.data.size()) / (sfinfo.samplerate * sfinfo.channels);
+        info.durationSeconds = static_cast<double>(info.size()) / (info.sampleRate * info.channels);
     }
     else
     {
         info.durationSeconds = 0.0; // Should not happen with valid WAV files
     }
 
-    // Close the input file
-    sf_close(infile);
+    // Check the file's format against its manifest entry (before any
+    // conversion). The content hash is only checked by 'mml_libtool
+    // manifest': hashing every sample here would cost a pass over the file
+    // (and a float copy of a mapped int16 one) on every load.
+    if (filePath.compare(0, m_libraryBasePath.length(), m_libraryBasePath) == 0)
+    {
+        const ManifestEntry *entry = m_manifest.find(std::string_view(filePath).substr(m_libraryBasePath.length() + 1));
+        if (entry != nullptr && (entry->frames != frames || entry->sampleRate != info.sampleRate))
+        {
+            std::cerr << "Warning: " << filePath << " has changed since the library manifest was written. "
+                      << "Rebuild it with 'mml_libtool manifest'." << std::endl;
+        }
+    }
+
+    // Convert to the engine's format: mono at the engine's sample rate.
+    // This happens once per sample; the cache keeps the converted data.
+    if (info.channels > 1)
+    {
+        info.data = downmixToMono(info.data, info.channels);
+        info.channels = 1;
+    }
+    if (info.sampleRate > 0 && info.sampleRate != m_engineSampleRate)
+    {
+        std::cout << "Resampling " << filePath << " from " << info.sampleRate
+                  << " Hz to " << m_engineSampleRate << " Hz" << std::endl;
+        info.data = resampleAudio(info.data, info.sampleRate, m_engineSampleRate);
+        info.sampleRate = m_engineSampleRate;
+    }
+    if (m_sampleType == SampleType::Int16 && !info.mappedFile)
+    {
+        info.data16.resize(info.data.size());
+        convertToInt16(info.data.data(), info.data.size(), info.data16.data());
+        info.data = std::vector<float>(); // Release the float copy
+        info.type = SampleType::Int16;
+    }
 
     std::cout << "Successfully loaded WAV: " << filePath
-              << " (Rate: " << info.sampleRate
+              << (info.mappedFile ? " (mapped" : " (decoded")
+              << (info.type == SampleType::Int16 ? ", int16" : "") << ", Rate: " << info.sampleRate
               << ", Ch: " << info.channels
               << ", Dur: " << info.durationSeconds << "s)" << std::endl;
 
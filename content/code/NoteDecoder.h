@@ -6,21 +6,82 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <sndfile.h> // For SF_INFO and related types
+#include <memory> // For std::shared_ptr
+#include <string_view>
+#include <unordered_set>
+#include <memory_resource> // For std::pmr::string scratch paths
+#include "InstrumentRegistry.h"
+#include "LibraryManifest.h"
+#include "NoiseGenerator.h"
+#include "PitchShift.h"
+#include "SampleStore.h"
+#include "SampleType.h"
+#include "WavReader.h"
 
 // Structure to hold information about a loaded waveform sample
 struct SampleInfo
 {
     std::string filePath; // Store the file path for cache key
-    std::vector<float> data;
+    SampleType type;         // How the samples are stored (the engine's sample type)
+    std::vector<float> data; // Decoded float samples (empty while mappedFile is set)
+    std::vector<int16_t> data16; // Decoded int16 samples, for an int16 engine
+    std::shared_ptr<const WavFile> mappedFile; // Samples read in place from the file's mapping
     int sampleRate;
     int channels;
     double durationSeconds; // Pre-calculated duration of the original sample
 
     // Default constructor to ensure members are initialized
-    SampleInfo() : sampleRate(0), channels(0), durationSeconds(0.0) {}
+    SampleInfo() : type(SampleType::Float32), sampleRate(0), channels(0), durationSeconds(0.0) {}
+
+    // The samples, wherever they live: samples() if they are floats,
+    // samples16() if they are int16 (the other one is nullptr)
+    const float *samples() const
+    {
+        return type != SampleType::Float32 ? nullptr : mappedFile ? mappedFile->floatData() : data.data();
+    }
+    const int16_t *samples16() const
+    {
+        return type != SampleType::Int16 ? nullptr : mappedFile ? mappedFile->int16Data() : data16.data();
+    }
+    size_t size() const
+    {
+        return mappedFile ? mappedFile->numSamples() : type == SampleType::Int16 ? data16.size() : data.size();
+    }
+};
+
+// A single note resolved to its sample and length, ready to render
+struct Voice
+{
+    const SampleInfo *sample; // Points into the decoder's sample store (kept alive by its pins); nullptr if generated
+    bool loop;                // Pitched instruments loop; one-shots pad with silence
+    size_t numSamples;        // Total length of the note, including any padding
+    VoiceEnvelope envelope;
+    double pitchRatio;        // Source samples read per output sample (1 = as recorded)
+    const SincKernel *kernel; // Interpolation kernel when pitchRatio is not 1, else nullptr
+    NoiseSource noise;        // Generated voices: the noise played instead of a sample
+
+    Voice() : sample(nullptr), loop(false), numSamples(0), envelope{0.0, 0.0, 1.0f, 0.0},
+              pitchRatio(1.0), kernel(nullptr), noise() {}
 };
 
+// Longest a note, chord or rest can be, in samples: 2^48, about 200 years
+// at 44.1 kHz. Longer durations are cut to it, so a length always fits
+// size_t with room left to add lengths up.
+const size_t MAX_EVENT_SAMPLES = size_t(1) << 48;
+
+// Converts a duration to samples at 'rate', capped at MAX_EVENT_SAMPLES.
+// The product is compared in double before the cast, so a huge or infinite
+// duration is cut rather than overflowing; a negative or NaN one is 0.
+inline size_t durationToSamples(double seconds, double rate)
+{
+    double samples = seconds * rate;
+    if (!(samples > 0.0))
+    {
+        return 0;
+    }
+    return samples < static_cast<double>(MAX_EVENT_SAMPLES) ? static_cast<size_t>(samples) : MAX_EVENT_SAMPLES;
+}
+
 // Forward declaration of the generate_audio function (from previous discussions)
 // This function takes raw sample data, its sample rate, and a desired duration,
 // and returns the looped/cut audio data.
@@ -29,11 +90,85 @@ std::vector<float> generate_audio(const std::vector<float> &sample_data, double
 class NoteDecoder
 {
 public:
-    // Constructor: Takes the base path to your waveform library
-    NoteDecoder(const std::string &libraryBasePath);
+    // Constructor: Takes the base path to your waveform library and the
+    // rate the engine renders at. Every sample is converted to mono at that
+    // rate when it is loaded. If a bank decimated ahead of time for that
+    // rate exists next to the library ("<library>-<rate>", e.g.
+    // "waveforms-22050"), it is used instead, so loading costs no resampling.
+    NoteDecoder(const std::string &libraryBasePath, int engineSampleRate = 44100);
 
+    // Rate of every cached sample (and so of every rendered voice)
     int getLoadedSampleRate() const;
 
+    // Enables the per-voice attack/release ramps (on by default). Draft
+    // renders switch them off to save the work.
+    void setDeclickEnabled(bool enabled);
+
+    // Sampler mode (off by default): pitched instruments (PitchedNote
+    // naming) play every note from the nearest root sample in their folder,
+    // shifted by band-limited fractional-rate playback, so an instrument
+    // needs only a few recorded notes and any pitch can be played (outside
+    // the recorded octaves too). With 'rootSpacing' > 0 only the notes that
+    // many semitones apart, counted from A, are used as roots (12 = the A of
+    // each octave), which shrinks a full library's resident samples the
+    // same way. Changing it drops every stored sample.
+    void setSamplerMode(bool enabled, int rootSpacing = 0);
+
+    // True if notes of 'instrument' are played from root samples, and it
+    // has at least one (its per-note files need not exist)
+    bool playsFromRoots(const InstrumentInfo &instrument);
+
+    // Seed of generated noise (0 by default). The same seed renders the
+    // same noise; voices start with it as is (see noiseSeedFor).
+    void setNoiseSeed(uint64_t seed) { m_noiseSeed = seed; }
+
+    // Type samples are stored in from now on (Float32 by default). Int16
+    // halves the decoded samples, and 16-bit files are then used in place.
+    // Changing it drops every stored sample, like reloadLibrary().
+    void setSampleType(SampleType type);
+    SampleType getSampleType() const { return m_sampleType; }
+
+    // Directory samples are loaded from (the library, or its bank for the
+    // engine rate)
+    const std::string &getLibraryPath() const { return m_libraryBasePath; }
+
+    // Drops every stored sample and re-reads the library manifest, so the
+    // next prepareVoice() loads the files as they are on disk now. Voices
+    // prepared earlier still render the old samples as long as their pins
+    // are held.
+    void reloadLibrary();
+
+    // Every loaded sample, deduplicated and packed (see SampleStore)
+    const SampleStore &getSampleStore() const { return m_samples; }
+
+    // Bytes of decoded samples kept beyond the ones songs hold
+    void setSampleCacheBudget(size_t bytes) { m_samples.setHotBudget(bytes); }
+
+    // Hands over the samples prepareVoice() pointed voices at since the
+    // last call. Whoever renders those voices keeps them for as long as it
+    // does; the store may drop its own decoded copy at any time.
+    std::vector<std::shared_ptr<const SampleInfo>> takePins();
+
+    // The library's manifest, loaded at construction if the library has one
+    bool hasManifest() const { return !m_manifest.empty(); }
+
+    // Looks a note's sample up in the manifest without opening any file:
+    // its rate, frame count (and so duration), level and hash. Returns
+    // nullptr if there is no manifest or the sample is not in it.
+    const ManifestEntry *lookupSample(
+        const InstrumentInfo &instrument,
+        const std::string &noteName,
+        char accidental,
+        int octave);
+
+    // Path of a note's sample relative to the library root (as listed in
+    // the manifest)
+    std::string getSampleRelativePath(
+        const InstrumentInfo &instrument,
+        const std::string &noteName,
+        char accidental,
+        int octave);
+
     // Main function to get audio data for a single MML note command
     // Parameters would come from your MML parser
     // For now, let's pass them explicitly for testing
@@ -45,33 +180,97 @@ public:
         int length,                     // e.g., 4 (quarter), 8 (eighth). 0 if not specified.
         int octave,                     // e.g., 4 (octave 4). 0 if not specified (for drums/noise)
         double explicitDurationSeconds, // The 'Xs' duration from MML. Use 0 if not specified.
-        double currentTempoBPM          // The current tempo for calculating duration from 'length'
+        double currentTempoBPM,         // The current tempo for calculating duration from 'length'
+        float gain = 1.0f               // Linear gain applied while rendering (e.g., track VOLUME)
     );
 
+    // Resolves a note to its cached sample, length and envelope without
+    // rendering it. The instrument comes from the registry (resolved once,
+    // when the MML is compiled). 'cents' detunes a pitched note (played from
+    // its own sample, or from a root in sampler mode). Returns false (after
+    // reporting why) if the note has no playable audio.
+    bool prepareVoice(
+        const InstrumentInfo &instrument,
+        const std::string &noteName,
+        char accidental,
+        int length,
+        int octave,
+        double cents,
+        double explicitDurationSeconds,
+        double currentTempoBPM,
+        Voice &voice);
+
+    // Fused voice stage: reads the voice's sample (looping or padding as
+    // needed) and applies gain and envelope in a single pass over 'out',
+    // which must hold voice.numSamples floats. With 'accumulate' the voice
+    // is mixed into 'out' instead of overwriting it. If 'outRight' is given
+    // the voice is rendered to two channels with an equal-power 'pan'
+    // (-1 = left, 0 = center, +1 = right).
+    static void renderVoice(const Voice &voice, float gain, float *out, bool accumulate,
+                            float *outRight = nullptr, float pan = 0.0f);
+
+    // The voice stage of an int16 mix: renders the voice as above (mono)
+    // and adds it to 'out' with saturating arithmetic.
+    static void renderVoice(const Voice &voice, float gain, int16_t *out);
+
+    // Mixes samples [from, to) of the voice (mono) into 'out', which holds
+    // just that window: the same samples a whole render would put there,
+    // without rendering the rest of the note. Generated and pitch-shifted
+    // voices produce only the window's samples. The int16 form adds with
+    // saturating arithmetic.
+    static void renderVoiceRange(const Voice &voice, float gain, size_t from, size_t to, float *out);
+    static void renderVoiceRange(const Voice &voice, float gain, size_t from, size_t to, int16_t *out);
+
 private:
     std::string m_libraryBasePath;
-    // Cache for loaded waveform samples.
-    // Key could be the full WAV file path or a standardized ID.
-    std::map<std::string, SampleInfo> m_sampleCache;
+    int m_engineSampleRate;
+    bool m_declickEnabled;
+    SampleType m_sampleType;
+    // Loaded waveform samples, keyed by the full WAV file path
+    SampleStore m_samples;
+    // Samples voices were pointed at since the last takePins()
+    std::vector<std::shared_ptr<const SampleInfo>> m_pins;
+    std::unordered_set<const SampleInfo *> m_pinned;
+    LibraryManifest m_manifest;
 
-    // Helper functions:
+    // Sampler mode: each pitched instrument's root samples, found the
+    // first time it plays, sorted by pitch
+    struct RootSample
+    {
+        int semitone;         // MIDI numbering (A4 = 69)
+        std::string fileName; // In the instrument's folder
+    };
+    bool m_samplerMode;
+    int m_rootSpacing;
+    std::map<std::string_view, std::vector<RootSample>> m_roots; // By instrument abbreviation
+    uint64_t m_noiseSeed;
 
-    // Maps MML folder abbreviations to full directory names
-    std::string getFullFolderPath(const std::string &folderAbbr) const;
+    // The instrument's roots (empty if it has none)
+    const std::vector<RootSample> &findRoots(const InstrumentInfo &instrument);
 
-    // Constructs the full WAV file path from MML parameters
-    std::string buildWaveformFilePath(
-        const std::string &folderAbbr,
+    // Helper functions:
+
+    // Constructs the full WAV file path from MML parameters, appending it
+    // to 'filePath' (no stringstream or temporary strings)
+    void buildWaveformFilePath(
+        const InstrumentInfo &instrument,
         const std::string &noteName,
         char accidental,
         int length,
-        int octave) const;
+        int octave,
+        std::pmr::string &filePath) const;
+
+    // Loads the library's manifest (if it has one) and reports what it lists
+    void loadManifest();
 
-    // Loads a .wav file and stores it in the cache
+    // Loads a .wav file for the sample store. The built-in reader
+    // maps the file; mono samples already in the engine's rate and sample
+    // type are used in place, anything else is converted once. Unless built with
+    // MML_NO_SNDFILE, files it cannot read go through libsndfile.
     SampleInfo loadWavFile(const std::string &filePath);
 
     // Translates MML note name, accidental, and octave into a canonical
-    // filename part (e.g., "A4", "C#5", "Bb3")
+    // filename part (e.g., "A4", "Db5", "Bb3")
     std::string getCanonicalNoteFilename(
         const std::string &noteName,
         char accidental, int octave) const;
@@ -0,0 +1,213 @@
+#include "PitchShift.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Builds the phase table of a kernel keeping 'cutoff' of the source band
+    std::unique_ptr<SincKernel> buildKernel(double cutoff)
+    {
+        auto kernel = std::make_unique<SincKernel>();
+        double halfWidth = PITCH_ZERO_CROSSINGS / cutoff; // In source samples
+        int taps = (static_cast<int>(std::ceil(2.0 * halfWidth)) + 3) & ~3;
+        if (taps > PITCH_MAX_TAPS)
+        {
+            // Too wide to follow the ratio: keep the widest kernel's cutoff
+            taps = PITCH_MAX_TAPS;
+            cutoff = 2.0 * PITCH_ZERO_CROSSINGS / (PITCH_MAX_TAPS - 4);
+            halfWidth = PITCH_ZERO_CROSSINGS / cutoff;
+        }
+        kernel->cutoff = cutoff;
+        kernel->taps = taps;
+        kernel->coeffs.resize(static_cast<size_t>(PITCH_KERNEL_PHASES + 1) * taps);
+
+        // Tap j reads source sample floor(x) - (taps / 2 - 1) + j
+        for (int phase = 0; phase <= PITCH_KERNEL_PHASES; ++phase)
+        {
+            double frac = static_cast<double>(phase) / PITCH_KERNEL_PHASES;
+            float *row = kernel->coeffs.data() + static_cast<size_t>(phase) * taps;
+            double sum = 0.0;
+            for (int j = 0; j < taps; ++j)
+            {
+                double t = (j - (taps / 2 - 1)) - frac; // Distance from the position, in source samples
+                double c = 0.0;
+                if (std::fabs(t) < halfWidth)
+                {
+                    double x = t * cutoff; // In kernel zero crossings
+                    double sinc = (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+                    double w = 0.42 + 0.5 * std::cos(M_PI * x / PITCH_ZERO_CROSSINGS) +
+                               0.08 * std::cos(2.0 * M_PI * x / PITCH_ZERO_CROSSINGS);
+                    c = sinc * w;
+                }
+                row[j] = static_cast<float>(c);
+                sum += c;
+            }
+            // Unity gain at every phase, so a held note does not flutter
+            for (int j = 0; j < taps; ++j)
+            {
+                row[j] = static_cast<float>(row[j] / sum);
+            }
+        }
+        return kernel;
+    }
+
+    // One output sample: the source window against the two kernel phases
+    // around the position, blended by 'blend'
+    inline float interpolate(const float *window, const float *row0, const float *row1, float blend, int taps)
+    {
+        int j = 0;
+        float sum0 = 0.0f, sum1 = 0.0f;
+#ifdef __SSE2__
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+        for (; j + 4 <= taps; j += 4)
+        {
+            __m128 s = _mm_loadu_ps(window + j);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(s, _mm_loadu_ps(row0 + j)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(s, _mm_loadu_ps(row1 + j)));
+        }
+        // Horizontal sums
+        acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+        acc1 = _mm_add_ps(acc1, _mm_movehl_ps(acc1, acc1));
+        acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+        acc1 = _mm_add_ss(acc1, _mm_shuffle_ps(acc1, acc1, 1));
+        sum0 = _mm_cvtss_f32(acc0);
+        sum1 = _mm_cvtss_f32(acc1);
+#endif
+        for (; j < taps; ++j)
+        {
+            sum0 += window[j] * row0[j];
+            sum1 += window[j] * row1[j];
+        }
+        return sum0 + blend * (sum1 - sum0);
+    }
+}
+
+// --- sincKernelFor Implementation ---
+const SincKernel *sincKernelFor(double ratio)
+{
+    static std::mutex mutex;
+    static std::map<int, std::unique_ptr<SincKernel>> kernels;
+
+    // Semitones of upward shift, rounded up (a slightly lower cutoff than
+    // needed is safe); every downward shift keeps the full band
+    int key = ratio > 1.0 ? static_cast<int>(std::ceil(12.0 * std::log2(ratio) - 1e-9)) : 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<SincKernel> &kernel = kernels[key];
+    if (!kernel)
+    {
+        kernel = buildKernel(0.95 * std::pow(2.0, -key / 12.0));
+    }
+    return kernel.get();
+}
+
+// --- noteSemitone Implementation ---
+int noteSemitone(char note, char accidental, int octave)
+{
+    // Semitones above C of A, B, C, D, E, F and G
+    static const int PITCH_CLASS[] = {9, 11, 0, 2, 4, 5, 7};
+    int semitone = 12 * (octave + 1) + PITCH_CLASS[(note >= 'a' ? note - 'a' : note - 'A') % 7];
+    if (accidental == '#' || accidental == '+')
+    {
+        semitone++;
+    }
+    else if (accidental == 'b' || accidental == '-')
+    {
+        semitone--;
+    }
+    return semitone;
+}
+
+// --- pitchRatio Implementation ---
+double pitchRatio(double fromSemitone, double toSemitone)
+{
+    return std::pow(2.0, (toSemitone - fromSemitone) / 12.0);
+}
+
+// --- renderPitched Implementation ---
+template <typename Source>
+void renderPitched(const Source *source, size_t size, bool loop, double ratio, const SincKernel &kernel,
+                   size_t pos, size_t count, float *out)
+{
+    // Source samples staged as floats at a time: the stretch a batch of
+    // output samples reads, gathered once (wrapping around a loop, silence
+    // past a one-shot's ends) so every window is contiguous
+    const long STAGE_SAMPLES = 4096;
+    float stage[STAGE_SAMPLES];
+
+    const int taps = kernel.taps;
+    const long length = static_cast<long>(size);
+    const long before = taps / 2 - 1; // Taps before the position's sample
+
+    // Position of the first output sample in the source; a loop's is kept
+    // within one pass, and the batch reads on past the end, wrapping
+    double x = static_cast<double>(pos) * ratio;
+    if (loop)
+    {
+        x = std::fmod(x, static_cast<double>(size));
+    }
+
+    const size_t maxBatch = std::max<size_t>(1, static_cast<size_t>((STAGE_SAMPLES - taps - 2) / ratio));
+    while (count > 0)
+    {
+        size_t batch = std::min(count, maxBatch);
+        long first = static_cast<long>(x) - before;
+        long last = static_cast<long>(x + (batch - 1) * ratio) - before + taps; // One past the last tap read
+
+        const float *staged = stage;
+        if constexpr (std::is_same<Source, float>::value)
+        {
+            if (first >= 0 && last <= length)
+            {
+                staged = source + first; // Read in place
+            }
+        }
+        if (staged == stage)
+        {
+            for (long k = first; k < last; ++k)
+            {
+                long index = k;
+                if (loop)
+                {
+                    index %= length;
+                    index += index < 0 ? length : 0;
+                }
+                else if (index < 0 || index >= length)
+                {
+                    stage[k - first] = 0.0f;
+                    continue;
+                }
+                stage[k - first] = static_cast<float>(source[index]);
+            }
+        }
+
+        for (size_t i = 0; i < batch; ++i)
+        {
+            double position = x + i * ratio;
+            long whole = static_cast<long>(position);
+            double phase = (position - whole) * PITCH_KERNEL_PHASES;
+            int row = static_cast<int>(phase);
+            out[i] = interpolate(staged + (whole - before - first), kernel.row(row), kernel.row(row + 1),
+                                 static_cast<float>(phase - row), taps);
+        }
+
+        x += batch * ratio;
+        if (loop)
+        {
+            x = std::fmod(x, static_cast<double>(size));
+        }
+        out += batch;
+        count -= batch;
+    }
+}
+
+template void renderPitched<float>(const float *, size_t, bool, double, const SincKernel &, size_t, size_t, float *);
+template void renderPitched<int16_t>(const int16_t *, size_t, bool, double, const SincKernel &, size_t, size_t, float *);
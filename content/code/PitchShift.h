@@ -0,0 +1,60 @@
+// PitchShift.h
+
+#ifndef PITCH_SHIFT_H
+#define PITCH_SHIFT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Band-limited fractional-rate playback, for notes played from a root
+// sample at another pitch (see NoteDecoder::setSamplerMode).
+//
+// A note 'ratio' times the root's frequency reads the root 'ratio' source
+// samples per output sample. Every output sample is a dot product of the
+// source around its position with a windowed-sinc kernel (Blackman window,
+// as in resampleAudio), taken from a table of kernel phases and
+// interpolated between the two nearest. Playing above the root, the
+// kernel's cutoff follows the source rate down, so harmonics the shifted
+// note cannot hold are filtered out instead of aliasing.
+
+// Kernel half-width in zero crossings of the sinc
+const int PITCH_ZERO_CROSSINGS = 8;
+// Fractional positions tabulated between two source samples
+const int PITCH_KERNEL_PHASES = 256;
+// Widest kernel (the cutoff stops following the ratio beyond it)
+const int PITCH_MAX_TAPS = 256;
+
+struct SincKernel
+{
+    double cutoff; // Fraction of the source Nyquist frequency kept
+    int taps;      // Source samples per output sample (a multiple of 4)
+    // PITCH_KERNEL_PHASES + 1 rows of 'taps' coefficients; row p is the
+    // kernel for a position p / PITCH_KERNEL_PHASES past a source sample
+    std::vector<float> coeffs;
+
+    const float *row(int phase) const { return coeffs.data() + static_cast<size_t>(phase) * taps; }
+};
+
+// The kernel for playing at 'ratio' times the root's rate. Kernels are
+// built once per semitone of upward shift (every downward shift shares
+// one) and live for the whole program, so voices can point at them.
+const SincKernel *sincKernelFor(double ratio);
+
+// Pitch of a note in semitones, MIDI numbering (A4 = 69): 'note' is A-G,
+// 'accidental' '#'/'+' (sharp), 'b'/'-' (flat) or anything else (natural)
+int noteSemitone(char note, char accidental, int octave);
+
+// Playback rate that turns 'fromSemitone' into 'toSemitone' (fractional
+// semitones are microtonal)
+double pitchRatio(double fromSemitone, double toSemitone);
+
+// Renders output samples [pos, pos + count) of 'source' (a root of 'size'
+// samples) played at 'ratio' into 'out' as floats (an int16 source keeps
+// its int16 scale). A looped root wraps around; a one-shot reads silence
+// past its ends.
+template <typename Source>
+void renderPitched(const Source *source, size_t size, bool loop, double ratio, const SincKernel &kernel,
+                   size_t pos, size_t count, float *out);
+
+#endif // PITCH_SHIFT_H
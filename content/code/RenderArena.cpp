@@ -0,0 +1,38 @@
+#include "RenderArena.h"
+#include <algorithm> // For std::min
+#include <new>       // For ::operator new with alignment
+
+RenderArena::RenderArena(size_t initialBytes)
+    : m_buffer(initialBytes),
+      m_maxBytes(initialBytes * MAX_GROWTH)
+{
+    m_resource.emplace(m_buffer.data(), m_buffer.size(), &m_upstream);
+}
+
+void RenderArena::reset()
+{
+    size_t overflow = m_upstream.bytesAllocated();
+
+    // Hands overflow chunks back to the heap and rewinds to the buffer start
+    m_resource.reset();
+    m_upstream.resetCount();
+
+    if (overflow > 0 && m_buffer.size() < m_maxBytes)
+    {
+        // Grow to the last job's high-water mark so the next one fits, up
+        // to the cap
+        m_buffer.resize(std::min(m_buffer.size() + overflow, m_maxBytes));
+    }
+    m_resource.emplace(m_buffer.data(), m_buffer.size(), &m_upstream);
+}
+
+void *RenderArena::OverflowResource::do_allocate(size_t bytes, size_t alignment)
+{
+    m_bytes += bytes;
+    return ::operator new(bytes, std::align_val_t(alignment));
+}
+
+void RenderArena::OverflowResource::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+    ::operator delete(p, bytes, std::align_val_t(alignment));
+}
@@ -0,0 +1,61 @@
+// RenderArena.h
+
+#ifndef RENDER_ARENA_H
+#define RENDER_ARENA_H
+
+#include <cstddef>
+#include <memory_resource> // For std::pmr (C++17)
+#include <optional>
+#include <vector>
+
+// Monotonic arena for the short-lived objects of one render job (tokens,
+// split strings, per-chord voice lists). Allocation is a pointer bump and
+// nothing is freed individually; reset() frees everything at once.
+//
+// The arena keeps its buffer between jobs. If a job outgrows it, the
+// overflow comes from the heap and the next reset() grows the buffer to the
+// job's high-water mark, so steady-state batch rendering stops touching the
+// general-purpose allocator. The buffer grows to at most MAX_GROWTH times
+// its initial size: one huge job does not pin its memory for every later
+// one, and jobs larger than that keep overflowing to the heap.
+class RenderArena
+{
+public:
+    explicit RenderArena(size_t initialBytes = 256 * 1024);
+
+    static const size_t MAX_GROWTH = 16;
+
+    RenderArena(const RenderArena &) = delete;
+    RenderArena &operator=(const RenderArena &) = delete;
+
+    std::pmr::memory_resource *resource() { return &*m_resource; }
+
+    // Releases every allocation made since the last reset in one step
+    void reset();
+
+    // Size of the retained buffer, and how far this job has overflowed it
+    size_t capacity() const { return m_buffer.size(); }
+    size_t overflowBytes() const { return m_upstream.bytesAllocated(); }
+
+private:
+    // Upstream for overflow beyond the buffer; counts what it hands out
+    class OverflowResource : public std::pmr::memory_resource
+    {
+    public:
+        size_t bytesAllocated() const { return m_bytes; }
+        void resetCount() { m_bytes = 0; }
+
+    private:
+        size_t m_bytes = 0;
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+    };
+
+    std::vector<std::byte> m_buffer;
+    size_t m_maxBytes; // Most the buffer grows to
+    OverflowResource m_upstream;
+    std::optional<std::pmr::monotonic_buffer_resource> m_resource;
+};
+
+#endif // RENDER_ARENA_H
@@ -0,0 +1,53 @@
+#include "RenderLimits.h"
+#include <chrono>
+
+namespace
+{
+    int64_t steadyNowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+}
+
+// --- RenderLimits::untrusted Implementation ---
+RenderLimits RenderLimits::untrusted()
+{
+    RenderLimits limits;
+    limits.maxDurationSeconds = 3600.0;
+    limits.maxEvents = 10000000;
+    limits.maxPolyphony = 64;
+    limits.maxBytes = size_t(4) << 30;
+    return limits;
+}
+
+// --- RenderCost::print Implementation ---
+void RenderCost::print(std::ostream &out, int sampleRate) const
+{
+    out << "Estimated cost: " << static_cast<double>(samples) / sampleRate << "s (" << samples << " samples), "
+        << events << " events, " << voices << " voices (up to " << maxPolyphony << " at once), "
+        << voiceSamples << " voice-samples to mix, about " << (bytes >> 20) << " MiB" << std::endl;
+}
+
+// --- CancellationToken::cancelAfter Implementation ---
+void CancellationToken::cancelAfter(double seconds)
+{
+    m_deadlineNs.store(steadyNowNs() + static_cast<int64_t>(seconds * 1e9), std::memory_order_relaxed);
+}
+
+// --- CancellationToken::cancelled Implementation ---
+bool CancellationToken::cancelled() const
+{
+    if (m_cancelled.load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+    int64_t deadline = m_deadlineNs.load(std::memory_order_relaxed);
+    if (deadline != 0 && steadyNowNs() >= deadline)
+    {
+        m_cancelled.store(true, std::memory_order_relaxed); // Later checks skip the clock
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,65 @@
+// RenderLimits.h
+
+#ifndef RENDER_LIMITS_H
+#define RENDER_LIMITS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Resource limits for rendering songs that come from an untrusted source
+// (generated MML). A song is compiled, its cost is estimated from the
+// timeline, and it is rejected, or cut down to fit, before any audio is
+// rendered. Zero means no limit.
+struct RenderLimits
+{
+    double maxDurationSeconds = 0.0; // Length of the song
+    size_t maxEvents = 0;            // Timeline events (notes, chords, rests, block plays), each block's once
+    size_t maxPolyphony = 0;         // Voices in one event (the notes of a chord)
+    size_t maxBytes = 0;             // Predicted peak memory of the render
+    bool truncate = false;           // Cut the song to the limits instead of rejecting it
+
+    bool any() const { return maxDurationSeconds > 0.0 || maxEvents > 0 || maxPolyphony > 0 || maxBytes > 0; }
+
+    // Limits for a server rendering whatever it is sent: an hour of audio,
+    // ten million events, 64-note chords and 4 GiB
+    static RenderLimits untrusted();
+};
+
+// Predicted cost of rendering a compiled song, from its timeline alone
+struct RenderCost
+{
+    size_t samples = 0;      // Output length
+    size_t events = 0;       // Timeline events, each distinct block's own counted once
+    size_t voices = 0;       // Voices over all events (the same way)
+    size_t maxPolyphony = 0; // Most voices in one event
+    size_t voiceSamples = 0; // Voice samples to render: the mixing work (CPU)
+    size_t bytes = 0;        // Predicted peak memory: output, timeline and block audio
+
+    void print(std::ostream &out, int sampleRate) const;
+};
+
+// Cooperative cancellation for a render job. Whoever runs the job calls
+// cancel() (or sets a deadline); the renderer checks cancelled() between
+// blocks and stops early, leaving the rest of its output silent. The caller
+// must then discard the output.
+class CancellationToken
+{
+public:
+    CancellationToken() : m_cancelled(false), m_deadlineNs(0) {}
+
+    void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+
+    // Cancels the job once 'seconds' have passed from now
+    void cancelAfter(double seconds);
+
+    // True once cancel() was called or the deadline has passed
+    bool cancelled() const;
+
+private:
+    mutable std::atomic<bool> m_cancelled;
+    std::atomic<int64_t> m_deadlineNs; // steady_clock time; 0 = none
+};
+
+#endif // RENDER_LIMITS_H
@@ -0,0 +1,459 @@
+#include "SampleStore.h"
+#include "NoteDecoder.h" // For SampleInfo
+#include "SampleType.h"
+#include <cstring>
+#include <algorithm>
+#include <iomanip>
+
+// One stored sample, shared by every path that decodes to the same audio
+struct SampleStore::Entry
+{
+    // Description of the samples (what a decoded buffer is built with)
+    std::string filePath;
+    SampleType type = SampleType::Float32;
+    int sampleRate = 0;
+    int channels = 0;
+    double durationSeconds = 0.0;
+    size_t count = 0;
+
+    std::vector<uint8_t> cold;                  // Packed int16 samples (see packInt16)
+    std::shared_ptr<const SampleInfo> resident; // Set instead when there is no compact form
+    std::weak_ptr<const SampleInfo> decoded;    // The buffer in use, if any
+    std::shared_ptr<const SampleInfo> hot;      // Keeps 'decoded' alive while in the hot tier
+    std::list<Entry *>::iterator hotPos;
+
+    size_t bytes() const { return count * (type == SampleType::Int16 ? sizeof(int16_t) : sizeof(float)); }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Lossless int16 packing
+//
+// The samples are coded in blocks of BLOCK_SAMPLES. Each block predicts
+// every sample from the ones before it with a fixed polynomial of order
+// 0, 1 or 2 (whichever leaves the smallest residuals), and Rice codes the
+// residuals with a parameter chosen from their mean: the quotient in
+// unary, the remainder in k bits. A quotient past ESCAPE_QUOTIENT is
+// written as the raw residual instead, so a click cannot cost hundreds
+// of bits.
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    const size_t BLOCK_SAMPLES = 4096;
+    const unsigned ESCAPE_QUOTIENT = 32;
+    const unsigned RAW_BITS = 18;  // An order-2 residual fits in 18 bits zigzagged
+    const unsigned ORDER_BITS = 2;
+    const unsigned RICE_BITS = 5;
+    const unsigned MAX_RICE = RAW_BITS - 1;
+
+    inline uint32_t zigzag(int32_t value)
+    {
+        return value >= 0 ? static_cast<uint32_t>(value) << 1 : (static_cast<uint32_t>(-value) << 1) - 1;
+    }
+
+    inline int32_t unzigzag(uint32_t value)
+    {
+        return (value & 1) ? -static_cast<int32_t>((value + 1) >> 1) : static_cast<int32_t>(value >> 1);
+    }
+
+    inline int32_t predict(unsigned order, int32_t previous, int32_t beforePrevious)
+    {
+        return order == 0 ? 0 : order == 1 ? previous : 2 * previous - beforePrevious;
+    }
+
+    // MSB-first bit writer
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<uint8_t> &out) : m_out(out), m_bits(0), m_count(0) {}
+
+        // Appends the low 'count' bits of 'value' (count <= 33)
+        void put(uint64_t value, unsigned count)
+        {
+            m_bits = (m_bits << count) | (value & ((uint64_t(1) << count) - 1));
+            m_count += count;
+            while (m_count >= 8)
+            {
+                m_count -= 8;
+                m_out.push_back(static_cast<uint8_t>(m_bits >> m_count));
+            }
+        }
+
+        void flush()
+        {
+            if (m_count > 0)
+            {
+                m_out.push_back(static_cast<uint8_t>(m_bits << (8 - m_count)));
+                m_count = 0;
+            }
+        }
+
+    private:
+        std::vector<uint8_t> &m_out;
+        uint64_t m_bits;
+        unsigned m_count;
+    };
+
+    // MSB-first bit reader; reads zeros past the end
+    class BitReader
+    {
+    public:
+        BitReader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_pos(0), m_bits(0), m_count(0) {}
+
+        uint32_t get(unsigned count)
+        {
+            refill();
+            m_count -= count;
+            return static_cast<uint32_t>((m_bits >> m_count) & ((uint64_t(1) << count) - 1));
+        }
+
+        // Counts ones up to a zero (consumed) or 'limit' ones (no zero)
+        unsigned unary(unsigned limit)
+        {
+            refill();
+            unsigned ones = 0;
+            while (ones < limit && ((m_bits >> (m_count - 1)) & 1))
+            {
+                --m_count;
+                ++ones;
+            }
+            if (ones < limit)
+            {
+                --m_count;
+            }
+            return ones;
+        }
+
+    private:
+        // Keeps at least 57 bits buffered (enough for any code above)
+        void refill()
+        {
+            while (m_count <= 56)
+            {
+                m_bits = (m_bits << 8) | (m_pos < m_size ? m_data[m_pos] : 0);
+                ++m_pos;
+                m_count += 8;
+            }
+        }
+
+        const uint8_t *m_data;
+        size_t m_size;
+        size_t m_pos;
+        uint64_t m_bits;
+        unsigned m_count;
+    };
+
+    std::vector<uint8_t> packInt16(const int16_t *samples, size_t count)
+    {
+        std::vector<uint8_t> packed;
+        packed.reserve(count); // A rough guess: most samples pack to a byte or less
+        BitWriter writer(packed);
+        int32_t previous = 0, beforePrevious = 0;
+
+        for (size_t start = 0; start < count; start += BLOCK_SAMPLES)
+        {
+            const size_t end = std::min(count, start + BLOCK_SAMPLES);
+
+            // The order with the smallest residuals predicts this block
+            uint64_t cost[3] = {0, 0, 0};
+            int32_t p1 = previous, p2 = beforePrevious;
+            for (size_t i = start; i < end; ++i)
+            {
+                for (unsigned order = 0; order < 3; ++order)
+                {
+                    cost[order] += zigzag(samples[i] - predict(order, p1, p2));
+                }
+                p2 = p1;
+                p1 = samples[i];
+            }
+            unsigned order = 0;
+            for (unsigned o = 1; o < 3; ++o)
+            {
+                if (cost[o] < cost[order])
+                {
+                    order = o;
+                }
+            }
+
+            // Rice parameter: about log2 of the mean residual
+            const uint64_t blockSize = end - start;
+            unsigned k = 0;
+            while (k < MAX_RICE && (blockSize << (k + 1)) <= cost[order])
+            {
+                ++k;
+            }
+
+            writer.put(order, ORDER_BITS);
+            writer.put(k, RICE_BITS);
+            for (size_t i = start; i < end; ++i)
+            {
+                uint32_t residual = zigzag(samples[i] - predict(order, previous, beforePrevious));
+                uint32_t quotient = residual >> k;
+                if (quotient < ESCAPE_QUOTIENT)
+                {
+                    writer.put(((uint64_t(1) << quotient) - 1) << 1, quotient + 1);
+                    writer.put(residual, k);
+                }
+                else
+                {
+                    writer.put((uint64_t(1) << ESCAPE_QUOTIENT) - 1, ESCAPE_QUOTIENT);
+                    writer.put(residual, RAW_BITS);
+                }
+                beforePrevious = previous;
+                previous = samples[i];
+            }
+        }
+        writer.flush();
+        packed.shrink_to_fit();
+        return packed;
+    }
+
+    void unpackInt16(const std::vector<uint8_t> &packed, size_t count, int16_t *out)
+    {
+        BitReader reader(packed.data(), packed.size());
+        int32_t previous = 0, beforePrevious = 0;
+
+        for (size_t start = 0; start < count; start += BLOCK_SAMPLES)
+        {
+            const size_t end = std::min(count, start + BLOCK_SAMPLES);
+            const unsigned order = reader.get(ORDER_BITS);
+            const unsigned k = reader.get(RICE_BITS);
+            for (size_t i = start; i < end; ++i)
+            {
+                unsigned quotient = reader.unary(ESCAPE_QUOTIENT);
+                uint32_t residual = quotient < ESCAPE_QUOTIENT ? (quotient << k) | reader.get(k) : reader.get(RAW_BITS);
+                int32_t sample = unzigzag(residual) + predict(order, previous, beforePrevious);
+                out[i] = static_cast<int16_t>(sample);
+                beforePrevious = previous;
+                previous = sample;
+            }
+        }
+    }
+
+    // Hash of a sample's contents (confirmed with memcmp before sharing)
+    uint64_t contentHash(SampleType type, int sampleRate, const void *data, size_t bytes)
+    {
+        const uint64_t PRIME = 0x100000001b3ULL;
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        hash = (hash ^ static_cast<uint64_t>(type)) * PRIME;
+        hash = (hash ^ static_cast<uint64_t>(sampleRate)) * PRIME;
+        hash = (hash ^ bytes) * PRIME;
+
+        // A word at a time, then the bytes left over
+        const uint8_t *bytePtr = static_cast<const uint8_t *>(data);
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, bytePtr + i, sizeof(word));
+            hash = (hash ^ word) * PRIME;
+            hash ^= hash >> 29;
+        }
+        for (; i < bytes; ++i)
+        {
+            hash = (hash ^ bytePtr[i]) * PRIME;
+        }
+        return hash;
+    }
+
+    const void *sampleData(const SampleInfo &sample)
+    {
+        return sample.type == SampleType::Int16 ? static_cast<const void *>(sample.samples16())
+                                                : static_cast<const void *>(sample.samples());
+    }
+}
+
+// --- SampleStore Implementation ---
+SampleStore::SampleStore(size_t hotBudgetBytes)
+    : m_hotBytes(0), m_hotBudget(hotBudgetBytes)
+{
+}
+
+std::shared_ptr<const SampleInfo> SampleStore::acquire(std::string_view path)
+{
+    auto it = m_byPath.find(path);
+    if (it == m_byPath.end())
+    {
+        return nullptr;
+    }
+    return obtain(*it->second);
+}
+
+std::shared_ptr<const SampleInfo> SampleStore::add(const std::string &path, SampleInfo &&sample)
+{
+    const size_t bytes = sample.size() * (sample.type == SampleType::Int16 ? sizeof(int16_t) : sizeof(float));
+    const uint64_t hash = contentHash(sample.type, sample.sampleRate, sampleData(sample), bytes);
+
+    // The same audio already stored under another path is shared
+    auto candidates = m_byContent.equal_range(hash);
+    for (auto it = candidates.first; it != candidates.second; ++it)
+    {
+        Entry &entry = *it->second;
+        if (entry.type != sample.type || entry.sampleRate != sample.sampleRate || entry.count != sample.size())
+        {
+            continue;
+        }
+        std::shared_ptr<const SampleInfo> stored = obtain(entry);
+        if (std::memcmp(sampleData(*stored), sampleData(sample), bytes) == 0)
+        {
+            m_byPath[path] = it->second;
+            return stored;
+        }
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->filePath = sample.filePath;
+    entry->type = sample.type;
+    entry->sampleRate = sample.sampleRate;
+    entry->channels = sample.channels;
+    entry->durationSeconds = sample.durationSeconds;
+    entry->count = sample.size();
+
+    // 16-bit content is packed. A float sample is, if every value is an
+    // int16 step (as decoded from a 16-bit file), so decoding gives back
+    // exactly the same floats. A mapped file costs no heap to begin with.
+    if (!sample.mappedFile)
+    {
+        if (sample.type == SampleType::Int16)
+        {
+            entry->cold = packInt16(sample.data16.data(), entry->count);
+        }
+        else
+        {
+            std::vector<int16_t> asInt16(entry->count);
+            std::vector<float> roundTrip(entry->count);
+            convertToInt16(sample.data.data(), entry->count, asInt16.data());
+            convertToFloat(asInt16.data(), entry->count, roundTrip.data());
+            if (std::memcmp(roundTrip.data(), sample.data.data(), bytes) == 0)
+            {
+                entry->cold = packInt16(asInt16.data(), entry->count);
+            }
+        }
+    }
+
+    std::shared_ptr<const SampleInfo> stored = std::make_shared<const SampleInfo>(std::move(sample));
+    if (entry->cold.empty() && entry->count > 0)
+    {
+        entry->resident = stored;
+    }
+    else
+    {
+        entry->decoded = stored;
+        touch(*entry, stored);
+    }
+    m_byPath[path] = entry;
+    m_byContent.emplace(hash, entry);
+    return stored;
+}
+
+void SampleStore::clear()
+{
+    m_hot.clear();
+    m_hotBytes = 0;
+    m_byContent.clear();
+    m_byPath.clear();
+}
+
+void SampleStore::setHotBudget(size_t bytes)
+{
+    m_hotBudget = bytes;
+    evict();
+}
+
+std::shared_ptr<const SampleInfo> SampleStore::obtain(Entry &entry)
+{
+    if (entry.resident)
+    {
+        return entry.resident;
+    }
+    std::shared_ptr<const SampleInfo> decoded = entry.decoded.lock();
+    if (!decoded)
+    {
+        auto sample = std::make_shared<SampleInfo>();
+        sample->filePath = entry.filePath;
+        sample->type = entry.type;
+        sample->sampleRate = entry.sampleRate;
+        sample->channels = entry.channels;
+        sample->durationSeconds = entry.durationSeconds;
+        if (entry.type == SampleType::Int16)
+        {
+            sample->data16.resize(entry.count);
+            unpackInt16(entry.cold, entry.count, sample->data16.data());
+        }
+        else
+        {
+            std::vector<int16_t> samples16(entry.count);
+            unpackInt16(entry.cold, entry.count, samples16.data());
+            sample->data.resize(entry.count);
+            convertToFloat(samples16.data(), entry.count, sample->data.data());
+        }
+        decoded = sample;
+        entry.decoded = decoded;
+    }
+    touch(entry, decoded);
+    return decoded;
+}
+
+void SampleStore::touch(Entry &entry, const std::shared_ptr<const SampleInfo> &decoded)
+{
+    if (entry.hot)
+    {
+        m_hot.splice(m_hot.begin(), m_hot, entry.hotPos);
+        return;
+    }
+    entry.hot = decoded;
+    entry.hotPos = m_hot.insert(m_hot.begin(), &entry);
+    m_hotBytes += entry.bytes();
+    evict();
+}
+
+void SampleStore::evict()
+{
+    // Buffers still held by a song stay alive (and are found again through
+    // 'decoded'); only the tier's own reference goes
+    while (m_hotBytes > m_hotBudget && !m_hot.empty())
+    {
+        Entry *entry = m_hot.back();
+        m_hot.pop_back();
+        entry->hot.reset();
+        m_hotBytes -= entry->bytes();
+    }
+}
+
+SampleStore::Stats SampleStore::stats() const
+{
+    Stats stats;
+    stats.paths = m_byPath.size();
+    for (const auto &path : m_byPath)
+    {
+        stats.decodedBytes += path.second->bytes();
+    }
+    stats.unique = m_byContent.size();
+    for (const auto &content : m_byContent)
+    {
+        const Entry &entry = *content.second;
+        stats.coldBytes += entry.cold.size();
+        if (entry.resident)
+        {
+            (entry.resident->mappedFile ? stats.mappedBytes : stats.residentBytes) += entry.bytes();
+        }
+    }
+    stats.hotBytes = m_hotBytes;
+    return stats;
+}
+
+void SampleStore::printStats(std::ostream &out) const
+{
+    const double MIB = 1024.0 * 1024.0;
+    Stats s = stats();
+    size_t held = s.coldBytes + s.residentBytes + s.hotBytes;
+    out << "Sample store: " << s.paths << " files, " << s.unique << " distinct samples; "
+        << std::fixed << std::setprecision(2)
+        << s.coldBytes / MIB << " MiB packed + " << s.residentBytes / MIB << " MiB resident + "
+        << s.hotBytes / MIB << " MiB hot = " << held / MIB << " MiB (decoded: " << s.decodedBytes / MIB << " MiB";
+    if (s.mappedBytes > 0)
+    {
+        out << "; " << s.mappedBytes / MIB << " MiB read from file mappings";
+    }
+    out << ")" << std::defaultfloat << std::setprecision(6) << std::endl;
+}
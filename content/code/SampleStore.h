@@ -0,0 +1,90 @@
+// SampleStore.h
+
+#ifndef SAMPLE_STORE_H
+#define SAMPLE_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct SampleInfo;
+
+// Every sample the engine has loaded, each kept once and mostly compressed.
+//
+// Samples are deduplicated by content: files that decode to the same audio
+// (a noise sample filed under two instruments, a loop copied between
+// banks) share one entry, found by a hash of the decoded samples and
+// confirmed by comparing them. Each entry keeps a cold copy; 16-bit
+// content (every float sample decoded from a 16-bit file, and every sample
+// of the int16 engine) is packed losslessly as deltas with a Rice code,
+// typically a third of the float size. Decoded buffers form the hot tier:
+// the most recently used, up to a byte budget, are kept decoded; the rest
+// are decoded again when next acquired. Samples the file mapping already
+// serves in place, and float samples with no 16-bit form (resampled ones),
+// stay decoded.
+//
+// A decoded buffer lives as long as anyone holds it, so a song that points
+// into it keeps it alive while the tier moves on (see NoteDecoder pins).
+class SampleStore
+{
+public:
+    // Default hot tier budget: 64 MiB of decoded samples
+    static const size_t DEFAULT_HOT_BUDGET = size_t(64) << 20;
+
+    explicit SampleStore(size_t hotBudgetBytes = DEFAULT_HOT_BUDGET);
+
+    // The sample stored under 'path', decoded, or nullptr if there is none
+    std::shared_ptr<const SampleInfo> acquire(std::string_view path);
+
+    // Stores a freshly loaded sample under 'path' and returns it decoded.
+    // If the store already holds the same audio, 'path' shares it and the
+    // new copy is dropped.
+    std::shared_ptr<const SampleInfo> add(const std::string &path, SampleInfo &&sample);
+
+    // Forgets every sample (buffers still held elsewhere stay valid)
+    void clear();
+
+    // Bytes of decoded samples the hot tier may keep
+    void setHotBudget(size_t bytes);
+
+    struct Stats
+    {
+        size_t paths = 0;        // Files loaded
+        size_t unique = 0;       // Distinct samples among them
+        size_t coldBytes = 0;    // Compressed copies
+        size_t residentBytes = 0; // Samples kept decoded for good (no compact form)
+        size_t mappedBytes = 0;  // Samples read in place from file mappings
+        size_t hotBytes = 0;     // Decoded buffers in the hot tier
+        size_t decodedBytes = 0; // Every file decoded on its own (what a plain cache holds)
+    };
+    Stats stats() const;
+
+    // One line: files, distinct samples and memory against decoding every file
+    void printStats(std::ostream &out) const;
+
+private:
+    struct Entry;
+
+    std::map<std::string, std::shared_ptr<Entry>, std::less<>> m_byPath;
+    std::unordered_multimap<uint64_t, std::shared_ptr<Entry>> m_byContent;
+
+    // Hot tier, most recently used first
+    std::list<Entry *> m_hot;
+    size_t m_hotBytes;
+    size_t m_hotBudget;
+
+    // The entry's samples, decoding its cold copy if no buffer is alive
+    std::shared_ptr<const SampleInfo> obtain(Entry &entry);
+    // Moves a decoded entry to the front of the hot tier
+    void touch(Entry &entry, const std::shared_ptr<const SampleInfo> &decoded);
+    // Drops the least recently used buffers until the tier fits its budget
+    void evict();
+};
+
+#endif // SAMPLE_STORE_H
@@ -0,0 +1,75 @@
+#include "SampleType.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// --- sampleTypeName Implementation ---
+const char *sampleTypeName(SampleType type)
+{
+    return type == SampleType::Int16 ? "16-bit integer" : "32-bit float";
+}
+
+// --- convertToInt16 Implementation ---
+void convertToInt16(const float *in, size_t count, int16_t *out)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    // Eight samples per step: scale, clamp (the conversion would turn a
+    // large positive value negative), round and pack with saturation
+    const __m128 scale = _mm_set1_ps(INT16_FULL_SCALE);
+    const __m128 low = _mm_set1_ps(-32768.0f);
+    const __m128 high = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), low), high);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), low), high);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = saturateToInt16(in[i] * INT16_FULL_SCALE);
+    }
+}
+
+// --- convertToFloat Implementation ---
+void convertToFloat(const int16_t *in, size_t count, float *out)
+{
+    const float scale = 1.0f / INT16_FULL_SCALE;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 scaleVector = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scaleVector));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scaleVector));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = in[i] * scale;
+    }
+}
+
+// --- mixSaturating Implementation ---
+void mixSaturating(const int16_t *in, size_t count, int16_t *out)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(out + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_adds_epi16(a, b));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = addSaturating(out[i], in[i]);
+    }
+}
@@ -0,0 +1,49 @@
+// SampleType.h
+
+#ifndef SAMPLE_TYPE_H
+#define SAMPLE_TYPE_H
+
+#include <cmath> // For std::lrintf
+#include <cstddef>
+#include <cstdint>
+
+// Type the engine stores samples and mixes in. Float32 is the default and
+// feeds the master bus; Int16 halves the memory traffic of the sample cache,
+// the mix and the output for renders delivered as 16-bit, at the price of
+// saturating (hard-clipping) instead of going through the limiter.
+enum class SampleType
+{
+    Float32,
+    Int16
+};
+
+// Human-readable name of a sample type, for messages
+const char *sampleTypeName(SampleType type);
+
+// Float value of a full-scale int16 sample: -32768 maps to -1.0, as
+// libsndfile (and WavFile) read 16-bit files, so an int16 sample survives
+// the round trip through float unchanged
+const float INT16_FULL_SCALE = 32768.0f;
+
+// Rounds a value already scaled to int16 range, saturating at its limits
+inline int16_t saturateToInt16(float value)
+{
+    value = value < -32768.0f ? -32768.0f : (value > 32767.0f ? 32767.0f : value);
+    return static_cast<int16_t>(std::lrintf(value));
+}
+
+// a + b, saturating instead of wrapping around
+inline int16_t addSaturating(int16_t a, int16_t b)
+{
+    int32_t sum = static_cast<int32_t>(a) + b;
+    return static_cast<int16_t>(sum < -32768 ? -32768 : (sum > 32767 ? 32767 : sum));
+}
+
+// Converts float samples in [-1, 1] to int16 (saturating) and back (SSE2)
+void convertToInt16(const float *in, size_t count, int16_t *out);
+void convertToFloat(const int16_t *in, size_t count, float *out);
+
+// out[i] = out[i] + in[i], saturating (SSE2)
+void mixSaturating(const int16_t *in, size_t count, int16_t *out);
+
+#endif // SAMPLE_TYPE_H
@@ -0,0 +1,64 @@
+#include "SparseTrack.h"
+#include <algorithm> // For std::max, std::min, std::partition_point
+
+// --- audibleSamples Implementation ---
+size_t SparseTrack::audibleSamples() const
+{
+    size_t total = 0;
+    for (const AudioRun &run : m_runs)
+    {
+        total += run.samples.size();
+    }
+    return total;
+}
+
+// --- appendRun Implementation ---
+float *SparseTrack::appendRun(size_t start, size_t numSamples)
+{
+    m_runs.push_back(AudioRun{start, std::vector<float>(numSamples, 0.0f)});
+    m_totalSamples = std::max(m_totalSamples, start + numSamples);
+    return m_runs.back().samples.data();
+}
+
+// --- firstRunEndingAfter Implementation ---
+size_t SparseTrack::firstRunEndingAfter(size_t sample) const
+{
+    auto it = std::partition_point(m_runs.begin(), m_runs.end(), [sample](const AudioRun &run)
+                                   { return run.end() <= sample; });
+    return static_cast<size_t>(it - m_runs.begin());
+}
+
+// --- hasAudio Implementation ---
+bool SparseTrack::hasAudio(size_t startSample, size_t endSample) const
+{
+    size_t i = firstRunEndingAfter(startSample);
+    return i < m_runs.size() && m_runs[i].start < endSample && startSample < endSample;
+}
+
+// --- mixInto Implementation ---
+void SparseTrack::mixInto(size_t startSample, size_t endSample, float gain, float *out) const
+{
+    for (size_t i = firstRunEndingAfter(startSample); i < m_runs.size() && m_runs[i].start < endSample; ++i)
+    {
+        const AudioRun &run = m_runs[i];
+        size_t from = std::max(run.start, startSample);
+        size_t to = std::min(run.end(), endSample);
+        const float *in = run.samples.data() + (from - run.start);
+        float *dest = out + (from - startSample);
+        for (size_t n = 0; n < to - from; ++n)
+        {
+            dest[n] += in[n] * gain;
+        }
+    }
+}
+
+// --- toDense Implementation ---
+std::vector<float> SparseTrack::toDense() const
+{
+    std::vector<float> dense(m_totalSamples, 0.0f);
+    for (const AudioRun &run : m_runs)
+    {
+        std::copy(run.samples.begin(), run.samples.end(), dense.begin() + run.start);
+    }
+    return dense;
+}
@@ -0,0 +1,57 @@
+// SparseTrack.h
+
+#ifndef SPARSE_TRACK_H
+#define SPARSE_TRACK_H
+
+#include <cstddef>
+#include <vector>
+
+// One stretch of audible samples of a track, at its offset in the track
+struct AudioRun
+{
+    size_t start;
+    std::vector<float> samples;
+
+    size_t end() const { return start + samples.size(); }
+};
+
+// A track stored as a run list: its audible extents, in order and not
+// overlapping, with everything between them silent. A percussion or sfx
+// track that is mostly rests costs memory, and mixing time, in proportion to
+// the audio it actually holds rather than to the song's length.
+class SparseTrack
+{
+public:
+    explicit SparseTrack(size_t totalSamples = 0) : m_totalSamples(totalSamples) {}
+
+    // Length of the track, silence included
+    size_t totalSamples() const { return m_totalSamples; }
+
+    const std::vector<AudioRun> &runs() const { return m_runs; }
+
+    // Samples held in runs (the rest of the track is silent)
+    size_t audibleSamples() const;
+
+    // Appends a run of 'numSamples' zeroed samples at 'start', which must not
+    // be before the end of the last run, and returns its storage
+    float *appendRun(size_t start, size_t numSamples);
+
+    // True if any run overlaps [startSample, endSample)
+    bool hasAudio(size_t startSample, size_t endSample) const;
+
+    // Adds the track's samples in [startSample, endSample), times 'gain', to
+    // 'out' (out[0] is startSample). Only the runs in the range are touched.
+    void mixInto(size_t startSample, size_t endSample, float gain, float *out) const;
+
+    // The whole track as one buffer, gaps filled with zeros
+    std::vector<float> toDense() const;
+
+private:
+    size_t m_totalSamples;
+    std::vector<AudioRun> m_runs;
+
+    // Index of the first run that ends after 'sample' (binary search)
+    size_t firstRunEndingAfter(size_t sample) const;
+};
+
+#endif // SPARSE_TRACK_H
@@ -0,0 +1,134 @@
+#include "ThreadPool.h"
+#include "Trace.h"
+#include <algorithm> // For std::max
+
+// --- ThreadPool Constructor ---
+ThreadPool::ThreadPool(size_t numThreads)
+    : m_queuedTasks(0), m_stopping(false)
+{
+    if (numThreads == 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 0; i < numThreads; ++i)
+    {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (size_t i = 0; i < numThreads; ++i)
+    {
+        m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+// --- ThreadPool Destructor ---
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (std::thread &thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+// --- takeTask Implementation ---
+bool ThreadPool::takeTask(size_t self, std::function<void()> &task)
+{
+    const size_t numQueues = m_queues.size();
+    for (size_t i = 0; i < numQueues; ++i)
+    {
+        WorkerQueue &queue = *m_queues[(self + i) % numQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            // Own queue: newest task first (its data is likely still cached)
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            // Steal the oldest task from another worker
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        m_queuedTasks--;
+        return true;
+    }
+    return false;
+}
+
+// --- workerLoop Implementation ---
+void ThreadPool::workerLoop(size_t index)
+{
+    Trace::setThreadName("worker " + std::to_string(index));
+    std::function<void()> task;
+    while (true)
+    {
+        if (takeTask(index, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_wake.wait(lock, [this]
+                    { return m_stopping || m_queuedTasks > 0; });
+        if (m_stopping && m_queuedTasks == 0)
+        {
+            return;
+        }
+    }
+}
+
+// --- parallelFor Implementation ---
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &body)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    std::mutex doneMutex;
+    std::condition_variable done;
+    size_t remaining = count;
+
+    // Deal the tasks out round-robin; stealing evens out the load later
+    for (size_t i = 0; i < count; ++i)
+    {
+        WorkerQueue &queue = *m_queues[i % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.emplace_back([&, i]
+                                 {
+                                     body(i);
+                                     std::lock_guard<std::mutex> doneLock(doneMutex);
+                                     if (--remaining == 0)
+                                     {
+                                         done.notify_all();
+                                     } });
+        m_queuedTasks++;
+    }
+    {
+        // Taking the lock orders this wake-up after any worker's check
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+    }
+    m_wake.notify_all();
+
+    // Help out instead of idling, then wait for the tasks still running
+    std::function<void()> task;
+    while (takeTask(0, task))
+    {
+        task();
+    }
+    TRACE_SCOPE("wait for workers", "pool");
+    std::unique_lock<std::mutex> lock(doneMutex);
+    done.wait(lock, [&remaining]
+              { return remaining == 0; });
+}
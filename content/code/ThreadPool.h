@@ -0,0 +1,58 @@
+// ThreadPool.h
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size work-stealing thread pool.
+//
+// Every worker owns a task deque. A worker takes tasks from the back of its
+// own deque and, when that runs dry, steals from the front of the others',
+// so uneven tasks (a dense chord passage next to a long rest) still keep
+// every core busy.
+class ThreadPool
+{
+public:
+    // 0 threads means one per hardware thread
+    explicit ThreadPool(size_t numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return m_threads.size(); }
+
+    // Runs body(0) ... body(count - 1) on the pool and returns when all of
+    // them have finished. The calling thread helps while it waits.
+    void parallelFor(size_t count, const std::function<void(size_t)> &body);
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::atomic<size_t> m_queuedTasks;
+    bool m_stopping;
+
+    // Takes a task from queue 'self' (back) or steals one (front of another)
+    bool takeTask(size_t self, std::function<void()> &task);
+    void workerLoop(size_t index);
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,165 @@
+#include "Trace.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Trace::s_enabled(false);
+
+namespace
+{
+    struct TraceRecord
+    {
+        const char *name;
+        const char *category;
+        uint64_t startNs;
+        uint64_t endNs;
+        std::string detail;
+    };
+
+    // One per thread that recorded anything; only that thread appends
+    struct ThreadBuffer
+    {
+        size_t tid;
+        std::string name;
+        std::vector<TraceRecord> records;
+    };
+
+    std::chrono::steady_clock::time_point g_origin;
+
+    // Guards the list of buffers (taken once per thread, not per record)
+    std::mutex g_registryMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> g_buffers; // Outlive their threads
+
+    ThreadBuffer &localBuffer()
+    {
+        thread_local ThreadBuffer *buffer = nullptr;
+        if (!buffer)
+        {
+            std::lock_guard<std::mutex> lock(g_registryMutex);
+            g_buffers.push_back(std::make_unique<ThreadBuffer>());
+            buffer = g_buffers.back().get();
+            buffer->tid = g_buffers.size();
+            buffer->name = "thread " + std::to_string(buffer->tid);
+            buffer->records.reserve(4096);
+        }
+        return *buffer;
+    }
+
+    // Writes 'text' as a JSON string literal
+    void writeJsonString(std::ostream &out, const std::string &text)
+    {
+        out << '"';
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '"':
+                out << "\\\"";
+                break;
+            case '\\':
+                out << "\\\\";
+                break;
+            case '\n':
+                out << "\\n";
+                break;
+            case '\t':
+                out << "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    out << ' ';
+                }
+                else
+                {
+                    out << c;
+                }
+            }
+        }
+        out << '"';
+    }
+}
+
+// --- Trace::enable Implementation ---
+void Trace::enable()
+{
+    g_origin = std::chrono::steady_clock::now();
+    s_enabled.store(true, std::memory_order_release);
+}
+
+// --- Trace::now Implementation ---
+uint64_t Trace::now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now() - g_origin)
+                                     .count());
+}
+
+// --- Trace::setThreadName Implementation ---
+void Trace::setThreadName(const std::string &name)
+{
+    if (enabled())
+    {
+        localBuffer().name = name;
+    }
+}
+
+// --- Trace::record Implementation ---
+void Trace::record(const char *name, const char *category, uint64_t startNs, uint64_t endNs, std::string detail)
+{
+    localBuffer().records.push_back({name, category, startNs, endNs, std::move(detail)});
+}
+
+// --- Trace::write Implementation ---
+bool Trace::write(const std::string &path)
+{
+    std::ofstream out(path);
+    if (!out.is_open())
+    {
+        std::cerr << "Error: Could not open trace file " << path << " for writing." << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(g_registryMutex);
+    size_t numRecords = 0;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer : g_buffers)
+    {
+        // Metadata event: the thread's name in the timeline
+        out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":";
+        writeJsonString(out, buffer->name);
+        out << "}}";
+        first = false;
+
+        // Complete events; timestamps and durations are in microseconds
+        for (const TraceRecord &record : buffer->records)
+        {
+            out << ",\n{\"name\":\"" << record.name << "\",\"cat\":\"" << record.category
+                << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                << ",\"ts\":" << record.startNs / 1000 << '.' << (record.startNs % 1000) / 100
+                << ",\"dur\":" << (record.endNs - record.startNs) / 1000 << '.' << ((record.endNs - record.startNs) % 1000) / 100;
+            if (!record.detail.empty())
+            {
+                out << ",\"args\":{\"detail\":";
+                writeJsonString(out, record.detail);
+                out << "}";
+            }
+            out << "}";
+            numRecords++;
+        }
+    }
+    out << "\n]}\n";
+
+    if (out.fail())
+    {
+        std::cerr << "Error: Failed to write trace file " << path << "." << std::endl;
+        return false;
+    }
+    std::cout << "Trace: wrote " << numRecords << " events from " << g_buffers.size() << " threads to " << path << std::endl;
+    return true;
+}
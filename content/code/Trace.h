@@ -0,0 +1,101 @@
+// Trace.h
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Timeline tracing for render jobs.
+//
+// TRACE_SCOPE marks a stretch of code (lexing, a sample load, a mixed
+// segment, an encoder flush). While tracing is enabled every scope appends
+// one record to a buffer owned by the thread it ran on, so recording takes
+// no lock; while it is disabled a scope costs one relaxed load. Trace::write
+// emits the Chrome trace-event format, which chrome://tracing and Perfetto
+// (ui.perfetto.dev) open as a per-thread timeline.
+//
+// Build with -DMML_NO_TRACE to compile every marker out.
+class Trace
+{
+public:
+    // Starts recording; timestamps count from this call. Call it before
+    // the threads to be traced start work.
+    static void enable();
+
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Names the calling thread in the timeline (e.g., "worker 2")
+    static void setThreadName(const std::string &name);
+
+    // Nanoseconds since enable()
+    static uint64_t now();
+
+    // Appends one finished scope to the calling thread's buffer
+    static void record(const char *name, const char *category, uint64_t startNs, uint64_t endNs, std::string detail);
+
+    // Writes every thread's records as a Chrome trace (JSON). Call it once
+    // the traced work has finished: buffers are read without locking them.
+    static bool write(const std::string &path);
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+// Records the time between its construction and destruction. 'name' and
+// 'category' must be string literals (only the pointers are kept); 'detail'
+// (a file name, a sample count) is copied, and only while tracing.
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const char *category)
+        : m_name(nullptr), m_category(category), m_start(0)
+    {
+        if (Trace::enabled())
+        {
+            m_name = name;
+            m_start = Trace::now();
+        }
+    }
+
+    TraceScope(const char *name, const char *category, std::string_view detail)
+        : TraceScope(name, category)
+    {
+        if (m_name)
+        {
+            m_detail.assign(detail.data(), detail.size());
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (m_name)
+        {
+            Trace::record(m_name, m_category, m_start, Trace::now(), std::move(m_detail));
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *m_name; // nullptr when tracing was off at construction
+    const char *m_category;
+    uint64_t m_start;
+    std::string m_detail;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifndef MML_NO_TRACE
+#define TRACE_SCOPE(name, category) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name, category)
+#define TRACE_SCOPE_DETAIL(name, category, detail) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name, category, detail)
+#else
+#define TRACE_SCOPE(name, category) ((void)0)
+#define TRACE_SCOPE_DETAIL(name, category, detail) ((void)0)
+#endif
+
+#endif // TRACE_H
@@ -0,0 +1,307 @@
+#include "WavReader.h"
+#include <algorithm> // For std::min
+#include <cerrno>
+#include <cstdint>
+#include <cstring> // For std::memcmp, std::memcpy, std::strerror
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // WAVE format tags (fmt chunk, or the sub-format of an extensible header)
+    const uint16_t WAVE_FORMAT_PCM = 0x0001;
+    const uint16_t WAVE_FORMAT_IEEE_FLOAT = 0x0003;
+    const uint16_t WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
+
+    uint16_t readU16(const unsigned char *p)
+    {
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+
+    uint32_t readU32(const unsigned char *p)
+    {
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+               (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    WavSampleFormat sampleFormatFor(uint16_t tag, uint16_t bitsPerSample)
+    {
+        if (tag == WAVE_FORMAT_PCM)
+        {
+            switch (bitsPerSample)
+            {
+            case 8:
+                return WavSampleFormat::Pcm8;
+            case 16:
+                return WavSampleFormat::Pcm16;
+            case 24:
+                return WavSampleFormat::Pcm24;
+            case 32:
+                return WavSampleFormat::Pcm32;
+            }
+        }
+        else if (tag == WAVE_FORMAT_IEEE_FLOAT)
+        {
+            if (bitsPerSample == 32)
+                return WavSampleFormat::Float32;
+            if (bitsPerSample == 64)
+                return WavSampleFormat::Float64;
+        }
+        return WavSampleFormat::Unknown;
+    }
+
+    size_t bytesPerSample(WavSampleFormat format)
+    {
+        switch (format)
+        {
+        case WavSampleFormat::Pcm8:
+            return 1;
+        case WavSampleFormat::Pcm16:
+            return 2;
+        case WavSampleFormat::Pcm24:
+            return 3;
+        case WavSampleFormat::Pcm32:
+        case WavSampleFormat::Float32:
+            return 4;
+        case WavSampleFormat::Float64:
+            return 8;
+        default:
+            return 0;
+        }
+    }
+
+    // Integer PCM is scaled by 1 / 2^(bits - 1), as libsndfile does, so
+    // both readers give bit-identical samples
+    void convertPcm16(const unsigned char *in, size_t count, float *out)
+    {
+        const float scale = 1.0f / 32768.0f;
+        size_t i = 0;
+#ifdef __SSE2__
+        // Eight samples per step: widen to 32 bits (sign-extending via the
+        // arithmetic shift), convert and scale
+        const __m128 scaleVector = _mm_set1_ps(scale);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i));
+            __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+            __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scaleVector));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scaleVector));
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            out[i] = static_cast<int16_t>(readU16(in + 2 * i)) * scale;
+        }
+    }
+
+    void convertPcm24(const unsigned char *in, size_t count, float *out)
+    {
+        // Each sample goes to the top three bytes of an int32, which keeps
+        // its sign; a branch-free loop the compiler vectorizes
+        const float scale = 1.0f / 2147483648.0f;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const unsigned char *p = in + 3 * i;
+            uint32_t bits = (static_cast<uint32_t>(p[0]) << 8) | (static_cast<uint32_t>(p[1]) << 16) |
+                            (static_cast<uint32_t>(p[2]) << 24);
+            out[i] = static_cast<float>(static_cast<int32_t>(bits)) * scale;
+        }
+    }
+
+    void convertPcm32(const unsigned char *in, size_t count, float *out)
+    {
+        const float scale = 1.0f / 2147483648.0f;
+        for (size_t i = 0; i < count; ++i)
+        {
+            out[i] = static_cast<float>(static_cast<int32_t>(readU32(in + 4 * i))) * scale;
+        }
+    }
+}
+
+// --- WavFile Constructor ---
+WavFile::WavFile()
+    : m_mapping(nullptr),
+      m_mappingSize(0),
+      m_data(nullptr),
+      m_format(WavSampleFormat::Unknown),
+      m_sampleRate(0),
+      m_channels(0),
+      m_frames(0)
+{
+}
+
+// --- WavFile Destructor ---
+WavFile::~WavFile()
+{
+    close();
+}
+
+// --- close Implementation ---
+void WavFile::close()
+{
+    if (m_mapping)
+    {
+        munmap(m_mapping, m_mappingSize);
+        m_mapping = nullptr;
+    }
+    m_mappingSize = 0;
+    m_data = nullptr;
+    m_frames = 0;
+}
+
+// --- open Implementation ---
+bool WavFile::open(const std::string &path, std::string &error)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        error = std::strerror(errno);
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < 12)
+    {
+        ::close(fd);
+        error = "file is too short to be a WAV file";
+        return false;
+    }
+    m_mappingSize = static_cast<size_t>(status.st_size);
+    void *mapping = mmap(nullptr, m_mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // The mapping keeps the file open
+    if (mapping == MAP_FAILED)
+    {
+        error = std::string("cannot map the file: ") + std::strerror(errno);
+        m_mappingSize = 0;
+        return false;
+    }
+    m_mapping = mapping;
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(m_mapping);
+    if (std::memcmp(bytes, "RIFF", 4) != 0 || std::memcmp(bytes + 8, "WAVE", 4) != 0)
+    {
+        error = "not a RIFF/WAVE file";
+        close();
+        return false;
+    }
+
+    // Walk the chunks (each padded to an even size) for fmt and data
+    const unsigned char *fmt = nullptr;
+    size_t fmtSize = 0;
+    size_t dataSize = 0;
+    for (size_t pos = 12; pos + 8 <= m_mappingSize;)
+    {
+        const unsigned char *chunk = bytes + pos;
+        size_t chunkSize = readU32(chunk + 4);
+        size_t available = m_mappingSize - (pos + 8);
+        if (std::memcmp(chunk, "fmt ", 4) == 0)
+        {
+            fmt = chunk + 8;
+            fmtSize = std::min(chunkSize, available);
+        }
+        else if (std::memcmp(chunk, "data", 4) == 0)
+        {
+            m_data = chunk + 8;
+            dataSize = std::min(chunkSize, available); // Truncated (or streamed) files keep what is there
+            break;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    if (fmt == nullptr || fmtSize < 16 || m_data == nullptr)
+    {
+        error = fmt == nullptr || fmtSize < 16 ? "missing fmt chunk" : "missing data chunk";
+        close();
+        return false;
+    }
+
+    uint16_t tag = readU16(fmt);
+    m_channels = readU16(fmt + 2);
+    m_sampleRate = static_cast<int>(readU32(fmt + 4));
+    uint16_t bitsPerSample = readU16(fmt + 14);
+    if (tag == WAVE_FORMAT_EXTENSIBLE && fmtSize >= 40)
+    {
+        tag = readU16(fmt + 24); // First two bytes of the sub-format GUID
+    }
+    m_format = sampleFormatFor(tag, bitsPerSample);
+    if (m_format == WavSampleFormat::Unknown || m_channels <= 0 || m_sampleRate <= 0)
+    {
+        error = "unsupported WAV encoding (format " + std::to_string(tag) + ", " +
+                std::to_string(bitsPerSample) + " bits)";
+        close();
+        return false;
+    }
+
+    m_frames = dataSize / (bytesPerSample(m_format) * m_channels);
+    madvise(m_mapping, m_mappingSize, MADV_WILLNEED); // Start reading ahead now
+    return true;
+}
+
+// --- floatData Implementation ---
+const float *WavFile::floatData() const
+{
+    if (m_format != WavSampleFormat::Float32 ||
+        reinterpret_cast<uintptr_t>(m_data) % alignof(float) != 0)
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<const float *>(m_data);
+}
+
+// --- int16Data Implementation ---
+const int16_t *WavFile::int16Data() const
+{
+    if (m_format != WavSampleFormat::Pcm16 ||
+        reinterpret_cast<uintptr_t>(m_data) % alignof(int16_t) != 0)
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<const int16_t *>(m_data);
+}
+
+// --- readFloat Implementation ---
+void WavFile::readFloat(std::vector<float> &out) const
+{
+    const size_t count = numSamples();
+    out.resize(count);
+    switch (m_format)
+    {
+    case WavSampleFormat::Pcm8:
+        for (size_t i = 0; i < count; ++i)
+        {
+            out[i] = (static_cast<int>(m_data[i]) - 128) / 128.0f;
+        }
+        break;
+    case WavSampleFormat::Pcm16:
+        convertPcm16(m_data, count, out.data());
+        break;
+    case WavSampleFormat::Pcm24:
+        convertPcm24(m_data, count, out.data());
+        break;
+    case WavSampleFormat::Pcm32:
+        convertPcm32(m_data, count, out.data());
+        break;
+    case WavSampleFormat::Float32:
+        std::memcpy(out.data(), m_data, count * sizeof(float)); // Unaligned or wanted as a copy
+        break;
+    case WavSampleFormat::Float64:
+        for (size_t i = 0; i < count; ++i)
+        {
+            double value;
+            std::memcpy(&value, m_data + 8 * i, sizeof(double));
+            out[i] = static_cast<float>(value);
+        }
+        break;
+    default:
+        out.clear();
+        break;
+    }
+}
@@ -0,0 +1,75 @@
+// WavReader.h
+
+#ifndef WAV_READER_H
+#define WAV_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Encoding of the samples in a WAV file's data chunk
+enum class WavSampleFormat
+{
+    Pcm8,    // Unsigned 8-bit
+    Pcm16,   // Signed 16-bit
+    Pcm24,   // Signed 24-bit, packed in 3 bytes
+    Pcm32,   // Signed 32-bit
+    Float32, // IEEE float
+    Float64, // IEEE double
+    Unknown
+};
+
+// Built-in WAV reader: memory-maps a file and parses its RIFF header, fmt
+// chunk and data chunk, without decoding or copying anything. 32-bit float
+// data can then be read in place, straight from the mapping; any other
+// encoding is converted to float by readFloat() (SSE2 for 16-bit). Loading
+// a float sample this way costs the page faults of touching it, nothing
+// more. Handles plain PCM/float and WAVE_FORMAT_EXTENSIBLE headers; assumes
+// a little-endian host, like the raw .pcm output. A file replaced by rename
+// (as mml_libtool writes them) is safe to change while mapped; one
+// truncated in place is not.
+class WavFile
+{
+public:
+    WavFile();
+    ~WavFile(); // Unmaps the file; pointers from floatData() die with it
+
+    WavFile(const WavFile &) = delete;
+    WavFile &operator=(const WavFile &) = delete;
+
+    // Maps 'path' and parses its headers. Returns false, with the reason in
+    // 'error', if the file cannot be read or is not a WAV file this reader
+    // understands.
+    bool open(const std::string &path, std::string &error);
+
+    int sampleRate() const { return m_sampleRate; }
+    int channels() const { return m_channels; }
+    size_t frames() const { return m_frames; }
+    size_t numSamples() const { return m_frames * m_channels; } // Interleaved
+    WavSampleFormat format() const { return m_format; }
+
+    // The interleaved samples inside the mapping, if they are 32-bit float
+    // and suitably aligned to be read in place; nullptr otherwise
+    const float *floatData() const;
+
+    // Likewise for 16-bit PCM, for an engine that stores samples as int16
+    const int16_t *int16Data() const;
+
+    // Converts every sample to float in [-1, 1] and stores them, interleaved,
+    // in 'out' (resized to numSamples())
+    void readFloat(std::vector<float> &out) const;
+
+private:
+    void *m_mapping;
+    size_t m_mappingSize;
+    const unsigned char *m_data; // Start of the data chunk's samples
+    WavSampleFormat m_format;
+    int m_sampleRate;
+    int m_channels;
+    size_t m_frames;
+
+    void close();
+};
+
+#endif // WAV_READER_H
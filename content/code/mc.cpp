@@ -1,24 +1,701 @@
 // main.cpp
+#include "AllocAccounting.h"
+#include "AudioEncoder.h"
 #include "AudioUtils.h"
+#include "BatchShard.h"
+#include "FileWatcher.h"
+#include "MasterBus.h"
 #include "MMLParser.h"
 #include "NoteDecoder.h"
+#include "RenderLimits.h"
+#include "SparseTrack.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 #include <iostream>
 #include <fstream> // Required for file operations
+#include <algorithm> // For std::min, std::max
+#include <chrono>    // For timing watch-mode re-renders
+#include <cstdio>    // For std::rename
+#include <filesystem> // For batch output directories
 
 // COMPILE:
-// g++ main.cpp MMLParser.cpp NoteDecoder.cpp AudioUtils.cpp -o mml_player -lsndfile -std=c++17
+// g++ mc.cpp AllocAccounting.cpp MMLParser.cpp NoteDecoder.cpp NoiseGenerator.cpp AudioUtils.cpp AudioEncoder.cpp BatchShard.cpp FileWatcher.cpp MasterBus.cpp RenderArena.cpp RenderLimits.cpp PitchShift.cpp SampleStore.cpp SampleType.cpp ThreadPool.cpp LibraryManifest.cpp SparseTrack.cpp Trace.cpp WavReader.cpp -o mml_player -lsndfile -std=c++17 -pthread
+// Without libsndfile (raw and WAV output only): add -DMML_NO_SNDFILE and drop -lsndfile
 // USE:
-// ./mml_player /path/to/your/waveform/library song.mml
+// ./mml_player [options] /path/to/your/waveform/library song.mml [output_file]
+// ./mml_player --batch songs/ [--shard i/n] [options] /path/to/library [output_dir]
+// The output file's extension picks the format: .pcm (raw 32-bit float, the
+// default), .wav, .flac, .ogg, .opus or .mp3. Encoding runs on its own
+// thread while the song renders; no intermediate .pcm file is written.
+// OPTIONS:
+//   --no-limiter         Skip the master bus limiter (peaks are hard-clipped instead)
+//   --normalize <LUFS>   Normalize loudness to the target (e.g., --normalize -16)
+//   --rate <Hz>          Output sample rate (default 44100)
+//   --draft              Fast preview: 22050 Hz (unless --rate is given), no
+//                        limiter and no declick ramps
+//   --start <s>          Render only from this time (seconds) ...
+//   --end <s>            ... up to this time, without rendering the rest
+//   --threads <N>        Render threads (default: one per core; 1 = single-threaded)
+//   --watch              Keep running; on every save of the MML file re-render
+//                        only the part of the song the edit changed and rewrite
+//                        the output (a library change re-renders everything)
+//   --trace <file.json>  Record a per-thread timeline of the render (parsing,
+//                        sample loads, mixing, master bus, encoding) as a
+//                        Chrome trace; open it in chrome://tracing or
+//                        ui.perfetto.dev
+//   --track <file.mml>   Mix another track of the song into the output (repeat
+//                        for each track); tracks are held and mixed as runs
+//                        of audio, so mostly-silent ones cost little
+//   --alloc-budget <N>   Allocation self-check (needs a build with
+//                        -DMML_ALLOC_ACCOUNTING): render the warmed song block
+//                        by block and fail if any block allocates more than N
+//                        times. Such a build also reports every run's
+//                        allocations per stage.
+//   --max-duration <s>   Resource limits for generated MML: each track is
+//   --max-events <N>     compiled, its cost (length, events, voices, memory)
+//   --max-polyphony <N>  estimated, and it is rejected before rendering if it
+//   --max-memory <MiB>   breaks any of them (a runaway repeat stops compiling
+//                        at the limit)
+//   --truncate           Cut a track down to the limits instead of rejecting it
+//   --timeout <s>        Abandon the render (and fail) after this many seconds
+//   --int16              16-bit engine for 16-bit deliverables: samples are
+//                        stored, mixed (with saturating adds) and written as
+//                        int16, halving the memory traffic. There is no
+//                        master bus: peaks clip (no limiter or --normalize).
+//                        .wav/.flac are written 16-bit, .pcm as s16le.
+//   --sample-cache <MiB> Decoded samples kept between songs (default 64);
+//                        the rest stay packed (see SampleStore.h)
+//   --sampler            Play pitched instruments from root samples: each note
+//                        comes from the nearest note file the instrument has,
+//                        pitch-shifted, so a library needs only a few per
+//                        instrument, and notes past its octaves still play
+//   --root-spacing <N>   Sampler mode using only roots N semitones apart,
+//                        counted from A (12 = one A per octave)
+//   --seed <N>           Seed of the generated noise instrument (default 0);
+//                        the same seed renders the same noise
+//   --batch <dir>        Render every .mml file below the directory to the
+//                        same relative path below output_dir (default: the
+//                        directory itself), skipping songs whose output is
+//                        already complete
+//   --shard i/n          Batch mode on n machines: this one renders only the
+//                        songs whose path hashes to shard i (0 to n - 1).
+//                        Outputs appear by atomic rename and songs in progress
+//                        hold a claim file, so a crashed shard is simply run
+//                        again (see BatchShard.h)
+//   --batch-format <ext> Batch output format (default wav)
+//   --claim-ttl <s>      Time after which another machine's claim counts as
+//                        abandoned if it was not touched (a claimant touches
+//                        its claims every quarter of this; default 3600)
+// Pitched notes take a detune in cents after the octave: sqr:A4+25c, sqr:C-10c.
+
+// Writes finished audio under a temporary name and renames it over the
+// output, so a player never sees the file half-written
+static bool writeOutputFile(const std::vector<float> &audio, int sampleRate, const std::string &outputFilename)
+{
+    // Keep the extension last: it picks the format
+    size_t dot = outputFilename.find_last_of('.');
+    std::string tempFilename = dot == std::string::npos ? outputFilename + ".tmp"
+                                                        : outputFilename.substr(0, dot) + ".tmp" + outputFilename.substr(dot);
+    AudioEncoder encoder;
+    if (!encoder.open(tempFilename, sampleRate))
+    {
+        return false;
+    }
+    encoder.write(audio.data(), audio.size());
+    if (!encoder.close() || std::rename(tempFilename.c_str(), outputFilename.c_str()) != 0)
+    {
+        std::cerr << "Error: Failed to replace " << outputFilename << "." << std::endl;
+        std::remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Admission control for one compiled track: reports its estimated cost and
+// checks it against the limits, cutting it down if they allow truncation.
+// Returns false (after saying why) if the track must not be rendered.
+static bool admitTrack(CompiledSong &song, const RenderLimits &limits, const std::string &trackPath)
+{
+    song.estimateCost().print(std::cout, song.sampleRate);
+    std::string reason;
+    if (!song.admit(limits, reason))
+    {
+        std::cerr << "Error: " << trackPath << " rejected: " << reason << "." << std::endl;
+        return false;
+    }
+    if (song.truncated)
+    {
+        std::cerr << "Warning: " << trackPath << " " << reason << "." << std::endl;
+    }
+    return true;
+}
+
+// --- Watch mode ---
+// Keeps the rendered mix (before the master bus) and the compiled song of the
+// last version. After an edit the new version's timeline is diffed against
+// the old one; only the events between the unchanged head and tail are
+// rendered, and the old mix's tail is moved to its new position. The master
+// bus resumes from its checkpoint before the edit and rejoins its last pass
+// after it, so both stages cost what the edit changed; the file itself is
+// still rewritten whole.
+static int runWatchMode(MMLParser &parser, ThreadPool &pool, const std::string &mmlFilePath,
+                        const std::string &outputFilename, const MasterBusSettings &settings,
+                        const std::string &tracePath)
+{
+    CompiledSong song = parser.compileSong(readFileIntoString(mmlFilePath));
+    std::vector<float> mix = song.renderRangeParallel(pool, 0, song.totalSamples);
+    IncrementalMasterBus masterBus(song.sampleRate, settings);
+    if (mix.empty() || !writeOutputFile(masterBus.process(mix), song.sampleRate, outputFilename))
+    {
+        std::cerr << "Error: Initial render failed." << std::endl;
+        return 1;
+    }
+    if (!tracePath.empty())
+    {
+        Trace::write(tracePath); // Rewritten after every update: it covers the session so far
+    }
+
+    FileWatcher watcher;
+    if (!watcher.watchFile(mmlFilePath))
+    {
+        return 1;
+    }
+    watcher.watchTree(parser.getLibraryPath());
+    std::cout << "Watching " << mmlFilePath << " and " << parser.getLibraryPath()
+              << " for changes (Ctrl+C to stop)." << std::endl;
+
+    while (true)
+    {
+        std::vector<std::string> changed = watcher.waitForChanges();
+        if (changed.empty())
+        {
+            break;
+        }
+        auto started = std::chrono::steady_clock::now();
+        bool libraryChanged = std::any_of(changed.begin(), changed.end(), [&](const std::string &path)
+                                          { return path != mmlFilePath; });
+
+        std::string mmlString = readFileIntoString(mmlFilePath);
+        if (mmlString.empty())
+        {
+            continue; // Deleted or empty for the moment; wait for the next save
+        }
+
+        size_t renderedSamples;
+        const std::vector<float> *finished;
+        if (libraryChanged)
+        {
+            // Cached samples may be stale: reload them and render everything
+            parser.reloadLibrary();
+            song = parser.compileSong(mmlString);
+            mix = song.renderRangeParallel(pool, 0, song.totalSamples);
+            renderedSamples = mix.size();
+            finished = &masterBus.process(mix);
+        }
+        else
+        {
+            CompiledSong next = parser.compileSong(mmlString);
+            TimelineDiff diff = next.diff(song);
+            if (diff.unchanged())
+            {
+                std::cout << "No audible change." << std::endl;
+                song = std::move(next);
+                continue;
+            }
+
+            // Unchanged head, re-rendered middle, unchanged (moved) tail
+            std::vector<float> middle = next.renderRangeParallel(pool, diff.start, diff.newEnd);
+            std::vector<float> spliced;
+            spliced.reserve(next.totalSamples);
+            spliced.insert(spliced.end(), mix.begin(), mix.begin() + diff.start);
+            spliced.insert(spliced.end(), middle.begin(), middle.end());
+            spliced.insert(spliced.end(), mix.begin() + diff.oldEnd, mix.end());
+            mix.swap(spliced);
+            song = std::move(next);
+            renderedSamples = middle.size();
+            finished = &masterBus.update(mix, diff.start, diff.newEnd, diff.oldEnd);
+        }
+        auto processed = std::chrono::steady_clock::now();
+
+        if (finished->empty() || !writeOutputFile(*finished, song.sampleRate, outputFilename))
+        {
+            std::cerr << "Error: Could not write the new version; still watching." << std::endl;
+            continue;
+        }
+        auto written = std::chrono::steady_clock::now();
+        std::cout << "Re-rendered " << static_cast<double>(renderedSamples) / song.sampleRate << "s and re-limited "
+                  << static_cast<double>(masterBus.lastProcessedSamples()) / song.sampleRate << "s of "
+                  << static_cast<double>(song.totalSamples) / song.sampleRate << "s in "
+                  << std::chrono::duration<double, std::milli>(processed - started).count() << " ms (write "
+                  << std::chrono::duration<double, std::milli>(written - processed).count() << " ms)" << std::endl;
+        if (!tracePath.empty())
+        {
+            Trace::write(tracePath);
+        }
+    }
+    return 0;
+}
+
+// --- Multi-track mixdown ---
+// Every track is rendered as a run list, so a track that is mostly rests
+// holds and mixes only its audible runs. The tracks are summed chunk by
+// chunk into one reused buffer, which goes through the master bus to the
+// encoder. A chunk no track sounds in is not mixed, and when the master bus
+// hands it back as pure silence only its length is queued for the writer.
+// Normalization measures the whole mix, so it is summed up front.
+static bool writeMixdown(const std::vector<SparseTrack> &tracks, int sampleRate,
+                         const MasterBusSettings &settings, AudioEncoder &encoder)
+{
+    size_t numSamples = 0;
+    for (const SparseTrack &track : tracks)
+    {
+        numSamples = std::max(numSamples, track.totalSamples());
+    }
+
+    float inputGain = 1.0f;
+    if (settings.normalize)
+    {
+        std::vector<float> mix(numSamples, 0.0f);
+        for (const SparseTrack &track : tracks)
+        {
+            track.mixInto(0, numSamples, 1.0f, mix.data());
+        }
+        inputGain = normalizationGain(mix.data(), mix.size(), sampleRate, settings);
+    }
+
+    const size_t CHUNK_SAMPLES = 1 << 16;
+    MasterBusStream masterBus(sampleRate, settings, inputGain);
+    std::vector<float> chunk(std::max(CHUNK_SAMPLES, masterBus.latency()));
+    bool writeOk = true;
+    for (size_t from = 0; from < numSamples && writeOk; from += CHUNK_SAMPLES)
+    {
+        TRACE_SCOPE("mixdown chunk", "render");
+        size_t to = std::min(numSamples, from + CHUNK_SAMPLES);
+        std::fill(chunk.begin(), chunk.begin() + (to - from), 0.0f);
+        bool audible = false;
+        for (const SparseTrack &track : tracks)
+        {
+            if (track.hasAudio(from, to))
+            {
+                track.mixInto(from, to, 1.0f, chunk.data());
+                audible = true;
+            }
+        }
+        size_t ready = masterBus.process(chunk.data(), to - from, chunk.data());
+        if (!audible && std::all_of(chunk.begin(), chunk.begin() + ready, [](float sample)
+                                    { return sample == 0.0f; }))
+        {
+            writeOk = encoder.writeSilence(ready);
+        }
+        else
+        {
+            writeOk = encoder.write(chunk.data(), ready);
+        }
+    }
+    if (writeOk)
+    {
+        writeOk = encoder.write(chunk.data(), masterBus.finish(chunk.data()));
+    }
+    return writeOk;
+}
+
+// --- Single-track render ---
+// Renders [startSample, endSample) of one track into 'encoder'. Returns
+// false if writing failed; a cancelled render just stops early.
+static bool renderTrack(const CompiledSong &song, ThreadPool &pool, size_t startSample, size_t endSample,
+                        const MasterBusSettings &settings, SampleType sampleType, AudioEncoder &encoder,
+                        const CancellationToken &cancel)
+{
+    bool writeOk = true;
+    if (sampleType == SampleType::Int16)
+    {
+        // --- 16-bit engine: render and encode int16 chunks ---
+        // The saturating mix is the output; there is no master bus pass
+        const size_t chunkSamples = pool.size() * (4 << 16);
+        for (size_t from = startSample; from < endSample && writeOk && !cancel.cancelled(); from += chunkSamples)
+        {
+            TRACE_SCOPE("chunk", "render");
+            size_t to = std::min(endSample, from + chunkSamples);
+            std::vector<int16_t> chunk = song.renderRangeParallel<int16_t>(pool, from, to, &cancel);
+            writeOk = encoder.write(chunk.data(), chunk.size());
+        }
+        return writeOk;
+    }
+
+    // --- Render, master bus and encode as a pipeline ---
+    // The range is rendered in chunks, each split across the pool. A chunk
+    // goes through the master bus and is handed to the encoder's writer
+    // thread, which encodes it while the next chunk renders. Normalization
+    // needs the loudness of the whole range, so with --normalize the range
+    // is rendered up front and encoding overlaps the master bus pass only.
+    const size_t chunkSamples = pool.size() * (4 << 16); // Four 64K-sample segments per thread
+    std::vector<float> rendered;
+    float inputGain = 1.0f;
+    if (settings.normalize)
+    {
+        rendered = song.renderRangeParallel(pool, startSample, endSample, &cancel);
+        inputGain = normalizationGain(rendered.data(), rendered.size(), song.sampleRate, settings);
+    }
+
+    MasterBusStream masterBus(song.sampleRate, settings, inputGain);
+    std::vector<float> chunk;
+    for (size_t from = startSample; from < endSample && writeOk && !cancel.cancelled(); from += chunkSamples)
+    {
+        TRACE_SCOPE("chunk", "render");
+        size_t to = std::min(endSample, from + chunkSamples);
+        float *data;
+        if (rendered.empty())
+        {
+            chunk = song.renderRangeParallel(pool, from, to, &cancel);
+            data = chunk.data();
+        }
+        else
+        {
+            data = rendered.data() + (from - startSample);
+        }
+        size_t ready = masterBus.process(data, to - from, data); // In place
+        writeOk = encoder.write(data, ready);
+    }
+    std::vector<float> tail(masterBus.latency());
+    if (writeOk && !cancel.cancelled())
+    {
+        writeOk = encoder.write(tail.data(), masterBus.finish(tail.data()));
+    }
+    return writeOk;
+}
+
+// --- Batch mode ---
+// Renders every song below 'batchDir' that belongs to this machine's shard
+// (see BatchShard.h) to the same relative path below 'outputDir', with
+// 'extension'. Songs whose output is complete are skipped and songs another
+// live process has claimed are left to it, so running the same shard again
+// after a crash renders only what is missing. Each output is encoded under
+// a temporary name and renamed into place. Returns 1 if any song failed.
+static int runBatchMode(MMLParser &parser, ThreadPool &pool, const std::string &batchDir,
+                        const std::string &outputDir, const std::string &extension, const ShardSpec &shard,
+                        double claimTtlSeconds, const MasterBusSettings &settings, SampleType sampleType,
+                        const RenderLimits &limits, double timeoutSeconds)
+{
+    std::vector<std::string> songs = listBatchSongs(batchDir);
+    size_t owned = 0, rendered = 0, complete = 0, busy = 0, failed = 0;
+    for (const std::string &relativePath : songs)
+    {
+        if (!shard.owns(relativePath))
+        {
+            continue;
+        }
+        owned++;
+        std::string songPath = batchDir + "/" + relativePath;
+        std::string outputPath = outputDir + "/" + relativePath.substr(0, relativePath.length() - 4) + extension;
+        if (outputComplete(songPath, outputPath))
+        {
+            complete++;
+            continue;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(outputPath).parent_path(), ec);
+        SongClaim claim;
+        ClaimStatus status = claim.acquire(outputPath, claimTtlSeconds);
+        if (status != ClaimStatus::Claimed)
+        {
+            (status == ClaimStatus::Busy ? busy : failed)++;
+            continue;
+        }
+        if (outputComplete(songPath, outputPath))
+        {
+            complete++; // Finished by the previous claimant in the meantime
+            continue;
+        }
+
+        std::cout << "\n--- Rendering " << relativePath << " ---" << std::endl;
+        std::string mml = readFileIntoString(songPath);
+        if (mml.empty())
+        {
+            std::cerr << "Error: Failed to read " << songPath << "." << std::endl;
+            failed++;
+            continue;
+        }
+        CompiledSong song = parser.compileSong(mml, limits);
+        if (limits.any() && !admitTrack(song, limits, songPath))
+        {
+            failed++;
+            continue;
+        }
+        if (song.totalSamples == 0)
+        {
+            std::cerr << "Error: " << songPath << " generated no audio data." << std::endl;
+            failed++;
+            continue;
+        }
+
+        CancellationToken cancel;
+        if (timeoutSeconds > 0.0)
+        {
+            cancel.cancelAfter(timeoutSeconds);
+        }
+        std::string tempPath = claim.tempPath();
+        AudioEncoder encoder;
+        if (!encoder.open(tempPath, song.sampleRate, sampleType))
+        {
+            failed++;
+            continue;
+        }
+        bool writeOk = renderTrack(song, pool, 0, song.totalSamples, settings, sampleType, encoder, cancel);
+        bool closeOk = encoder.close();
+        if (cancel.cancelled() || !writeOk || !closeOk || std::rename(tempPath.c_str(), outputPath.c_str()) != 0)
+        {
+            std::remove(tempPath.c_str());
+            std::cerr << "Error: " << (cancel.cancelled() ? "Render abandoned (--timeout)" : "Failed to save")
+                      << ": " << outputPath << "." << std::endl;
+            failed++;
+            continue;
+        }
+        std::cout << "Audio saved to " << outputPath << std::endl;
+        rendered++;
+    }
+
+    std::cout << "\nShard " << shard.index << "/" << shard.count << ": " << owned << " of " << songs.size()
+              << " songs; rendered " << rendered << ", already complete " << complete << ", claimed elsewhere "
+              << busy << ", failed " << failed << "." << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+// --- Allocation self-check ---
+// Renders the whole song twice, block by block, through the mixer and the
+// master bus into one reused buffer, the way a real-time host would. The
+// first pass warms up (samples, scratch buffers); the second is counted,
+// and the check fails if any block allocated more than 'budget' times.
+static const size_t ALLOC_CHECK_BLOCK_SAMPLES = 4096;
+
+static int runAllocCheck(const CompiledSong &song, const MasterBusSettings &settings, uint64_t budget)
+{
+    if (!AllocAccounting::available())
+    {
+        std::cerr << "Error: --alloc-budget needs a build with -DMML_ALLOC_ACCOUNTING." << std::endl;
+        return 1;
+    }
+    if (song.totalSamples == 0)
+    {
+        std::cerr << "Parsing generated no audio data." << std::endl;
+        return 1;
+    }
+
+    std::vector<float> block(ALLOC_CHECK_BLOCK_SAMPLES);
+    uint64_t worstBlockAllocations = 0;
+    size_t worstBlockStart = 0;
+    size_t numBlocks = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        MasterBusStream masterBus(song.sampleRate, settings); // Set up before counting starts
+        AllocAccounting::reset();
+        for (size_t from = 0; from < song.totalSamples; from += ALLOC_CHECK_BLOCK_SAMPLES)
+        {
+            size_t to = std::min(song.totalSamples, from + ALLOC_CHECK_BLOCK_SAMPLES);
+            uint64_t before = AllocAccounting::total().allocations;
+            std::fill(block.begin(), block.begin() + (to - from), 0.0f);
+            song.renderRangeInto(from, to, block.data());
+            masterBus.process(block.data(), to - from, block.data());
+            uint64_t allocations = AllocAccounting::total().allocations - before;
+            if (pass == 1)
+            {
+                numBlocks++;
+                if (allocations > worstBlockAllocations)
+                {
+                    worstBlockAllocations = allocations;
+                    worstBlockStart = from;
+                }
+            }
+        }
+    }
+
+    std::cout << "Steady-state allocations over " << numBlocks << " blocks of " << ALLOC_CHECK_BLOCK_SAMPLES
+              << " samples:" << std::endl;
+    AllocAccounting::report(std::cout);
+    if (worstBlockAllocations > budget)
+    {
+        std::cerr << "Error: Allocation budget exceeded: the block at "
+                  << static_cast<double>(worstBlockStart) / song.sampleRate << "s allocated "
+                  << worstBlockAllocations << " times (budget " << budget << " per block)." << std::endl;
+        return 1;
+    }
+    std::cout << "Allocation check passed: at most " << worstBlockAllocations << " allocations per block (budget "
+              << budget << ")." << std::endl;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     // --- Parse Command Line Arguments ---
-    if (argc < 3)
-    { // Now expecting at least 3 arguments: program_name, waveform_path, mml_file_path
-        std::cerr << "Usage: " << argv[0] << " <waveform_library_path> <mml_file_path> [output_pcm_filename]" << std::endl;
+    // Options may appear anywhere; everything else is positional.
+    MasterBusSettings masterBusSettings;
+    int sampleRate = 0; // 0 = not given on the command line
+    bool draftMode = false;
+    double rangeStartSeconds = 0.0;
+    double rangeEndSeconds = -1.0; // Negative = until the end of the song
+    size_t numThreads = 0;         // 0 = one per hardware thread
+    bool watchMode = false;
+    std::string tracePath; // Empty = no trace
+    long long allocBudget = -1; // Negative = no allocation self-check
+    std::vector<std::string> extraTrackPaths; // Mixed with the main track
+    RenderLimits limits;                       // None unless given
+    double timeoutSeconds = 0.0;               // 0 = no timeout
+    SampleType sampleType = SampleType::Float32;
+    long long sampleCacheMiB = -1;             // Negative = the store's default
+    bool samplerMode = false;
+    int rootSpacing = 0;                       // 0 = every note file is a root
+    unsigned long long noiseSeed = 0;
+    std::string batchDir;                      // Empty = render one song
+    ShardSpec shard;                           // 0/1 = every song
+    bool shardGiven = false;
+    std::string batchExtension = ".wav";
+    double claimTtlSeconds = 3600.0;
+    std::vector<std::string> positionalArgs;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--no-limiter")
+        {
+            masterBusSettings.limiterEnabled = false;
+        }
+        else if (arg == "--normalize" && i + 1 < argc)
+        {
+            masterBusSettings.normalize = true;
+            masterBusSettings.targetLoudnessLUFS = std::stod(argv[++i]);
+        }
+        else if (arg == "--rate" && i + 1 < argc)
+        {
+            sampleRate = std::stoi(argv[++i]);
+            if (sampleRate < 4000 || sampleRate > 192000)
+            {
+                std::cerr << "Error: Unsupported sample rate " << sampleRate << " Hz." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--draft")
+        {
+            draftMode = true;
+        }
+        else if (arg == "--start" && i + 1 < argc)
+        {
+            rangeStartSeconds = std::stod(argv[++i]);
+        }
+        else if (arg == "--end" && i + 1 < argc)
+        {
+            rangeEndSeconds = std::stod(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            numThreads = static_cast<size_t>(std::max(1, std::stoi(argv[++i])));
+        }
+        else if (arg == "--watch")
+        {
+            watchMode = true;
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            tracePath = argv[++i];
+        }
+        else if (arg == "--track" && i + 1 < argc)
+        {
+            extraTrackPaths.push_back(argv[++i]);
+        }
+        else if (arg == "--alloc-budget" && i + 1 < argc)
+        {
+            allocBudget = std::max(0LL, std::stoll(argv[++i]));
+        }
+        else if (arg == "--max-duration" && i + 1 < argc)
+        {
+            limits.maxDurationSeconds = std::max(0.0, std::stod(argv[++i]));
+        }
+        else if (arg == "--max-events" && i + 1 < argc)
+        {
+            limits.maxEvents = static_cast<size_t>(std::max(0LL, std::stoll(argv[++i])));
+        }
+        else if (arg == "--max-polyphony" && i + 1 < argc)
+        {
+            limits.maxPolyphony = static_cast<size_t>(std::max(0LL, std::stoll(argv[++i])));
+        }
+        else if (arg == "--max-memory" && i + 1 < argc)
+        {
+            limits.maxBytes = static_cast<size_t>(std::max(0LL, std::stoll(argv[++i]))) << 20;
+        }
+        else if (arg == "--truncate")
+        {
+            limits.truncate = true;
+        }
+        else if (arg == "--timeout" && i + 1 < argc)
+        {
+            timeoutSeconds = std::max(0.0, std::stod(argv[++i]));
+        }
+        else if (arg == "--int16")
+        {
+            sampleType = SampleType::Int16;
+        }
+        else if (arg == "--sample-cache" && i + 1 < argc)
+        {
+            sampleCacheMiB = std::max(0LL, std::stoll(argv[++i]));
+        }
+        else if (arg == "--sampler")
+        {
+            samplerMode = true;
+        }
+        else if (arg == "--root-spacing" && i + 1 < argc)
+        {
+            samplerMode = true;
+            rootSpacing = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            noiseSeed = std::stoull(argv[++i]);
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batchDir = argv[++i];
+            while (batchDir.length() > 1 && batchDir.back() == '/')
+            {
+                batchDir.pop_back();
+            }
+        }
+        else if (arg == "--shard" && i + 1 < argc)
+        {
+            if (!parseShardSpec(argv[++i], shard))
+            {
+                return 1;
+            }
+            shardGiven = true;
+        }
+        else if (arg == "--batch-format" && i + 1 < argc)
+        {
+            batchExtension = argv[++i];
+            if (batchExtension.empty() || batchExtension[0] != '.')
+            {
+                batchExtension = "." + batchExtension;
+            }
+        }
+        else if (arg == "--claim-ttl" && i + 1 < argc)
+        {
+            claimTtlSeconds = std::max(0.0, std::stod(argv[++i]));
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+        else
+        {
+            positionalArgs.push_back(arg);
+        }
+    }
+
+    if (positionalArgs.size() < (batchDir.empty() ? 2u : 1u))
+    { // Expecting at least 2 positional arguments: waveform_path, mml_file_path (batch mode: waveform_path)
+        std::cerr << "Usage: " << argv[0] << " [--no-limiter] [--normalize <LUFS>] [--rate <Hz>] [--draft] [--start <s>] [--end <s>] [--threads <N>] [--watch] [--trace <file.json>] [--track <file.mml>]... [--alloc-budget <N>] [--max-duration <s>] [--max-events <N>] [--max-polyphony <N>] [--max-memory <MiB>] [--truncate] [--timeout <s>] [--int16] [--sample-cache <MiB>] [--sampler] [--root-spacing <N>] [--seed <N>] <waveform_library_path> <mml_file_path> [output_file (.pcm/.wav/.flac/.ogg/.opus/.mp3)]" << std::endl;
+        std::cerr << "       " << argv[0] << " --batch <song_dir> [--shard i/n] [--batch-format <ext>] [--claim-ttl <s>] [options] <waveform_library_path> [output_dir]" << std::endl;
         return 1;
     }
 
-    std::string waveformLibraryPath = argv[1]; // First argument is the waveform library path
+    std::string waveformLibraryPath = positionalArgs[0]; // First argument is the waveform library path
 
     // --- Normalize waveformLibraryPath: remove trailing slash if present ---
     if (!waveformLibraryPath.empty())
@@ -31,16 +708,88 @@ int main(int argc, char *argv[])
         }
     }
 
-    std::string mmlFilePath = argv[2];                  // Second argument is the MML file path
-    std::string outputPcmFilename = "output_audio.pcm"; // Default output filename
+    std::string mmlFilePath;                            // Second argument is the MML file path
+    std::string outputFilename = "output_audio.pcm";    // Default output filename
 
-    if (argc > 3)
-    { // If there's a third argument, it's the custom output filename
-        outputPcmFilename = argv[3];
+    if (!batchDir.empty())
+    { // Batch mode: the second argument, if any, is the output directory
+        outputFilename = positionalArgs.size() > 1 ? positionalArgs[1] : batchDir;
+        if (watchMode || !extraTrackPaths.empty() || allocBudget >= 0 || rangeStartSeconds > 0.0 ||
+            rangeEndSeconds >= 0.0)
+        {
+            std::cerr << "Error: --batch renders whole songs, one at a time; it cannot be combined with --watch, "
+                      << "--track, --alloc-budget or --start/--end." << std::endl;
+            return 1;
+        }
+    }
+    else if (shardGiven)
+    {
+        std::cerr << "Error: --shard splits a --batch directory; give one with --batch <dir>." << std::endl;
+        return 1;
+    }
+    else
+    {
+        mmlFilePath = positionalArgs[1];
+        if (positionalArgs.size() > 2)
+        { // If there's a third argument, it's the custom output filename
+            outputFilename = positionalArgs[2];
+        }
+    }
+
+    // --- Draft preset: a rough listen at a fraction of the cost ---
+    if (draftMode)
+    {
+        masterBusSettings.limiterEnabled = false;
+        if (sampleRate == 0)
+        {
+            sampleRate = DRAFT_SAMPLE_RATE;
+        }
+        std::cout << "Draft render: " << sampleRate << " Hz mono, no limiter, no declick." << std::endl;
+    }
+    if (sampleRate == 0)
+    {
+        sampleRate = SAMPLE_RATE;
+    }
+    if (sampleType == SampleType::Int16)
+    {
+        if (masterBusSettings.normalize || watchMode || !extraTrackPaths.empty() || allocBudget >= 0)
+        {
+            std::cerr << "Error: --int16 renders straight to 16-bit without the master bus; it cannot be combined "
+                      << "with --normalize, --watch, --track or --alloc-budget." << std::endl;
+            return 1;
+        }
+        std::cout << "16-bit render: int16 samples and mix, saturating (no limiter)." << std::endl;
+    }
+
+    // --- Start tracing before any work (and any worker thread) starts ---
+    if (!tracePath.empty())
+    {
+        Trace::enable();
+        Trace::setThreadName("main");
     }
 
     // --- Instantiate Parser ---
-    MMLParser parser(waveformLibraryPath, 120.0, 4, 4, 100);
+    MMLParser parser(waveformLibraryPath, 120.0, 4, 4, 100, sampleRate);
+    parser.setDeclickEnabled(!draftMode);
+    parser.setSampleType(sampleType);
+    parser.setSamplerMode(samplerMode, rootSpacing);
+    parser.setNoiseSeed(noiseSeed);
+    if (sampleCacheMiB >= 0)
+    {
+        parser.setSampleCacheBudget(static_cast<size_t>(sampleCacheMiB) << 20);
+    }
+
+    if (!batchDir.empty())
+    {
+        ThreadPool pool(numThreads);
+        int result = runBatchMode(parser, pool, batchDir, outputFilename, batchExtension, shard, claimTtlSeconds,
+                                  masterBusSettings, sampleType, limits, timeoutSeconds);
+        if (!tracePath.empty())
+        {
+            Trace::write(tracePath);
+        }
+        return result;
+    }
 
     // --- DEBUG PARSING ---
     std::vector<ParsedCommand> debugOutput = parser.debugParseMML(mmlFilePath);
@@ -53,8 +802,9 @@ int main(int argc, char *argv[])
             std::cout << "NOTE { Folder: " << note.folderAbbr
                       << ", Name: " << note.noteName
                       << ", Accidental: '" << note.accidental
-                      << "', Length: " << note.length
-                      << ", Octave: " << note.octave
+                      << "', Length: " << (note.length > 0 ? std::to_string(note.length) : "default")
+                      << ", Octave: " << (note.octave >= 0 ? std::to_string(note.octave) : "default")
+                      << ", Cents: " << note.cents
                       << ", Explicit Duration: " << note.explicitDurationSeconds << "s }";
         }
         else if (cmd.type == CommandType::TEMPO)
@@ -93,11 +843,25 @@ int main(int argc, char *argv[])
             {
                 if (!firstNote)
                     std::cout << ", ";
-                std::cout << note.folderAbbr << ":" << note.noteName << note.accidental << note.octave; // Simplified for brevity
+                std::cout << note.folderAbbr << ":" << note.noteName << note.accidental; // Simplified for brevity
+                if (note.octave >= 0)
+                    std::cout << note.octave;
                 firstNote = false;
             }
             std::cout << "] }";
         }
+        else if (cmd.type == CommandType::REPEAT)
+        {
+            const auto &repeat = std::get<ParsedRepeat>(cmd.data);
+            std::cout << "REPEAT { Count: " << repeat.count
+                      << ", Commands: " << repeat.commands.size() << " }";
+        }
+        else if (cmd.type == CommandType::PLAY)
+        {
+            const auto &play = std::get<ParsedPlay>(cmd.data);
+            std::cout << "PLAY { Pattern: " << play.pattern->name
+                      << ", Commands: " << play.pattern->commands.size() << " }";
+        }
         else
         {
             std::cout << "UNKNOWN Command";
@@ -110,7 +874,8 @@ int main(int argc, char *argv[])
     std::cout << "\n--- Generating Audio from " << mmlFilePath << " ---" << std::endl;
 
     // --- Generate Audio ---
-    // Read MML from file *again* for parseMML (or you could modify parseMML to take path too, but often easier to reuse readFileIntoString)
+    // Read MML from file *again* for compileSong (the listing above only
+    // compiled it, without building a timeline)
     std::string mmlStringForAudio = readFileIntoString(mmlFilePath);
     if (mmlStringForAudio.empty())
     {
@@ -118,38 +883,146 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    std::vector<float> audioOutput = parser.parseMML(mmlStringForAudio); // Pass the string here
+    ThreadPool pool(numThreads);
+    if (watchMode)
+    {
+        if (rangeStartSeconds > 0.0 || rangeEndSeconds >= 0.0)
+        {
+            std::cerr << "Error: --watch renders the whole song; it cannot be combined with --start/--end." << std::endl;
+            return 1;
+        }
+        if (!extraTrackPaths.empty())
+        {
+            std::cerr << "Error: --watch follows a single track; it cannot be combined with --track." << std::endl;
+            return 1;
+        }
+        return runWatchMode(parser, pool, mmlFilePath, outputFilename, masterBusSettings, tracePath);
+    }
+    if (allocBudget >= 0)
+    {
+        return runAllocCheck(parser.compileSong(mmlStringForAudio), masterBusSettings,
+                             static_cast<uint64_t>(allocBudget));
+    }
 
-    // --- Read MML from file ---
-    std::string mmlString = readFileIntoString(mmlFilePath);
-    if (mmlString.empty())
+    // --- Compile the song into its time index ---
+    // Every event's offset is known, so only the requested range is
+    // rendered, and it can be rendered piece by piece
+    CompiledSong song = parser.compileSong(mmlStringForAudio, limits);
+    if (limits.any() && !admitTrack(song, limits, mmlFilePath))
     {
-        // readFileIntoString already prints an error message
         return 1;
     }
 
-    std::cout << "--- Parsing MML from " << mmlFilePath << " ---" << std::endl;
+    // --- Compile the other tracks to mix in (same parser, same samples) ---
+    std::vector<CompiledSong> extraSongs;
+    size_t songSamples = song.totalSamples;
+    for (const std::string &trackPath : extraTrackPaths)
+    {
+        std::string trackMML = readFileIntoString(trackPath);
+        if (trackMML.empty())
+        {
+            std::cerr << "Failed to read MML track " << trackPath << "." << std::endl;
+            return 1;
+        }
+        extraSongs.push_back(parser.compileSong(trackMML, limits));
+        if (limits.any() && !admitTrack(extraSongs.back(), limits, trackPath))
+        {
+            return 1;
+        }
+        songSamples = std::max(songSamples, extraSongs.back().totalSamples);
+    }
+    parser.getSampleStore().printStats(std::cout);
 
-    if (audioOutput.empty())
+    // --- Open the output (once every track is admitted); its extension picks the format ---
+    AudioEncoder encoder;
+    if (!encoder.open(outputFilename, parser.getSampleRate(), sampleType))
     {
-        std::cerr << "Parsing generated no audio data." << std::endl;
         return 1;
     }
 
-    // --- Save Audio to PCM File ---
-    if (saveToPcmFile(audioOutput, outputPcmFilename))
+    size_t startSample = secondsToSample(rangeStartSeconds, song.sampleRate, songSamples);
+    size_t endSample = rangeEndSeconds >= 0.0 ? secondsToSample(rangeEndSeconds, song.sampleRate, songSamples)
+                                              : songSamples;
+    if (startSample >= endSample)
     {
-        std::cout << "Audio saved to " << outputPcmFilename << std::endl;
-        std::cout << "To play or convert this raw PCM file, you might use tools like FFmpeg or Audacity:" << std::endl;
-        std::cout << "  Using FFmpeg: ffmpeg -f f32le -ar " << SAMPLE_RATE << " -ac 1 -i " << outputPcmFilename << " output_audio.wav" << std::endl;
-        std::cout << "  (Note: f32le is 32-bit float, little-endian; -ac 1 assumes mono.)" << std::endl;
-        std::cout << "  Using Audacity: File > Import > Raw Data... then specify Sample Rate (" << SAMPLE_RATE << " Hz), Format (32-bit float), Channels (1 Mono)." << std::endl;
+        if (songSamples > 0)
+        {
+            std::cerr << "Error: The range to render is empty (--start is at or past --end or the end of the song)."
+                      << std::endl;
+        }
+        else
+        {
+            std::cerr << "Parsing generated no audio data." << std::endl;
+        }
+        return 1;
+    }
+    std::cout << "Rendering range " << static_cast<double>(startSample) / song.sampleRate << "s to "
+              << static_cast<double>(endSample) / song.sampleRate << "s" << std::endl;
+
+    // Checked between render blocks; the render stops early once it fires
+    CancellationToken cancel;
+    if (timeoutSeconds > 0.0)
+    {
+        cancel.cancelAfter(timeoutSeconds);
+    }
+
+    if (!extraSongs.empty())
+    {
+        // --- Mix the tracks down, each held as runs of audio ---
+        std::vector<SparseTrack> tracks;
+        tracks.push_back(song.renderSparse(pool, startSample, endSample, &cancel));
+        for (const CompiledSong &extraSong : extraSongs)
+        {
+            tracks.push_back(extraSong.renderSparse(pool, startSample, endSample, &cancel));
+        }
+        for (const SparseTrack &track : tracks)
+        {
+            std::cout << "Rendered " << track.audibleSamples() << " of " << track.totalSamples() << " samples as "
+                      << track.runs().size() << " runs." << std::endl;
+        }
+        if (!cancel.cancelled())
+        {
+            writeMixdown(tracks, song.sampleRate, masterBusSettings, encoder);
+        }
     }
     else
     {
-        std::cerr << "Failed to save audio to PCM file." << std::endl;
+        renderTrack(song, pool, startSample, endSample, masterBusSettings, sampleType, encoder, cancel);
+    }
+
+    // --- Finish the file ---
+    if (cancel.cancelled())
+    {
+        encoder.close();
+        std::remove(outputFilename.c_str());
+        std::cerr << "Error: Render abandoned after " << timeoutSeconds << "s (--timeout); removed "
+                  << outputFilename << "." << std::endl;
+        return 1;
+    }
+    if (!encoder.close())
+    {
+        std::cerr << "Failed to save audio to " << outputFilename << "." << std::endl;
         return 1;
     }
+    std::cout << "Audio saved to " << outputFilename << std::endl;
+    if (!tracePath.empty())
+    {
+        Trace::write(tracePath);
+    }
+    if (AllocAccounting::available())
+    {
+        std::cout << "Heap allocations by stage:" << std::endl;
+        AllocAccounting::report(std::cout);
+    }
+    if (encoder.format() == OutputFormat::RawFloat)
+    {
+        std::cout << "To play or convert this raw PCM file, you might use tools like FFmpeg or Audacity:" << std::endl;
+        bool int16 = sampleType == SampleType::Int16;
+        std::cout << "  Using FFmpeg: ffmpeg -f " << (int16 ? "s16le" : "f32le") << " -ar " << parser.getSampleRate() << " -ac 1 -i " << outputFilename << " output_audio.wav" << std::endl;
+        std::cout << "  (Note: " << (int16 ? "s16le is signed 16-bit" : "f32le is 32-bit float") << ", little-endian; -ac 1 assumes mono.)" << std::endl;
+        std::cout << "  Using Audacity: File > Import > Raw Data... then specify Sample Rate (" << parser.getSampleRate() << " Hz), Format (" << (int16 ? "Signed 16-bit PCM" : "32-bit float") << "), Channels (1 Mono)." << std::endl;
+        std::cout << "  (Or name the output .wav, .flac, .ogg, .opus or .mp3 to have it encoded directly.)" << std::endl;
+    }
 
     return 0;
 }
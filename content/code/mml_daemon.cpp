@@ -0,0 +1,811 @@
+// mml_daemon.cpp
+// Long-lived render server. "serve" loads the engine once (parser, sample
+// cache, block cache and render pool) and answers requests on a Unix
+// domain socket, so a short jingle costs its render and nothing else: no
+// process startup, no library scan and no cold sample loads after the first
+// request that uses a sample. The other commands are a small client.
+//
+// COMPILE:
+// g++ mml_daemon.cpp AllocAccounting.cpp MMLParser.cpp NoteDecoder.cpp NoiseGenerator.cpp AudioUtils.cpp AudioEncoder.cpp MasterBus.cpp RenderArena.cpp RenderLimits.cpp PitchShift.cpp SampleStore.cpp SampleType.cpp ThreadPool.cpp LibraryManifest.cpp SparseTrack.cpp Trace.cpp WavReader.cpp -o mml_daemon -lsndfile -std=c++17 -pthread -lrt
+// USE:
+// ./mml_daemon serve /path/to/your/waveform/library /tmp/mml.sock [--rate <Hz>] [--threads <N>] [--verbose]
+//                    [--max-duration <s>] [--max-events <N>] [--max-polyphony <N>] [--max-memory <MiB>]
+//                    [--truncate] [--timeout <s>] [--no-limits]
+// ./mml_daemon render /tmp/mml.sock song.mml output.wav [--no-limiter] [--normalize <LUFS>] [--start <s>] [--end <s>]
+// ./mml_daemon render /tmp/mml.sock song.mml shm [...]   (audio returned in shared memory)
+// ./mml_daemon analyze /tmp/mml.sock song.mml [...]
+// ./mml_daemon batch /tmp/mml.sock jobs.txt [--no-limiter] [--normalize <LUFS>]
+// ./mml_daemon ping|clear-cache|shutdown /tmp/mml.sock
+//
+// PROTOCOL:
+// Every message is a frame: a 4-byte little-endian length, then that many
+// bytes. A connection may send any number of requests; each gets exactly one
+// response frame. Requests are served one at a time (one parser), and each
+// render is spread across the daemon's pool.
+//
+// A request is a header line, '\n', then a body:
+//   render output=<path>|shm [limiter=0|1] [normalize=<LUFS>] [start=<s>] [end=<s>]
+//          Body: MML text. The output extension picks the format, as in
+//          mml_player. With output=shm the raw float samples are put in a
+//          POSIX shared-memory object the client maps and then shm_unlinks.
+//   analyze [limiter=...] [normalize=...] [start=...] [end=...]
+//          Body: MML text. Renders it and measures the result.
+//   batch [limiter=...] [normalize=...]
+//          Body: one job per line, "<song.mml><TAB><output>". Paths are
+//          read and written by the daemon.
+//   ping | clear-cache | shutdown
+//          No body.
+// Header values cannot contain spaces; paths are as the daemon sees them,
+// so clients should send absolute ones.
+//
+// A response is "ok key=value ..." or "error <message>", plus for batch one
+// line per failed job.
+//
+// LIMITS:
+// The daemon renders whatever it is sent, so every song is compiled, its
+// cost estimated and checked against the serve limits before it renders
+// (by default RenderLimits::untrusted(): an hour, ten million events,
+// 64-note chords, 4 GiB; --no-limits turns them off). A song over a limit
+// is rejected with an error naming it, or with --truncate cut down to fit
+// (its response then says truncated=1). --timeout abandons a render that
+// runs longer. Either way only that request, or that batch job, fails.
+
+#include "AudioEncoder.h"
+#include "AudioUtils.h"
+#include "MasterBus.h"
+#include "MMLParser.h"
+#include "RenderLimits.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Largest frame either side accepts (a long MML file or batch list fits)
+const uint32_t MAX_FRAME_BYTES = 64u << 20;
+
+//////////////////////////////////////////////////////////////////////////////
+// FRAMING                                                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+// Reads or writes exactly 'size' bytes, retrying short transfers
+static bool readFully(int fd, void *buffer, size_t size)
+{
+    char *p = static_cast<char *>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false; // Error, or the peer closed the connection
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void *buffer, size_t size)
+{
+    const char *p = static_cast<const char *>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool sendFrame(int fd, const std::string &payload)
+{
+    uint32_t size = static_cast<uint32_t>(payload.size());
+    unsigned char header[4] = {static_cast<unsigned char>(size), static_cast<unsigned char>(size >> 8),
+                               static_cast<unsigned char>(size >> 16), static_cast<unsigned char>(size >> 24)};
+    return writeFully(fd, header, sizeof(header)) && writeFully(fd, payload.data(), payload.size());
+}
+
+static bool receiveFrame(int fd, std::string &payload)
+{
+    unsigned char header[4];
+    if (!readFully(fd, header, sizeof(header)))
+    {
+        return false;
+    }
+    uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+    if (size > MAX_FRAME_BYTES)
+    {
+        std::cerr << "Error: Frame of " << size << " bytes exceeds the limit." << std::endl;
+        return false;
+    }
+    payload.resize(size);
+    return size == 0 || readFully(fd, &payload[0], size);
+}
+
+// Fills a sockaddr_un for 'path'; false if the path is too long for one
+static bool makeSocketAddress(const std::string &path, sockaddr_un &address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Error: Socket path '" << path << "' is too long." << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// REQUESTS                                                                 //
+//////////////////////////////////////////////////////////////////////////////
+
+// A request split into its command, key=value options and body
+struct Request
+{
+    std::string command;
+    std::map<std::string, std::string> options;
+    std::string body;
+};
+
+static Request parseRequest(const std::string &payload)
+{
+    Request request;
+    size_t newline = payload.find('\n');
+    std::istringstream header(payload.substr(0, newline));
+    header >> request.command;
+    std::string option;
+    while (header >> option)
+    {
+        size_t equals = option.find('=');
+        if (equals != std::string::npos)
+            request.options[option.substr(0, equals)] = option.substr(equals + 1);
+        else
+            request.options[option] = "1";
+    }
+    if (newline != std::string::npos)
+    {
+        request.body = payload.substr(newline + 1);
+    }
+    return request;
+}
+
+// Discards everything written to it; swapped into std::cout while the
+// engine works, since its per-note debug output costs more than a jingle
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+};
+
+// Silences std::cout for its lifetime (unless the daemon is verbose)
+class QuietScope
+{
+public:
+    explicit QuietScope(bool quiet) : m_saved(nullptr)
+    {
+        if (quiet)
+        {
+            static NullBuffer nullBuffer;
+            m_saved = std::cout.rdbuf(&nullBuffer);
+        }
+    }
+    ~QuietScope()
+    {
+        if (m_saved)
+        {
+            std::cout.rdbuf(m_saved);
+        }
+    }
+
+private:
+    std::streambuf *m_saved;
+};
+
+// The warm engine and everything that outlives a request
+class RenderServer
+{
+public:
+    RenderServer(const std::string &libraryPath, int sampleRate, size_t numThreads, bool verbose,
+                 const RenderLimits &limits, double timeoutSeconds)
+        : m_parser(libraryPath, 120.0, 4, 4, 100, sampleRate),
+          m_pool(numThreads),
+          m_verbose(verbose),
+          m_limits(limits),
+          m_timeoutSeconds(timeoutSeconds),
+          m_shmCounter(0),
+          m_shutdown(false)
+    {
+    }
+
+    bool shutdownRequested() const { return m_shutdown; }
+
+    // Handles one request frame and returns the response frame
+    std::string handle(const std::string &payload)
+    {
+        Request request = parseRequest(payload);
+        auto started = std::chrono::steady_clock::now();
+        std::string response;
+        {
+            QuietScope quiet(!m_verbose);
+            response = dispatch(request);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        if (response.rfind("ok", 0) == 0 && request.command != "ping")
+        {
+            size_t lineEnd = response.find('\n');
+            response.insert(lineEnd == std::string::npos ? response.size() : lineEnd, " ms=" + std::to_string(ms));
+        }
+        std::cout << request.command << ": " << response.substr(0, response.find('\n')) << std::endl;
+        return response;
+    }
+
+private:
+    MMLParser m_parser;
+    ThreadPool m_pool;
+    bool m_verbose;
+    RenderLimits m_limits;   // Checked before every render
+    double m_timeoutSeconds; // Per render; 0 = none
+    size_t m_shmCounter; // Makes every shared-memory name unique
+    bool m_shutdown;
+
+    std::string dispatch(const Request &request)
+    {
+        if (request.command == "ping")
+        {
+            SampleStore::Stats samples = m_parser.getSampleStore().stats();
+            return "ok rate=" + std::to_string(m_parser.getSampleRate()) + " threads=" + std::to_string(m_pool.size()) +
+                   " samples=" + std::to_string(samples.paths) + " distinct=" + std::to_string(samples.unique) +
+                   " sample_bytes=" + std::to_string(samples.coldBytes + samples.residentBytes + samples.hotBytes);
+        }
+        if (request.command == "render")
+            return handleRender(request);
+        if (request.command == "analyze")
+            return handleAnalyze(request);
+        if (request.command == "batch")
+            return handleBatch(request);
+        if (request.command == "clear-cache")
+        {
+            m_parser.clearPatternCache();
+            return "ok";
+        }
+        if (request.command == "shutdown")
+        {
+            m_shutdown = true;
+            return "ok";
+        }
+        return "error unknown command '" + request.command + "'";
+    }
+
+    static MasterBusSettings masterBusSettings(const Request &request)
+    {
+        MasterBusSettings settings;
+        auto it = request.options.find("limiter");
+        if (it != request.options.end())
+            settings.limiterEnabled = it->second != "0";
+        it = request.options.find("normalize");
+        if (it != request.options.end())
+        {
+            settings.normalize = true;
+            settings.targetLoudnessLUFS = std::stod(it->second);
+        }
+        return settings;
+    }
+
+    // Compiles and renders the request's range through the master bus.
+    // Returns no audio, with the reason in 'error', if the song is rejected
+    // by the limits, runs past the timeout or is silent; 'truncated' is set
+    // if it was cut down to the limits.
+    std::vector<float> renderSong(const std::string &mml, const Request &request, std::string &error, bool &truncated)
+    {
+        CompiledSong song = m_parser.compileSong(mml, m_limits);
+        std::string reason;
+        if (!song.admit(m_limits, reason))
+        {
+            error = "rejected: " + reason;
+            return {};
+        }
+        truncated = song.truncated;
+        if (truncated)
+        {
+            std::cerr << "Warning: Song " << reason << "." << std::endl;
+        }
+        size_t startSample = 0;
+        size_t endSample = song.totalSamples;
+        auto it = request.options.find("start");
+        if (it != request.options.end())
+            startSample = secondsToSample(std::stod(it->second), song.sampleRate, song.totalSamples);
+        it = request.options.find("end");
+        if (it != request.options.end())
+            endSample = secondsToSample(std::stod(it->second), song.sampleRate, song.totalSamples);
+        if (startSample >= endSample && song.totalSamples > 0)
+        {
+            error = "the range to render is empty (start is at or past the end)";
+            return {};
+        }
+
+        CancellationToken cancel;
+        if (m_timeoutSeconds > 0.0)
+        {
+            cancel.cancelAfter(m_timeoutSeconds);
+        }
+        std::vector<float> audio = song.renderRangeParallel(m_pool, startSample, endSample, &cancel);
+        if (cancel.cancelled())
+        {
+            std::ostringstream message;
+            message << "render abandoned after " << m_timeoutSeconds << "s";
+            error = message.str();
+            return {};
+        }
+        if (audio.empty())
+        {
+            error = "the MML generated no audio";
+            return {};
+        }
+        applyMasterBus(audio, song.sampleRate, masterBusSettings(request));
+        return audio;
+    }
+
+    // Writes 'audio' to 'output' (format by extension); "" on success
+    static std::string writeOutput(const std::vector<float> &audio, const std::string &output, int sampleRate)
+    {
+        AudioEncoder encoder;
+        if (!encoder.open(output, sampleRate))
+        {
+            return "cannot open '" + output + "' for writing";
+        }
+        encoder.write(audio.data(), audio.size());
+        return encoder.close() ? "" : "write to '" + output + "' failed";
+    }
+
+    // Copies 'audio' into a new shared-memory object; "" on failure
+    std::string writeSharedMemory(const std::vector<float> &audio)
+    {
+        std::string name = "/mml-" + std::to_string(::getpid()) + "-" + std::to_string(++m_shmCounter);
+        int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+        {
+            return "";
+        }
+        size_t bytes = audio.size() * sizeof(float);
+        void *mapped = MAP_FAILED;
+        if (::ftruncate(fd, static_cast<off_t>(bytes)) == 0 && bytes > 0)
+        {
+            mapped = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            ::shm_unlink(name.c_str());
+            return "";
+        }
+        std::memcpy(mapped, audio.data(), bytes);
+        ::munmap(mapped, bytes);
+        return name;
+    }
+
+    std::string handleRender(const Request &request)
+    {
+        auto it = request.options.find("output");
+        if (it == request.options.end())
+        {
+            return "error render needs output=<path> or output=shm";
+        }
+        std::string error;
+        bool truncated = false;
+        std::vector<float> audio = renderSong(request.body, request, error, truncated);
+        if (audio.empty())
+        {
+            return "error " + error;
+        }
+
+        std::string sizeInfo = " samples=" + std::to_string(audio.size()) + " rate=" + std::to_string(m_parser.getSampleRate()) +
+                               (truncated ? " truncated=1" : "");
+        if (it->second == "shm")
+        {
+            std::string name = writeSharedMemory(audio);
+            if (name.empty())
+            {
+                return std::string("error shared memory: ") + std::strerror(errno);
+            }
+            return "ok shm=" + name + sizeInfo;
+        }
+        error = writeOutput(audio, it->second, m_parser.getSampleRate());
+        if (!error.empty())
+        {
+            return "error " + error;
+        }
+        return "ok path=" + it->second + sizeInfo;
+    }
+
+    std::string handleAnalyze(const Request &request)
+    {
+        std::string error;
+        bool truncated = false;
+        std::vector<float> audio = renderSong(request.body, request, error, truncated);
+        if (audio.empty())
+        {
+            return "error " + error;
+        }
+        LoudnessAnalysis analysis = analyzeLoudness(audio.data(), audio.size(), m_parser.getSampleRate());
+        return "ok samples=" + std::to_string(audio.size()) + " rate=" + std::to_string(m_parser.getSampleRate()) +
+               " lufs=" + std::to_string(analysis.integratedLUFS) + " peak=" + std::to_string(analysis.peak) +
+               (truncated ? " truncated=1" : "");
+    }
+
+    std::string handleBatch(const Request &request)
+    {
+        size_t rendered = 0;
+        std::string failures;
+        std::istringstream jobs(request.body);
+        std::string line;
+        while (std::getline(jobs, line))
+        {
+            if (line.empty())
+                continue;
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos)
+            {
+                failures += "\nerror malformed job line '" + line + "'";
+                continue;
+            }
+            std::string mmlPath = line.substr(0, tab);
+            std::string output = line.substr(tab + 1);
+
+            // A job that fails, even by throwing (out of memory), fails alone;
+            // the rest of the batch still renders
+            std::string error;
+            try
+            {
+                std::string mml = readFileIntoString(mmlPath);
+                bool truncated = false;
+                std::vector<float> audio = mml.empty() ? std::vector<float>() : renderSong(mml, request, error, truncated);
+                if (audio.empty())
+                {
+                    error = error.empty() ? "no audio" : error;
+                }
+                else
+                {
+                    error = writeOutput(audio, output, m_parser.getSampleRate());
+                }
+            }
+            catch (const std::exception &e)
+            {
+                error = std::string("failed (") + e.what() + ")";
+            }
+            if (!error.empty())
+            {
+                failures += "\nerror " + mmlPath + ": " + error;
+                continue;
+            }
+            rendered++;
+        }
+        size_t failed = static_cast<size_t>(std::count(failures.begin(), failures.end(), '\n'));
+        return "ok rendered=" + std::to_string(rendered) + " failed=" + std::to_string(failed) + failures;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// SERVER                                                                   //
+//////////////////////////////////////////////////////////////////////////////
+
+static volatile std::sig_atomic_t g_stopRequested = 0;
+
+static void onStopSignal(int)
+{
+    g_stopRequested = 1;
+}
+
+static int runServer(const std::string &libraryPath, const std::string &socketPath, int sampleRate, size_t numThreads, bool verbose,
+                     const RenderLimits &limits, double timeoutSeconds)
+{
+    sockaddr_un address;
+    if (!makeSocketAddress(socketPath, address))
+    {
+        return 1;
+    }
+
+    // A vanished client must not kill the daemon; SIGINT/SIGTERM interrupt
+    // accept() (no SA_RESTART) so the socket file is removed on the way out
+    std::signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop{};
+    stop.sa_handler = onStopSignal;
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        std::cerr << "Error: socket(): " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    ::unlink(socketPath.c_str()); // A stale socket from an earlier run
+    mode_t oldMask = ::umask(0077); // Only this user may connect
+    int bound = ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    ::umask(oldMask);
+    if (bound < 0 || ::listen(listener, 16) < 0)
+    {
+        std::cerr << "Error: Cannot listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        ::close(listener);
+        return 1;
+    }
+
+    RenderServer server(libraryPath, sampleRate, numThreads, verbose, limits, timeoutSeconds);
+    std::cout << "mml_daemon: serving " << libraryPath << " on " << socketPath << std::endl;
+
+    while (!g_stopRequested && !server.shutdownRequested())
+    {
+        int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Error: accept(): " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        std::string payload;
+        while (!server.shutdownRequested() && receiveFrame(client, payload))
+        {
+            std::string response;
+            try
+            {
+                response = server.handle(payload);
+            }
+            catch (const std::exception &e)
+            {
+                // E.g. a number option that does not parse (std::stod)
+                response = std::string("error bad request (") + e.what() + ")";
+                std::cerr << "Error: Request failed: " << e.what() << std::endl;
+            }
+            if (!sendFrame(client, response))
+            {
+                break;
+            }
+        }
+        ::close(client);
+    }
+
+    ::close(listener);
+    ::unlink(socketPath.c_str());
+    std::cout << "mml_daemon: stopped." << std::endl;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CLIENT                                                                   //
+//////////////////////////////////////////////////////////////////////////////
+
+// Sends one request and prints the response; returns the exit code
+static int runClient(const std::string &socketPath, const std::string &request)
+{
+    sockaddr_un address;
+    if (!makeSocketAddress(socketPath, address))
+    {
+        return 1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+    {
+        std::cerr << "Error: Cannot connect to " << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0)
+            ::close(fd);
+        return 1;
+    }
+
+    std::string response;
+    bool ok = sendFrame(fd, request) && receiveFrame(fd, response);
+    ::close(fd);
+    if (!ok)
+    {
+        std::cerr << "Error: The daemon closed the connection." << std::endl;
+        return 1;
+    }
+    std::cout << response << std::endl;
+
+    // A shared-memory result belongs to us now: read it, then release it
+    size_t shmPos = response.find(" shm=");
+    if (shmPos != std::string::npos)
+    {
+        std::string name = response.substr(shmPos + 5, response.find(' ', shmPos + 5) - (shmPos + 5));
+        int shmFd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat info{};
+        if (shmFd >= 0 && ::fstat(shmFd, &info) == 0 && info.st_size > 0)
+        {
+            size_t bytes = static_cast<size_t>(info.st_size);
+            void *mapped = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, shmFd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                const float *samples = static_cast<const float *>(mapped);
+                float peak = 0.0f;
+                for (size_t i = 0; i < bytes / sizeof(float); ++i)
+                {
+                    peak = std::max(peak, std::abs(samples[i]));
+                }
+                std::cout << "Mapped " << bytes / sizeof(float) << " samples from " << name << " (peak " << peak << ")" << std::endl;
+                ::munmap(mapped, bytes);
+            }
+        }
+        if (shmFd >= 0)
+            ::close(shmFd);
+        ::shm_unlink(name.c_str());
+    }
+    return response.rfind("ok", 0) == 0 ? 0 : 1;
+}
+
+// Turns client options into request header options
+static bool appendRenderOptions(int argc, char *argv[], int first, std::string &header)
+{
+    for (int i = first; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--no-limiter")
+            header += " limiter=0";
+        else if (arg == "--normalize" && i + 1 < argc)
+            header += std::string(" normalize=") + argv[++i];
+        else if (arg == "--start" && i + 1 < argc)
+            header += std::string(" start=") + argv[++i];
+        else if (arg == "--end" && i + 1 < argc)
+            header += std::string(" end=") + argv[++i];
+        else
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " serve <library> <socket> [--rate <Hz>] [--threads <N>] [--verbose] [--max-duration <s>] [--max-events <N>] [--max-polyphony <N>] [--max-memory <MiB>] [--truncate] [--timeout <s>] [--no-limits]" << std::endl;
+        std::cerr << "       " << argv[0] << " render <socket> <song.mml> <output|shm> [--no-limiter] [--normalize <LUFS>] [--start <s>] [--end <s>]" << std::endl;
+        std::cerr << "       " << argv[0] << " analyze <socket> <song.mml> [--no-limiter] [--normalize <LUFS>] [--start <s>] [--end <s>]" << std::endl;
+        std::cerr << "       " << argv[0] << " batch <socket> <jobs.txt> [--no-limiter] [--normalize <LUFS>]" << std::endl;
+        std::cerr << "       " << argv[0] << " ping|clear-cache|shutdown <socket>" << std::endl;
+        return 1;
+    }
+
+    std::string command = argv[1];
+    if (command == "serve")
+    {
+        if (argc < 4)
+        {
+            std::cerr << "Usage: " << argv[0] << " serve <library> <socket> [--rate <Hz>] [--threads <N>] [--verbose] [--max-duration <s>] [--max-events <N>] [--max-polyphony <N>] [--max-memory <MiB>] [--truncate] [--timeout <s>] [--no-limits]" << std::endl;
+            return 1;
+        }
+        std::string libraryPath = argv[2];
+        if (!libraryPath.empty() && (libraryPath.back() == '/' || libraryPath.back() == '\\'))
+        {
+            libraryPath.pop_back();
+        }
+        int sampleRate = SAMPLE_RATE;
+        size_t numThreads = 0;
+        bool verbose = false;
+        RenderLimits limits = RenderLimits::untrusted();
+        double timeoutSeconds = 0.0;
+        for (int i = 4; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--rate" && i + 1 < argc)
+                sampleRate = std::stoi(argv[++i]);
+            else if (arg == "--threads" && i + 1 < argc)
+                numThreads = static_cast<size_t>(std::max(1, std::stoi(argv[++i])));
+            else if (arg == "--verbose")
+                verbose = true;
+            else if (arg == "--max-duration" && i + 1 < argc)
+                limits.maxDurationSeconds = std::max(0.0, std::stod(argv[++i]));
+            else if (arg == "--max-events" && i + 1 < argc)
+                limits.maxEvents = static_cast<size_t>(std::max(0LL, std::stoll(argv[++i])));
+            else if (arg == "--max-polyphony" && i + 1 < argc)
+                limits.maxPolyphony = static_cast<size_t>(std::max(0LL, std::stoll(argv[++i])));
+            else if (arg == "--max-memory" && i + 1 < argc)
+                limits.maxBytes = static_cast<size_t>(std::max(0LL, std::stoll(argv[++i]))) << 20;
+            else if (arg == "--truncate")
+                limits.truncate = true;
+            else if (arg == "--no-limits")
+                limits = RenderLimits();
+            else if (arg == "--timeout" && i + 1 < argc)
+                timeoutSeconds = std::max(0.0, std::stod(argv[++i]));
+            else
+            {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return 1;
+            }
+        }
+        if (sampleRate < 4000 || sampleRate > 192000)
+        {
+            std::cerr << "Error: Unsupported sample rate " << sampleRate << " Hz." << std::endl;
+            return 1;
+        }
+        return runServer(libraryPath, argv[3], sampleRate, numThreads, verbose, limits, timeoutSeconds);
+    }
+
+    std::string socketPath = argv[2];
+    if (command == "ping" || command == "clear-cache" || command == "shutdown")
+    {
+        return runClient(socketPath, command);
+    }
+
+    if (argc < 4)
+    {
+        std::cerr << "Error: " << command << " needs a file argument." << std::endl;
+        return 1;
+    }
+    std::string header;
+    std::string body;
+    int firstOption = 4;
+    if (command == "render")
+    {
+        if (argc < 5)
+        {
+            std::cerr << "Error: render needs <song.mml> <output|shm>." << std::endl;
+            return 1;
+        }
+        std::string output = argv[4];
+        if (output != "shm")
+        {
+            output = fs::absolute(output).string(); // The daemon may run elsewhere
+        }
+        header = "render output=" + output;
+        body = readFileIntoString(argv[3]);
+        firstOption = 5;
+    }
+    else if (command == "analyze")
+    {
+        header = "analyze";
+        body = readFileIntoString(argv[3]);
+    }
+    else if (command == "batch")
+    {
+        // Job paths are made absolute for the daemon
+        header = "batch";
+        std::istringstream jobs(readFileIntoString(argv[3]));
+        std::string line;
+        while (std::getline(jobs, line))
+        {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos)
+                continue;
+            body += fs::absolute(line.substr(0, tab)).string() + "\t" + fs::absolute(line.substr(tab + 1)).string() + "\n";
+        }
+    }
+    else
+    {
+        std::cerr << "Unknown command: " << command << std::endl;
+        return 1;
+    }
+    if (body.empty())
+    {
+        return 1; // readFileIntoString already reported why
+    }
+    if (!appendRenderOptions(argc, argv, firstOption, header))
+    {
+        return 1;
+    }
+    return runClient(socketPath, header + "\n" + body);
+}
@@ -0,0 +1,487 @@
+// mml_libtool.cpp
+// Maintenance tool for the waveform library. "conform" replaces the
+// ffprobe/ffmpeg pipeline of wav_lib.py: every WAV is decoded, downmixed,
+// resampled, trimmed and loudness-normalized in-process with the engine's
+// own DSP, all files in parallel, and each result replaces its target
+// atomically. A manifest describing the conformed library is written last.
+// "manifest" (re)builds the manifest of a library without changing it, and
+// reports every sample whose content changed since the previous one.
+//
+// COMPILE:
+// g++ mml_libtool.cpp AllocAccounting.cpp AudioEncoder.cpp AudioUtils.cpp MasterBus.cpp SampleType.cpp ThreadPool.cpp LibraryManifest.cpp Trace.cpp WavReader.cpp -o mml_libtool -lsndfile -std=c++17 -pthread
+// Without libsndfile (WAV encodings the built-in reader understands only):
+// add -DMML_NO_SNDFILE and drop -lsndfile
+// USE:
+// ./mml_libtool conform /path/to/your/waveform/library [options]
+// ./mml_libtool manifest /path/to/your/waveform/library [--threads <N>]
+// ./mml_libtool scan /path/to/your/waveform/library
+// CONFORM OPTIONS:
+//   --out <dir>          Write the conformed library here (default: in place)
+//   --rate <Hz>          Target sample rate (default 44100). Conforming to
+//                        another rate into "<library>-<rate>" builds the
+//                        pre-decimated bank mml_player --rate/--draft looks for.
+//   --normalize <LUFS>   Loudness target (default -18, as in wav_lib.py)
+//   --no-normalize       Keep the original levels
+//   --trim-db <dB>       Leading-silence threshold (default -60 dBFS)
+//   --no-trim            Keep leading silence
+//   --threads <N>        Worker threads (default: one per core)
+
+#include "AudioEncoder.h"
+#include "AudioUtils.h"
+#include "LibraryManifest.h"
+#include "MasterBus.h"
+#include "ThreadPool.h"
+#include "WavReader.h"
+#ifndef MML_NO_SNDFILE
+#include <sndfile.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Settings for one conform run
+struct ConformSettings
+{
+    int targetSampleRate = 44100;     // The engine's SAMPLE_RATE
+    bool normalize = true;
+    double targetLoudnessLUFS = -18.0; // Same target as wav_lib.py
+    float peakCeiling = 0.794f;        // -2 dBFS, wav_lib.py's true-peak target
+    bool trimLeadingSilence = true;
+    double trimThresholdDb = -60.0;
+};
+
+// What happened to one file; filled in by a worker, reported afterwards
+struct ConformResult
+{
+    fs::path relativePath;
+    bool ok = false;
+    std::string message;
+    int sourceSampleRate = 0;
+    int sourceChannels = 0;
+    size_t trimmedFrames = 0; // Leading frames removed
+    float gain = 1.0f;        // Normalization gain applied
+    ManifestEntry entry{};    // Description of the file written
+};
+
+// Describes decoded (interleaved) audio for the manifest
+static ManifestEntry describeSamples(const fs::path &relativePath, const std::vector<float> &data, int sampleRate, int channels)
+{
+    ManifestEntry entry{};
+    entry.path = relativePath.generic_string();
+    entry.sampleRate = sampleRate;
+    entry.channels = channels;
+    entry.frames = channels > 0 ? data.size() / channels : 0;
+
+    double sumSquares = 0.0;
+    for (float sample : data)
+    {
+        entry.peak = std::max(entry.peak, std::abs(sample));
+        sumSquares += static_cast<double>(sample) * sample;
+    }
+    entry.rms = data.empty() ? 0.0f : static_cast<float>(std::sqrt(sumSquares / data.size()));
+    entry.contentHash = LibraryManifest::hashSamples(data.data(), data.size());
+    return entry;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// FILE I/O                                                                 //
+//////////////////////////////////////////////////////////////////////////////
+
+// Format of a source file
+struct WavInfo
+{
+    int sampleRate = 0;
+    int channels = 0;
+    size_t frames = 0;
+};
+
+// Reads a WAV file's format, and with 'data' decodes it to interleaved
+// floats. The built-in reader handles PCM and float WAVs; anything else
+// goes through libsndfile, when the build has it. Returns false with a
+// message.
+static bool readWav(const fs::path &path, WavInfo &info, std::vector<float> *data, std::string &error)
+{
+    info = WavInfo{};
+    WavFile file;
+    if (file.open(path.string(), error))
+    {
+        info.sampleRate = file.sampleRate();
+        info.channels = file.channels();
+        info.frames = file.frames();
+        if (data)
+        {
+            file.readFloat(*data);
+        }
+    }
+    else
+    {
+#ifdef MML_NO_SNDFILE
+        error = "cannot open: " + error;
+        return false;
+#else
+        SF_INFO sfinfo{};
+        SNDFILE *sndfile = sf_open(path.c_str(), SFM_READ, &sfinfo);
+        if (!sndfile)
+        {
+            error = std::string("cannot open: ") + sf_strerror(nullptr);
+            return false;
+        }
+        info.sampleRate = sfinfo.samplerate;
+        info.channels = sfinfo.channels;
+        info.frames = static_cast<size_t>(std::max<sf_count_t>(0, sfinfo.frames));
+        if (data)
+        {
+            data->resize(info.frames * std::max(0, info.channels));
+            sf_count_t read = sf_read_float(sndfile, data->data(), static_cast<sf_count_t>(data->size()));
+            data->resize(static_cast<size_t>(std::max<sf_count_t>(0, read)));
+        }
+        sf_close(sndfile);
+#endif
+    }
+    if (info.sampleRate <= 0 || info.channels <= 0)
+    {
+        error = "no audio stream";
+        return false;
+    }
+    return true;
+}
+
+// Writes mono 32-bit float WAV data to a temporary file next to 'path' and
+// renames it over 'path', so readers never see a half-written file.
+static bool writeWavAtomically(const fs::path &path, const std::vector<float> &data, int sampleRate, std::string &error)
+{
+    fs::path tempPath = path;
+    tempPath += ".tmp";
+
+    std::ofstream file(tempPath, std::ios::out | std::ios::binary);
+    if (!file)
+    {
+        error = "cannot write: " + tempPath.string();
+        return false;
+    }
+    AudioEncoder::writeWavHeader(file, sampleRate, data.size(), SampleType::Float32);
+    file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size() * sizeof(float)));
+    file.close();
+    if (!file)
+    {
+        fs::remove(tempPath);
+        error = "short write";
+        return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tempPath, path, ec); // Atomic within one filesystem
+    if (ec)
+    {
+        fs::remove(tempPath);
+        error = "cannot replace target: " + ec.message();
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CONFORM                                                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+// Conforms one file: decode, downmix, resample, trim, normalize, write
+static ConformResult conformFile(const fs::path &root, const fs::path &outputRoot, const fs::path &relativePath, const ConformSettings &settings)
+{
+    const fs::path source = root / relativePath;
+    const fs::path target = outputRoot / relativePath;
+    ConformResult result;
+    std::vector<float> audio;
+    WavInfo info;
+    if (!readWav(source, info, &audio, result.message))
+    {
+        return result;
+    }
+    result.sourceSampleRate = info.sampleRate;
+    result.sourceChannels = info.channels;
+
+    // The engine plays mono samples at its own rate
+    audio = downmixToMono(audio, info.channels);
+    audio = resampleAudio(audio, info.sampleRate, settings.targetSampleRate);
+
+    if (settings.trimLeadingSilence)
+    {
+        const float threshold = static_cast<float>(std::pow(10.0, settings.trimThresholdDb / 20.0));
+        auto firstSound = std::find_if(audio.begin(), audio.end(), [threshold](float s)
+                                       { return std::abs(s) > threshold; });
+        if (firstSound != audio.end())
+        {
+            result.trimmedFrames = static_cast<size_t>(firstSound - audio.begin());
+            audio.erase(audio.begin(), firstSound);
+        }
+    }
+
+    if (audio.empty())
+    {
+        result.message = "silent or empty after conforming; not written";
+        return result;
+    }
+
+    LoudnessAnalysis analysis = analyzeLoudness(audio.data(), audio.size(), settings.targetSampleRate);
+    if (settings.normalize && analysis.peak > 0.0f)
+    {
+        // Gated loudness needs 400 ms; shorter samples keep their level and
+        // only the peak ceiling applies to them
+        float gain = 1.0f;
+        if (analysis.integratedLUFS > -70.0)
+        {
+            gain = static_cast<float>(std::pow(10.0, (settings.targetLoudnessLUFS - analysis.integratedLUFS) / 20.0));
+        }
+        gain = std::min(gain, settings.peakCeiling / analysis.peak);
+        for (float &sample : audio)
+        {
+            sample *= gain;
+        }
+        result.gain = gain;
+    }
+    result.entry = describeSamples(relativePath, audio, settings.targetSampleRate, 1);
+
+    result.ok = writeWavAtomically(target, audio, settings.targetSampleRate, result.message);
+    return result;
+}
+
+// Collects every .wav below 'root' (relative paths, sorted for stable output)
+static std::vector<fs::path> findWavFiles(const fs::path &root)
+{
+    std::vector<fs::path> files;
+    for (const auto &entry : fs::recursive_directory_iterator(root))
+    {
+        if (!entry.is_regular_file())
+            continue;
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension == ".wav")
+        {
+            files.push_back(fs::relative(entry.path(), root));
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+static int runConform(const fs::path &libraryRoot, const fs::path &outputRoot, const ConformSettings &settings, size_t numThreads)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<fs::path> files = findWavFiles(libraryRoot);
+
+    std::cout << "--- Conforming " << files.size() << " WAV files in " << libraryRoot << " ---" << std::endl;
+    std::cout << "Target: " << settings.targetSampleRate << " Hz mono, 32-bit float";
+    if (settings.normalize)
+        std::cout << ", " << settings.targetLoudnessLUFS << " LUFS";
+    std::cout << std::endl;
+    std::cout << "Output: " << (outputRoot == libraryRoot ? std::string("in place") : outputRoot.string()) << std::endl;
+
+    // Directories first, so the workers only write files
+    for (const fs::path &file : files)
+    {
+        fs::create_directories((outputRoot / file).parent_path());
+    }
+
+    std::vector<ConformResult> results(files.size());
+    ThreadPool pool(numThreads);
+    pool.parallelFor(files.size(), [&](size_t i)
+                     {
+                         results[i] = conformFile(libraryRoot, outputRoot, files[i], settings);
+                         results[i].relativePath = files[i]; });
+
+    size_t failed = 0;
+    for (const ConformResult &result : results)
+    {
+        if (result.ok)
+        {
+            std::cout << result.relativePath.generic_string() << ": " << result.sourceSampleRate << " Hz, "
+                      << result.sourceChannels << " ch -> " << result.entry.frames << " frames";
+            if (result.trimmedFrames > 0)
+                std::cout << " (trimmed " << result.trimmedFrames << ")";
+            if (result.gain != 1.0f)
+                std::cout << " (gain " << result.gain << ")";
+            std::cout << std::endl;
+        }
+        else
+        {
+            std::cerr << "Error: " << result.relativePath.generic_string() << ": " << result.message << std::endl;
+            failed++;
+        }
+    }
+
+    // The manifest lists the files that were written
+    std::vector<ManifestEntry> entries;
+    for (const ConformResult &result : results)
+    {
+        if (result.ok)
+        {
+            entries.push_back(result.entry);
+        }
+    }
+    LibraryManifest manifest;
+    manifest.assign(std::move(entries));
+    bool manifestOk = manifest.save(outputRoot.string());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    std::cout << "\n--- Conform Summary ---" << std::endl;
+    std::cout << "Files conformed: " << files.size() - failed << ", failed: " << failed
+              << " (" << seconds << "s on " << pool.size() << " threads)" << std::endl;
+    if (manifestOk)
+        std::cout << "Manifest: " << (outputRoot / MANIFEST_FILENAME).string() << std::endl;
+    return (failed == 0 && manifestOk) ? 0 : 1;
+}
+
+// Describes every file of a library as it is and writes its manifest. The
+// engine only checks a sample's format against the manifest when it loads
+// it; this is where the content is checked, against the previous manifest.
+static int runManifest(const fs::path &libraryRoot, size_t numThreads)
+{
+    LibraryManifest previous;
+    previous.load(libraryRoot.string());
+
+    std::vector<fs::path> files = findWavFiles(libraryRoot);
+    std::vector<ManifestEntry> entries(files.size());
+    std::vector<std::string> errors(files.size());
+
+    ThreadPool pool(numThreads);
+    pool.parallelFor(files.size(), [&](size_t i)
+                     {
+                         std::vector<float> data;
+                         WavInfo info;
+                         if (readWav(libraryRoot / files[i], info, &data, errors[i]))
+                         {
+                             entries[i] = describeSamples(files[i], data, info.sampleRate, info.channels);
+                         } });
+
+    std::vector<ManifestEntry> described;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (errors[i].empty())
+            described.push_back(std::move(entries[i]));
+        else
+            std::cerr << "Error: " << files[i].generic_string() << ": " << errors[i] << std::endl;
+    }
+    size_t failed = files.size() - described.size();
+
+    size_t changed = 0;
+    for (const ManifestEntry &entry : described)
+    {
+        const ManifestEntry *old = previous.find(entry.path);
+        if (old != nullptr && old->contentHash != 0 && old->contentHash != entry.contentHash)
+        {
+            std::cout << "Changed: " << entry.path << std::endl;
+            changed++;
+        }
+    }
+
+    LibraryManifest manifest;
+    manifest.assign(std::move(described));
+    if (!manifest.save(libraryRoot.string()))
+    {
+        return 1;
+    }
+    std::cout << "Manifest: " << (libraryRoot / MANIFEST_FILENAME).string() << " (" << manifest.entries().size()
+              << " samples, " << failed << " unreadable, " << changed << " changed since the last manifest)" << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+// Dry run: reports the format of every file without changing anything
+static int runScan(const fs::path &libraryRoot)
+{
+    std::vector<fs::path> files = findWavFiles(libraryRoot);
+    size_t errors = 0;
+    for (const fs::path &file : files)
+    {
+        WavInfo info;
+        std::string error;
+        if (!readWav(libraryRoot / file, info, nullptr, error))
+        {
+            std::cout << file.generic_string() << "\tERROR" << std::endl;
+            errors++;
+            continue;
+        }
+        std::cout << file.generic_string() << '\t' << info.sampleRate << " Hz\t" << info.channels << " ch\t"
+                  << info.frames << " frames" << std::endl;
+    }
+    std::cout << "Files found: " << files.size() << ", errors: " << errors << std::endl;
+    return errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " conform <library> [--out <dir>] [--rate <Hz>] [--normalize <LUFS> | --no-normalize]"
+                  << " [--trim-db <dB> | --no-trim] [--threads <N>]" << std::endl;
+        std::cerr << "       " << argv[0] << " manifest <library> [--threads <N>]" << std::endl;
+        std::cerr << "       " << argv[0] << " scan <library>" << std::endl;
+        return 1;
+    }
+
+    std::string command = argv[1];
+    fs::path libraryRoot = argv[2];
+    if (!fs::is_directory(libraryRoot))
+    {
+        std::cerr << "Error: Library root '" << libraryRoot.string() << "' is not a directory." << std::endl;
+        return 1;
+    }
+
+    if (command == "scan")
+    {
+        return runScan(libraryRoot);
+    }
+    if (command == "manifest")
+    {
+        size_t numThreads = 0;
+        if (argc > 4 && std::string(argv[3]) == "--threads")
+        {
+            numThreads = static_cast<size_t>(std::max(1, std::stoi(argv[4])));
+        }
+        return runManifest(libraryRoot, numThreads);
+    }
+    if (command != "conform")
+    {
+        std::cerr << "Unknown command: " << command << std::endl;
+        return 1;
+    }
+
+    ConformSettings settings;
+    fs::path outputRoot = libraryRoot;
+    size_t numThreads = 0;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc)
+            outputRoot = argv[++i];
+        else if (arg == "--rate" && i + 1 < argc)
+            settings.targetSampleRate = std::stoi(argv[++i]);
+        else if (arg == "--normalize" && i + 1 < argc)
+            settings.targetLoudnessLUFS = std::stod(argv[++i]);
+        else if (arg == "--no-normalize")
+            settings.normalize = false;
+        else if (arg == "--trim-db" && i + 1 < argc)
+            settings.trimThresholdDb = std::stod(argv[++i]);
+        else if (arg == "--no-trim")
+            settings.trimLeadingSilence = false;
+        else if (arg == "--threads" && i + 1 < argc)
+            numThreads = static_cast<size_t>(std::max(1, std::stoi(argv[++i])));
+        else
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (settings.targetSampleRate < 4000 || settings.targetSampleRate > 192000)
+    {
+        std::cerr << "Error: Unsupported sample rate " << settings.targetSampleRate << " Hz." << std::endl;
+        return 1;
+    }
+
+    return runConform(libraryRoot, outputRoot, settings, numThreads);
+}
@@ -0,0 +1,215 @@
+// mml_py.cpp
+// Python bindings for the MML engine (pybind11).
+//
+// Renders happen in-process: no mml_player launch and no .pcm round trip.
+// Audio comes back as NumPy float32 arrays that own the engine's buffer
+// (the vector is moved into a capsule), so nothing is copied on the way out.
+// An Engine keeps its parser, and with it the sample cache and the block
+// cache of compiled repeats and patterns, warm across calls.
+//
+// COMPILE:
+// c++ -O2 -shared -fPIC -std=c++17 $(python3 -m pybind11 --includes) mml_py.cpp AllocAccounting.cpp MMLParser.cpp NoteDecoder.cpp NoiseGenerator.cpp AudioUtils.cpp MasterBus.cpp RenderArena.cpp RenderLimits.cpp PitchShift.cpp SampleStore.cpp SampleType.cpp ThreadPool.cpp LibraryManifest.cpp SparseTrack.cpp Trace.cpp WavReader.cpp -o mml$(python3-config --extension-suffix) -lsndfile -pthread
+// USE:
+// import mml
+// engine = mml.Engine("/path/to/your/waveform/library")
+// audio = engine.render(open("song.mml").read())   # numpy.ndarray (float32)
+// song = engine.compile_song(mml_text)
+// tail = song.render(start=song.duration - 20.0)
+// print(mml.analyze(audio, engine.sample_rate))
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "MMLParser.h"
+#include "MasterBus.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace py = pybind11;
+
+namespace
+{
+    // Hands a rendered buffer to NumPy without copying it. The array's base
+    // object is a capsule that owns the vector and frees it with the array.
+    py::array_t<float> toNumpy(std::vector<float> &&audio)
+    {
+        auto *owned = new std::vector<float>(std::move(audio));
+        py::capsule owner(owned, [](void *p)
+                          { delete static_cast<std::vector<float> *>(p); });
+        return py::array_t<float>({owned->size()}, {sizeof(float)}, owned->data(), owner);
+    }
+
+    // Python-facing engine: one parser (and sample cache) plus a render pool
+    class Engine
+    {
+    public:
+        Engine(const std::string &libraryPath, int sampleRate, double tempoBPM,
+               int octave, int length, int volume, size_t threads)
+            : m_parser(libraryPath, tempoBPM, octave, length, volume, sampleRate),
+              m_pool(threads)
+        {
+        }
+
+        int sampleRate() const { return m_parser.getSampleRate(); }
+
+        MMLParser &parser() { return m_parser; }
+        ThreadPool &pool() { return m_pool; }
+
+        // The parser (its caches and arena) is used by one call at a time;
+        // renders of compiled songs only read, so they need no lock
+        std::mutex &parserMutex() { return m_parserMutex; }
+
+    private:
+        std::mutex m_parserMutex;
+        MMLParser m_parser;
+        ThreadPool m_pool;
+    };
+
+    // A compiled song; holds its engine alive, since its voices point into
+    // the engine's sample cache
+    struct Song
+    {
+        std::shared_ptr<Engine> engine;
+        CompiledSong compiled;
+    };
+
+    MasterBusSettings masterBusSettings(bool limiter, std::optional<double> normalizeLUFS)
+    {
+        MasterBusSettings settings;
+        settings.limiterEnabled = limiter;
+        if (normalizeLUFS)
+        {
+            settings.normalize = true;
+            settings.targetLoudnessLUFS = *normalizeLUFS;
+        }
+        return settings;
+    }
+}
+
+PYBIND11_MODULE(mml, m)
+{
+    m.doc() = "In-process MML compiler and renderer";
+    m.attr("SAMPLE_RATE") = SAMPLE_RATE;
+    m.attr("DRAFT_SAMPLE_RATE") = DRAFT_SAMPLE_RATE;
+
+    py::class_<Engine, std::shared_ptr<Engine>>(m, "Engine")
+        .def(py::init<const std::string &, int, double, int, int, int, size_t>(),
+             py::arg("library_path"), py::arg("sample_rate") = SAMPLE_RATE,
+             py::arg("tempo") = 120.0, py::arg("octave") = 4, py::arg("length") = 4,
+             py::arg("volume") = 100, py::arg("threads") = 0)
+        .def_property_readonly("sample_rate", &Engine::sampleRate)
+        .def(
+            "set_declick", [](Engine &engine, bool enabled)
+            {
+                std::lock_guard<std::mutex> lock(engine.parserMutex());
+                engine.parser().setDeclickEnabled(enabled); },
+            py::arg("enabled"))
+        .def(
+            "set_sampler", [](Engine &engine, bool enabled, int rootSpacing)
+            {
+                std::lock_guard<std::mutex> lock(engine.parserMutex());
+                engine.parser().setSamplerMode(enabled, rootSpacing); },
+            py::arg("enabled"), py::arg("root_spacing") = 0)
+        .def(
+            "set_noise_seed", [](Engine &engine, uint64_t seed)
+            {
+                std::lock_guard<std::mutex> lock(engine.parserMutex());
+                engine.parser().setNoiseSeed(seed); },
+            py::arg("seed"))
+        .def(
+            "compile", [](Engine &engine, const std::string &mmlText)
+            {
+                // Command list as (type, original text) pairs, for inspection
+                std::vector<std::pair<int, std::string>> commands;
+                std::lock_guard<std::mutex> lock(engine.parserMutex());
+                for (const ParsedCommand &cmd : engine.parser().compileMML(mmlText))
+                {
+                    commands.emplace_back(static_cast<int>(cmd.type), cmd.originalCommandString);
+                }
+                return commands; },
+            py::arg("mml"))
+        .def(
+            "compile_song", [](std::shared_ptr<Engine> engine, const std::string &mmlText)
+            {
+                Song song{engine, {}};
+                {
+                    py::gil_scoped_release release;
+                    std::lock_guard<std::mutex> lock(engine->parserMutex());
+                    song.compiled = engine->parser().compileSong(mmlText);
+                }
+                return song; },
+            py::arg("mml"))
+        .def(
+            "render", [](Engine &engine, const std::string &mmlText, bool limiter, std::optional<double> normalize)
+            {
+                std::vector<float> audio;
+                {
+                    py::gil_scoped_release release;
+                    {
+                        std::lock_guard<std::mutex> lock(engine.parserMutex());
+                        audio = engine.parser().parseMML(mmlText);
+                    }
+                    applyMasterBus(audio, engine.sampleRate(), masterBusSettings(limiter, normalize));
+                }
+                return toNumpy(std::move(audio)); },
+            py::arg("mml"), py::arg("limiter") = true, py::arg("normalize") = py::none())
+        .def(
+            "clear_pattern_cache", [](Engine &engine)
+            {
+                std::lock_guard<std::mutex> lock(engine.parserMutex());
+                engine.parser().clearPatternCache(); });
+
+    py::class_<Song>(m, "Song")
+        .def_property_readonly("num_samples", [](const Song &song)
+                               { return song.compiled.totalSamples; })
+        .def_property_readonly("num_events", [](const Song &song)
+                               { return song.compiled.events.size(); })
+        .def_property_readonly("sample_rate", [](const Song &song)
+                               { return song.compiled.sampleRate; })
+        .def_property_readonly("duration", [](const Song &song)
+                               { return static_cast<double>(song.compiled.totalSamples) / song.compiled.sampleRate; })
+        .def(
+            "render", [](const Song &song, double start, std::optional<double> end, bool masterBus, bool limiter, std::optional<double> normalize)
+            {
+                // Times in seconds; only the events inside the range render,
+                // and a range at or past the end renders an empty array
+                const CompiledSong &compiled = song.compiled;
+                size_t startSample = secondsToSample(start, compiled.sampleRate, compiled.totalSamples);
+                size_t endSample = end ? secondsToSample(*end, compiled.sampleRate, compiled.totalSamples)
+                                       : compiled.totalSamples;
+                std::vector<float> audio;
+                {
+                    py::gil_scoped_release release;
+                    audio = compiled.renderRangeParallel(song.engine->pool(), startSample, endSample);
+                    if (masterBus)
+                    {
+                        applyMasterBus(audio, compiled.sampleRate, masterBusSettings(limiter, normalize));
+                    }
+                }
+                return toNumpy(std::move(audio)); },
+            py::arg("start") = 0.0, py::arg("end") = py::none(), py::arg("master_bus") = true,
+            py::arg("limiter") = true, py::arg("normalize") = py::none());
+
+    m.def(
+        "analyze", [](py::array_t<float, py::array::c_style | py::array::forcecast> audio, int sampleRate)
+        {
+            // Reads the array in place (no copy for float32 C-contiguous input)
+            py::buffer_info info = audio.request();
+            LoudnessAnalysis analysis;
+            {
+                py::gil_scoped_release release;
+                analysis = analyzeLoudness(static_cast<const float *>(info.ptr), static_cast<size_t>(info.size), sampleRate);
+            }
+            py::dict result;
+            result["integrated_lufs"] = analysis.integratedLUFS;
+            result["peak"] = analysis.peak;
+            return result; },
+        py::arg("audio"), py::arg("sample_rate") = SAMPLE_RATE,
+        "Integrated loudness (LUFS) and sample peak of mono audio");
+}
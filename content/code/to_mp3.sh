@@ -1,3 +1,8 @@
 # to_mp3.sh
-# Convert the pcm binary audio file to MP3 using ffmpeg.
-ffmpeg -f f32le -ar 44100 -ac 1 -i output_audio.pcm output.mp3
\ No newline at end of file
+# Render an MML file straight to MP3. mml_player encodes in-process (through
+# libsndfile) while it renders, so no intermediate .pcm file is written.
+# Usage: ./to_mp3.sh /path/to/your/waveform/library song.mml [output.mp3]
+./mml_player "$1" "$2" "${3:-output.mp3}"
+
+# An existing raw render can still be converted with ffmpeg:
+# ffmpeg -f f32le -ar 44100 -ac 1 -i output_audio.pcm output.mp3
@@ -5,6 +5,9 @@ import json
 import sys
 import tempfile # Needed for creating temporary files
 
+# NOTE: "mml_libtool conform" (mml_libtool.cpp) does the same job natively,
+# in parallel and without ffmpeg; this script is kept for reference.
+
 # --- Configuration ---
 WAVEFORM_LIBRARY_ROOT = "/home/user/Dropbox/Music/waveform_library" # <<< IMPORTANT: SET THIS TO YOUR ACTUAL PATH
 TARGET_SAMPLE_RATE = 44100  # Hz (consistent with your C++ project's SAMPLE_RATE)